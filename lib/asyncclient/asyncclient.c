@@ -0,0 +1,533 @@
+#include "asyncclient.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+
+#define ASYNC_POLL_BATCH_SIZE 64
+// Requests written by one system call.
+#define ASYNC_WRITE_BATCH_SIZE 64
+#define ASYNC_READ_SIZE 4096
+// Attempts of a request that is turned away by a shard that does not own
+// its key, the ring map is refreshed in between.
+#define ASYNC_MAX_ATTEMPTS 2
+
+/* ----------- HELPERS ------------------------*/
+
+/**
+ * @brief Completes an operation and calls its callback.
+ *
+ * @param async - CanaryAsync *
+ * @param op - canary_op_t *
+ * @param status - int
+ */
+void finish_op(CanaryAsync *async, canary_op_t *op, int status) {
+  free(op->out);
+  op->out = NULL;
+  op->done = true;
+  op->status = status;
+  async->num_pending--;
+  async->num_completed++;
+  if (op->callback != NULL)
+    op->callback(op, op->arg);
+}
+
+/**
+ * @brief Polls a connection for writes as well as reads, or only for reads.
+ *
+ * @param async - CanaryAsync *
+ * @param conn - async_conn_t *
+ * @param writing - bool
+ * @return -1 in case of error, 0 otherwise.
+ */
+int arm_conn(CanaryAsync *async, async_conn_t *conn, bool writing) {
+  if (conn->writing == writing)
+    return 0;
+
+  struct epoll_event event = {.events = EPOLLIN | (writing ? EPOLLOUT : 0),
+                              .data.ptr = conn};
+  if (epoll_ctl(async->poll_fd, EPOLL_CTL_MOD, conn->socket, &event) == -1)
+    return -1;
+  conn->writing = writing;
+  return 0;
+}
+
+/**
+ * @brief Finds the connection to a shard, or takes one from the pool of the
+ * cache handle.
+ *
+ * @param async - CanaryAsync *
+ * @param addr - ring_addr_t *
+ * @return pointer to the connection, NULL in case of error.
+ */
+async_conn_t *find_conn(CanaryAsync *async, ring_addr_t *addr) {
+  async_conn_t *conn;
+  for (conn = async->conns; conn != NULL; conn = conn->next) {
+    if (!conn->failed && conn->addr.s_addr == addr->addr.s_addr &&
+        conn->port == addr->port)
+      return conn;
+  }
+
+  int socket = pool_acquire(async->cache->pool, addr->addr, addr->port);
+  if (socket == -1)
+    return NULL;
+
+  conn = calloc(1, sizeof(async_conn_t));
+  conn->addr = addr->addr;
+  conn->port = addr->port;
+  conn->socket = socket;
+  // Requests written behind others must not wait for them to be acknowledged.
+  int nodelay = 1;
+  struct epoll_event event = {.events = EPOLLIN, .data.ptr = conn};
+  if (setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &nodelay,
+                 sizeof(nodelay)) == -1 ||
+      fcntl(socket, F_SETFL, O_NONBLOCK) == -1 ||
+      epoll_ctl(async->poll_fd, EPOLL_CTL_ADD, socket, &event) == -1) {
+    close(socket);
+    free(conn);
+    return NULL;
+  }
+  conn->next = async->conns;
+  async->conns = conn;
+  return conn;
+}
+
+/**
+ * @brief Writes the requests of a connection that have not been written,
+ * many at a time, until the socket would block.
+ *
+ * @param async - CanaryAsync *
+ * @param conn - async_conn_t *
+ * @return -1 if the connection failed, 0 otherwise.
+ */
+int flush_conn(CanaryAsync *async, async_conn_t *conn) {
+  while (conn->unsent != NULL) {
+    struct iovec iov[ASYNC_WRITE_BATCH_SIZE];
+    int iovcnt = 0;
+    for (canary_op_t *op = conn->unsent;
+         op != NULL && iovcnt < ASYNC_WRITE_BATCH_SIZE; op = op->next)
+      iov[iovcnt++] = (struct iovec){.iov_base = op->out + op->out_sent,
+                                     .iov_len = op->out_len - op->out_sent};
+
+    struct msghdr hdr = {.msg_iov = iov, .msg_iovlen = iovcnt};
+    ssize_t n = sendmsg(conn->socket, &hdr, MSG_NOSIGNAL);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return arm_conn(async, conn, true);
+      return -1;
+    }
+
+    // Skip the requests that were written completely.
+    while (n > 0) {
+      canary_op_t *op = conn->unsent;
+      size_t left = op->out_len - op->out_sent;
+      if ((size_t)n < left) {
+        op->out_sent += n;
+        break;
+      }
+      n -= left;
+      free(op->out);
+      op->out = NULL;
+      conn->unsent = op->next;
+    }
+  }
+  return arm_conn(async, conn, false);
+}
+
+/**
+ * @brief Builds the request frame of an operation, in the same format as
+ * `send_msg`.
+ *
+ * @param op - canary_op_t *
+ */
+void build_frame(canary_op_t *op) {
+  uint32_t key_len = strlen(op->key) + 1;
+  uint32_t payload_len = op->type == Client2MstrPut
+                             ? sizeof(key_len) + key_len + sizeof(op->value)
+                             : key_len;
+  uint32_t header[3] = {
+      htonl(sizeof(header) - sizeof(uint32_t) + payload_len),
+      htonl(op->type), htonl(payload_len)};
+
+  op->out_len = sizeof(header) + payload_len;
+  op->out_sent = 0;
+  op->out = malloc(op->out_len);
+  memcpy(op->out, header, sizeof(header));
+  if (op->type == Client2MstrPut)
+    pack_string_int(op->key, key_len, op->value, op->out + sizeof(header));
+  else
+    memcpy(op->out + sizeof(header), op->key, key_len);
+}
+
+/**
+ * @brief Sends an operation to the replica of its route, behind the requests
+ * that are already in flight on the connection. A connection that fails is
+ * closed by the next poll, which fails its operations.
+ *
+ * @param async - CanaryAsync *
+ * @param op - canary_op_t *
+ * @return -1 if the operation could not be routed, 0 otherwise.
+ */
+int submit_op(CanaryAsync *async, canary_op_t *op) {
+  ring_shard_t *shard = lookup_shard(async->cache, op->key);
+  ring_addr_t *addr = NULL;
+  if (shard != NULL) {
+    switch (op->route) {
+    case RouteReplica:
+      addr = ring_shard_replica(shard, rand_r(&async->cache->seed));
+      if (addr == &shard->mstr)
+        op->route = RouteMaster;
+      break;
+    case RouteMaster:
+      addr = &shard->mstr;
+      break;
+    case RoutePrev:
+      shard = ring_map_lookup_prev(async->cache->map, op->key);
+      addr = shard == NULL ? NULL : &shard->mstr;
+      break;
+    }
+  }
+  if (addr == NULL)
+    return -1;
+
+  async_conn_t *conn = find_conn(async, addr);
+  if (conn == NULL)
+    return -1;
+
+  build_frame(op);
+  op->next = NULL;
+  if (conn->tail != NULL)
+    conn->tail->next = op;
+  else
+    conn->head = op;
+  conn->tail = op;
+  if (conn->unsent == NULL)
+    conn->unsent = op;
+
+  if (flush_conn(async, conn) == -1)
+    conn->failed = true;
+  return 0;
+}
+
+/**
+ * @brief Completes an operation with its response, or sends it on to the
+ * next replica in the same order as `canary_get` and `canary_put`.
+ *
+ * @param async - CanaryAsync *
+ * @param op - canary_op_t *
+ * @param msg - CanaryMsg *
+ */
+void complete_op(CanaryAsync *async, canary_op_t *op, CanaryMsg *msg) {
+  if (msg->type == Shard2ClientNotOwner) {
+    if (++op->attempts < ASYNC_MAX_ATTEMPTS && refresh_map(async->cache) == 0 &&
+        submit_op(async, op) == 0)
+      return;
+    finish_op(async, op, -1);
+    return;
+  }
+
+  switch (op->type) {
+  case Client2ShardGet:
+    if (msg->type != Shard2ClientGet)
+      break;
+    if (msg->payload_len >= sizeof(op->value) + sizeof(op->version)) {
+      memcpy(&op->value, msg->payload, sizeof(op->value));
+      unpack_long(&op->version, msg->payload + sizeof(op->value));
+      finish_op(async, op, 1);
+      return;
+    }
+
+    // A follower may not have replicated a put yet, and while keys migrate
+    // the previous owner still holds the key.
+    if (op->route == RouteReplica) {
+      op->route = RouteMaster;
+    } else if (op->route == RouteMaster &&
+               ring_map_lookup_prev(async->cache->map, op->key) != NULL) {
+      op->route = RoutePrev;
+    } else {
+      finish_op(async, op, 0);
+      return;
+    }
+    if (submit_op(async, op) == -1)
+      finish_op(async, op, op->route == RoutePrev ? 0 : -1);
+    return;
+  case Client2MstrPut:
+    if (msg->type == Mstr2ClientPut) {
+      finish_op(async, op, 1);
+      return;
+    }
+    break;
+  default:
+    break;
+  }
+  finish_op(async, op, -1);
+}
+
+/**
+ * @brief Reads what the shard has sent on a connection, and completes the
+ * operations whose responses are complete.
+ *
+ * @param async - CanaryAsync *
+ * @param conn - async_conn_t *
+ * @return -1 if the connection failed or was closed, 0 otherwise.
+ */
+int read_conn(CanaryAsync *async, async_conn_t *conn) {
+  bool closed = false;
+  while (!closed) {
+    if (conn->in_cap - conn->in_len < ASYNC_READ_SIZE) {
+      conn->in_cap = conn->in_cap * 2 > conn->in_len + ASYNC_READ_SIZE
+                         ? conn->in_cap * 2
+                         : conn->in_len + ASYNC_READ_SIZE;
+      conn->in = realloc(conn->in, conn->in_cap);
+    }
+
+    ssize_t n = recv(conn->socket, conn->in + conn->in_len,
+                     conn->in_cap - conn->in_len, 0);
+    if (n == 0) {
+      closed = true;
+    } else if (n == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      if (errno != EINTR)
+        return -1;
+    } else {
+      conn->in_len += n;
+    }
+  }
+
+  size_t offset = 0;
+  uint32_t header[3];
+  while (conn->in_len - offset >= sizeof(header)) {
+    memcpy(header, conn->in + offset, sizeof(header));
+    uint32_t payload_len = ntohl(header[2]);
+    if (payload_len > MAX_PAYLOAD_SIZE ||
+        ntohl(header[0]) != sizeof(header) - sizeof(uint32_t) + payload_len)
+      return -1;
+    if (conn->in_len - offset < sizeof(header) + payload_len)
+      break;
+
+    // A response to a request that was never sent.
+    canary_op_t *op = conn->head;
+    if (op == NULL || op == conn->unsent)
+      return -1;
+    conn->head = op->next;
+    if (conn->head == NULL)
+      conn->tail = NULL;
+
+    CanaryMsg msg;
+    deserialize(conn->in + offset + sizeof(uint32_t), &msg);
+    offset += sizeof(header) + payload_len;
+    complete_op(async, op, &msg);
+    free(msg.payload);
+  }
+  memmove(conn->in, conn->in + offset, conn->in_len - offset);
+  conn->in_len -= offset;
+  return closed ? -1 : 0;
+}
+
+/**
+ * @brief Closes the connections that failed, and fails their operations.
+ *
+ * @param async - CanaryAsync *
+ */
+void close_failed(CanaryAsync *async) {
+  async_conn_t **link = &async->conns;
+  while (*link != NULL) {
+    async_conn_t *conn = *link;
+    if (!conn->failed) {
+      link = &conn->next;
+      continue;
+    }
+
+    *link = conn->next;
+    if (conn->socket != -1)
+      close(conn->socket);
+    canary_op_t *op = conn->head;
+    free(conn->in);
+    free(conn);
+    while (op != NULL) {
+      canary_op_t *next = op->next;
+      finish_op(async, op, -1);
+      op = next;
+    }
+    // The callbacks may have failed other connections.
+    link = &async->conns;
+  }
+}
+
+/**
+ * @brief Creates an operation.
+ *
+ * @param type - CanaryMsgType
+ * @param key - char *
+ * @param value - int
+ * @param callback - canary_callback_t
+ * @param arg - void *
+ * @return pointer to the operation.
+ */
+canary_op_t *create_op(CanaryMsgType type, char *key, int value,
+                       canary_callback_t callback, void *arg) {
+  canary_op_t *op = calloc(1, sizeof(canary_op_t));
+  op->type = type;
+  op->key = strdup(key);
+  op->value = value;
+  op->callback = callback;
+  op->arg = arg;
+  return op;
+}
+
+/* ----------- EXTERNAL API -------------------*/
+
+/**
+ * @brief Creates an asynchronous client over a cache handle, which must
+ * outlive it.
+ *
+ * @param cache - CanaryCache *
+ * @return pointer to the client, NULL in case of error.
+ */
+CanaryAsync *create_canary_async(CanaryCache *cache) {
+  int poll_fd = epoll_create1(0);
+  if (poll_fd == -1)
+    return NULL;
+
+  CanaryAsync *async = calloc(1, sizeof(CanaryAsync));
+  async->cache = cache;
+  async->poll_fd = poll_fd;
+  return async;
+}
+
+/**
+ * @brief Fails the operations that are still pending, whose callbacks must
+ * not submit new ones, and frees the client. Connections without pending
+ * operations go back to the pool of the cache handle.
+ *
+ * @param async - CanaryAsync *
+ */
+void destroy_canary_async(CanaryAsync *async) {
+  for (async_conn_t *conn = async->conns; conn != NULL; conn = conn->next) {
+    if (!conn->failed && conn->head == NULL && conn->in_len == 0 &&
+        fcntl(conn->socket, F_SETFL, 0) != -1) {
+      epoll_ctl(async->poll_fd, EPOLL_CTL_DEL, conn->socket, NULL);
+      pool_release(async->cache->pool, conn->addr, conn->port, conn->socket);
+      conn->socket = -1;
+    }
+    conn->failed = true;
+  }
+  close_failed(async);
+  close(async->poll_fd);
+  free(async);
+}
+
+/**
+ * @brief Submits a get of `key`, which is sent to a replica of its shard like
+ * `canary_get`, without waiting for the response. The near cache of the
+ * handle is not used.
+ *
+ * @param async - CanaryAsync *
+ * @param key - char *
+ * @param callback - canary_callback_t, may be NULL.
+ * @param arg - void *, passed to the callback.
+ * @return pointer to the operation, NULL if it could not be submitted.
+ */
+canary_op_t *canary_get_async(CanaryAsync *async, char *key,
+                              canary_callback_t callback, void *arg) {
+  canary_op_t *op = create_op(Client2ShardGet, key, 0, callback, arg);
+  op->route = RouteReplica;
+  if (submit_op(async, op) == -1) {
+    destroy_canary_op(op);
+    return NULL;
+  }
+  async->num_pending++;
+  return op;
+}
+
+/**
+ * @brief Submits a put of `value` under `key` to the master of its shard,
+ * without waiting for the acknowledgement.
+ *
+ * @param async - CanaryAsync *
+ * @param key - char *
+ * @param value - int
+ * @param callback - canary_callback_t, may be NULL.
+ * @param arg - void *, passed to the callback.
+ * @return pointer to the operation, NULL if it could not be submitted.
+ */
+canary_op_t *canary_put_async(CanaryAsync *async, char *key, int value,
+                              canary_callback_t callback, void *arg) {
+  near_invalidate(async->cache, key);
+  canary_op_t *op = create_op(Client2MstrPut, key, value, callback, arg);
+  op->route = RouteMaster;
+  if (submit_op(async, op) == -1) {
+    destroy_canary_op(op);
+    return NULL;
+  }
+  async->num_pending++;
+  return op;
+}
+
+/**
+ * @brief Writes pending requests and completes the operations whose
+ * responses have arrived, waiting at most `timeout_ms` for any to arrive.
+ *
+ * @param async - CanaryAsync *
+ * @param timeout_ms - int, -1 waits until an operation completes.
+ * @return -1 in case of error, otherwise the number of completed operations.
+ */
+int canary_poll(CanaryAsync *async, int timeout_ms) {
+  struct epoll_event events[ASYNC_POLL_BATCH_SIZE];
+  size_t num_completed = async->num_completed;
+
+  // Connections that failed while submitting are done with first.
+  close_failed(async);
+  if (async->num_completed != num_completed)
+    return async->num_completed - num_completed;
+
+  int num_events =
+      epoll_wait(async->poll_fd, events, ASYNC_POLL_BATCH_SIZE, timeout_ms);
+  if (num_events == -1)
+    return errno == EINTR ? 0 : -1;
+
+  for (int i = 0; i < num_events; i++) {
+    async_conn_t *conn = events[i].data.ptr;
+    if (!conn->failed && (events[i].events & EPOLLOUT) &&
+        flush_conn(async, conn) == -1)
+      conn->failed = true;
+    if (!conn->failed && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) &&
+        read_conn(async, conn) == -1)
+      conn->failed = true;
+  }
+  close_failed(async);
+  return async->num_completed - num_completed;
+}
+
+/**
+ * @brief Polls until an operation completes, e.g. after submitting a batch of
+ * operations and waiting for the last one.
+ *
+ * NOTE: The operation must not be freed by its callback.
+ *
+ * @param async - CanaryAsync *
+ * @param op - canary_op_t *
+ * @return the status of the operation, -1 in case of error.
+ */
+int canary_wait(CanaryAsync *async, canary_op_t *op) {
+  while (!op->done) {
+    if (canary_poll(async, -1) == -1)
+      return -1;
+  }
+  return op->status;
+}
+
+/**
+ * @brief Frees a completed operation.
+ *
+ * @param op - canary_op_t *
+ */
+void destroy_canary_op(canary_op_t *op) {
+  free(op->out);
+  free(op->key);
+  free(op);
+}
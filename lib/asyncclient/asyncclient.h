@@ -0,0 +1,86 @@
+#ifndef __ASYNCCLIENT_H__
+#define __ASYNCCLIENT_H__
+
+#include "../client/client.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+struct canary_op_t;
+
+// Called once an operation completes, from `canary_poll`. The callback may
+// submit new operations and free the operation, but must not poll.
+typedef void (*canary_callback_t)(struct canary_op_t *op, void *arg);
+
+// A get or put that has been submitted, and may still be waiting for its
+// response.
+typedef struct canary_op_t {
+  CanaryMsgType type; // Client2ShardGet or Client2MstrPut.
+  char *key;
+  int value;        // to put, or the value got once done.
+  uint64_t version; // of the value got.
+
+  // Once done, the status is -1 in case of error, 0 if a get missed and 1
+  // otherwise.
+  bool done;
+  int status;
+  canary_callback_t callback;
+  void *arg;
+
+  CanaryRoute route;
+  int attempts; // turned away by shards that do not own the key.
+
+  // The request frame, freed once it has been written.
+  uint8_t *out;
+  size_t out_len, out_sent;
+  struct canary_op_t *next; // on its connection.
+} canary_op_t;
+
+// A connection that requests are pipelined over. A shard answers the
+// requests of a connection one at a time, so responses arrive in the order
+// that the requests were sent.
+typedef struct async_conn_t {
+  struct in_addr addr;
+  in_port_t port;
+  int socket;
+  bool writing; // also polled for writes, while requests are not written.
+  bool failed;  // closed once the poll is done with it.
+
+  canary_op_t *head, *tail; // in the order sent.
+  canary_op_t *unsent;      // first operation that is not written yet.
+
+  // Partially received responses.
+  uint8_t *in;
+  size_t in_len, in_cap;
+
+  struct async_conn_t *next;
+} async_conn_t;
+
+// Non-blocking gets and puts over the shards of a cache handle. Operations
+// are submitted without waiting, every shard gets one connection from the
+// pool of the handle that all of its requests are pipelined over, and
+// `canary_poll` completes the operations as their responses arrive. The
+// epoll file descriptor is readable whenever there is something to poll, so
+// it can be added to the event loop of the caller.
+//
+// NOTE: Fetching the ring map and connecting to a shard still block. Is not
+// thread safe, and must not be used by another thread than its cache handle.
+typedef struct {
+  CanaryCache *cache;
+  int poll_fd;
+  async_conn_t *conns;
+  size_t num_pending;
+  size_t num_completed;
+} CanaryAsync;
+
+CanaryAsync *create_canary_async(CanaryCache *);
+void destroy_canary_async(CanaryAsync *);
+
+canary_op_t *canary_get_async(CanaryAsync *, char *, canary_callback_t,
+                              void *);
+canary_op_t *canary_put_async(CanaryAsync *, char *, int, canary_callback_t,
+                              void *);
+int canary_poll(CanaryAsync *, int);
+int canary_wait(CanaryAsync *, canary_op_t *);
+void destroy_canary_op(canary_op_t *);
+
+#endif // __ASYNCCLIENT_H__
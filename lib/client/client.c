@@ -1,92 +1,979 @@
 #include "client.h"
+#include <fcntl.h>
 
-int get_shard(int socket, char *key, char **addr, in_port_t *port);
-int *get_from_shard(int socket, char *key);
-void put_in_shard(int socket, char *key, int value);
+#define LOAD_RETRIES 5
+#define LOAD_RETRY_INTERVAL_US 10000
+#define RING_MAP_TTL 10
+// Idle connections kept to a shard, and for how long in seconds.
+#define POOL_MAX_PER_SHARD 4
+#define POOL_IDLE_TIMEOUT 30
+// Attempts of a key of a batch whose shard fails or turns it away, the ring
+// map is refreshed in between.
+#define BATCH_MAX_ATTEMPTS 2
+
+// Keys of a batch request that go to the same shard.
+typedef struct {
+  uint32_t shard_id;
+  CanaryRoute route; // of the keys.
+  ring_addr_t addr;
+  bool to_mstr; // the replica is the master.
+  size_t *keys; // indices into the keys of the request.
+  size_t num_keys;
+  int socket; // -1 if the batch could not be sent.
+} batch_t;
+
+// State of the keys of a `canary_mget` or `canary_mput`.
+typedef struct {
+  CanaryMsgType type;
+  char **keys;
+  int *values; // NULL for gets.
+  size_t num_keys;
+  canary_result_t *results;
+
+  CanaryRoute *routes;
+  int *attempts;
+  bool *pending; // not done, and not failed for good.
+
+  // The batches of the current round, and the indices of their keys.
+  batch_t *batches;
+  size_t num_batches;
+  size_t *indices;
+  size_t *batch_of; // batch of each key.
+} scatter_t;
+
+int fetch_map(CanaryCache *cache, char *cnf_addr, in_port_t cnf_port);
+int counter_op(CanaryCache *cache, CanaryMsgType type, char *key, int operand,
+               int *value);
+int request_addr(CanaryCache *cache, ring_addr_t *addr, CanaryMsg req,
+                 CanaryMsg *resp);
+int request_shard(CanaryCache *cache, char *key, CanaryMsg req,
+                  CanaryMsg *resp);
+int request_get(CanaryCache *cache, char *key, CanaryMsg *resp);
+int request_replica(CanaryCache *cache, char *key, CanaryMsg req,
+                    CanaryMsg *resp);
+int request_prev(CanaryCache *cache, char *key, CanaryMsg req,
+                 CanaryMsg *resp);
+int request_watch(CanaryCache *cache, char *key, CanaryMsg *resp);
+void near_drain(CanaryCache *cache);
+int scatter_gather(CanaryCache *cache, CanaryMsgType type, char **keys,
+                   int *values, size_t num_keys, canary_result_t *results);
+size_t group_batches(CanaryCache *cache, scatter_t *sc);
+void send_batch(CanaryCache *cache, scatter_t *sc, batch_t *batch);
+int gather_batch(CanaryCache *cache, scatter_t *sc, batch_t *batch);
 
 CanaryCache create_canary_cache(char *cnf_addr, in_port_t cnf_port) {
-  return (CanaryCache){.cnf_addr = cnf_addr, .cnf_port = cnf_port};
+  return (CanaryCache){
+      .cnf_addr = cnf_addr,
+      .cnf_port = cnf_port,
+      .seed = time(NULL) ^ getpid(),
+      .pool = create_conn_pool(POOL_MAX_PER_SHARD, POOL_IDLE_TIMEOUT),
+      .watch_socket = -1};
+}
+
+/**
+ * @brief Keeps the values of recent gets in the process, so that repeated
+ * gets of hot keys do not leave it. A value is served for at most `ttl_ms`
+ * milliseconds after it was fetched, which bounds how stale it can be. Puts
+ * through this handle drop the key right away. With `watch`, gets fetch from
+ * the master and watch the key, and writes by other clients drop it as soon
+ * as their invalidation arrives, while the TTL covers lost invalidations.
+ *
+ * NOTE: Only `canary_get` is served from the near cache, the versions of
+ * `canary_gets` must come from the shards.
+ *
+ * @param cache - CanaryCache *
+ * @param capacity - size_t, number of keys.
+ * @param ttl_ms - unsigned int, must not be 0.
+ * @param watch - bool
+ * @return -1 in case of error, 0 otherwise.
+ */
+int canary_near_cache(CanaryCache *cache, size_t capacity, unsigned int ttl_ms,
+                      bool watch) {
+  if (cache->near != NULL || capacity == 0 || ttl_ms == 0)
+    return -1;
+
+  if (watch) {
+    SA_IN addr;
+    socklen_t addr_len = sizeof(addr);
+    int socket = bind_udp_socket(0);
+    if (socket == -1)
+      return -1;
+    if (getsockname(socket, (SA *)&addr, &addr_len) == -1 ||
+        fcntl(socket, F_SETFL, O_NONBLOCK) == -1) {
+      close(socket);
+      return -1;
+    }
+    cache->watch_socket = socket;
+    cache->watch_port = ntohs(addr.sin_port);
+  }
+
+  cache->near = create_lru_cache(capacity);
+  cache->near->ttl = (uint64_t)ttl_ms * 1000000;
+  return 0;
 }
 
+/**
+ * @brief Closes the connections of the cache handle, and frees its ring map
+ * and near cache.
+ *
+ * @param cache - CanaryCache *
+ */
+void destroy_canary_cache(CanaryCache *cache) {
+  destroy_conn_pool(cache->pool);
+  if (cache->map != NULL)
+    destroy_ring_map(cache->map);
+  if (cache->near != NULL)
+    destroy_lru_cache(cache->near);
+  if (cache->watch_socket != -1)
+    close(cache->watch_socket);
+  cache->pool = NULL;
+  cache->map = NULL;
+  cache->near = NULL;
+  cache->watch_socket = -1;
+}
+
+/**
+ * @brief Gets the value of `key`.
+ *
+ * NOTE: The value is allocated on the heap.
+ *
+ * @param cache - CanaryCache *
+ * @param key - char *
+ * @return pointer to the value, NULL if the key is not cached or in case of
+ * error.
+ */
 int *canary_get(CanaryCache *cache, char *key) {
-  int cnf_socket, shard_socket;
-  in_port_t shard_port;
-  char *shard_addr;
+  CanaryMsg resp;
+
+  if (cache->near != NULL) {
+    near_drain(cache);
+    int *near_value = get(cache->near, key);
+    if (near_value != NULL) {
+      int *value = malloc(sizeof(*value));
+      *value = *near_value;
+      return value;
+    }
+  }
 
-  if ((cnf_socket = connect_to_socket(cache->cnf_addr, cache->cnf_port)) == -1)
+  int rc = cache->watch_socket != -1 ? request_watch(cache, key, &resp)
+                                     : request_get(cache, key, &resp);
+  if (rc == -1)
     return NULL;
 
-  if (get_shard(cnf_socket, key, &shard_addr, &shard_port) == -1)
+  if (resp.type != Shard2ClientGet || resp.payload_len == 0) {
+    free(resp.payload);
     return NULL;
+  }
+  if (cache->near != NULL) {
+    lru_entry_t *removed = put(cache->near, key, *(int *)resp.payload);
+    if (removed != NULL)
+      destroy_entry(removed);
+  }
+  return (int *)resp.payload;
+}
+
+/**
+ * @brief Puts `value` under `key`, and waits until the master has applied it.
+ *
+ * @param cache - CanaryCache *
+ * @param key - char *
+ * @param value - int
+ */
+void canary_put(CanaryCache *cache, char *key, int value) {
+  uint32_t key_len = strlen(key) + 1;
+  uint32_t payload_len = sizeof(key_len) + key_len + sizeof(value);
+  uint8_t *payload = malloc(payload_len);
+  pack_string_int(key, key_len, value, payload);
+
+  CanaryMsg resp, req = {.type = Client2MstrPut,
+                         .payload_len = payload_len,
+                         .payload = payload};
+
+  near_invalidate(cache, key);
+  if (request_shard(cache, key, req, &resp) != -1)
+    free(resp.payload);
+  free(payload);
+}
+
+/**
+ * @brief Gets the value of `key` together with its version, to be used in a
+ * later compare-and-set.
+ *
+ * @param cache - CanaryCache *
+ * @param key - char *
+ * @param value - int *
+ * @param version - uint64_t *
+ * @return -1 in case of error, 0 if the key is not cached, 1 otherwise.
+ */
+int canary_gets(CanaryCache *cache, char *key, int *value, uint64_t *version) {
+  CanaryMsg resp;
+
+  if (request_get(cache, key, &resp) == -1)
+    return -1;
+
+  int rc = -1;
+  if (resp.type == Shard2ClientGet) {
+    rc = resp.payload_len != 0;
+    if (rc == 1) {
+      memcpy(value, resp.payload, sizeof(*value));
+      unpack_long(version, resp.payload + sizeof(*value));
+    }
+  }
+  free(resp.payload);
+  return rc;
+}
+
+/**
+ * @brief Gets the value of `key`, and loads it with `loader` on a miss. The
+ * shard coalesces concurrent misses of a key, so only one client runs the
+ * loader while the others wait for its put. Falls back to loading the key
+ * without the cache if the loader of another client does not finish in time.
+ *
+ * @param cache - CanaryCache *
+ * @param key - char *
+ * @param value - int *
+ * @param loader - canary_loader_t
+ * @param arg - void *, passed to the loader.
+ * @return -1 in case of error, 0 if the key does not exist, 1 if `value` was
+ * set.
+ */
+int canary_get_or_load(CanaryCache *cache, char *key, int *value,
+                       canary_loader_t loader, void *arg) {
+  CanaryMsg resp, req = {.type = Client2ShardLease,
+                         .payload_len = strlen(key) + 1,
+                         .payload = (uint8_t *)key};
+
+  for (int i = 0; i < LOAD_RETRIES; i++) {
+    if (request_shard(cache, key, req, &resp) == -1)
+      break;
+    if (resp.type != Shard2ClientLease) {
+      free(resp.payload);
+      break;
+    }
+
+    LeaseStatus status = ntohl(*(uint32_t *)resp.payload);
+    memcpy(value, resp.payload + sizeof(uint32_t), sizeof(*value));
+    free(resp.payload);
+
+    switch (status) {
+    case LeaseHit:
+      return 1;
+    case LeaseGranted: {
+      // A key that does not exist leaves the lease to expire.
+      int rc = loader(key, value, arg);
+      if (rc == 1)
+        canary_put(cache, key, *value);
+      return rc;
+    }
+    case LeaseRetry:
+      usleep(LOAD_RETRY_INTERVAL_US);
+      break;
+    }
+  }
+  return loader(key, value, arg);
+}
+
+/**
+ * @brief Puts `value` only if the version of `key` is still `expected`, use
+ * version 0 to put only if the key is not cached.
+ *
+ * @param cache - CanaryCache *
+ * @param key - char *
+ * @param value - int
+ * @param expected - uint64_t
+ * @param version - uint64_t *, the new version if the put was applied, the
+ * current version otherwise.
+ * @return -1 in case of error, 1 if the put was applied, 0 otherwise.
+ */
+int canary_cas(CanaryCache *cache, char *key, int value, uint64_t expected,
+               uint64_t *version) {
+  uint32_t key_len = strlen(key) + 1;
+  uint32_t payload_len =
+      sizeof(key_len) + key_len + sizeof(value) + sizeof(expected);
+  uint8_t *payload = malloc(payload_len);
+  pack_string_int(key, key_len, value, payload);
+  pack_long(expected, payload + payload_len - sizeof(expected));
+
+  CanaryMsg resp, req = {.type = Client2MstrCas,
+                         .payload_len = payload_len,
+                         .payload = payload};
+
+  near_invalidate(cache, key);
+  int rc = request_shard(cache, key, req, &resp);
+  free(payload);
+  if (rc == -1)
+    return -1;
+
+  rc = -1;
+  if (resp.type == Mstr2ClientCas) {
+    rc = ntohl(*(uint32_t *)resp.payload);
+    unpack_long(version, resp.payload + sizeof(uint32_t));
+  }
+  free(resp.payload);
+  return rc;
+}
+
+/**
+ * @brief Atomically adds `delta` to the value of `key`, a missing key counts
+ * as 0.
+ *
+ * @param cache - CanaryCache *
+ * @param key - char *
+ * @param delta - int
+ * @param value - int *, the value after the increment.
+ * @return -1 in case of error, 0 otherwise.
+ */
+int canary_incr(CanaryCache *cache, char *key, int delta, int *value) {
+  return counter_op(cache, Client2MstrIncr, key, delta, value) == -1 ? -1 : 0;
+}
+
+/**
+ * @brief Atomically subtracts `delta` from the value of `key`, a missing key
+ * counts as 0.
+ *
+ * @param cache - CanaryCache *
+ * @param key - char *
+ * @param delta - int
+ * @param value - int *, the value after the decrement.
+ * @return -1 in case of error, 0 otherwise.
+ */
+int canary_decr(CanaryCache *cache, char *key, int delta, int *value) {
+  return counter_op(cache, Client2MstrDecr, key, delta, value) == -1 ? -1 : 0;
+}
+
+/**
+ * @brief Puts `value` only if `key` is not cached.
+ *
+ * @param cache - CanaryCache *
+ * @param key - char *
+ * @param value - int
+ * @param current - int *, the cached value after the operation.
+ * @return -1 in case of error, 1 if the value was added, 0 if the key was
+ * already cached.
+ */
+int canary_add(CanaryCache *cache, char *key, int value, int *current) {
+  return counter_op(cache, Client2MstrAdd, key, value, current);
+}
+
+/**
+ * @brief Gets many keys at once. The keys are grouped by shard, every shard
+ * gets one batch request, and all batches are sent before any response is
+ * read, so the shards serve them in parallel. Misses are asked again of the
+ * same replicas as `canary_get`, one batch per shard. The near cache of the
+ * handle is not used.
+ *
+ * @param cache - CanaryCache *
+ * @param keys - char **
+ * @param num_keys - size_t
+ * @param results - canary_result_t *, one per key.
+ * @return -1 if any key failed, 0 otherwise.
+ */
+int canary_mget(CanaryCache *cache, char **keys, size_t num_keys,
+                canary_result_t *results) {
+  return scatter_gather(cache, Client2ShardMget, keys, NULL, num_keys,
+                        results);
+}
+
+/**
+ * @brief Puts many keys at once, with one batch request per master shard
+ * like `canary_mget`, and waits until the masters have applied them.
+ *
+ * @param cache - CanaryCache *
+ * @param keys - char **
+ * @param values - int *, one per key.
+ * @param num_keys - size_t
+ * @param results - canary_result_t *, one per key.
+ * @return -1 if any key failed, 0 otherwise.
+ */
+int canary_mput(CanaryCache *cache, char **keys, int *values, size_t num_keys,
+                canary_result_t *results) {
+  for (size_t i = 0; i < num_keys; i++)
+    near_invalidate(cache, keys[i]);
+  return scatter_gather(cache, Client2MstrMput, keys, values, num_keys,
+                        results);
+}
+
+/**
+ * @brief Fetches the metrics of a single shard.
+ *
+ * NOTE: The text is allocated on the heap.
+ *
+ * @param shard_addr - char *
+ * @param shard_port - in_port_t
+ * @return the metrics in the Prometheus text format, NULL in case of error.
+ */
+char *canary_stats(char *shard_addr, in_port_t shard_port) {
+  int shard_socket;
+  CanaryMsg req = {.type = Client2ShardStats, .payload_len = 0}, resp;
 
   if ((shard_socket = connect_to_socket(shard_addr, shard_port)) == -1)
     return NULL;
 
-  return get_from_shard(shard_socket, key);
+  if (send_msg(shard_socket, req) == -1 ||
+      receive_msg(shard_socket, &resp) == -1) {
+    close(shard_socket);
+    return NULL;
+  }
+  close(shard_socket);
+
+  if (resp.type != Shard2ClientStats) {
+    free(resp.payload);
+    return NULL;
+  }
+  return (char *)resp.payload;
 }
 
-void canary_put(CanaryCache *cache, char *key, int value) {
-  int cnf_socket, shard_socket;
-  in_port_t shard_port;
-  char *shard_addr;
+/**
+ * @brief Fetches the ring map from a random replica of the configuration
+ * service listed in the current map, or from the configured address if there
+ * are none or the replica fails.
+ *
+ * @param cache - CanaryCache *
+ * @return -1 in case of error, 0 otherwise.
+ */
+int refresh_map(CanaryCache *cache) {
+  char cnf_addr[INET_ADDRSTRLEN];
 
-  if ((cnf_socket = connect_to_socket(cache->cnf_addr, cache->cnf_port)) == -1)
-    return;
+  if (cache->map != NULL && cache->map->num_cnfs > 0) {
+    ring_addr_t *cnf =
+        &cache->map->cnfs[rand_r(&cache->seed) % cache->map->num_cnfs];
+    inet_ntop(AF_INET, &cnf->addr, cnf_addr, sizeof(cnf_addr));
+    if (fetch_map(cache, cnf_addr, cnf->port) == 0)
+      return 0;
+  }
+  return fetch_map(cache, cache->cnf_addr, cache->cnf_port);
+}
 
-  if (get_shard(cnf_socket, key, &shard_addr, &shard_port) == -1)
-    return;
+/**
+ * @brief Fetches the ring map from a configuration service. A map older than
+ * the current one, from a replica that lags behind, is rejected.
+ *
+ * @param cache - CanaryCache *
+ * @param cnf_addr - char *
+ * @param cnf_port - in_port_t
+ * @return -1 in case of error, 0 otherwise.
+ */
+int fetch_map(CanaryCache *cache, char *cnf_addr, in_port_t cnf_port) {
+  CanaryMsg resp, req = {.type = Client2CnfRing, .payload_len = 0};
+  int cnf_socket, rc;
 
-  if ((shard_socket = connect_to_socket(shard_addr, shard_port)) == -1)
-    return;
-  put_in_shard(shard_socket, key, value);
+  if ((cnf_socket = connect_to_socket(cnf_addr, cnf_port)) == -1)
+    return -1;
+
+  rc = send_msg(cnf_socket, req) == -1 ? -1 : receive_msg(cnf_socket, &resp);
+  close(cnf_socket);
+  if (rc == -1)
+    return -1;
+
+  ring_map_t *map = resp.type == Cnf2ClientRing
+                        ? unpack_ring_map(resp.payload, resp.payload_len)
+                        : NULL;
+  free(resp.payload);
+  if (map == NULL)
+    return -1;
+  if (cache->map != NULL && map->epoch < cache->map->epoch) {
+    destroy_ring_map(map);
+    return -1;
+  }
+
+  if (cache->map != NULL)
+    destroy_ring_map(cache->map);
+  cache->map = map;
+  cache->map_expires_at = time(NULL) + RING_MAP_TTL;
+  return 0;
 }
 
-int get_shard(int socket, char *key, char **addr, in_port_t *port) {
-  CanaryMsg req, resp;
+/**
+ * @brief Sends a counter operation to the master shard of the key, and waits
+ * for the result.
+ *
+ * @param cache - CanaryCache *
+ * @param type - CanaryMsgType
+ * @param key - char *
+ * @param operand - int
+ * @param value - int *, the value stored after the operation.
+ * @return -1 in case of error, otherwise whether the operation was applied.
+ */
+int counter_op(CanaryCache *cache, CanaryMsgType type, char *key, int operand,
+               int *value) {
+  uint32_t key_len = strlen(key) + 1;
+  uint32_t payload_len = sizeof(key_len) + key_len + sizeof(operand);
+  uint8_t *payload = malloc(payload_len);
+  pack_string_int(key, key_len, operand, payload);
 
-  req = (CanaryMsg){.type = Client2CnfDiscover,
-                    .payload_len = strlen(key) + 1,
-                    .payload = (uint8_t *)key};
+  CanaryMsg resp,
+      req = {.type = type, .payload_len = payload_len, .payload = payload};
+
+  near_invalidate(cache, key);
+  int rc = request_shard(cache, key, req, &resp);
+  free(payload);
+  if (rc == -1)
+    return -1;
 
-  send_msg(socket, req);
-  receive_msg(socket, &resp);
+  rc = -1;
+  if (resp.type == Mstr2ClientCounter) {
+    uint32_t applied, result;
+    unpack_int_int(&applied, &result, resp.payload);
+    *value = result;
+    rc = applied;
+  }
+  free(resp.payload);
+  return rc;
+}
+
+/**
+ * @brief Looks up the shard of the key in the ring map, the map is fetched
+ * first if it is missing or has expired.
+ *
+ * @param cache - CanaryCache *
+ * @param key - char *
+ * @return pointer to the shard in the ring map, NULL in case of error.
+ */
+ring_shard_t *lookup_shard(CanaryCache *cache, char *key) {
+  if ((cache->map == NULL || cache->map_expires_at <= time(NULL)) &&
+      refresh_map(cache) == -1)
+    return NULL;
+
+  return ring_map_lookup(cache->map, key);
+}
 
-  if (resp.type != Cnf2ClientDiscover)
+/**
+ * @brief Sends a request to a shard over a pooled connection and waits for
+ * the response. The connection goes back to the pool, unless it failed.
+ *
+ * NOTE: The response payload is allocated on the heap.
+ *
+ * @param cache - CanaryCache *
+ * @param addr - ring_addr_t *
+ * @param req - CanaryMsg
+ * @param resp - CanaryMsg *
+ * @return -1 in case of error, 0 otherwise.
+ */
+int request_addr(CanaryCache *cache, ring_addr_t *addr, CanaryMsg req,
+                 CanaryMsg *resp) {
+  // The address may be freed by a refresh of the ring map.
+  IA shard_addr = addr->addr;
+  in_port_t shard_port = addr->port;
+
+  int shard_socket = pool_acquire(cache->pool, shard_addr, shard_port);
+  if (shard_socket == -1)
     return -1;
 
-  unpack_string_short(addr, port, resp.payload);
+  if (send_msg(shard_socket, req) == -1 ||
+      receive_msg(shard_socket, resp) == -1) {
+    close(shard_socket);
+    return -1;
+  }
+  pool_release(cache->pool, shard_addr, shard_port, shard_socket);
   return 0;
 }
 
-int *get_from_shard(int socket, char *key) {
-  CanaryMsg req, resp;
+/**
+ * @brief Sends a request to the shard of the key and waits for the response.
+ * If the shard can not be reached or does not own the key, the ring map is
+ * refreshed and the request is retried once.
+ *
+ * NOTE: The response payload is allocated on the heap.
+ *
+ * @param cache - CanaryCache *
+ * @param key - char *
+ * @param req - CanaryMsg
+ * @param resp - CanaryMsg *
+ * @return -1 in case of error, 0 otherwise.
+ */
+int request_shard(CanaryCache *cache, char *key, CanaryMsg req,
+                  CanaryMsg *resp) {
+  for (int attempt = 0; attempt < 2; attempt++) {
+    if (attempt > 0 && refresh_map(cache) == -1)
+      return -1;
+
+    ring_shard_t *shard = lookup_shard(cache, key);
+    if (shard == NULL || request_addr(cache, &shard->mstr, req, resp) == -1)
+      continue;
+
+    if (resp->type != Shard2ClientNotOwner)
+      return 0;
+    free(resp->payload);
+  }
+  return -1;
+}
+
+/**
+ * @brief Sends a get to a replica of the shard of the key, picked by the
+ * power of two choices over the loads in the ring map.
+ *
+ * NOTE: The response payload is allocated on the heap.
+ *
+ * @param cache - CanaryCache *
+ * @param key - char *
+ * @param req - CanaryMsg
+ * @param resp - CanaryMsg *
+ * @return -1 if the master should be asked instead, 0 otherwise.
+ */
+int request_replica(CanaryCache *cache, char *key, CanaryMsg req,
+                    CanaryMsg *resp) {
+  ring_shard_t *shard = lookup_shard(cache, key);
+  if (shard == NULL)
+    return -1;
+  ring_addr_t *replica = ring_shard_replica(shard, rand_r(&cache->seed));
+  if (replica == &shard->mstr || request_addr(cache, replica, req, resp) == -1)
+    return -1;
+
+  // A follower may not have replicated a put yet, misses are checked with
+  // the master.
+  if (resp->type != Shard2ClientGet || resp->payload_len == 0) {
+    free(resp->payload);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Gets a key from a replica of its shard, which is the master or one
+ * of its followers. Followers replicate asynchronously, so a get may return
+ * a value that has just been overwritten. While keys migrate after a change
+ * of the ring, a miss on the new owner falls back to the previous owner,
+ * which still holds the key until it has been handed over.
+ *
+ * NOTE: The response payload is allocated on the heap.
+ *
+ * @param cache - CanaryCache *
+ * @param key - char *
+ * @param resp - CanaryMsg *
+ * @return -1 in case of error, 0 otherwise.
+ */
+int request_get(CanaryCache *cache, char *key, CanaryMsg *resp) {
+  CanaryMsg req = {.type = Client2ShardGet,
+                   .payload_len = strlen(key) + 1,
+                   .payload = (uint8_t *)key};
+
+  if (request_replica(cache, key, req, resp) == 0)
+    return 0;
+  if (request_shard(cache, key, req, resp) == -1)
+    return -1;
+  return request_prev(cache, key, req, resp);
+}
+
+/**
+ * @brief Replaces a miss of the owner of the key with the response of the
+ * previous owner while keys migrate, see `request_get`.
+ *
+ * @param cache - CanaryCache *
+ * @param key - char *
+ * @param req - CanaryMsg, a get that the previous owner can serve.
+ * @param resp - CanaryMsg *, the response of the owner.
+ * @return 0
+ */
+int request_prev(CanaryCache *cache, char *key, CanaryMsg req,
+                 CanaryMsg *resp) {
+  CanaryMsg prev_resp;
+
+  ring_shard_t *prev = ring_map_lookup_prev(cache->map, key);
+  if (prev == NULL || resp->type != Shard2ClientGet || resp->payload_len != 0)
+    return 0;
+
+  if (request_addr(cache, &prev->mstr, req, &prev_resp) == -1)
+    return 0;
+
+  if (prev_resp.type == Shard2ClientGet && prev_resp.payload_len != 0) {
+    free(resp->payload);
+    *resp = prev_resp;
+  } else {
+    free(prev_resp.payload);
+  }
+  return 0;
+}
+
+/**
+ * @brief Gets a key from its master and watches it, so that the next write of
+ * the key sends an invalidation to the datagram socket of the cache handle.
+ * Writes go to the new owner of a key while keys migrate, so only a miss is
+ * asked of the previous owner, without a watch.
+ *
+ * NOTE: The response payload is allocated on the heap.
+ *
+ * @param cache - CanaryCache *
+ * @param key - char *
+ * @param resp - CanaryMsg *
+ * @return -1 in case of error, 0 otherwise.
+ */
+int request_watch(CanaryCache *cache, char *key, CanaryMsg *resp) {
+  uint32_t key_len = strlen(key) + 1;
+  uint8_t *payload = malloc(sizeof(uint16_t) + key_len);
+  pack_short(cache->watch_port, payload);
+  memcpy(payload + sizeof(uint16_t), key, key_len);
+
+  CanaryMsg req = {.type = Client2MstrWatch,
+                   .payload_len = sizeof(uint16_t) + key_len,
+                   .payload = payload};
+  int rc = request_shard(cache, key, req, resp);
+  free(payload);
+  if (rc == -1)
+    return -1;
 
-  uint32_t payload_len = strlen(key) + 1;
   req = (CanaryMsg){.type = Client2ShardGet,
-                    .payload_len = payload_len,
+                    .payload_len = key_len,
                     .payload = (uint8_t *)key};
+  return request_prev(cache, key, req, resp);
+}
 
-  send_msg(socket, req);
-  receive_msg(socket, &resp);
+/**
+ * @brief Drops a key from the near cache, if there is one.
+ *
+ * @param cache - CanaryCache *
+ * @param key - char *
+ */
+void near_invalidate(CanaryCache *cache, char *key) {
+  if (cache->near == NULL)
+    return;
 
-  if (resp.type != Shard2ClientGet)
-    return NULL;
+  lru_entry_t *removed = lru_delete(cache->near, key);
+  if (removed != NULL)
+    destroy_entry(removed);
+}
 
-  if (resp.payload_len == 0)
-    return NULL;
+/**
+ * @brief Applies the invalidations that the masters have sent since the last
+ * get, without waiting for more.
+ *
+ * @param cache - CanaryCache *
+ */
+void near_drain(CanaryCache *cache) {
+  CanaryMsg msg;
 
-  return (int *)resp.payload;
+  if (cache->watch_socket == -1)
+    return;
+
+  while (receive_datagram(cache->watch_socket, &msg) != -1) {
+    if (msg.type == Mstr2ClientInvalidate && msg.payload_len > 0) {
+      msg.payload[msg.payload_len - 1] = '\0';
+      near_invalidate(cache, (char *)msg.payload);
+    }
+    free(msg.payload);
+  }
 }
-void put_in_shard(int socket, char *key, int value) {
-  uint32_t key_len = strlen(key) + 1;
-  size_t payload_len = sizeof(key_len) + key_len + sizeof(value);
 
-  uint8_t *payload = malloc(payload_len);
-  pack_string_int(key, key_len, value, payload);
+/**
+ * @brief Sends batches of gets or puts to the shards of their keys in rounds.
+ * Every round scatters a batch to each shard before gathering the responses,
+ * and the next round asks the keys that are left of their next replica, or
+ * of their owner in a refreshed ring map.
+ *
+ * @param cache - CanaryCache *
+ * @param type - CanaryMsgType, Client2ShardMget or Client2MstrMput.
+ * @param keys - char **
+ * @param values - int *, NULL for gets.
+ * @param num_keys - size_t
+ * @param results - canary_result_t *
+ * @return -1 if any key failed, 0 otherwise.
+ */
+int scatter_gather(CanaryCache *cache, CanaryMsgType type, char **keys,
+                   int *values, size_t num_keys, canary_result_t *results) {
+  scatter_t sc = {.type = type,
+                  .keys = keys,
+                  .values = values,
+                  .num_keys = num_keys,
+                  .results = results,
+                  .routes = malloc(sizeof(CanaryRoute) * num_keys),
+                  .attempts = calloc(num_keys, sizeof(int)),
+                  .pending = malloc(sizeof(bool) * num_keys),
+                  .batches = malloc(sizeof(batch_t) * num_keys),
+                  .indices = malloc(sizeof(size_t) * num_keys),
+                  .batch_of = malloc(sizeof(size_t) * num_keys)};
+  for (size_t i = 0; i < num_keys; i++) {
+    sc.routes[i] = type == Client2ShardMget ? RouteReplica : RouteMaster;
+    sc.pending[i] = true;
+    results[i] = (canary_result_t){.status = -1};
+  }
 
-  CanaryMsg msg = {
-      .type = Client2MstrPut, .payload_len = payload_len, .payload = payload};
+  while (group_batches(cache, &sc) > 0) {
+    for (size_t b = 0; b < sc.num_batches; b++)
+      send_batch(cache, &sc, &sc.batches[b]);
 
-  send_msg(socket, msg);
+    int num_retries = 0;
+    for (size_t b = 0; b < sc.num_batches; b++)
+      num_retries += gather_batch(cache, &sc, &sc.batches[b]);
+
+    if (num_retries > 0 && refresh_map(cache) == -1)
+      break;
+  }
+
+  int rc = 0;
+  for (size_t i = 0; i < num_keys; i++) {
+    if (results[i].status == -1)
+      rc = -1;
+  }
+  free(sc.batch_of);
+  free(sc.indices);
+  free(sc.batches);
+  free(sc.pending);
+  free(sc.attempts);
+  free(sc.routes);
+  return rc;
+}
+
+/**
+ * @brief Groups the pending keys into one batch per shard and route.
+ *
+ * @param cache - CanaryCache *
+ * @param sc - scatter_t *
+ * @return the number of batches.
+ */
+size_t group_batches(CanaryCache *cache, scatter_t *sc) {
+  sc->num_batches = 0;
+  for (size_t i = 0; i < sc->num_keys; i++) {
+    if (!sc->pending[i])
+      continue;
+
+    ring_shard_t *shard = sc->routes[i] == RoutePrev
+                              ? ring_map_lookup_prev(cache->map, sc->keys[i])
+                              : lookup_shard(cache, sc->keys[i]);
+    if (shard == NULL) {
+      // The previous owner is gone once the keys have migrated.
+      if (sc->routes[i] == RoutePrev)
+        sc->results[i].status = 0;
+      sc->pending[i] = false;
+      continue;
+    }
+
+    size_t b = 0;
+    while (b < sc->num_batches && (sc->batches[b].shard_id != shard->id ||
+                                   sc->batches[b].route != sc->routes[i]))
+      b++;
+    if (b == sc->num_batches) {
+      ring_addr_t *addr = sc->routes[i] == RouteReplica
+                              ? ring_shard_replica(shard, rand_r(&cache->seed))
+                              : &shard->mstr;
+      sc->batches[sc->num_batches++] =
+          (batch_t){.shard_id = shard->id,
+                    .route = sc->routes[i],
+                    .addr = *addr,
+                    .to_mstr = addr == &shard->mstr};
+    }
+    sc->batches[b].num_keys++;
+    sc->batch_of[i] = b;
+  }
+
+  // Lay the keys of the batches out one after the other.
+  size_t offset = 0;
+  for (size_t b = 0; b < sc->num_batches; b++) {
+    sc->batches[b].keys = sc->indices + offset;
+    offset += sc->batches[b].num_keys;
+    sc->batches[b].num_keys = 0;
+  }
+  for (size_t i = 0; i < sc->num_keys; i++) {
+    if (sc->pending[i]) {
+      batch_t *batch = &sc->batches[sc->batch_of[i]];
+      batch->keys[batch->num_keys++] = i;
+    }
+  }
+  return sc->num_batches;
+}
+
+/**
+ * @brief Sends a batch to its shard over a pooled connection, without
+ * waiting for the response.
+ *
+ * @param cache - CanaryCache *
+ * @param sc - scatter_t *
+ * @param batch - batch_t *
+ */
+void send_batch(CanaryCache *cache, scatter_t *sc, batch_t *batch) {
+  uint32_t payload_len = sizeof(uint32_t);
+  for (size_t k = 0; k < batch->num_keys; k++)
+    payload_len += sizeof(uint32_t) + strlen(sc->keys[batch->keys[k]]) + 1 +
+                   (sc->values != NULL ? sizeof(int) : 0);
+
+  uint8_t *payload = malloc(payload_len);
+  uint32_t n_num_keys = htonl(batch->num_keys);
+  memcpy(payload, &n_num_keys, sizeof(n_num_keys));
+  size_t offset = sizeof(n_num_keys);
+  for (size_t k = 0; k < batch->num_keys; k++) {
+    char *key = sc->keys[batch->keys[k]];
+    uint32_t key_len = strlen(key) + 1;
+    if (sc->values != NULL) {
+      pack_string_int(key, key_len, sc->values[batch->keys[k]],
+                      payload + offset);
+      offset += sizeof(key_len) + key_len + sizeof(int);
+    } else {
+      uint32_t n_key_len = htonl(key_len);
+      memcpy(payload + offset, &n_key_len, sizeof(n_key_len));
+      memcpy(payload + offset + sizeof(n_key_len), key, key_len);
+      offset += sizeof(n_key_len) + key_len;
+    }
+  }
+
+  CanaryMsg req = {
+      .type = sc->type, .payload_len = payload_len, .payload = payload};
+  batch->socket = pool_acquire(cache->pool, batch->addr.addr, batch->addr.port);
+  if (batch->socket != -1 && send_msg(batch->socket, req) == -1) {
+    close(batch->socket);
+    batch->socket = -1;
+  }
   free(payload);
 }
+
+/**
+ * @brief Receives the response to a batch, and moves each of its keys on to
+ * done or to its next route. Keys whose shard failed or turned them away are
+ * retried once the ring map has been refreshed, except on the previous owner
+ * where they count as misses like in `request_get`.
+ *
+ * @param cache - CanaryCache *
+ * @param sc - scatter_t *
+ * @param batch - batch_t *
+ * @return the number of keys to retry with a refreshed ring map.
+ */
+int gather_batch(CanaryCache *cache, scatter_t *sc, batch_t *batch) {
+  CanaryMsgType resp_type =
+      sc->type == Client2ShardMget ? Shard2ClientMget : Mstr2ClientMput;
+  CanaryMsg resp = {.payload = NULL};
+  uint32_t num_keys = 0;
+  int num_retries = 0;
+
+  bool failed = batch->socket == -1 || receive_msg(batch->socket, &resp) == -1;
+  if (!failed && resp.payload_len >= sizeof(num_keys)) {
+    memcpy(&num_keys, resp.payload, sizeof(num_keys));
+    num_keys = ntohl(num_keys);
+  }
+  failed = failed || resp.type != resp_type || num_keys != batch->num_keys ||
+           resp.payload_len != sizeof(num_keys) + num_keys * BATCH_RECORD_SIZE;
+  if (failed && batch->socket != -1)
+    close(batch->socket);
+  else if (!failed)
+    pool_release(cache->pool, batch->addr.addr, batch->addr.port,
+                 batch->socket);
+
+  for (size_t k = 0; k < batch->num_keys; k++) {
+    size_t i = batch->keys[k];
+    canary_result_t *result = &sc->results[i];
+    uint32_t status = KeyNotOwner, value = 0;
+    if (!failed) {
+      uint8_t *record = resp.payload + sizeof(num_keys) + k * BATCH_RECORD_SIZE;
+      unpack_int_int(&status, &value, record);
+      unpack_long(&result->version, record + 2 * sizeof(uint32_t));
+    }
+
+    if (status == KeyDone) {
+      result->status = 1;
+      result->value = value;
+      sc->pending[i] = false;
+    } else if (!batch->to_mstr) {
+      // A follower may not have replicated a put yet, or may have failed.
+      sc->routes[i] = RouteMaster;
+    } else if (status == KeyMiss && batch->route != RoutePrev &&
+               ring_map_lookup_prev(cache->map, sc->keys[i]) != NULL) {
+      // The previous owner still holds the key while it migrates.
+      sc->routes[i] = RoutePrev;
+    } else if (status == KeyMiss || batch->route == RoutePrev) {
+      result->status = 0;
+      sc->pending[i] = false;
+    } else if (++sc->attempts[i] < BATCH_MAX_ATTEMPTS) {
+      num_retries++;
+    } else {
+      sc->pending[i] = false;
+    }
+  }
+  free(resp.payload);
+  return num_retries;
+}
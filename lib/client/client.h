@@ -1,22 +1,85 @@
 #ifndef __CANARY_CLIENT_H__
 #define __CANARY_CLIENT_H__
 
+#include "../connpool/connpool.h"
 #include "../cproto/cproto.h"
+#include "../lru/lru.h"
 #include "../nethelpers/nethelpers.h"
+#include "../ring/ring.h"
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
 
+// NOTE: Is not thread safe, every thread should use its own cache handle.
 typedef struct {
+  // The primary configuration service or any of its replicas. Once the ring
+  // map is fetched, it is refreshed from the replicas listed in the map.
   char *cnf_addr;
   in_port_t cnf_port;
+
+  // Copy of the ring map of the configuration service, used to find the shard
+  // of a key. Fetched on first use, and refreshed when it expires or a shard
+  // turns a key away.
+  ring_map_t *map;
+  time_t map_expires_at;
+
+  // Picks the replicas that gets and map refreshes are sent to.
+  unsigned int seed;
+
+  // Connections to the shards, kept open between requests.
+  conn_pool_t *pool;
+
+  // Optional cache of recent gets in the process, see `canary_near_cache`.
+  // With watches, the masters send invalidations of written keys to the
+  // datagram socket, otherwise entries are only dropped when they expire.
+  lru_cache_t *near;
+  int watch_socket;
+  in_port_t watch_port;
 } CanaryCache;
 
+// Where a get was sent, so that a miss can be asked of the next replica in
+// the same order as `canary_get`.
+typedef enum {
+  RouteReplica, // a follower picked by the power of two choices.
+  RouteMaster,
+  RoutePrev, // the previous owner, while keys migrate.
+} CanaryRoute;
+
+// Outcome for a key of `canary_mget` or `canary_mput`.
+typedef struct {
+  int status; // -1 in case of error, 0 if a get missed and 1 otherwise.
+  int value;
+  uint64_t version;
+} canary_result_t;
+
+// Loads a key from the backing store, returns -1 in case of error, 0 if the
+// key does not exist and 1 if `value` was set.
+typedef int (*canary_loader_t)(char *key, int *value, void *arg);
+
 CanaryCache create_canary_cache(char *, in_port_t cnf_port);
+void destroy_canary_cache(CanaryCache *);
+int canary_near_cache(CanaryCache *, size_t, unsigned int, bool);
 
 int *canary_get(CanaryCache *, char *);
 void canary_put(CanaryCache *, char *, int);
+int canary_incr(CanaryCache *, char *, int, int *);
+int canary_decr(CanaryCache *, char *, int, int *);
+int canary_add(CanaryCache *, char *, int, int *);
+int canary_gets(CanaryCache *, char *, int *, uint64_t *);
+int canary_cas(CanaryCache *, char *, int, uint64_t, uint64_t *);
+int canary_get_or_load(CanaryCache *, char *, int *, canary_loader_t, void *);
+int canary_mget(CanaryCache *, char **, size_t, canary_result_t *);
+int canary_mput(CanaryCache *, char **, int *, size_t, canary_result_t *);
+char *canary_stats(char *, in_port_t);
+
+// Shared with the asynchronous client.
+int refresh_map(CanaryCache *);
+ring_shard_t *lookup_shard(CanaryCache *, char *);
+void near_invalidate(CanaryCache *, char *);
 
 #endif // __CANARY_CLIENT_H__
@@ -0,0 +1,147 @@
+#include "connpool.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* ----------- HELPERS ------------------------*/
+
+/**
+ * @brief Removes a connection from the pool, without closing it.
+ *
+ * @param pool - conn_pool_t *
+ * @param i - int
+ */
+void remove_conn(conn_pool_t *pool, int i) {
+  for (; i < pool->num_conns - 1; i++)
+    pool->conns[i] = pool->conns[i + 1];
+  pool->num_conns--;
+}
+
+/**
+ * @brief Closes the connections that have been idle for too long. They are
+ * the least recently used, so they are always first in the pool.
+ *
+ * @param pool - conn_pool_t *
+ * @param now - time_t
+ */
+void close_idle(conn_pool_t *pool, time_t now) {
+  int num_idle = 0;
+  while (num_idle < pool->num_conns &&
+         now - pool->conns[num_idle].idle_since >= pool->idle_timeout)
+    close(pool->conns[num_idle++].socket);
+
+  for (int i = num_idle; i < pool->num_conns; i++)
+    pool->conns[i - num_idle] = pool->conns[i];
+  pool->num_conns -= num_idle;
+}
+
+/**
+ * @brief Checks that an idle connection is still usable. The shard may have
+ * closed it, or it may hold a response that was never read after an error.
+ *
+ * @param socket - int
+ * @return whether the connection is usable.
+ */
+bool is_healthy(int socket) {
+  uint8_t byte;
+  ssize_t n = recv(socket, &byte, sizeof(byte), MSG_PEEK | MSG_DONTWAIT);
+  return n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/* ----------- EXTERNAL API -------------------*/
+
+/**
+ * @brief Creates an empty connection pool.
+ *
+ * @param max_per_shard - int, idle connections kept to a single shard.
+ * @param idle_timeout - int, seconds.
+ * @return pointer to the pool.
+ */
+conn_pool_t *create_conn_pool(int max_per_shard, int idle_timeout) {
+  conn_pool_t *pool = malloc(sizeof(conn_pool_t));
+  *pool = (conn_pool_t){.conns = NULL,
+                        .num_conns = 0,
+                        .capacity = 0,
+                        .max_per_shard = max_per_shard,
+                        .idle_timeout = idle_timeout};
+  return pool;
+}
+
+/**
+ * @brief Closes all connections of the pool and frees it.
+ *
+ * @param pool - conn_pool_t *
+ */
+void destroy_conn_pool(conn_pool_t *pool) {
+  for (int i = 0; i < pool->num_conns; i++)
+    close(pool->conns[i].socket);
+  free(pool->conns);
+  free(pool);
+}
+
+/**
+ * @brief Takes the most recently used healthy connection to a shard out of
+ * the pool, or connects to the shard if there is none.
+ *
+ * @param pool - conn_pool_t *
+ * @param addr - IA
+ * @param port - in_port_t
+ * @return -1 if the shard could not be reached, the socket otherwise.
+ */
+int pool_acquire(conn_pool_t *pool, IA addr, in_port_t port) {
+  char shard_addr[INET_ADDRSTRLEN];
+
+  close_idle(pool, time(NULL));
+  for (int i = pool->num_conns - 1; i >= 0; i--) {
+    pooled_conn_t *conn = &pool->conns[i];
+    if (conn->addr.s_addr != addr.s_addr || conn->port != port)
+      continue;
+
+    int socket = conn->socket;
+    remove_conn(pool, i);
+    if (is_healthy(socket))
+      return socket;
+    close(socket);
+  }
+
+  inet_ntop(AF_INET, &addr, shard_addr, sizeof(shard_addr));
+  return connect_to_socket(shard_addr, port);
+}
+
+/**
+ * @brief Puts a connection back into the pool once its response has been
+ * received. Connections that failed must be closed instead.
+ *
+ * @param pool - conn_pool_t *
+ * @param addr - IA
+ * @param port - in_port_t
+ * @param socket - int
+ */
+void pool_release(conn_pool_t *pool, IA addr, in_port_t port, int socket) {
+  time_t now = time(NULL);
+  close_idle(pool, now);
+
+  int num_idle = 0;
+  for (int i = 0; i < pool->num_conns; i++)
+    num_idle += pool->conns[i].addr.s_addr == addr.s_addr &&
+                pool->conns[i].port == port;
+  if (num_idle >= pool->max_per_shard) {
+    close(socket);
+    return;
+  }
+
+  if (pool->num_conns == pool->capacity) {
+    int capacity = pool->capacity > 0 ? pool->capacity * 2 : 8;
+    pooled_conn_t *conns =
+        realloc(pool->conns, sizeof(pooled_conn_t) * capacity);
+    if (conns == NULL) {
+      close(socket);
+      return;
+    }
+    pool->conns = conns;
+    pool->capacity = capacity;
+  }
+  pool->conns[pool->num_conns++] = (pooled_conn_t){
+      .addr = addr, .port = port, .socket = socket, .idle_since = now};
+}
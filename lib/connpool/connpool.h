@@ -0,0 +1,37 @@
+#ifndef __CONNPOOL_H__
+#define __CONNPOOL_H__
+
+#include "../nethelpers/nethelpers.h"
+#include <stdbool.h>
+#include <time.h>
+
+// An idle connection to a shard.
+typedef struct {
+  IA addr;
+  in_port_t port;
+  int socket;
+  time_t idle_since;
+} pooled_conn_t;
+
+// Persistent connections to shards, so that a request does not pay for a TCP
+// handshake. A connection is taken out of the pool while a request is under
+// way, and put back once its response has been received. Connections that
+// have been idle for `idle_timeout` seconds are closed, and so are the ones
+// beyond `max_per_shard` idle connections to the same shard.
+//
+// NOTE: Is not thread safe.
+typedef struct {
+  pooled_conn_t *conns; // the most recently used last.
+  int num_conns;
+  int capacity;
+  int max_per_shard;
+  int idle_timeout;
+} conn_pool_t;
+
+conn_pool_t *create_conn_pool(int, int);
+void destroy_conn_pool(conn_pool_t *);
+
+int pool_acquire(conn_pool_t *, IA, in_port_t);
+void pool_release(conn_pool_t *, IA, in_port_t, int);
+
+#endif // __CONNPOOL_H__
@@ -2,12 +2,16 @@
 #define __CANARY_QUEUE_H__
 
 #include "../nethelpers/nethelpers.h"
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 typedef struct {
   int socket;
   IA client_addr;
   in_port_t port;
+  uint64_t enqueued_at; // for measuring the time spent in the queue.
+  bool kept_alive;      // has served a request, and is watched for the next.
 } conn_ctx_t;
 
 typedef struct node {
@@ -1,6 +1,7 @@
 #include "cproto.h"
 
 #include <arpa/inet.h>
+#include <endian.h>
 #include <errno.h>
 #include <netinet/in.h>
 #include <stddef.h>
@@ -8,6 +9,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 /* ----------- HELPERS ------------------------*/
@@ -25,7 +28,10 @@ int read_from_socket(int socket, uint8_t *buf, size_t buf_size) {
   int rc, bytes_read = 0;
   do {
     rc = read(socket, buf + bytes_read, buf_size - bytes_read);
-    if (rc <= 0) {
+    if (rc == 0)
+      return -1; // peer closed the connection.
+
+    if (rc < 0) {
       if ((errno == EAGAIN || errno == EWOULDBLOCK))
         continue;
 
@@ -52,7 +58,7 @@ int write_to_socket(int socket, uint8_t *buf, size_t buf_size) {
 
   do {
     rc = write(socket, buf + bytes_written, buf_size - bytes_written);
-    if (rc <= 0) {
+    if (rc < 0) {
       if (errno == EAGAIN || errno == EWOULDBLOCK)
         continue;
 
@@ -65,6 +71,43 @@ int write_to_socket(int socket, uint8_t *buf, size_t buf_size) {
   return 0;
 }
 
+/**
+ * @brief Writes all bytes of the provided buffers into the provided socket,
+ * with as few system calls as possible. A peer that closed the connection
+ * fails the write instead of raising SIGPIPE, which would kill a client that
+ * writes to a pooled connection.
+ *
+ * NOTE: Modifies the buffers in `iov`.
+ *
+ * @param socket - int
+ * @param iov - struct iovec *
+ * @param iovcnt - int
+ * @return -1 if something went wrong.
+ */
+int writev_to_socket(int socket, struct iovec *iov, int iovcnt) {
+  while (iovcnt > 0) {
+    struct msghdr hdr = {.msg_iov = iov, .msg_iovlen = iovcnt};
+    ssize_t rc = sendmsg(socket, &hdr, MSG_NOSIGNAL);
+    if (rc < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        continue;
+      return -1;
+    }
+
+    // Skip the buffers that were written completely.
+    while (iovcnt > 0 && (size_t)rc >= iov->iov_len) {
+      rc -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (uint8_t *)iov->iov_base + rc;
+      iov->iov_len -= rc;
+    }
+  }
+  return 0;
+}
+
 /* ----------- EXTERNAL API  ------------------*/
 
 /**
@@ -216,30 +259,55 @@ int unpack_int_int(uint32_t *num1, uint32_t *num2, uint8_t *buf) {
   return 0;
 }
 
+int pack_long(uint64_t num, uint8_t buf[8]) {
+  uint64_t n_num = htobe64(num);
+  memcpy(buf, &n_num, sizeof(n_num));
+  return 0;
+}
+
+int unpack_long(uint64_t *num, uint8_t *buf) {
+  uint64_t n_num;
+  memcpy(&n_num, buf, sizeof(n_num));
+  *num = be64toh(n_num);
+  return 0;
+}
+
 /**
  * @brief Receives a message from the provided socket and loads it into the
  * provided CanaryMsg struct.
  *
+ * NOTE: The message payload is allocated on heap.
+ *
  * @param socket - int
  * @param msg - CanaryMsg *
- * @return -1 if something went wrong.
+ * @return -1 if something went wrong, or if the frame is malformed or larger
+ * than `MAX_PAYLOAD_SIZE`.
  */
 int receive_msg(int socket, CanaryMsg *msg) {
-  // Read the size of message.
-  uint32_t msg_size;
-  uint8_t *msg_size_buf = (uint8_t *)&msg_size;
-
-  if (read_from_socket(socket, msg_size_buf, sizeof(msg_size)) == -1)
+  uint32_t header[3];
+  if (read_from_socket(socket, (uint8_t *)header, sizeof(header)) == -1)
     return -1;
 
-  msg_size = ntohl(msg_size); // convert to the endianess of the host.
+  // Convert to the endianess of the host.
+  uint32_t msg_size = ntohl(header[0]);
+  msg->type = ntohl(header[1]);
+  msg->payload_len = ntohl(header[2]);
 
-  uint8_t msg_buf[msg_size];
-  if (read_from_socket(socket, msg_buf, msg_size) == -1)
+  // The payload is read straight into its own buffer, so a frame is never
+  // copied and its size is checked before anything is allocated.
+  if (msg->payload_len > MAX_PAYLOAD_SIZE ||
+      msg_size != sizeof(header) - sizeof(msg_size) + msg->payload_len)
     return -1;
-  if (deserialize(msg_buf, msg) == -1)
+
+  msg->payload = malloc(msg->payload_len);
+  if (msg->payload == NULL && msg->payload_len > 0)
     return -1;
 
+  if (msg->payload_len > 0 &&
+      read_from_socket(socket, msg->payload, msg->payload_len) == -1) {
+    free(msg->payload);
+    return -1;
+  }
   return 0;
 }
 
@@ -251,24 +319,18 @@ int receive_msg(int socket, CanaryMsg *msg) {
  * @return -1 if something went wrong.
  */
 int send_msg(int socket, CanaryMsg msg) {
-  uint8_t *msg_buf;
-  int msg_size = serialize(msg, &msg_buf);
-
-  if (msg_size == -1) {
-    return -1;
-  }
-  msg_size = htonl(msg_size);
-  uint8_t *msg_size_buf = (uint8_t *)&msg_size;
-
-  if (write_to_socket(socket, msg_size_buf, sizeof(msg_size)) == -1)
-    return -1;
-
-  if (write_to_socket(socket, msg_buf, msg_size) == -1)
+  if (msg.payload_len > MAX_PAYLOAD_SIZE)
     return -1;
 
-  free(msg_buf);
+  // The header and the payload go out in one system call, without copying
+  // the payload.
+  uint32_t header[3] = {
+      htonl(sizeof(header) - sizeof(uint32_t) + msg.payload_len),
+      htonl(msg.type), htonl(msg.payload_len)};
+  struct iovec iov[2] = {{.iov_base = header, .iov_len = sizeof(header)},
+                         {.iov_base = msg.payload, .iov_len = msg.payload_len}};
 
-  return 0;
+  return writev_to_socket(socket, iov, msg.payload_len > 0 ? 2 : 1);
 }
 
 /**
@@ -283,3 +345,133 @@ void send_error_msg(int socket, const char *error_msg) {
                    .payload = (uint8_t *)error_msg};
   send_msg(socket, msg);
 }
+
+/**
+ * @brief Unpacks the keys of a batch request, with a value per key if
+ * `values` is set. Every key must be NUL terminated, and the batch must end
+ * with the last key.
+ *
+ * NOTE: The keys point into the buffer, while the arrays are allocated on
+ * heap.
+ *
+ * @param buf - uint8_t *
+ * @param len - uint32_t
+ * @param values - int **, NULL for a batch of gets.
+ * @param num_keys - uint32_t *
+ * @return array of the keys, NULL if the batch is malformed.
+ */
+char **unpack_batch(uint8_t *buf, uint32_t len, int **values,
+                    uint32_t *num_keys) {
+  // Bound the number of keys by the size of the batch before allocating.
+  size_t min_entry_size =
+      sizeof(uint32_t) + 1 + (values != NULL ? sizeof(uint32_t) : 0);
+  if (len < sizeof(uint32_t))
+    return NULL;
+  memcpy(num_keys, buf, sizeof(*num_keys));
+  *num_keys = ntohl(*num_keys);
+  if (*num_keys == 0 || *num_keys > (len - sizeof(uint32_t)) / min_entry_size)
+    return NULL;
+
+  char **keys = malloc(sizeof(char *) * *num_keys);
+  if (values != NULL)
+    *values = malloc(sizeof(int) * *num_keys);
+
+  size_t offset = sizeof(uint32_t);
+  bool malformed = false;
+  for (uint32_t i = 0; i < *num_keys; i++) {
+    uint32_t key_len, value;
+    if (len - offset < sizeof(key_len)) {
+      malformed = true;
+      break;
+    }
+    memcpy(&key_len, buf + offset, sizeof(key_len));
+    key_len = ntohl(key_len);
+    offset += sizeof(key_len);
+    if (key_len == 0 || len - offset < key_len ||
+        buf[offset + key_len - 1] != '\0') {
+      malformed = true;
+      break;
+    }
+    keys[i] = (char *)buf + offset;
+    offset += key_len;
+
+    if (values != NULL) {
+      if (len - offset < sizeof(value)) {
+        malformed = true;
+        break;
+      }
+      memcpy(&value, buf + offset, sizeof(value));
+      (*values)[i] = ntohl(value);
+      offset += sizeof(value);
+    }
+  }
+
+  if (malformed || offset != len) {
+    free(keys);
+    if (values != NULL)
+      free(*values);
+    return NULL;
+  }
+  return keys;
+}
+
+/**
+ * @brief Receives a message sent with `send_datagram`.
+ *
+ * NOTE: The message payload is allocated on heap.
+ *
+ * @param socket - int, a datagram socket.
+ * @param msg - CanaryMsg *
+ * @return -1 if something went wrong, or if the datagram is malformed.
+ */
+int receive_datagram(int socket, CanaryMsg *msg) {
+  uint8_t buf[MAX_DATAGRAM_SIZE];
+  ssize_t n = recv(socket, buf, sizeof(buf), 0);
+  if (n < (ssize_t)(sizeof(uint32_t) * 2))
+    return -1;
+
+  uint32_t payload_len = ntohl(*(uint32_t *)(buf + sizeof(uint32_t)));
+  if (payload_len != n - sizeof(uint32_t) * 2)
+    return -1;
+  return deserialize(buf, msg);
+}
+
+/**
+ * @brief Sends the provided CanaryMsg as a single datagram, which may be lost
+ * or arrive out of order.
+ *
+ * @param socket - int, a connected datagram socket.
+ * @param msg - CanaryMsg
+ * @return -1 if something went wrong.
+ */
+int send_datagram(int socket, CanaryMsg msg) {
+  return send_datagram_to(socket, msg, NULL);
+}
+
+/**
+ * @brief Sends the provided CanaryMsg as a single datagram to an address, so
+ * that one unconnected socket can notify many peers.
+ *
+ * @param socket - int, a datagram socket, connected if `addr` is NULL.
+ * @param msg - CanaryMsg
+ * @param addr - struct sockaddr_in *
+ * @return -1 if something went wrong.
+ */
+int send_datagram_to(int socket, CanaryMsg msg, struct sockaddr_in *addr) {
+  uint8_t *buf;
+  int buf_len = serialize(msg, &buf);
+  if (buf_len == -1)
+    return -1;
+  if (buf_len > MAX_DATAGRAM_SIZE) {
+    free(buf);
+    return -1;
+  }
+
+  socklen_t addr_len = addr == NULL ? 0 : sizeof(*addr);
+  int rc = sendto(socket, buf, buf_len, 0, (struct sockaddr *)addr,
+                  addr_len) == buf_len
+               ? 0
+               : -1;
+  free(buf);
+  return rc;
+}
@@ -6,6 +6,12 @@
 #include <stddef.h>
 #include <stdint.h>
 
+// Larger frames are rejected, a corrupt size would otherwise have a peer
+// allocate gigabytes.
+#define MAX_PAYLOAD_SIZE (64 << 20)
+// Datagrams carry small fixed messages, such as heartbeats.
+#define MAX_DATAGRAM_SIZE 512
+
 typedef enum {
   Error,
   // Register shards with cnf_svc
@@ -13,31 +19,129 @@ typedef enum {
   Cnf2MstrRegister,
   Flwr2CnfRegister,
   Cnf2FlwrRegister,
+  // [ id ], a master that leaves the ring hands its keys to the new owners.
+  Mstr2CnfDeregister,
+  Cnf2MstrDeregister,
+  // The master of the follower left the ring, the follower registers again.
+  Cnf2FlwrReregister,
 
-  // Shard heartbeats
+  // Shard heartbeats, [ id | load ] and [ mstr_id | flwr_idx | seq ] where
+  // seq is the last record of the replication log applied by the follower.
   Mstr2CnfHeartbeat,
   Flwr2CnfHeartbeat,
 
   // Get shard cnf_svc
   Client2CnfDiscover,
   Cnf2ClientDiscover,
+  // Get the ring map, so that clients can find the shard of a key themselves.
+  Client2CnfRing,
+  // [ epoch | num_shards | num_rings | shards | ring | prev_ring ], see
+  // `pack_ring_map`.
+  Cnf2ClientRing,
+  // [ epoch ], the shard does not own the key in the ring map of that epoch.
+  Shard2ClientNotOwner,
+  // The ring map, pushed to the masters whenever the ring changes.
+  Cnf2MstrRing,
+  // Batch of keys handed to their new owner after a change of the ring, see
+  // `batch_seal`. Records are only applied if the key is absent.
+  Mstr2MstrMigrate,
+  Mstr2MstrMigrated,
 
-  // Get cache value from shard
+  // Get cache value from shard, the response is [ value | version ] or
+  // empty on a miss.
   Client2ShardGet,
   Shard2ClientGet,
 
-  // Put cache value in shard
+  // Put cache value in shard, acknowledged once it has been applied.
   Client2MstrPut,
+  Mstr2ClientPut,
+
+  // Atomic counter operations on the master shard, replicated like puts.
+  // Requests are [ key_len | key | value ], where incr/decr adds/subtracts the
+  // value (a missing key counts as 0) and add only puts if the key is absent.
+  Client2MstrIncr,
+  Client2MstrDecr,
+  Client2MstrAdd,
+  // [ applied | value ], where value is the value stored after the operation
+  // and applied is 0 if an add found the key present.
+  Mstr2ClientCounter,
+
+  // Put [ key_len | key | value | version ] only if the version of the entry
+  // still matches, version 0 means that the key must be absent.
+  Client2MstrCas,
+  // [ applied | version ], the new version if applied, the current otherwise.
+  Mstr2ClientCas,
+
+  // Read-through get of a key. On a miss the first client gets a lease to load
+  // the key from the backing store, and its put of the key completes the
+  // lease. Other clients wait on the lease instead of loading the key.
+  Client2ShardLease,
+  // [ status | value | version ], see `LeaseStatus`.
+  Shard2ClientLease,
+
+  // Metrics of a shard in the Prometheus text format.
+  Client2ShardStats,
+  Shard2ClientStats,
 
   Flwr2MstrConnect,
   // Replicate the master shard.
   Mstr2FlwrReplicate,
+  // Bulk copy of the master cache for followers that can not catch up.
+  Mstr2FlwrSnapshot,
+  // Highest sequence number applied by a follower and all followers after it
+  // in the chain, sent back on the replication stream.
+  Flwr2MstrAck,
 
-  // Promote follower shard
+  // [ mstr_id ], the follower takes over its master, which has expired.
   Cnf2FlwrPromote,
-  // TODO: add message for flwr shards to become mstr
+  // The master or upstream of a follower changed after a promotion, same
+  // payload as `Cnf2FlwrRegister`.
+  Cnf2FlwrUpstream,
+
+  // [ port ], a read-only replica of the configuration service registers,
+  // and registers again every 2 seconds to stay registered.
+  Rplc2CnfRegister,
+  // The ring map, same payload as `Cnf2ClientRing`. Sent in response to a
+  // registration, and pushed to the replicas whenever the map changes.
+  Cnf2RplcRing,
+
+  // [ port | key ], a get from the master that also watches the key for the
+  // near cache of the client, the response is the same as `Client2ShardGet`.
+  // The next write of the key sends an invalidation to the datagram socket of
+  // the client on that port, and ends the watch.
+  Client2MstrWatch,
+  // [ key ], sent as a datagram, which may be lost.
+  Mstr2ClientInvalidate,
+
+  // Gets of many keys of a shard in one request, [ num_keys | key_len | key
+  // | ... ], see `unpack_batch`.
+  Client2ShardMget,
+  // [ num_keys | status | value | version | ... ] in the order of the keys of
+  // the request, see `KeyStatus`.
+  Shard2ClientMget,
+  // Puts of many keys of a master in one request, [ num_keys | key_len | key
+  // | value | ... ], applied in one critical section.
+  Client2MstrMput,
+  // Same as `Shard2ClientMget`, with the values and versions that were put.
+  Mstr2ClientMput,
 } CanaryMsgType;
 
+typedef enum {
+  LeaseHit,     // the key is cached, value and version are set.
+  LeaseGranted, // load the key and put it.
+  LeaseRetry,   // another client is still loading the key, retry shortly.
+} LeaseStatus;
+
+// Outcome for a key of a batch request.
+typedef enum {
+  KeyMiss,     // the key is not cached.
+  KeyDone,     // the key is cached, or was put.
+  KeyNotOwner, // the shard does not own the key in its ring map.
+} KeyStatus;
+
+// [ status | value | version ] of a key in a batch response.
+#define BATCH_RECORD_SIZE (2 * sizeof(uint32_t) + sizeof(uint64_t))
+
 typedef struct {
   CanaryMsgType type;
   uint32_t payload_len;
@@ -55,10 +159,16 @@ int pack_string_short(char *, uint32_t, uint16_t, uint8_t *);
 int unpack_string_short(char **, uint16_t *, uint8_t *);
 int pack_int_int(uint32_t, uint32_t, uint8_t[8]);
 int unpack_int_int(uint32_t *, uint32_t *, uint8_t[8]);
+int pack_long(uint64_t, uint8_t[8]);
+int unpack_long(uint64_t *, uint8_t *);
+char **unpack_batch(uint8_t *, uint32_t, int **, uint32_t *);
 
 int receive_msg(int, CanaryMsg *);
 int send_msg(int, CanaryMsg);
 void send_error_msg(int, const char *);
+int receive_datagram(int, CanaryMsg *);
+int send_datagram(int, CanaryMsg);
+int send_datagram_to(int, CanaryMsg, struct sockaddr_in *);
 int compare_shards(const void *, const void *);
 
 #endif //__CPROTO_H__
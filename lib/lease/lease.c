@@ -0,0 +1,163 @@
+#include "lease.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* ----------- HELPERS ------------------------*/
+
+/**
+ * @brief Drops a reference to the lease, and frees it if it was the last.
+ *
+ * @param lease - lease_t *
+ */
+void release_lease(lease_t *lease) {
+  if (--lease->refs > 0)
+    return;
+
+  pthread_cond_destroy(&lease->done);
+  free(lease->key);
+  free(lease);
+}
+
+/**
+ * @brief Unlinks the lease of the key from the table and wakes up its
+ * waiters.
+ *
+ * @param table - lease_table_t *
+ * @param key - char *
+ */
+void remove_lease(lease_table_t *table, char *key) {
+  lease_t **prev = &table->buckets[hash_djb2(key) % table->num_buckets];
+  while (*prev != NULL) {
+    lease_t *lease = *prev;
+    if (strcmp(lease->key, key) == 0) {
+      *prev = lease->next;
+      table->num_leases--;
+      lease->completed = true;
+      pthread_cond_broadcast(&lease->done);
+      release_lease(lease);
+      return;
+    }
+    prev = &lease->next;
+  }
+}
+
+/* ----------- EXTERNAL API -------------------*/
+
+/**
+ * @brief Creates an empty lease table.
+ *
+ * @param num_buckets - size_t
+ * @return pointer to the table.
+ */
+lease_table_t *create_lease_table(size_t num_buckets) {
+  lease_table_t *table = malloc(sizeof(lease_table_t));
+  table->buckets = calloc(num_buckets, sizeof(lease_t *));
+  table->num_buckets = num_buckets;
+  table->num_leases = 0;
+  return table;
+}
+
+/**
+ * @brief Frees the table, all leases must have been completed and all waiters
+ * must have returned.
+ *
+ * @param table - lease_table_t *
+ */
+void destroy_lease_table(lease_table_t *table) {
+  for (size_t i = 0; i < table->num_buckets; i++) {
+    while (table->buckets[i] != NULL)
+      remove_lease(table, table->buckets[i]->key);
+  }
+  free(table->buckets);
+  free(table);
+}
+
+/**
+ * @brief Finds the in-flight lease of a key. An expired lease is completed
+ * instead, so its waiters give the key a new loader.
+ *
+ * @param table - lease_table_t *
+ * @param key - char *
+ * @param now - uint64_t, monotonic nanoseconds.
+ * @return pointer to the lease, NULL means that no one is loading the key.
+ */
+lease_t *lease_find(lease_table_t *table, char *key, uint64_t now) {
+  lease_t *lease = table->buckets[hash_djb2(key) % table->num_buckets];
+  while (lease != NULL && strcmp(lease->key, key) != 0)
+    lease = lease->next;
+
+  if (lease != NULL && lease->expires_at <= now) {
+    remove_lease(table, key);
+    return NULL;
+  }
+  return lease;
+}
+
+/**
+ * @brief Hands out a new lease for a key, the caller must have checked that
+ * there is no in-flight lease with `lease_find`.
+ *
+ * @param table - lease_table_t *
+ * @param key - char *
+ * @param expires_at - uint64_t, monotonic nanoseconds.
+ * @return pointer to the lease.
+ */
+lease_t *lease_acquire(lease_table_t *table, char *key, uint64_t expires_at) {
+  lease_t *lease = malloc(sizeof(lease_t));
+  lease->key = malloc(strlen(key) + 1);
+  strcpy(lease->key, key);
+  lease->expires_at = expires_at;
+  lease->completed = false;
+  lease->refs = 1;
+
+  // Waiters use monotonic deadlines.
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&lease->done, &attr);
+  pthread_condattr_destroy(&attr);
+
+  size_t bucket = hash_djb2(key) % table->num_buckets;
+  lease->next = table->buckets[bucket];
+  table->buckets[bucket] = lease;
+  table->num_leases++;
+  return lease;
+}
+
+/**
+ * @brief Completes the lease of a key, if any, and wakes up its waiters.
+ * Called on every write of a key, so that the put of the loader completes
+ * the lease.
+ *
+ * @param table - lease_table_t *
+ * @param key - char *
+ */
+void lease_complete(lease_table_t *table, char *key) {
+  if (table->num_leases > 0)
+    remove_lease(table, key);
+}
+
+/**
+ * @brief Waits until the lease is completed, or the deadline has passed.
+ *
+ * NOTE: `lock` must be held, and is released while waiting.
+ *
+ * @param lease - lease_t *
+ * @param lock - pthread_mutex_t *
+ * @param deadline - uint64_t, monotonic nanoseconds.
+ * @return -1 if the deadline passed, 0 if the lease was completed.
+ */
+int lease_wait(lease_t *lease, pthread_mutex_t *lock, uint64_t deadline) {
+  struct timespec ts = {.tv_sec = deadline / 1000000000,
+                        .tv_nsec = deadline % 1000000000};
+
+  lease->refs++;
+  while (!lease->completed) {
+    if (pthread_cond_timedwait(&lease->done, lock, &ts) != 0)
+      break;
+  }
+  int rc = lease->completed ? 0 : -1;
+  release_lease(lease);
+  return rc;
+}
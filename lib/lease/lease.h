@@ -0,0 +1,39 @@
+#ifndef __LEASE_H__
+#define __LEASE_H__
+
+#include "../hashing/hashing.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A miss that a client is loading from the backing store. Requesters of the
+// same key wait on it instead of loading the key themselves.
+typedef struct lease_t {
+  char *key;
+  uint64_t expires_at; // the loader is presumed dead after this point.
+  bool completed;
+  int refs; // held by the table and each waiter.
+  pthread_cond_t done;
+  struct lease_t *next;
+} lease_t;
+
+// Hashtable of in-flight leases.
+//
+// NOTE: Is not thread safe, every call (and the waits) should use the same
+// external lock, e.g. the lock of the cache that the leases fill.
+typedef struct {
+  lease_t **buckets;
+  size_t num_buckets;
+  size_t num_leases;
+} lease_table_t;
+
+lease_table_t *create_lease_table(size_t);
+void destroy_lease_table(lease_table_t *);
+
+lease_t *lease_find(lease_table_t *, char *, uint64_t);
+lease_t *lease_acquire(lease_table_t *, char *, uint64_t);
+void lease_complete(lease_table_t *, char *);
+int lease_wait(lease_t *, pthread_mutex_t *, uint64_t);
+
+#endif // __LEASE_H__
@@ -1,21 +1,248 @@
 #include "logger.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define LOG_RING_SIZE 256 // records per thread, must be a power of 2.
+#define LOG_MSG_SIZE 256
+#define LOG_DRAIN_INTERVAL_US 5000
+
+typedef struct {
+  LogLevel level;
+  struct timespec time;
+  char message[LOG_MSG_SIZE];
+} log_entry_t;
+
+// Single producer (the owning thread), single consumer (the drain thread)
+// ring buffer.
+typedef struct log_ring {
+  log_entry_t entries[LOG_RING_SIZE];
+  _Atomic uint64_t head, tail;
+  _Atomic uint64_t dropped;
+  _Atomic bool dead; // owning thread has exited.
+  pthread_t tid;
+  struct log_ring *next;
+} log_ring_t;
+
+LogLevel log_level = LogInfo;
+
+static const char *level_names[] = {"error", "warn", "info", "debug"};
+
+static __thread log_ring_t *thread_ring = NULL;
+static log_ring_t *rings = NULL;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static pthread_t drain_thread;
+
+/* ----------- HELPERS ------------------------*/
+
+/**
+ * @brief Writes `str` to the stream as the contents of a JSON string.
+ *
+ * @param out - FILE *
+ * @param str - const char *
+ */
+static void write_json_string(FILE *out, const char *str) {
+  for (; *str != '\0'; str++) {
+    unsigned char c = *str;
+    if (c == '"' || c == '\\') {
+      fputc('\\', out);
+      fputc(c, out);
+    } else if (c < 0x20) {
+      fprintf(out, "\\u%04x", c);
+    } else {
+      fputc(c, out);
+    }
+  }
+}
+
+/**
+ * @brief Formats a single entry as a JSON object on its own line.
+ *
+ * @param out - FILE *
+ * @param entry - log_entry_t *
+ * @param tid - pthread_t
+ */
+static void write_entry(FILE *out, log_entry_t *entry, pthread_t tid) {
+  struct tm tm;
+  char time_buf[32];
+  localtime_r(&entry->time.tv_sec, &tm);
+  strftime(time_buf, sizeof(time_buf), "%Y-%m-%dT%H:%M:%S", &tm);
+
+  fprintf(out, "{\"time\":\"%s.%06ld\",\"level\":\"%s\",\"tid\":%lu,",
+          time_buf, entry->time.tv_nsec / 1000, level_names[entry->level],
+          (unsigned long)tid);
+  fputs("\"message\":\"", out);
+  write_json_string(out, entry->message);
+  fputs("\"}\n", out);
+}
 
 /**
- * @brief wraps printf with timestamp and thread_id info. Logs json object to
- * stderr.
+ * @brief Drains all thread rings to stderr, and frees the rings of threads
+ * that have exited.
  *
- * @param format - char *
- * @return
+ * @return the number of drained entries.
  */
-int logfmt(const char *format, ...) {
-  time_t now;
-  time(&now);
-  fprintf(stderr, "{\"time\":\"%s\",\"tid\":%ld,\"message\":\"",
-          strtok(ctime(&now), "\n"), pthread_self());
+static int drain_rings() {
+  int drained = 0;
+
+  // BEGIN CRITICAL SECTION
+  pthread_mutex_lock(&rings_lock);
+  log_ring_t **prev = &rings;
+  while (*prev != NULL) {
+    log_ring_t *ring = *prev;
+
+    // Check before draining, so that no entry is lost when freeing.
+    bool dead = atomic_load_explicit(&ring->dead, memory_order_acquire);
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    for (; tail < head; tail++, drained++) {
+      write_entry(stderr, &ring->entries[tail & (LOG_RING_SIZE - 1)],
+                  ring->tid);
+    }
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+    uint64_t dropped = atomic_exchange(&ring->dropped, 0);
+    if (dropped > 0) {
+      fprintf(stderr,
+              "{\"level\":\"warn\",\"tid\":%lu,\"message\":\"dropped %lu log "
+              "records\"}\n",
+              (unsigned long)ring->tid, (unsigned long)dropped);
+    }
+
+    if (dead) {
+      *prev = ring->next;
+      free(ring);
+    } else {
+      prev = &ring->next;
+    }
+  }
+
+  if (drained > 0)
+    fflush(stderr);
+  pthread_mutex_unlock(&rings_lock);
+  // END CRITICAL SECTION
+
+  return drained;
+}
+
+/**
+ * @brief Background thread that formats and writes the log records.
+ *
+ * @param arg - void *
+ */
+static void *drain_log_thread(void *arg) {
+  while (1) {
+    if (drain_rings() == 0)
+      usleep(LOG_DRAIN_INTERVAL_US);
+  }
+  return NULL;
+}
+
+/**
+ * @brief Marks the ring of an exiting thread, it is freed once drained. The
+ * thread forgets the ring, so that a record logged later on its way out, e.g.
+ * by the destructor of another key, registers a new ring instead of writing
+ * to a freed one.
+ *
+ * @param arg - log_ring_t *
+ */
+static void release_ring(void *arg) {
+  log_ring_t *ring = (log_ring_t *)arg;
+  thread_ring = NULL;
+  atomic_store_explicit(&ring->dead, true, memory_order_release);
+}
+
+/**
+ * @brief Starts the drain thread, runs once per process.
+ */
+static void init_log() {
+  pthread_key_create(&ring_key, release_ring);
+  pthread_create(&drain_thread, NULL, drain_log_thread, NULL);
+  pthread_detach(drain_thread);
+  atexit(flush_log);
+}
+
+/**
+ * @brief Returns the ring of the calling thread, registering it on first use.
+ *
+ * @return log_ring_t *
+ */
+static log_ring_t *get_thread_ring() {
+  if (thread_ring != NULL)
+    return thread_ring;
+
+  pthread_once(&log_once, init_log);
+
+  log_ring_t *ring = calloc(1, sizeof(log_ring_t));
+  ring->tid = pthread_self();
+  pthread_setspecific(ring_key, ring);
+
+  pthread_mutex_lock(&rings_lock);
+  ring->next = rings;
+  rings = ring;
+  pthread_mutex_unlock(&rings_lock);
+
+  thread_ring = ring;
+  return ring;
+}
+
+/* ----------- EXTERNAL API -------------------*/
+
+/**
+ * @brief Formats a record into the ring of the calling thread, without taking
+ * any lock. The record is written to stderr as a JSON object by a background
+ * thread. If the ring is full the record is dropped and counted.
+ *
+ * NOTE: Use the `log_<level>` macros, which skip disabled levels.
+ *
+ * @param level - LogLevel
+ * @param format - const char *
+ */
+void log_record(LogLevel level, const char *format, ...) {
+  log_ring_t *ring = get_thread_ring();
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+  if (head - tail >= LOG_RING_SIZE) {
+    atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+    return;
+  }
+
+  log_entry_t *entry = &ring->entries[head & (LOG_RING_SIZE - 1)];
+  entry->level = level;
+  clock_gettime(CLOCK_REALTIME, &entry->time);
+
   va_list args;
   va_start(args, format);
-  vfprintf(stderr, format, args);
+  vsnprintf(entry->message, sizeof(entry->message), format, args);
   va_end(args);
-  fprintf(stderr, "\"}\n");
-  return 1;
+
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
 }
+
+/**
+ * @brief Parses a level name (error, warn, info or debug).
+ *
+ * @param name - const char *
+ * @param level - LogLevel *
+ * @return -1 if the name is not a level, 0 otherwise.
+ */
+int parse_log_level(const char *name, LogLevel *level) {
+  for (int i = LogError; i <= LogDebug; i++) {
+    if (strcmp(name, level_names[i]) == 0) {
+      *level = i;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/**
+ * @brief Synchronously writes all pending records, also runs at exit.
+ */
+void flush_log() { drain_rings(); }
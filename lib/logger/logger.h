@@ -1,8 +1,42 @@
 #ifndef __LOGGER_H__
+#define __LOGGER_H__
 #include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
-int logfmt(const char *format, ...);
+
+typedef enum {
+  LogError,
+  LogWarn,
+  LogInfo,
+  LogDebug,
+} LogLevel;
+
+// Most verbose level that is compiled in, records above it are elided by the
+// compiler. Release builds set it to `LogInfo`.
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LogDebug
+#endif
+
+// Most verbose level that is logged at runtime.
+extern LogLevel log_level;
+
+// Disabled levels cost at most one branch.
+#define log_at(level, ...)                                                     \
+  do {                                                                         \
+    if ((level) <= LOG_LEVEL && (level) <= log_level)                          \
+      log_record((level), __VA_ARGS__);                                        \
+  } while (0)
+
+#define log_error(...) log_at(LogError, __VA_ARGS__)
+#define log_warn(...) log_at(LogWarn, __VA_ARGS__)
+#define log_info(...) log_at(LogInfo, __VA_ARGS__)
+#define log_debug(...) log_at(LogDebug, __VA_ARGS__)
+
+void log_record(LogLevel, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+int parse_log_level(const char *, LogLevel *);
+void flush_log();
+
 #endif /* __LOGGER_H__ */
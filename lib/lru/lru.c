@@ -1,43 +1,58 @@
 #include "lru.h"
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 /* ----------- HELPERS ------------------------*/
 
 /**
- * @brief helper that allocates a entry on the heap.
+ * @brief helper that takes an entry from the free list of the cache, or
+ * allocates one on the heap if it is empty. The key buffer of a recycled entry
+ * is only reallocated if the key does not fit.
  *
+ * @param cache - lru_cache_t *
  * @param key - char *
  * @param value - int
  * @return pointer to entry
  */
-lru_entry_t *create_entry(char *key, int value) {
-  lru_entry_t *entry = malloc(sizeof(lru_entry_t) * 1);
-  entry->key = malloc(strlen(key) + 1);
+lru_entry_t *create_entry(lru_cache_t *cache, char *key, int value) {
+  size_t key_size = strlen(key) + 1;
+  lru_entry_t *entry = cache->free_list;
+  if (entry != NULL) {
+    cache->free_list = entry->lru_next;
+    cache->num_free--;
+    if (entry->key_size < key_size) {
+      free(entry->key);
+      entry->key = malloc(key_size);
+      entry->key_size = key_size;
+    }
+  } else {
+    entry = malloc(sizeof(lru_entry_t) * 1);
+    entry->key = malloc(key_size);
+    entry->key_size = key_size;
+  }
   entry->value = value;
 
   strcpy(entry->key, key);
-  entry->bucket_next = NULL;
+  entry->version = 0;
+  entry->expires_at = 0;
+  entry->bucket_next = entry->bucket_prev = NULL;
   entry->lru_prev = entry->lru_next = NULL;
   return entry;
 }
 
 /**
- * @brief  helper that employs the LRU protocol, by:
- * - Disconnecting tail entry from its potential bucket.
- * - Disconnecting tail entry from LRU queue and set tail pointer.
+ * @brief helper that disconnects an entry from its bucket and from the LRU
+ * queue.
  *
- * @param cache - lru_cache_t
- * @return  It returns the pointer to the disconnected entry (the previous tail
- * entry)
+ * @param cache - lru_cache_t *
+ * @param remove - lru_entry_t *
  */
-lru_entry_t *do_lru(lru_cache_t *cache) {
-  lru_entry_t *remove = cache->tail; // entry to remove to free space.
-
-  // Remove element from bucket
-  if (remove->bucket_prev == NULL && remove->bucket_prev == NULL) {
+void unlink_entry(lru_cache_t *cache, lru_entry_t *remove) {
+  // Remove element from bucket, the next entry becomes the first one.
+  if (remove->bucket_prev == NULL) {
     unsigned long slot = hash_djb2(remove->key) % cache->capacity;
-    cache->entries[slot] = NULL;
+    cache->entries[slot] = remove->bucket_next;
   }
 
   // Update previous bucket entry link.
@@ -50,13 +65,58 @@ lru_entry_t *do_lru(lru_cache_t *cache) {
     remove->bucket_next->bucket_prev = remove->bucket_prev;
   }
 
-  // Update tail pointer and free memory
-  cache->tail = remove->lru_prev;
-  cache->tail->lru_next = NULL;
+  // Update LRU queue links, and the head and tail pointers.
+  if (remove->lru_prev == NULL) {
+    cache->head = remove->lru_next;
+  } else {
+    remove->lru_prev->lru_next = remove->lru_next;
+  }
+  if (remove->lru_next == NULL) {
+    cache->tail = remove->lru_prev;
+  } else {
+    remove->lru_next->lru_prev = remove->lru_prev;
+  }
   cache->num_elements--;
+}
+
+/**
+ * @brief  helper that employs the LRU protocol, by:
+ * - Disconnecting tail entry from its potential bucket.
+ * - Disconnecting tail entry from LRU queue and set tail pointer.
+ *
+ * @param cache - lru_cache_t
+ * @return  It returns the pointer to the disconnected entry (the previous tail
+ * entry)
+ */
+lru_entry_t *do_lru(lru_cache_t *cache) {
+  lru_entry_t *remove = cache->tail; // entry to remove to free space.
+  unlink_entry(cache, remove);
   return remove;
 }
 
+/**
+ * @brief helper that checks if an entry has expired.
+ *
+ * @param entry - lru_entry_t *
+ * @param now - uint64_t, monotonic nanoseconds.
+ * @return true if the entry has expired.
+ */
+bool is_expired(lru_entry_t *entry, uint64_t now) {
+  return entry->expires_at != 0 && entry->expires_at <= now;
+}
+
+/**
+ * @brief helper that sets the version and the expiry of a written entry.
+ *
+ * @param cache - lru_cache_t *
+ * @param entry - lru_entry_t *
+ * @param version - uint64_t
+ */
+void stamp_entry(lru_cache_t *cache, lru_entry_t *entry, uint64_t version) {
+  entry->version = version;
+  entry->expires_at = cache->ttl == 0 ? 0 : lru_now() + cache->ttl;
+}
+
 // Helper that moves an entry to the head of the LRU queue.
 void move_entry_to_head(lru_cache_t *cache, lru_entry_t *entry) {
   if (entry == cache->head)
@@ -98,6 +158,19 @@ lru_cache_t *create_lru_cache(size_t capacity) {
   cache->capacity = capacity;
 
   cache->head = cache->tail = NULL;
+  cache->version_clock = 0;
+  cache->ttl = 0;
+  cache->free_list = NULL;
+  cache->num_free = 0;
+  // Small caches still keep an entry of headroom below the capacity, or the
+  // eviction never starts and every put at capacity evicts inline.
+  cache->high_watermark = cache->low_watermark = capacity;
+  if (capacity > 1) {
+    cache->high_watermark = capacity - (capacity < 10 ? 1 : capacity / 10);
+    cache->low_watermark = capacity - capacity / 5;
+    if (cache->low_watermark >= cache->high_watermark)
+      cache->low_watermark = cache->high_watermark - 1;
+  }
 
   cache->entries = malloc(sizeof(lru_entry_t *) * capacity);
 
@@ -122,6 +195,7 @@ void destroy_lru_cache(lru_cache_t *cache) {
       current = next;
     }
   }
+  destroy_entries(cache->free_list);
   free(cache->entries);
   free(cache);
 }
@@ -136,6 +210,34 @@ void destroy_entry(lru_entry_t *entry) {
   free(entry);
 }
 
+/**
+ * @brief Frees a list of entries linked by `lru_next`, e.g. the entries
+ * returned by `lru_evict` and `lru_expire`.
+ *
+ * @param entry - lru_entry_t *
+ * @return the number of freed entries.
+ */
+size_t destroy_entries(lru_entry_t *entry) {
+  size_t n = 0;
+  for (; entry != NULL; n++) {
+    lru_entry_t *next = entry->lru_next;
+    destroy_entry(entry);
+    entry = next;
+  }
+  return n;
+}
+
+/**
+ * @brief Returns a monotonic timestamp for the expiry of entries.
+ *
+ * @return nanoseconds.
+ */
+uint64_t lru_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 // OPERATIONS
 
 /**
@@ -146,17 +248,29 @@ void destroy_entry(lru_entry_t *entry) {
  * @return pointer to the value, NULL means the value is not in the cache.
  */
 int *get(lru_cache_t *cache, char *key) {
+  lru_entry_t *entry = get_entry(cache, key);
+  return entry == NULL ? NULL : &entry->value;
+}
+
+/**
+ * @brief Will fetch (if found) the entry of the given key, e.g to read its
+ * version. Expired entries are not returned, they are left for `lru_expire`.
+ *
+ * @param cache - lru_cache_t *
+ * @param key - char *
+ * @return pointer to the entry, NULL means the key is not in the cache.
+ */
+lru_entry_t *get_entry(lru_cache_t *cache, char *key) {
   unsigned long slot = hash_djb2(key) % cache->capacity;
 
   lru_entry_t *entry = cache->entries[slot];
 
-  if (entry == NULL)
-    return NULL;
-
   while (entry != NULL) {
     if (strcmp(entry->key, key) == 0) {
+      if (entry->expires_at != 0 && is_expired(entry, lru_now()))
+        return NULL;
       move_entry_to_head(cache, entry);
-      return &entry->value;
+      return entry;
     }
     entry = entry->bucket_next;
   }
@@ -167,6 +281,8 @@ int *get(lru_cache_t *cache, char *key) {
  * its value will be updated. NOTE: if the cache is full the least recently used
  * item will be removed.
  *
+ * The entry gets the next version of the cache.
+ *
  * @param cache - lru_cache_t *
  * @param key - char *
  * @param value - int
@@ -174,6 +290,25 @@ int *get(lru_cache_t *cache, char *key) {
  * element was removed.
  */
 lru_entry_t *put(lru_cache_t *cache, char *key, int value) {
+  return put_version(cache, key, value, cache->version_clock + 1);
+}
+
+/**
+ * @brief Same as `put`, but with the version assigned by the caller, e.g. a
+ * follower that applies the writes of its master. The version clock of the
+ * cache never goes backwards.
+ *
+ * @param cache - lru_cache_t *
+ * @param key - char *
+ * @param value - int
+ * @param version - uint64_t
+ * @returns A pointer to lru_entry_t removed by LRU protocol, NULL means no
+ * element was removed.
+ */
+lru_entry_t *put_version(lru_cache_t *cache, char *key, int value,
+                         uint64_t version) {
+  if (version > cache->version_clock)
+    cache->version_clock = version;
 
   size_t slot = hash_djb2(key) % cache->capacity;
 
@@ -185,7 +320,8 @@ lru_entry_t *put(lru_cache_t *cache, char *key, int value) {
       remove = do_lru(cache);
     }
 
-    entry = create_entry(key, value);
+    entry = create_entry(cache, key, value);
+    stamp_entry(cache, entry, version);
 
     // Put new element at head of LRU dll.
     if (cache->head != NULL) {
@@ -211,6 +347,7 @@ lru_entry_t *put(lru_cache_t *cache, char *key, int value) {
     // Check if we already have item in cache, update value and move to head.
     if (strcmp(entry->key, key) == 0) {
       entry->value = value;
+      stamp_entry(cache, entry, version);
       move_entry_to_head(cache, entry);
       return NULL;
     }
@@ -226,13 +363,14 @@ lru_entry_t *put(lru_cache_t *cache, char *key, int value) {
   }
 
   // Create and insert new element at end of bucket.
-  entry = create_entry(key, value);
-  entry->bucket_prev = prev;
+  entry = create_entry(cache, key, value);
+  stamp_entry(cache, entry, version);
 
   // in case we happend to remove the entry that `prev` is pointing to.
   if (remove == prev) {
     prev = remove->bucket_prev;
   }
+  entry->bucket_prev = prev;
 
   if (prev == NULL) {
     cache->entries[slot] = entry;
@@ -240,10 +378,103 @@ lru_entry_t *put(lru_cache_t *cache, char *key, int value) {
     prev->bucket_next = entry;
   }
 
-  // Insert element at head of LRU ddl.
-  cache->head->lru_prev = entry;
+  // Insert element at head of LRU ddl, which is empty if we removed the only
+  // entry.
+  if (cache->head != NULL) {
+    cache->head->lru_prev = entry;
+  } else {
+    cache->tail = entry;
+  }
   entry->lru_next = cache->head;
   cache->head = entry;
   cache->num_elements++;
   return remove;
 }
+
+/**
+ * @brief Removes the entry of a key, e.g. after it has been handed to another
+ * shard.
+ *
+ * @param cache - lru_cache_t *
+ * @param key - char *
+ * @return pointer to the removed entry, NULL means the key is not in the
+ * cache.
+ */
+lru_entry_t *lru_delete(lru_cache_t *cache, char *key) {
+  lru_entry_t *entry = cache->entries[hash_djb2(key) % cache->capacity];
+  while (entry != NULL && strcmp(entry->key, key) != 0)
+    entry = entry->bucket_next;
+
+  if (entry != NULL)
+    unlink_entry(cache, entry);
+  return entry;
+}
+
+/**
+ * @brief Removes least recently used entries until the cache holds at most
+ * `target` entries, or `max` entries have been removed. Lets the caller evict
+ * in bounded batches and free the entries after releasing its lock.
+ *
+ * @param cache - lru_cache_t *
+ * @param target - size_t
+ * @param max - size_t
+ * @return list of the removed entries linked by `lru_next`, NULL means that
+ * no entry was removed.
+ */
+lru_entry_t *lru_evict(lru_cache_t *cache, size_t target, size_t max) {
+  lru_entry_t *removed = NULL;
+  for (size_t i = 0; i < max && cache->num_elements > target; i++) {
+    lru_entry_t *entry = do_lru(cache);
+    entry->lru_next = removed;
+    removed = entry;
+  }
+  return removed;
+}
+
+/**
+ * @brief Removes the expired entries among the `max_scan` least recently used
+ * entries. Expired entries that are not read drift towards the tail, where
+ * they are found.
+ *
+ * @param cache - lru_cache_t *
+ * @param now - uint64_t, monotonic nanoseconds.
+ * @param max_scan - size_t
+ * @return list of the removed entries linked by `lru_next`, NULL means that
+ * no entry was removed.
+ */
+lru_entry_t *lru_expire(lru_cache_t *cache, uint64_t now, size_t max_scan) {
+  lru_entry_t *removed = NULL, *entry = cache->tail;
+  for (size_t i = 0; i < max_scan && entry != NULL; i++) {
+    lru_entry_t *prev = entry->lru_prev;
+    if (is_expired(entry, now)) {
+      unlink_entry(cache, entry);
+      entry->lru_next = removed;
+      removed = entry;
+    }
+    entry = prev;
+  }
+  return removed;
+}
+
+/**
+ * @brief Hands removed entries back to the cache, e.g. the entries returned by
+ * `lru_evict` and `lru_expire`, so that puts reuse them and their key buffers
+ * instead of allocating. The free list never holds more entries than the cache
+ * has room for, the rest are returned.
+ *
+ * @param cache - lru_cache_t *
+ * @param entries - lru_entry_t *, linked by `lru_next`.
+ * @return list of the entries that were not kept, to be freed with
+ * `destroy_entries`.
+ */
+lru_entry_t *lru_recycle(lru_cache_t *cache, lru_entry_t *entries) {
+  while (entries != NULL &&
+         cache->num_elements + cache->num_free < cache->capacity) {
+    lru_entry_t *next = entries->lru_next;
+    entries->lru_next = cache->free_list;
+    cache->free_list = entries;
+    cache->num_free++;
+    entries = next;
+  }
+  return entries;
+}
@@ -4,10 +4,16 @@
 #include "../hashing/hashing.h"
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 typedef struct lru_entry_t {
   char *key;
+  size_t key_size; // of the key buffer, that recycled entries reuse.
   int value;
+  // Changes on every write, used for compare-and-set.
+  uint64_t version;
+  // Monotonic nanoseconds, 0 means that the entry never expires.
+  uint64_t expires_at;
 
   // hashtable bucket ll.
   struct lru_entry_t *bucket_next, *bucket_prev;
@@ -25,13 +31,38 @@ typedef struct {
 
   size_t num_elements;
   lru_entry_t *head, *tail;
+
+  // Version of the most recent write.
+  uint64_t version_clock;
+
+  // Entries expire this many nanoseconds after their last write, 0 means
+  // never.
+  uint64_t ttl;
+
+  // Eviction by `lru_evict` starts once the cache holds more than the high
+  // watermark of entries, and stops at the low watermark. `put` only evicts
+  // when the cache is full.
+  size_t high_watermark, low_watermark;
+
+  // Removed entries handed back by `lru_recycle`, linked by `lru_next`, that
+  // new entries are taken from before allocating.
+  lru_entry_t *free_list;
+  size_t num_free;
 } lru_cache_t;
 
 lru_cache_t *create_lru_cache(size_t);
 void destroy_entry(lru_entry_t *entry);
+size_t destroy_entries(lru_entry_t *);
 void destroy_lru_cache(lru_cache_t *);
 
 int *get(lru_cache_t *, char *);
+lru_entry_t *get_entry(lru_cache_t *, char *);
 lru_entry_t *put(lru_cache_t *, char *, int);
+lru_entry_t *put_version(lru_cache_t *, char *, int, uint64_t);
+lru_entry_t *lru_delete(lru_cache_t *, char *);
+lru_entry_t *lru_evict(lru_cache_t *, size_t, size_t);
+lru_entry_t *lru_expire(lru_cache_t *, uint64_t, size_t);
+lru_entry_t *lru_recycle(lru_cache_t *, lru_entry_t *);
+uint64_t lru_now();
 
 #endif // __LRU_H__
@@ -0,0 +1,319 @@
+#include "metrics.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Metrics written by a single thread, summed over all threads when read.
+typedef struct metrics_slot {
+  _Atomic uint64_t counters[NUM_COUNTERS];
+  _Atomic int64_t gauges[NUM_GAUGES];
+  _Atomic uint64_t buckets[NUM_HISTOGRAMS][HIST_BUCKETS];
+  _Atomic uint64_t sums[NUM_HISTOGRAMS];
+  _Atomic bool free; // owning thread has exited, the slot can be reused.
+  struct metrics_slot *next;
+} metrics_slot_t;
+
+typedef struct {
+  const char *name;
+  const char *help;
+} metric_desc_t;
+
+static const metric_desc_t counter_descs[NUM_COUNTERS] = {
+    {"canary_requests_total", "Connections handled by the workers."},
+    {"canary_gets_total", "Get operations."},
+    {"canary_get_hits_total", "Get operations that found a cached value."},
+    {"canary_get_misses_total", "Get operations that found no cached value."},
+    {"canary_puts_total", "Puts and counter operations by clients."},
+    {"canary_evictions_total", "Entries evicted from the cache."},
+    {"canary_expirations_total", "Expired entries reclaimed from the cache."},
+    {"canary_replicated_records_total", "Puts applied from the upstream."},
+    {"canary_migrated_keys_total", "Keys handed to their new owner."},
+    {"canary_leases_granted_total", "Read-through misses handed a lease."},
+    {"canary_lease_retries_total",
+     "Read-through misses that timed out waiting on a lease."},
+};
+
+static const metric_desc_t gauge_descs[NUM_GAUGES] = {
+    {"canary_queue_depth", "Connections waiting for a worker."},
+    {"canary_followers", "Followers streaming from this shard."},
+};
+
+static const metric_desc_t hist_descs[NUM_HISTOGRAMS] = {
+    {"canary_get_latency_seconds", "Time to serve a get."},
+    {"canary_put_latency_seconds", "Time to serve a put."},
+    {"canary_replication_latency_seconds",
+     "Time to apply a replication batch."},
+    {"canary_queue_wait_seconds", "Time a connection waits for a worker."},
+};
+
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+static __thread metrics_slot_t *thread_slot = NULL;
+static metrics_slot_t *slots = NULL;
+static pthread_mutex_t slots_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t metrics_once = PTHREAD_ONCE_INIT;
+static pthread_key_t slot_key;
+
+/* ----------- HELPERS ------------------------*/
+
+/**
+ * @brief Marks the slot of an exiting thread as free. The slot keeps its
+ * values, so that the sums never go backwards. The thread forgets the slot,
+ * which another thread may claim from now on, so that a metric recorded later
+ * on its way out claims a slot of its own.
+ *
+ * @param arg - metrics_slot_t *
+ */
+static void release_slot(void *arg) {
+  metrics_slot_t *slot = (metrics_slot_t *)arg;
+  thread_slot = NULL;
+  atomic_store_explicit(&slot->free, true, memory_order_release);
+}
+
+static void init_metrics() { pthread_key_create(&slot_key, release_slot); }
+
+/**
+ * @brief Returns the slot of the calling thread, claiming one on first use.
+ *
+ * @return metrics_slot_t *
+ */
+static metrics_slot_t *get_thread_slot() {
+  if (thread_slot != NULL)
+    return thread_slot;
+
+  pthread_once(&metrics_once, init_metrics);
+
+  // BEGIN CRITICAL SECTION
+  pthread_mutex_lock(&slots_lock);
+  metrics_slot_t *slot = slots;
+  while (slot != NULL &&
+         !atomic_load_explicit(&slot->free, memory_order_acquire)) {
+    slot = slot->next;
+  }
+  if (slot == NULL) {
+    slot = calloc(1, sizeof(metrics_slot_t));
+    slot->next = slots;
+    slots = slot;
+  }
+  atomic_store_explicit(&slot->free, false, memory_order_relaxed);
+  pthread_mutex_unlock(&slots_lock);
+  // END CRITICAL SECTION
+
+  pthread_setspecific(slot_key, slot);
+  thread_slot = slot;
+  return slot;
+}
+
+/**
+ * @brief Adds to a value that only the calling thread writes, which avoids
+ * the locked read-modify-write of `atomic_fetch_add`.
+ *
+ * @param value - _Atomic uint64_t *
+ * @param n - uint64_t
+ */
+static void add_owned(_Atomic uint64_t *value, uint64_t n) {
+  atomic_store_explicit(
+      value, atomic_load_explicit(value, memory_order_relaxed) + n,
+      memory_order_relaxed);
+}
+
+/**
+ * @brief Maps a value to its log-linear bucket.
+ *
+ * @param value - uint64_t
+ * @return the bucket index.
+ */
+static int hist_bucket(uint64_t value) {
+  if (value < HIST_SUB_BUCKETS)
+    return value;
+
+  int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+  return (shift + 1) * HIST_SUB_BUCKETS +
+         ((value >> shift) & (HIST_SUB_BUCKETS - 1));
+}
+
+/**
+ * @brief Returns the highest value that maps to the bucket.
+ *
+ * @param bucket - int
+ * @return uint64_t
+ */
+static uint64_t hist_bucket_max(int bucket) {
+  bucket++;
+  if (bucket >= HIST_BUCKETS)
+    return UINT64_MAX;
+  if (bucket < HIST_SUB_BUCKETS)
+    return bucket - 1;
+
+  int shift = bucket / HIST_SUB_BUCKETS - 1;
+  uint64_t lower = (uint64_t)(HIST_SUB_BUCKETS + bucket % HIST_SUB_BUCKETS)
+                   << shift;
+  return lower - 1;
+}
+
+/**
+ * @brief Writes the HELP and TYPE lines of a metric.
+ *
+ * @param out - FILE *
+ * @param desc - const metric_desc_t *
+ * @param type - const char *
+ */
+static void write_header(FILE *out, const metric_desc_t *desc,
+                         const char *type) {
+  fprintf(out, "# HELP %s %s\n", desc->name, desc->help);
+  fprintf(out, "# TYPE %s %s\n", desc->name, type);
+}
+
+/* ----------- EXTERNAL API -------------------*/
+
+/**
+ * @brief Returns a monotonic timestamp for measuring latencies.
+ *
+ * @return nanoseconds.
+ */
+uint64_t metrics_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Increments a counter of the calling thread.
+ *
+ * @param counter - Counter
+ * @param n - uint64_t
+ */
+void metrics_inc(Counter counter, uint64_t n) {
+  add_owned(&get_thread_slot()->counters[counter], n);
+}
+
+/**
+ * @brief Adds to a gauge. A gauge may be incremented and decremented by
+ * different threads, only the sum over all threads is meaningful.
+ *
+ * @param gauge - Gauge
+ * @param n - int64_t
+ */
+void metrics_gauge_add(Gauge gauge, int64_t n) {
+  add_owned((_Atomic uint64_t *)&get_thread_slot()->gauges[gauge],
+            (uint64_t)n);
+}
+
+/**
+ * @brief Records a value in a histogram of the calling thread.
+ *
+ * @param hist - Histogram
+ * @param value - uint64_t, nanoseconds.
+ */
+void metrics_record(Histogram hist, uint64_t value) {
+  metrics_slot_t *slot = get_thread_slot();
+  add_owned(&slot->buckets[hist][hist_bucket(value)], 1);
+  add_owned(&slot->sums[hist], value);
+}
+
+/**
+ * @brief Sums the metrics of all threads. The values of a thread may be read
+ * while it is writing, so the snapshot is not atomic across metrics.
+ *
+ * @param snapshot - metrics_snapshot_t *
+ */
+void metrics_collect(metrics_snapshot_t *snapshot) {
+  memset(snapshot, 0, sizeof(metrics_snapshot_t));
+
+  // BEGIN CRITICAL SECTION
+  pthread_mutex_lock(&slots_lock);
+  for (metrics_slot_t *slot = slots; slot != NULL; slot = slot->next) {
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+      snapshot->counters[i] +=
+          atomic_load_explicit(&slot->counters[i], memory_order_relaxed);
+    }
+    for (int i = 0; i < NUM_GAUGES; i++) {
+      snapshot->gauges[i] +=
+          atomic_load_explicit(&slot->gauges[i], memory_order_relaxed);
+    }
+    for (int i = 0; i < NUM_HISTOGRAMS; i++) {
+      hist_t *hist = &snapshot->hists[i];
+      for (int j = 0; j < HIST_BUCKETS; j++) {
+        uint64_t n =
+            atomic_load_explicit(&slot->buckets[i][j], memory_order_relaxed);
+        hist->buckets[j] += n;
+        hist->count += n;
+      }
+      hist->sum += atomic_load_explicit(&slot->sums[i], memory_order_relaxed);
+    }
+  }
+  pthread_mutex_unlock(&slots_lock);
+  // END CRITICAL SECTION
+}
+
+/**
+ * @brief Returns the value at the quantile `q`, rounded up to the highest
+ * value of its bucket.
+ *
+ * @param hist - hist_t *
+ * @param q - double, between 0 and 1.
+ * @return 0 if the histogram is empty, the value otherwise.
+ */
+uint64_t hist_percentile(hist_t *hist, double q) {
+  if (hist->count == 0)
+    return 0;
+
+  uint64_t rank = q * hist->count;
+  if (rank < q * hist->count || rank == 0)
+    rank++;
+
+  uint64_t seen = 0;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    seen += hist->buckets[i];
+    if (seen >= rank)
+      return hist_bucket_max(i);
+  }
+  return UINT64_MAX;
+}
+
+/**
+ * @brief Formats a snapshot in the Prometheus text format, histograms are
+ * exposed as summaries.
+ *
+ * NOTE: The text is allocated on the heap.
+ *
+ * @param snapshot - metrics_snapshot_t *
+ * @param text - char **
+ * @return -1 if memory could not be allocated, the length of the text
+ * otherwise.
+ */
+int metrics_format(metrics_snapshot_t *snapshot, char **text) {
+  size_t len;
+  FILE *out = open_memstream(text, &len);
+  if (out == NULL)
+    return -1;
+
+  for (int i = 0; i < NUM_COUNTERS; i++) {
+    write_header(out, &counter_descs[i], "counter");
+    fprintf(out, "%s %lu\n", counter_descs[i].name,
+            (unsigned long)snapshot->counters[i]);
+  }
+  for (int i = 0; i < NUM_GAUGES; i++) {
+    write_header(out, &gauge_descs[i], "gauge");
+    fprintf(out, "%s %ld\n", gauge_descs[i].name, (long)snapshot->gauges[i]);
+  }
+  for (int i = 0; i < NUM_HISTOGRAMS; i++) {
+    hist_t *hist = &snapshot->hists[i];
+    const char *name = hist_descs[i].name;
+    write_header(out, &hist_descs[i], "summary");
+    for (size_t j = 0; j < sizeof(quantiles) / sizeof(quantiles[0]); j++) {
+      fprintf(out, "%s{quantile=\"%g\"} %.9f\n", name, quantiles[j],
+              hist_percentile(hist, quantiles[j]) / 1e9);
+    }
+    fprintf(out, "%s_sum %.9f\n", name, hist->sum / 1e9);
+    fprintf(out, "%s_count %lu\n", name, (unsigned long)hist->count);
+  }
+
+  if (fclose(out) != 0)
+    return -1;
+  return len;
+}
@@ -0,0 +1,64 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdint.h>
+
+// Log-linear histogram buckets, every power of two is split into
+// 2^HIST_SUB_BITS linear buckets, bounding the relative error to 12.5%.
+#define HIST_SUB_BITS 3
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+typedef enum {
+  CounterRequests,
+  CounterGets,
+  CounterHits,
+  CounterMisses,
+  CounterPuts,
+  CounterEvictions,
+  CounterExpirations,
+  CounterReplicated,
+  CounterMigrated,
+  CounterLeasesGranted,
+  CounterLeaseRetries,
+  NUM_COUNTERS,
+} Counter;
+
+typedef enum {
+  GaugeQueueDepth,
+  GaugeFollowers,
+  NUM_GAUGES,
+} Gauge;
+
+// Latencies in nanoseconds.
+typedef enum {
+  HistGet,
+  HistPut,
+  HistReplication,
+  HistQueueWait,
+  NUM_HISTOGRAMS,
+} Histogram;
+
+typedef struct {
+  uint64_t buckets[HIST_BUCKETS];
+  uint64_t count;
+  uint64_t sum;
+} hist_t;
+
+// Sum of the metrics of all threads at the time of reading.
+typedef struct {
+  uint64_t counters[NUM_COUNTERS];
+  int64_t gauges[NUM_GAUGES];
+  hist_t hists[NUM_HISTOGRAMS];
+} metrics_snapshot_t;
+
+uint64_t metrics_now();
+void metrics_inc(Counter, uint64_t);
+void metrics_gauge_add(Gauge, int64_t);
+void metrics_record(Histogram, uint64_t);
+
+void metrics_collect(metrics_snapshot_t *);
+uint64_t hist_percentile(hist_t *, double);
+int metrics_format(metrics_snapshot_t *, char **);
+
+#endif // __METRICS_H__
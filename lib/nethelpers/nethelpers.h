@@ -9,5 +9,7 @@ typedef struct in_addr IA;
 
 int connect_to_socket(char *, in_port_t);
 int bind_n_listen_socket(in_port_t, int);
+int connect_udp_socket(char *, in_port_t);
+int bind_udp_socket(in_port_t);
 
 #endif // __NETHELPERS_H__
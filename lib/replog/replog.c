@@ -0,0 +1,375 @@
+#include "replog.h"
+#include "../cproto/cproto.h"
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* ----------- HELPERS ------------------------*/
+
+/**
+ * @brief Makes sure that the batch buffer can fit `len` more bytes.
+ *
+ * @param batch - replog_batch_t *
+ * @param len - size_t
+ * @return -1 if memory could not be allocated, 0 otherwise.
+ */
+int reserve_batch(replog_batch_t *batch, size_t len) {
+  if (batch->buf_len + len <= batch->buf_cap)
+    return 0;
+
+  size_t cap = batch->buf_cap == 0 ? 1024 : batch->buf_cap;
+  while (cap < batch->buf_len + len)
+    cap *= 2;
+
+  uint8_t *buf = realloc(batch->buf, cap);
+  if (buf == NULL)
+    return -1;
+
+  batch->buf = buf;
+  batch->buf_cap = cap;
+  return 0;
+}
+
+/* ----------- EXTERNAL API -------------------*/
+
+// LOG
+
+/**
+ * @brief Creates a replication log that holds the `capacity` most recent
+ * records.
+ *
+ * @param capacity - size_t
+ * @param id - uint64_t, identifies the history of the log.
+ * @return pointer to the log.
+ */
+replog_t *create_replog(size_t capacity, uint64_t id) {
+  replog_t *log = malloc(sizeof(replog_t));
+  log->id = id;
+  log->records = calloc(capacity, sizeof(replog_record_t));
+  log->capacity = capacity;
+  log->head = 0;
+  pthread_mutex_init(&log->lock, NULL);
+  pthread_cond_init(&log->cond, NULL);
+  return log;
+}
+
+/**
+ * @brief Frees the memory of a replication log.
+ *
+ * @param log - replog_t *
+ */
+void destroy_replog(replog_t *log) {
+  for (size_t i = 0; i < log->capacity; i++) {
+    free(log->records[i].data);
+  }
+  pthread_mutex_destroy(&log->lock);
+  pthread_cond_destroy(&log->cond);
+  free(log->records);
+  free(log);
+}
+
+/**
+ * @brief Appends a put to the log, overwriting the oldest record if the log
+ * is full, and wakes up any reader waiting for new records.
+ *
+ * @param log - replog_t *
+ * @param key - char *
+ * @param value - int
+ * @param version - uint64_t, version of the cache entry after the put.
+ * @return the sequence number of the appended record.
+ */
+uint64_t replog_append(replog_t *log, char *key, int value, uint64_t version) {
+  uint32_t key_len = strlen(key) + 1;
+  replog_record_t record = {
+      .len = sizeof(key_len) + key_len + sizeof(value) + sizeof(version)};
+
+  // Pack outside of the critical section.
+  record.data = malloc(record.len);
+  pack_string_int(key, key_len, value, record.data);
+  pack_long(version, record.data + record.len - sizeof(version));
+
+  // BEGIN CRITICAL SECTION
+  pthread_mutex_lock(&log->lock);
+  uint64_t seq = ++log->head;
+  replog_record_t old = log->records[seq % log->capacity];
+  log->records[seq % log->capacity] = record;
+  pthread_cond_broadcast(&log->cond);
+  pthread_mutex_unlock(&log->lock);
+  // END CRITICAL SECTION
+
+  free(old.data);
+  return seq;
+}
+
+/**
+ * @brief Returns the sequence number of the last appended record.
+ *
+ * @param log - replog_t *
+ * @return uint64_t
+ */
+uint64_t replog_head(replog_t *log) {
+  pthread_mutex_lock(&log->lock);
+  uint64_t head = log->head;
+  pthread_mutex_unlock(&log->lock);
+  return head;
+}
+
+/**
+ * @brief Checks if a reader that has applied everything up to `seq` from the
+ * log `id` can catch up by reading the delta from the ring.
+ *
+ * @param log - replog_t *
+ * @param id - uint64_t
+ * @param seq - uint64_t
+ * @return 1 if the delta is in the ring, 0 otherwise.
+ */
+int replog_contains(replog_t *log, uint64_t id, uint64_t seq) {
+  pthread_mutex_lock(&log->lock);
+  int contains = id == log->id && seq <= log->head &&
+                 log->head - seq <= log->capacity;
+  pthread_mutex_unlock(&log->lock);
+  return contains;
+}
+
+/**
+ * @brief Blocks until there are records after `cursor`, or until `timeout_ms`
+ * has passed, then copies up to `max_records` of them into the batch and
+ * advances the cursor. A timeout yields an empty batch.
+ *
+ * @param log - replog_t *
+ * @param cursor - uint64_t *, sequence number of the last read record.
+ * @param batch - replog_batch_t *
+ * @param max_records - uint32_t
+ * @param timeout_ms - int
+ * @return -1 if the cursor has fallen out of the ring or memory could not be
+ * allocated, 0 otherwise.
+ */
+int replog_read(replog_t *log, uint64_t *cursor, replog_batch_t *batch,
+                uint32_t max_records, int timeout_ms) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += timeout_ms / 1000;
+  deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  // BEGIN CRITICAL SECTION
+  pthread_mutex_lock(&log->lock);
+  while (log->head <= *cursor) {
+    if (pthread_cond_timedwait(&log->cond, &log->lock, &deadline) != 0)
+      break;
+  }
+
+  if (batch_reset(batch, log->id, *cursor + 1) == -1) {
+    pthread_mutex_unlock(&log->lock);
+    return -1;
+  }
+
+  // The records have been overwritten, or belong to another history.
+  if (log->head < *cursor || log->head - *cursor > log->capacity) {
+    pthread_mutex_unlock(&log->lock);
+    return -1;
+  }
+
+  while (*cursor < log->head && batch->num_records < max_records) {
+    replog_record_t *record = &log->records[(*cursor + 1) % log->capacity];
+    // Dropped by a reset, the reader has to start over.
+    if (record->data == NULL || reserve_batch(batch, record->len) == -1) {
+      pthread_mutex_unlock(&log->lock);
+      return -1;
+    }
+    memcpy(batch->buf + batch->buf_len, record->data, record->len);
+    batch->buf_len += record->len;
+    batch->num_records++;
+    (*cursor)++;
+  }
+  pthread_mutex_unlock(&log->lock);
+  // END CRITICAL SECTION
+
+  batch_seal(batch);
+  return 0;
+}
+
+/**
+ * @brief Drops all records and continues the log from `seq` in the history
+ * `id`. Used by followers that mirror the log of their master after loading a
+ * snapshot. Readers of the old history fail on their next read.
+ *
+ * @param log - replog_t *
+ * @param id - uint64_t
+ * @param seq - uint64_t
+ */
+void replog_reset(replog_t *log, uint64_t id, uint64_t seq) {
+  // BEGIN CRITICAL SECTION
+  pthread_mutex_lock(&log->lock);
+  for (size_t i = 0; i < log->capacity; i++) {
+    free(log->records[i].data);
+    log->records[i] = (replog_record_t){.data = NULL, .len = 0};
+  }
+  log->id = id;
+  log->head = seq;
+  pthread_cond_broadcast(&log->cond);
+  pthread_mutex_unlock(&log->lock);
+  // END CRITICAL SECTION
+}
+
+// BATCHES
+
+/**
+ * @brief Creates an empty batch, the buffer is allocated on first use.
+ *
+ * @return replog_batch_t
+ */
+replog_batch_t create_batch() {
+  return (replog_batch_t){
+      .buf = NULL, .buf_len = 0, .buf_cap = 0, .num_records = 0};
+}
+
+/**
+ * @brief Frees the buffer of a batch.
+ *
+ * @param batch - replog_batch_t *
+ */
+void destroy_batch(replog_batch_t *batch) {
+  free(batch->buf);
+  *batch = create_batch();
+}
+
+/**
+ * @brief Empties the batch and writes a new header.
+ *
+ * @param batch - replog_batch_t *
+ * @param log_id - uint64_t
+ * @param first_seq - uint64_t
+ * @return -1 if memory could not be allocated, 0 otherwise.
+ */
+int batch_reset(replog_batch_t *batch, uint64_t log_id, uint64_t first_seq) {
+  batch->buf_len = 0;
+  batch->num_records = 0;
+  if (reserve_batch(batch, BATCH_HEADER_SIZE) == -1)
+    return -1;
+
+  pack_long(log_id, batch->buf);
+  pack_long(first_seq, batch->buf + sizeof(log_id));
+  batch->buf_len = BATCH_HEADER_SIZE;
+  return 0;
+}
+
+/**
+ * @brief Packs a record at the end of the batch.
+ *
+ * @param batch - replog_batch_t *
+ * @param key - char *
+ * @param value - int
+ * @param version - uint64_t
+ * @return -1 if memory could not be allocated, 0 otherwise.
+ */
+int batch_add(replog_batch_t *batch, char *key, int value, uint64_t version) {
+  uint32_t key_len = strlen(key) + 1;
+  size_t len = sizeof(key_len) + key_len + sizeof(value) + sizeof(version);
+  if (reserve_batch(batch, len) == -1)
+    return -1;
+
+  pack_string_int(key, key_len, value, batch->buf + batch->buf_len);
+  pack_long(version, batch->buf + batch->buf_len + len - sizeof(version));
+  batch->buf_len += len;
+  batch->num_records++;
+  return 0;
+}
+
+/**
+ * @brief Writes the number of records into the header of the batch.
+ *
+ * @param batch - replog_batch_t *
+ */
+void batch_seal(replog_batch_t *batch) {
+  uint32_t n_num_records = htonl(batch->num_records);
+  memcpy(batch->buf + sizeof(uint64_t) * 2, &n_num_records,
+         sizeof(n_num_records));
+}
+
+/**
+ * @brief Packs the live entries of a cache into batches of at most
+ * `batch_size` records for a snapshot, oldest entry first so that the follower
+ * ends up with the same LRU order. Expired entries are left out. The last
+ * batch is always empty and terminates the snapshot, so no other batch is.
+ *
+ * NOTE: Is not thread safe, the cache must not change while it is packed.
+ *
+ * @param cache - lru_cache_t *
+ * @param log_id - uint64_t
+ * @param seq - uint64_t, head of the log that the snapshot is taken at.
+ * @param batch_size - uint32_t
+ * @param now - uint64_t, monotonic nanoseconds.
+ * @param num_batches - int *, set to the number of batches.
+ * @return the sealed batches, to be destroyed and freed by the caller.
+ */
+replog_batch_t *replog_snapshot(lru_cache_t *cache, uint64_t log_id,
+                                uint64_t seq, uint32_t batch_size,
+                                uint64_t now, int *num_batches) {
+  // Room for every entry, expired ones included, and the terminator.
+  int max_batches = (cache->num_elements + batch_size - 1) / batch_size + 1;
+  replog_batch_t *batches = malloc(sizeof(replog_batch_t) * max_batches);
+  for (int i = 0; i < max_batches; i++) {
+    batches[i] = create_batch();
+    batch_reset(&batches[i], log_id, seq);
+  }
+
+  int i = 0;
+  for (lru_entry_t *entry = cache->tail; entry != NULL;
+       entry = entry->lru_prev) {
+    if (entry->expires_at != 0 && entry->expires_at <= now)
+      continue;
+    if (batches[i].num_records == batch_size)
+      i++;
+    batch_add(&batches[i], entry->key, entry->value, entry->version);
+  }
+
+  // The batches after the terminator stay unused.
+  *num_batches = batches[i].num_records == 0 ? i + 1 : i + 2;
+  for (i = 0; i < max_batches; i++) {
+    if (i < *num_batches)
+      batch_seal(&batches[i]);
+    else
+      destroy_batch(&batches[i]);
+  }
+  return batches;
+}
+
+/**
+ * @brief Unpacks the header of a batch.
+ *
+ * @param buf - uint8_t *
+ * @param log_id - uint64_t *
+ * @param first_seq - uint64_t *
+ * @param num_records - uint32_t *
+ * @return the size of the header.
+ */
+int unpack_batch_header(uint8_t *buf, uint64_t *log_id, uint64_t *first_seq,
+                        uint32_t *num_records) {
+  unpack_long(log_id, buf);
+  unpack_long(first_seq, buf + sizeof(*log_id));
+  *num_records = ntohl(*(uint32_t *)(buf + sizeof(uint64_t) * 2));
+  return BATCH_HEADER_SIZE;
+}
+
+/**
+ * @brief Unpacks a single record from a batch.
+ *
+ * NOTE: The key is allocated on the heap.
+ *
+ * @param buf - uint8_t *
+ * @param key - char **
+ * @param value - int *
+ * @param version - uint64_t *
+ * @return the number of bytes the record occupies in the buffer.
+ */
+int unpack_record(uint8_t *buf, char **key, int *value, uint64_t *version) {
+  uint32_t key_len = ntohl(*(uint32_t *)buf);
+  unpack_string_int(key, value, buf);
+  unpack_long(version, buf + sizeof(key_len) + key_len + sizeof(*value));
+  return sizeof(key_len) + key_len + sizeof(*value) + sizeof(*version);
+}
@@ -0,0 +1,62 @@
+#ifndef __REPLOG_H__
+#define __REPLOG_H__
+
+#include "../lru/lru.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Size of the batch header [ log_id | first_seq | num_records ].
+#define BATCH_HEADER_SIZE (sizeof(uint64_t) * 2 + sizeof(uint32_t))
+
+// A packed replication record on the format
+// [ key_len | key | value | version ].
+typedef struct {
+  uint8_t *data;
+  uint32_t len;
+} replog_record_t;
+
+// Bounded ring of the most recent puts, shared by all follower streams.
+// Records are numbered by a monotonically increasing sequence number starting
+// at 1, a sequence number of 0 means "nothing applied".
+typedef struct {
+  uint64_t id; // identifies the history, changes when the master restarts.
+  replog_record_t *records;
+  size_t capacity;
+
+  // Sequence number of the last appended record.
+  uint64_t head;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} replog_t;
+
+// A batch of records, ready to be sent as a frame payload on the format
+// [ log_id | first_seq | num_records | record ... ].
+typedef struct {
+  uint8_t *buf;
+  size_t buf_len;
+  size_t buf_cap;
+  uint32_t num_records;
+} replog_batch_t;
+
+replog_t *create_replog(size_t, uint64_t);
+void destroy_replog(replog_t *);
+
+uint64_t replog_append(replog_t *, char *, int, uint64_t);
+uint64_t replog_head(replog_t *);
+int replog_contains(replog_t *, uint64_t, uint64_t);
+int replog_read(replog_t *, uint64_t *, replog_batch_t *, uint32_t, int);
+void replog_reset(replog_t *, uint64_t, uint64_t);
+
+replog_batch_t create_batch();
+void destroy_batch(replog_batch_t *);
+int batch_reset(replog_batch_t *, uint64_t, uint64_t);
+int batch_add(replog_batch_t *, char *, int, uint64_t);
+void batch_seal(replog_batch_t *);
+replog_batch_t *replog_snapshot(lru_cache_t *, uint64_t, uint64_t, uint32_t,
+                                uint64_t, int *);
+int unpack_batch_header(uint8_t *, uint64_t *, uint64_t *, uint32_t *);
+int unpack_record(uint8_t *, char **, int *, uint64_t *);
+
+#endif // __REPLOG_H__
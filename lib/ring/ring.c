@@ -0,0 +1,724 @@
+#include "ring.h"
+#include "../cproto/cproto.h"
+#include <arpa/inet.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+// [ epoch | num_shards | num_rings | num_cnfs ]
+#define MAP_HEADER_SIZE (sizeof(uint64_t) + 3 * sizeof(uint32_t))
+// [ addr | port | load ]
+#define MAP_ADDR_SIZE (2 * sizeof(uint32_t) + sizeof(uint16_t))
+// [ id | addr | port | load | num_flwrs ]
+#define MAP_SHARD_SIZE (sizeof(uint32_t) + MAP_ADDR_SIZE + sizeof(uint16_t))
+// [ placement | num_members ]
+#define MAP_RING_SIZE (2 * sizeof(uint32_t))
+// [ owner | weight | overloaded ]
+#define MAP_MEMBER_SIZE (3 * sizeof(uint32_t))
+
+static const char *placement_names[NUM_PLACEMENTS] = {"ring", "jump",
+                                                      "rendezvous"};
+
+/* ----------- HELPERS ------------------------*/
+
+/**
+ * @brief Finalizer of MurmurHash3, spreads similar inputs over the whole
+ * ring.
+ *
+ * @param h - uint32_t
+ * @return uint32_t
+ */
+uint32_t mix32(uint32_t h) {
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return h;
+}
+
+/**
+ * @brief Finalizer of SplitMix64, spreads similar inputs over all 64 bits.
+ *
+ * @param h - uint64_t
+ * @return uint64_t
+ */
+uint64_t mix64(uint64_t h) {
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111eb;
+  h ^= h >> 31;
+  return h;
+}
+
+/**
+ * @brief Jump consistent hash (Lamping and Veach), maps a key to one of
+ * `num_buckets` buckets. Growing the number of buckets by one only moves a
+ * share of the keys to the new bucket.
+ *
+ * @param key - uint64_t
+ * @param num_buckets - size_t
+ * @return the bucket.
+ */
+size_t jump_hash(uint64_t key, size_t num_buckets) {
+  int64_t b = -1, j = 0;
+  while (j < (int64_t)num_buckets) {
+    b = j;
+    key = key * 2862933555777866757ULL + 1;
+    j = (b + 1) * ((double)(1LL << 31) / (double)((key >> 33) + 1));
+  }
+  return b;
+}
+
+/**
+ * @brief Whether keys spill past overloaded members. Overloaded members are
+ * only skipped while some member is not, so that every key has an owner.
+ *
+ * @param ring - ring_t *
+ * @return bool
+ */
+bool spills(ring_t *ring) {
+  return ring->num_overloaded > 0 && ring->num_overloaded < ring->num_members;
+}
+
+/**
+ * @brief Whether a master shard is overloaded.
+ *
+ * @param ring - ring_t *
+ * @param owner - uint32_t
+ * @return bool
+ */
+bool is_overloaded(ring_t *ring, uint32_t owner) {
+  for (size_t i = 0; i < ring->num_members; i++) {
+    if (ring->members[i].owner == owner)
+      return ring->members[i].overloaded;
+  }
+  return false;
+}
+
+/**
+ * @brief Jump consistent hash over the members. The key of an overloaded
+ * member is rehashed until it lands on one that is not, so spilled keys are
+ * spread over all other members, with a scan as the last resort.
+ *
+ * @param ring - ring_t *, with at least one member.
+ * @param key - uint64_t
+ * @return the owner.
+ */
+uint32_t jump_owner(ring_t *ring, uint64_t key) {
+  size_t bucket = jump_hash(key, ring->num_members);
+  if (!spills(ring))
+    return ring->members[bucket].owner;
+
+  for (size_t i = 1; ring->members[bucket].overloaded; i++) {
+    if (i <= ring->num_members) {
+      key = mix64(key + i);
+      bucket = jump_hash(key, ring->num_members);
+    } else {
+      bucket = (bucket + 1) % ring->num_members;
+    }
+  }
+  return ring->members[bucket].owner;
+}
+
+/**
+ * @brief Weighted rendezvous hashing, the member with the highest score for
+ * the key owns it. Scores are `-weight / ln(u)` for a uniform `u` in (0, 1)
+ * drawn from the key and the member, so a member owns a share of the keys
+ * in proportion to its weight. Overloaded members are passed over.
+ *
+ * @param ring - ring_t *, with at least one member.
+ * @param key - uint64_t
+ * @return the owner.
+ */
+uint32_t rendezvous_owner(ring_t *ring, uint64_t key) {
+  uint32_t owner = ring->members[0].owner;
+  double best = -INFINITY;
+  bool spill = spills(ring);
+  for (size_t i = 0; i < ring->num_members; i++) {
+    ring_member_t *member = &ring->members[i];
+    if (spill && member->overloaded)
+      continue;
+    uint64_t h = mix64(key ^ mix64(member->owner));
+    double u = ((h >> 11) + 0.5) / (double)(1ULL << 53);
+    double score = -(double)member->weight / log(u);
+    if (score > best) {
+      best = score;
+      owner = member->owner;
+    }
+  }
+  return owner;
+}
+
+/**
+ * @brief Adds the virtual nodes of a master shard, without sorting them.
+ *
+ * @param ring - ring_t *
+ * @param owner - uint32_t
+ * @param num_vnodes - uint32_t
+ */
+void add_vnodes(ring_t *ring, uint32_t owner, uint32_t num_vnodes) {
+  ring->vnodes =
+      realloc(ring->vnodes, sizeof(vnode_t) * (ring->num_vnodes + num_vnodes));
+  for (uint32_t i = 0; i < num_vnodes; i++) {
+    ring->vnodes[ring->num_vnodes++] =
+        (vnode_t){.hash = mix32(mix32(owner) + i), .owner = owner};
+  }
+}
+
+/**
+ * @brief Comparator for `vnode_t` meant to be used in `qsort`, ties are broken
+ * by the owner so that every ring with the same shards has the same order.
+ *
+ * @param a - void *
+ * @param b - void *
+ * @return 1 if a > b, -1 if a < b, 0 otherwise.
+ */
+int compare_vnodes(const void *a, const void *b) {
+  vnode_t *x = (vnode_t *)a;
+  vnode_t *y = (vnode_t *)b;
+  if (x->hash != y->hash)
+    return x->hash > y->hash ? 1 : -1;
+  if (x->owner != y->owner)
+    return x->owner > y->owner ? 1 : -1;
+  return 0;
+}
+
+/**
+ * @brief Packs the location of a shard.
+ *
+ * @param addr - ring_addr_t *
+ * @param buf - uint8_t *
+ * @return the number of packed bytes.
+ */
+size_t pack_addr(ring_addr_t *addr, uint8_t *buf) {
+  memcpy(buf, &addr->addr, sizeof(uint32_t)); // already in network order.
+  pack_short(addr->port, buf + sizeof(uint32_t));
+  uint32_t n_load = htonl(addr->load);
+  memcpy(buf + sizeof(uint32_t) + sizeof(uint16_t), &n_load, sizeof(n_load));
+  return MAP_ADDR_SIZE;
+}
+
+/**
+ * @brief Unpacks the location of a shard.
+ *
+ * @param addr - ring_addr_t *
+ * @param buf - uint8_t *
+ * @return the number of unpacked bytes.
+ */
+size_t unpack_addr(ring_addr_t *addr, uint8_t *buf) {
+  memcpy(&addr->addr, buf, sizeof(uint32_t));
+  unpack_short(&addr->port, buf + sizeof(uint32_t));
+  memcpy(&addr->load, buf + sizeof(uint32_t) + sizeof(uint16_t),
+         sizeof(addr->load));
+  addr->load = ntohl(addr->load);
+  return MAP_ADDR_SIZE;
+}
+
+/**
+ * @brief Packs the members of a ring, the virtual nodes are derived from
+ * them.
+ *
+ * @param ring - ring_t *
+ * @param buf - uint8_t *
+ * @return the number of packed bytes.
+ */
+size_t pack_ring(ring_t *ring, uint8_t *buf) {
+  pack_int_int(ring->placement, ring->num_members, buf);
+  for (size_t i = 0; i < ring->num_members; i++) {
+    uint8_t *p = buf + MAP_RING_SIZE + i * MAP_MEMBER_SIZE;
+    pack_int_int(ring->members[i].owner, ring->members[i].weight, p);
+    *(uint32_t *)(p + 2 * sizeof(uint32_t)) =
+        htonl(ring->members[i].overloaded);
+  }
+  return MAP_RING_SIZE + ring->num_members * MAP_MEMBER_SIZE;
+}
+
+/**
+ * @brief Unpacks a ring packed by `pack_ring`.
+ *
+ * @param ring - ring_t **
+ * @param buf - uint8_t *
+ * @param len - size_t, the number of bytes left in the buffer.
+ * @return -1 if the buffer is malformed, the number of unpacked bytes
+ * otherwise.
+ */
+long unpack_ring(ring_t **ring, uint8_t *buf, size_t len) {
+  uint32_t placement, num_members;
+  if (len < MAP_RING_SIZE)
+    return -1;
+  unpack_int_int(&placement, &num_members, buf);
+  if (placement >= NUM_PLACEMENTS ||
+      (len - MAP_RING_SIZE) / MAP_MEMBER_SIZE < num_members)
+    return -1;
+
+  *ring = create_ring(placement);
+  (*ring)->members = malloc(sizeof(ring_member_t) * num_members);
+  for (uint32_t i = 0; i < num_members; i++) {
+    ring_member_t *member = &(*ring)->members[i];
+    uint8_t *p = buf + MAP_RING_SIZE + i * MAP_MEMBER_SIZE;
+    unpack_int_int(&member->owner, &member->weight, p);
+    member->overloaded = ntohl(*(uint32_t *)(p + 2 * sizeof(uint32_t))) != 0;
+    (*ring)->num_overloaded += member->overloaded;
+    if (placement == PlacementRing)
+      add_vnodes(*ring, member->owner, member->weight);
+  }
+  (*ring)->num_members = num_members;
+  qsort((*ring)->vnodes, (*ring)->num_vnodes, sizeof(vnode_t),
+        compare_vnodes);
+  return MAP_RING_SIZE + num_members * MAP_MEMBER_SIZE;
+}
+
+/* ----------- EXTERNAL API -------------------*/
+
+/**
+ * @brief Creates an empty ring.
+ *
+ * @param placement - Placement
+ * @return pointer to the ring.
+ */
+ring_t *create_ring(Placement placement) {
+  ring_t *ring = malloc(sizeof(ring_t));
+  ring->placement = placement;
+  ring->members = NULL;
+  ring->num_members = 0;
+  ring->num_overloaded = 0;
+  ring->vnodes = NULL;
+  ring->num_vnodes = 0;
+  return ring;
+}
+
+/**
+ * @brief Frees the memory of a ring.
+ *
+ * @param ring - ring_t *
+ */
+void destroy_ring(ring_t *ring) {
+  free(ring->members);
+  free(ring->vnodes);
+  free(ring);
+}
+
+/**
+ * @brief Copies a ring, e.g. to keep it around after the ring has changed.
+ *
+ * @param ring - ring_t *
+ * @return pointer to the copy.
+ */
+ring_t *copy_ring(ring_t *ring) {
+  ring_t *copy = create_ring(ring->placement);
+  copy->members = malloc(sizeof(ring_member_t) * ring->num_members);
+  memcpy(copy->members, ring->members,
+         sizeof(ring_member_t) * ring->num_members);
+  copy->num_members = ring->num_members;
+  copy->num_overloaded = ring->num_overloaded;
+  copy->vnodes = malloc(sizeof(vnode_t) * ring->num_vnodes);
+  memcpy(copy->vnodes, ring->vnodes, sizeof(vnode_t) * ring->num_vnodes);
+  copy->num_vnodes = ring->num_vnodes;
+  return copy;
+}
+
+/**
+ * @brief Parses the name of a placement, e.g. "jump".
+ *
+ * @param name - const char *
+ * @param placement - Placement *
+ * @return -1 if the name is unknown, 0 otherwise.
+ */
+int parse_placement(const char *name, Placement *placement) {
+  for (int i = 0; i < NUM_PLACEMENTS; i++) {
+    if (strcasecmp(name, placement_names[i]) == 0) {
+      *placement = i;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/**
+ * @brief Returns the name of a placement.
+ *
+ * @param placement - Placement
+ * @return const char *
+ */
+const char *placement_name(Placement placement) {
+  return placement < NUM_PLACEMENTS ? placement_names[placement] : "unknown";
+}
+
+/**
+ * @brief Hashes a key to 64 bits with FNV-1a, finalized so that keys that only
+ * differ in their last byte still spread over all bits.
+ *
+ * @param key - const char *
+ * @return uint64_t
+ */
+uint64_t ring_hash64(const char *key) {
+  uint64_t hash = 0xcbf29ce484222325;
+  for (const char *c = key; *c != '\0'; c++) {
+    hash ^= (uint8_t)*c;
+    hash *= 0x100000001b3;
+  }
+  return mix64(hash);
+}
+
+/**
+ * @brief Hashes a key to its position on the ring.
+ *
+ * @param key - const char *
+ * @return uint32_t
+ */
+uint32_t ring_hash(const char *key) {
+  uint64_t hash = ring_hash64(key);
+  return hash ^ (hash >> 32);
+}
+
+/**
+ * @brief Adds a master shard to the ring. On a consistent hashing ring the
+ * shard gets `weight` virtual nodes, whose positions only depend on the id
+ * of the shard, so re-adding a shard restores its ranges.
+ *
+ * @param ring - ring_t *
+ * @param owner - uint32_t, id of the master shard.
+ * @param weight - int
+ */
+void ring_add(ring_t *ring, uint32_t owner, int weight) {
+  ring->members = realloc(ring->members,
+                          sizeof(ring_member_t) * (ring->num_members + 1));
+  ring->members[ring->num_members++] =
+      (ring_member_t){.owner = owner, .weight = weight, .overloaded = false};
+
+  if (ring->placement == PlacementRing) {
+    add_vnodes(ring, owner, weight);
+    qsort(ring->vnodes, ring->num_vnodes, sizeof(vnode_t), compare_vnodes);
+  }
+}
+
+/**
+ * @brief Removes a master shard from the ring. Its keys move to the shards
+ * that follow its virtual nodes on a consistent hashing ring, and are spread
+ * over all shards with rendezvous hashing.
+ *
+ * With jump consistent hash the last shard to join takes the place of the
+ * removed one, so the keys of both shards move.
+ *
+ * @param ring - ring_t *
+ * @param owner - uint32_t, id of the master shard.
+ */
+void ring_remove(ring_t *ring, uint32_t owner) {
+  for (size_t i = 0; i < ring->num_members; i++) {
+    if (ring->members[i].owner == owner) {
+      ring->num_overloaded -= ring->members[i].overloaded;
+      ring->members[i] = ring->members[--ring->num_members];
+      break;
+    }
+  }
+
+  size_t kept = 0;
+  for (size_t i = 0; i < ring->num_vnodes; i++) {
+    if (ring->vnodes[i].owner != owner)
+      ring->vnodes[kept++] = ring->vnodes[i];
+  }
+  ring->num_vnodes = kept;
+}
+
+/**
+ * @brief Marks a master shard as overloaded, or as no longer overloaded.
+ * Keys skip overloaded shards as long as at least one shard is not.
+ *
+ * @param ring - ring_t *
+ * @param owner - uint32_t, id of the master shard.
+ * @param overloaded - bool
+ * @return -1 if the shard is not on the ring, 1 if the mark changed, 0
+ * otherwise.
+ */
+int ring_set_overloaded(ring_t *ring, uint32_t owner, bool overloaded) {
+  for (size_t i = 0; i < ring->num_members; i++) {
+    ring_member_t *member = &ring->members[i];
+    if (member->owner != owner)
+      continue;
+    if (member->overloaded == overloaded)
+      return 0;
+    member->overloaded = overloaded;
+    if (overloaded)
+      ring->num_overloaded++;
+    else
+      ring->num_overloaded--;
+    return 1;
+  }
+  return -1;
+}
+
+/**
+ * @brief Finds the owner of a key. On a consistent hashing ring it is the
+ * owner of the first virtual node at or after the hash of the key, wrapping
+ * around to the first virtual node. Keys of overloaded shards go to the
+ * owner of the next virtual node that is not overloaded.
+ *
+ * @param ring - ring_t *
+ * @param key - const char *
+ * @param owner - uint32_t *
+ * @return -1 if the ring is empty, 0 otherwise.
+ */
+int ring_lookup(ring_t *ring, const char *key, uint32_t *owner) {
+  if (ring->num_members == 0)
+    return -1;
+
+  switch (ring->placement) {
+  case PlacementJump:
+    *owner = jump_owner(ring, ring_hash64(key));
+    return 0;
+  case PlacementRendezvous:
+    *owner = rendezvous_owner(ring, ring_hash64(key));
+    return 0;
+  default:
+    break;
+  }
+
+  if (ring->num_vnodes == 0)
+    return -1;
+  uint32_t hash = ring_hash(key);
+
+  // Binary search to find the first vnode.hash >= hash.
+  size_t start = 0, end = ring->num_vnodes;
+  while (start < end) {
+    size_t middle = start + (end - start) / 2;
+    if (ring->vnodes[middle].hash < hash) {
+      start = middle + 1;
+    } else {
+      end = middle;
+    }
+  }
+
+  size_t next = start % ring->num_vnodes;
+  if (spills(ring)) {
+    for (size_t i = 0; i < ring->num_vnodes; i++) {
+      if (!is_overloaded(ring, ring->vnodes[next].owner))
+        break;
+      next = (next + 1) % ring->num_vnodes;
+    }
+  }
+  *owner = ring->vnodes[next].owner;
+  return 0;
+}
+
+/**
+ * @brief Serializes a ring map into a buffer of bytes on the format
+ *
+ * [ epoch | num_shards | num_rings | num_cnfs | shards | cnfs | ring |
+ *   prev_ring ]
+ * - a shard is [ id | addr | port | load | num_flwrs | flwrs ]
+ * - a follower or a replica of the configuration service is
+ *   [ addr | port | load ]
+ * - a ring is [ placement | num_members | members ], where a member is
+ *   [ owner | weight | overloaded ]. Virtual nodes are derived from the
+ *   members.
+ * - the previous ring is only packed while keys migrate (num_rings is 2).
+ * - numbers are Big-endian, ports and the number of followers are 16 bit.
+ *
+ * NOTE: Allocates memory for the buffer on the heap.
+ *
+ * @param map - ring_map_t *
+ * @param buf - uint8_t **
+ * @return the size of the buffer.
+ */
+int pack_ring_map(ring_map_t *map, uint8_t **buf) {
+  uint32_t num_rings = map->prev_ring == NULL ? 1 : 2;
+  size_t size = MAP_HEADER_SIZE + MAP_RING_SIZE +
+                map->ring->num_members * MAP_MEMBER_SIZE;
+  if (map->prev_ring != NULL)
+    size += MAP_RING_SIZE + map->prev_ring->num_members * MAP_MEMBER_SIZE;
+  for (size_t i = 0; i < map->num_shards; i++)
+    size += MAP_SHARD_SIZE + map->shards[i].num_flwrs * MAP_ADDR_SIZE;
+  size += map->num_cnfs * MAP_ADDR_SIZE;
+
+  uint8_t *p = *buf = malloc(size);
+  pack_long(map->epoch, p);
+  pack_int_int(map->num_shards, num_rings, p + sizeof(uint64_t));
+  uint32_t n_num_cnfs = htonl(map->num_cnfs);
+  memcpy(p + MAP_HEADER_SIZE - sizeof(n_num_cnfs), &n_num_cnfs,
+         sizeof(n_num_cnfs));
+  p += MAP_HEADER_SIZE;
+
+  for (size_t i = 0; i < map->num_shards; i++) {
+    ring_shard_t *shard = &map->shards[i];
+    uint32_t n_id = htonl(shard->id);
+    memcpy(p, &n_id, sizeof(n_id));
+    p += sizeof(n_id) + pack_addr(&shard->mstr, p + sizeof(n_id));
+    pack_short(shard->num_flwrs, p);
+    p += sizeof(uint16_t);
+    for (int j = 0; j < shard->num_flwrs; j++)
+      p += pack_addr(&shard->flwrs[j], p);
+  }
+  for (size_t i = 0; i < map->num_cnfs; i++)
+    p += pack_addr(&map->cnfs[i], p);
+
+  p += pack_ring(map->ring, p);
+  if (map->prev_ring != NULL)
+    pack_ring(map->prev_ring, p);
+  return size;
+}
+
+/**
+ * @brief Deserializes a ring map packed by `pack_ring_map`.
+ *
+ * NOTE: The map is allocated on the heap.
+ *
+ * @param buf - uint8_t *
+ * @param len - uint32_t
+ * @return pointer to the map, NULL if the buffer is malformed.
+ */
+ring_map_t *unpack_ring_map(uint8_t *buf, uint32_t len) {
+  uint8_t *p = buf, *end = buf + len;
+  uint32_t num_shards, num_rings, num_cnfs;
+  if (len < MAP_HEADER_SIZE)
+    return NULL;
+
+  unpack_int_int(&num_shards, &num_rings, buf + sizeof(uint64_t));
+  num_cnfs = ntohl(*(uint32_t *)(buf + MAP_HEADER_SIZE - sizeof(uint32_t)));
+  if (num_rings < 1 || num_rings > 2)
+    return NULL;
+
+  ring_map_t *map = calloc(1, sizeof(ring_map_t));
+  unpack_long(&map->epoch, p);
+  p += MAP_HEADER_SIZE;
+
+  map->shards = calloc(num_shards, sizeof(ring_shard_t));
+  for (; map->num_shards < num_shards; map->num_shards++) {
+    ring_shard_t *shard = &map->shards[map->num_shards];
+    if (end - p < (long)MAP_SHARD_SIZE)
+      goto malformed;
+
+    shard->id = ntohl(*(uint32_t *)p);
+    p += sizeof(uint32_t) + unpack_addr(&shard->mstr, p + sizeof(uint32_t));
+    uint16_t num_flwrs;
+    unpack_short(&num_flwrs, p);
+    p += sizeof(uint16_t);
+    if (end - p < (long)(num_flwrs * MAP_ADDR_SIZE))
+      goto malformed;
+
+    shard->flwrs = malloc(sizeof(ring_addr_t) * num_flwrs);
+    for (shard->num_flwrs = 0; shard->num_flwrs < num_flwrs;
+         shard->num_flwrs++)
+      p += unpack_addr(&shard->flwrs[shard->num_flwrs], p);
+  }
+
+  if ((size_t)(end - p) / MAP_ADDR_SIZE < num_cnfs)
+    goto malformed;
+  map->cnfs = malloc(sizeof(ring_addr_t) * num_cnfs);
+  for (; map->num_cnfs < num_cnfs; map->num_cnfs++)
+    p += unpack_addr(&map->cnfs[map->num_cnfs], p);
+
+  long n = unpack_ring(&map->ring, p, end - p);
+  if (n == -1)
+    goto malformed;
+  p += n;
+  if (num_rings == 2) {
+    if ((n = unpack_ring(&map->prev_ring, p, end - p)) == -1)
+      goto malformed;
+    p += n;
+  }
+  if (p != end)
+    goto malformed;
+  return map;
+
+malformed:
+  destroy_ring_map(map);
+  return NULL;
+}
+
+/**
+ * @brief Frees the memory of a ring map, including its ring.
+ *
+ * @param map - ring_map_t *
+ */
+void destroy_ring_map(ring_map_t *map) {
+  for (size_t i = 0; i < map->num_shards; i++)
+    free(map->shards[i].flwrs);
+  free(map->shards);
+  free(map->cnfs);
+  if (map->ring != NULL)
+    destroy_ring(map->ring);
+  if (map->prev_ring != NULL)
+    destroy_ring(map->prev_ring);
+  free(map);
+}
+
+/**
+ * @brief Finds the master shard that owns a key.
+ *
+ * @param map - ring_map_t *
+ * @param key - const char *
+ * @return pointer to the shard, NULL if there is no shard.
+ */
+ring_shard_t *ring_map_lookup(ring_map_t *map, const char *key) {
+  uint32_t id;
+  if (ring_lookup(map->ring, key, &id) == -1)
+    return NULL;
+  return ring_map_find(map, id);
+}
+
+/**
+ * @brief Finds the master shard that owned a key before the ring changed.
+ *
+ * @param map - ring_map_t *
+ * @param key - const char *
+ * @return pointer to the shard, NULL if no keys are migrating or the key did
+ * not change owner.
+ */
+ring_shard_t *ring_map_lookup_prev(ring_map_t *map, const char *key) {
+  uint32_t id, prev_id;
+  if (map->prev_ring == NULL ||
+      ring_lookup(map->prev_ring, key, &prev_id) == -1)
+    return NULL;
+  if (ring_lookup(map->ring, key, &id) == 0 && id == prev_id)
+    return NULL;
+  return ring_map_find(map, prev_id);
+}
+
+/**
+ * @brief Picks the replica of a shard to read from with the power of two
+ * choices, the less loaded of two replicas drawn at random. Unlike always
+ * picking the least loaded replica, clients that share the same stale loads
+ * do not all pile onto the same replica.
+ *
+ * @param shard - ring_shard_t *
+ * @param r - uint32_t, a random number.
+ * @return pointer to the master or to one of its followers.
+ */
+ring_addr_t *ring_shard_replica(ring_shard_t *shard, uint32_t r) {
+  int num_replicas = shard->num_flwrs + 1;
+  if (num_replicas == 1)
+    return &shard->mstr;
+
+  // Two distinct replicas, where 0 is the master.
+  int a = r % num_replicas;
+  int b = (a + 1 + (r / num_replicas) % (num_replicas - 1)) % num_replicas;
+  ring_addr_t *x = a == 0 ? &shard->mstr : &shard->flwrs[a - 1];
+  ring_addr_t *y = b == 0 ? &shard->mstr : &shard->flwrs[b - 1];
+  return y->load < x->load ? y : x;
+}
+
+/**
+ * @brief Finds a master shard by id using binary search.
+ *
+ * @param map - ring_map_t *
+ * @param id - uint32_t
+ * @return pointer to the shard, NULL if the shard could not be found.
+ */
+ring_shard_t *ring_map_find(ring_map_t *map, uint32_t id) {
+  // Binary search to find the shard with the id.
+  size_t start = 0, end = map->num_shards;
+  while (start < end) {
+    size_t middle = start + (end - start) / 2;
+    if (map->shards[middle].id == id)
+      return &map->shards[middle];
+    if (map->shards[middle].id < id) {
+      start = middle + 1;
+    } else {
+      end = middle;
+    }
+  }
+  return NULL;
+}
@@ -0,0 +1,114 @@
+#ifndef __RING_H__
+#define __RING_H__
+
+#include "../hashing/hashing.h"
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// How keys are placed on the master shards.
+//
+// - PlacementRing: consistent hashing ring where every master shard owns
+//   `weight` virtual nodes, lookups are O(log vnodes).
+// - PlacementJump: jump consistent hash over the shards in order of joining,
+//   O(1) memory and near-perfect balance but weights are ignored, best for
+//   clusters of equal shards that rarely change.
+// - PlacementRendezvous: weighted rendezvous (highest random weight)
+//   hashing, lookups are O(shards) but only the keys of a shard that leaves
+//   move.
+//
+// With bounded loads, keys of a shard that is marked as overloaded spill to
+// the next shard, which is the next virtual node on the ring, the next bucket
+// of a rehash with jump consistent hash, and the runner-up with rendezvous
+// hashing.
+typedef enum {
+  PlacementRing,
+  PlacementJump,
+  PlacementRendezvous,
+  NUM_PLACEMENTS,
+} Placement;
+
+// A point on the consistent hashing ring, owned by a master shard.
+typedef struct {
+  uint32_t hash;
+  uint32_t owner; // id of the master shard.
+} vnode_t;
+
+// A master shard that keys are placed on.
+typedef struct {
+  uint32_t owner; // id of the master shard.
+  uint32_t weight;
+  bool overloaded; // its keys spill to the next shard.
+} ring_member_t;
+
+// The master shards that keys are placed on, and how. Named after the
+// consistent hashing ring that it started out as.
+//
+// NOTE: Is not thread safe.
+typedef struct {
+  Placement placement;
+  ring_member_t *members; // in order of joining, see `ring_remove`.
+  size_t num_members;
+  size_t num_overloaded;
+  vnode_t *vnodes; // ALWAYS in order of hashes, only used by PlacementRing.
+  size_t num_vnodes;
+} ring_t;
+
+// Network location of a shard.
+typedef struct {
+  struct in_addr addr;
+  in_port_t port;
+  uint32_t load; // requests per second, as of the last heartbeat.
+} ring_addr_t;
+
+// A master shard and its followers.
+typedef struct {
+  uint32_t id;
+  ring_addr_t mstr;
+  int num_flwrs;
+  ring_addr_t *flwrs;
+} ring_shard_t;
+
+// Everything a client needs to route keys without asking the configuration
+// service. The epoch changes whenever the ring or the shards change, but not
+// when only the loads of the shards change.
+//
+// While keys migrate to their new owners after a change of the ring, the map
+// also holds the ring from before the change, so that the old owner of a key
+// can still be read from.
+//
+// The map also lists the read-only replicas of the configuration service,
+// which serve the same map, so that clients spread their refreshes over them.
+typedef struct {
+  uint64_t epoch;
+  ring_t *ring;
+  ring_t *prev_ring;    // NULL when no keys are migrating.
+  ring_shard_t *shards; // ALWAYS in order of ids, masters of both rings.
+  size_t num_shards;
+  ring_addr_t *cnfs; // replicas of the configuration service, without load.
+  size_t num_cnfs;
+} ring_map_t;
+
+ring_t *create_ring(Placement);
+void destroy_ring(ring_t *);
+ring_t *copy_ring(ring_t *);
+int parse_placement(const char *, Placement *);
+const char *placement_name(Placement);
+
+uint64_t ring_hash64(const char *);
+uint32_t ring_hash(const char *);
+void ring_add(ring_t *, uint32_t, int);
+void ring_remove(ring_t *, uint32_t);
+int ring_set_overloaded(ring_t *, uint32_t, bool);
+int ring_lookup(ring_t *, const char *, uint32_t *);
+
+int pack_ring_map(ring_map_t *, uint8_t **);
+ring_map_t *unpack_ring_map(uint8_t *, uint32_t);
+void destroy_ring_map(ring_map_t *);
+ring_shard_t *ring_map_lookup(ring_map_t *, const char *);
+ring_shard_t *ring_map_lookup_prev(ring_map_t *, const char *);
+ring_shard_t *ring_map_find(ring_map_t *, uint32_t);
+ring_addr_t *ring_shard_replica(ring_shard_t *, uint32_t);
+
+#endif // __RING_H__
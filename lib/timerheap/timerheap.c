@@ -0,0 +1,138 @@
+#include "timerheap.h"
+#include <stdlib.h>
+
+/* ----------- HELPERS ------------------------*/
+
+/**
+ * @brief Swaps two timers of the heap.
+ *
+ * @param heap - timer_heap_t *
+ * @param i - size_t
+ * @param j - size_t
+ */
+void swap_timers(timer_heap_t *heap, size_t i, size_t j) {
+  timer_entry_t tmp = heap->timers[i];
+  heap->timers[i] = heap->timers[j];
+  heap->timers[j] = tmp;
+}
+
+/**
+ * @brief Moves a timer up until its parent is not later than it.
+ *
+ * @param heap - timer_heap_t *
+ * @param i - size_t
+ */
+void sift_up(timer_heap_t *heap, size_t i) {
+  while (i > 0) {
+    size_t parent = (i - 1) / 2;
+    if (heap->timers[parent].deadline <= heap->timers[i].deadline)
+      return;
+    swap_timers(heap, i, parent);
+    i = parent;
+  }
+}
+
+/**
+ * @brief Moves a timer down until none of its children are earlier than it.
+ *
+ * @param heap - timer_heap_t *
+ * @param i - size_t
+ */
+void sift_down(timer_heap_t *heap, size_t i) {
+  while (1) {
+    size_t left = 2 * i + 1, right = left + 1, earliest = i;
+    if (left < heap->num_timers &&
+        heap->timers[left].deadline < heap->timers[earliest].deadline)
+      earliest = left;
+    if (right < heap->num_timers &&
+        heap->timers[right].deadline < heap->timers[earliest].deadline)
+      earliest = right;
+    if (earliest == i)
+      return;
+    swap_timers(heap, i, earliest);
+    i = earliest;
+  }
+}
+
+/* ----------- EXTERNAL API -------------------*/
+
+/**
+ * @brief Creates an empty timer heap, that grows when it is full.
+ *
+ * @param capacity - size_t, initial capacity.
+ * @return pointer to the heap.
+ */
+timer_heap_t *create_timer_heap(size_t capacity) {
+  timer_heap_t *heap = malloc(sizeof(timer_heap_t));
+  heap->capacity = capacity > 0 ? capacity : 1;
+  heap->timers = malloc(sizeof(timer_entry_t) * heap->capacity);
+  heap->num_timers = 0;
+  return heap;
+}
+
+/**
+ * @brief Frees the heap and its timers.
+ *
+ * @param heap - timer_heap_t *
+ */
+void destroy_timer_heap(timer_heap_t *heap) {
+  free(heap->timers);
+  free(heap);
+}
+
+/**
+ * @brief Adds a timer.
+ *
+ * @param heap - timer_heap_t *
+ * @param deadline - uint64_t
+ * @param id - uint64_t
+ * @return -1 if memory could not be allocated, 0 otherwise.
+ */
+int timer_push(timer_heap_t *heap, uint64_t deadline, uint64_t id) {
+  if (heap->num_timers == heap->capacity) {
+    timer_entry_t *timers =
+        realloc(heap->timers, sizeof(timer_entry_t) * heap->capacity * 2);
+    if (timers == NULL)
+      return -1;
+    heap->timers = timers;
+    heap->capacity *= 2;
+  }
+
+  heap->timers[heap->num_timers] =
+      (timer_entry_t){.deadline = deadline, .id = id};
+  sift_up(heap, heap->num_timers++);
+  return 0;
+}
+
+/**
+ * @brief Reads the timer with the earliest deadline, without removing it.
+ *
+ * @param heap - timer_heap_t *
+ * @param timer - timer_entry_t *
+ * @return -1 if the heap is empty, 0 otherwise.
+ */
+int timer_peek(timer_heap_t *heap, timer_entry_t *timer) {
+  if (heap->num_timers == 0)
+    return -1;
+
+  *timer = heap->timers[0];
+  return 0;
+}
+
+/**
+ * @brief Removes the timer with the earliest deadline, if it has expired.
+ *
+ * @param heap - timer_heap_t *
+ * @param now - uint64_t, timers with a deadline at or before it have expired.
+ * @param timer - timer_entry_t *
+ * @return -1 if no timer has expired, 0 otherwise.
+ */
+int timer_pop_expired(timer_heap_t *heap, uint64_t now, timer_entry_t *timer) {
+  if (heap->num_timers == 0 || heap->timers[0].deadline > now)
+    return -1;
+
+  *timer = heap->timers[0];
+  heap->timers[0] = heap->timers[--heap->num_timers];
+  sift_down(heap, 0);
+  return 0;
+}
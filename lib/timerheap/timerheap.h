@@ -0,0 +1,33 @@
+#ifndef __TIMERHEAP_H__
+#define __TIMERHEAP_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A deadline of something identified by `id`.
+typedef struct {
+  uint64_t deadline;
+  uint64_t id;
+} timer_entry_t;
+
+// Min-heap of timers, the earliest deadline is always at the root.
+//
+// Timers are never updated in place. Pushing a later deadline for the same id
+// leaves the earlier timer behind, and the owner is expected to skip timers
+// that no longer match its current deadline once they fire.
+//
+// NOTE: Is not thread safe.
+typedef struct {
+  timer_entry_t *timers;
+  size_t num_timers;
+  size_t capacity;
+} timer_heap_t;
+
+timer_heap_t *create_timer_heap(size_t);
+void destroy_timer_heap(timer_heap_t *);
+
+int timer_push(timer_heap_t *, uint64_t, uint64_t);
+int timer_peek(timer_heap_t *, timer_entry_t *);
+int timer_pop_expired(timer_heap_t *, uint64_t, timer_entry_t *);
+
+#endif // __TIMERHEAP_H__
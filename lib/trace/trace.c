@@ -0,0 +1,148 @@
+#include "trace.h"
+#include "../metrics/metrics.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+__thread bool trace_sampled = false;
+__thread uint32_t trace_request_type = 0;
+
+static const char *stage_names[NUM_STAGES] = {
+    "queue", "receive", "lock", "execute", "unlock", "send"};
+
+// Timestamps of the sampled request handled by the calling thread.
+static __thread uint64_t trace_start, stamps[NUM_STAGES];
+static __thread uint64_t rng_state = 0;
+
+// Sampled requests are rare, so they share a single file.
+static unsigned sample_rate = 0;
+static FILE *trace_file = NULL;
+static bool first_event = true;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* ----------- HELPERS ------------------------*/
+
+/**
+ * @brief Writes a complete event in the Chrome trace event format.
+ *
+ * NOTE: Is not thread safe, should be executed in critical section.
+ *
+ * @param name - const char *
+ * @param start - uint64_t, nanoseconds.
+ * @param end - uint64_t, nanoseconds.
+ * @param tid - long
+ */
+static void write_event(const char *name, uint64_t start, uint64_t end,
+                        long tid) {
+  fprintf(trace_file,
+          "%s{\"name\":\"%s\",\"cat\":\"canary\",\"ph\":\"X\",\"ts\":%.3f,"
+          "\"dur\":%.3f,\"pid\":%d,\"tid\":%ld,\"args\":{\"type\":%u}}",
+          first_event ? "" : ",\n", name, start / 1e3, (end - start) / 1e3,
+          getpid(), tid, trace_request_type);
+  first_event = false;
+}
+
+/**
+ * @brief Per thread xorshift generator, so that sampling does not contend on
+ * a shared counter and workers that handle few requests are still sampled.
+ *
+ * @return uint64_t
+ */
+static uint64_t next_random() {
+  if (rng_state == 0)
+    rng_state = (metrics_now() ^ ((uint64_t)syscall(SYS_gettid) << 32)) | 1;
+
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+/* ----------- EXTERNAL API -------------------*/
+
+/**
+ * @brief Enables sampling of 1 in `rate` requests at random. The stages of
+ * the sampled requests are written to `path` as a Chrome trace, which can be
+ * opened in chrome://tracing or Perfetto.
+ *
+ * @param path - const char *
+ * @param rate - unsigned
+ * @return -1 if the file could not be opened, 0 otherwise.
+ */
+int trace_open(const char *path, unsigned rate) {
+  FILE *file = fopen(path, "w");
+  if (file == NULL)
+    return -1;
+
+  // The closing bracket is optional in the JSON array format, so the trace
+  // stays valid if the process is killed.
+  fputs("[\n", file);
+  fflush(file);
+
+  pthread_mutex_lock(&trace_lock);
+  if (trace_file != NULL)
+    fclose(trace_file);
+  trace_file = file;
+  first_event = true;
+  sample_rate = rate;
+  pthread_mutex_unlock(&trace_lock);
+  return 0;
+}
+
+/**
+ * @brief Starts tracing a request on the calling thread, decides if it is
+ * sampled.
+ *
+ * @param start - uint64_t, when the request was enqueued.
+ */
+void trace_begin(uint64_t start) {
+  trace_request_type = 0;
+  trace_sampled = sample_rate != 0 && next_random() % sample_rate == 0;
+  if (!trace_sampled)
+    return;
+
+  trace_start = start;
+  memset(stamps, 0, sizeof(stamps));
+}
+
+/**
+ * @brief Records the end of a stage of the sampled request.
+ *
+ * NOTE: Use the `trace_stage` macro, which also fires the tracepoint.
+ *
+ * @param stage - TraceStage
+ */
+void trace_mark(TraceStage stage) { stamps[stage] = metrics_now(); }
+
+/**
+ * @brief Writes the request and the stages it went through to the trace.
+ * Stages that were skipped are left out.
+ */
+void trace_end() {
+  if (!trace_sampled)
+    return;
+  trace_sampled = false;
+
+  long tid = syscall(SYS_gettid);
+  uint64_t prev = trace_start, end = trace_start;
+  for (int i = 0; i < NUM_STAGES; i++) {
+    if (stamps[i] != 0)
+      end = stamps[i];
+  }
+
+  // BEGIN CRITICAL SECTION
+  pthread_mutex_lock(&trace_lock);
+  // The enclosing event goes first, so that viewers nest the stages in it.
+  write_event("request", trace_start, end, tid);
+  for (int i = 0; i < NUM_STAGES; i++) {
+    if (stamps[i] == 0)
+      continue;
+    write_event(stage_names[i], prev, stamps[i], tid);
+    prev = stamps[i];
+  }
+  fflush(trace_file);
+  pthread_mutex_unlock(&trace_lock);
+  // END CRITICAL SECTION
+}
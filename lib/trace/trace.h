@@ -0,0 +1,53 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Statically defined tracepoints for perf/bpftrace, e.g.
+// `bpftrace -e 'usdt:./bin/shard:canary:Lock { ... }'`. They compile to a
+// single nop, and to nothing when <sys/sdt.h> is not installed.
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_PROBE(name, arg) DTRACE_PROBE1(canary, name, arg)
+#endif
+#endif
+#ifndef TRACE_PROBE
+#define TRACE_PROBE(name, arg)                                                 \
+  do {                                                                         \
+  } while (0)
+#endif
+
+// Stages of handling a request, each stage ends at its timestamp.
+typedef enum {
+  StageDequeue, // waited in the connection queue.
+  StageReceive, // read the request.
+  StageLock,    // waited for the lock.
+  StageExecute, // operation under the lock.
+  StageUnlock,  // released the lock.
+  StageSend,    // wrote the response.
+  NUM_STAGES,
+} TraceStage;
+
+// Whether the request handled by the calling thread is sampled.
+extern __thread bool trace_sampled;
+
+// Fires the tracepoint of the stage, and records its timestamp if the request
+// is sampled. `stage` is the name without the `Stage` prefix.
+#define trace_stage(stage)                                                     \
+  do {                                                                         \
+    TRACE_PROBE(stage, trace_request_type);                                    \
+    if (trace_sampled)                                                         \
+      trace_mark(Stage##stage);                                                \
+  } while (0)
+
+// Message type of the request handled by the calling thread.
+extern __thread uint32_t trace_request_type;
+
+int trace_open(const char *, unsigned);
+void trace_begin(uint64_t);
+void trace_mark(TraceStage);
+void trace_end();
+
+#endif // __TRACE_H__
@@ -0,0 +1,124 @@
+#include "watch.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* ----------- HELPERS ------------------------*/
+
+/**
+ * @brief Finds the link that points to the watch of a key, or to the end of
+ * its bucket if the key is not watched.
+ *
+ * @param table - watch_table_t *
+ * @param key - char *
+ * @return pointer to the link.
+ */
+watch_t **find_watch(watch_table_t *table, char *key) {
+  watch_t **link = &table->buckets[hash_djb2(key) % table->num_buckets];
+  while (*link != NULL && strcmp((*link)->key, key) != 0)
+    link = &(*link)->next;
+  return link;
+}
+
+/* ----------- EXTERNAL API -------------------*/
+
+/**
+ * @brief Creates an empty watch table.
+ *
+ * @param num_buckets - size_t
+ * @param max_watchers - size_t, watchers of all keys together.
+ * @return pointer to the table.
+ */
+watch_table_t *create_watch_table(size_t num_buckets, size_t max_watchers) {
+  watch_table_t *table = malloc(sizeof(watch_table_t));
+  table->buckets = calloc(num_buckets, sizeof(watch_t *));
+  table->num_buckets = num_buckets;
+  table->num_watchers = 0;
+  table->max_watchers = max_watchers;
+  return table;
+}
+
+/**
+ * @brief Frees the table and all of its watches.
+ *
+ * @param table - watch_table_t *
+ */
+void destroy_watch_table(watch_table_t *table) {
+  for (size_t i = 0; i < table->num_buckets; i++) {
+    while (table->buckets[i] != NULL)
+      destroy_watchers(watch_take(table, table->buckets[i]->key));
+  }
+  free(table->buckets);
+  free(table);
+}
+
+/**
+ * @brief Watches a key on behalf of a client, a client that already watches
+ * the key is only counted once.
+ *
+ * @param table - watch_table_t *
+ * @param key - char *
+ * @param addr - struct in_addr
+ * @param port - in_port_t
+ * @return -1 if the table is full, 0 otherwise.
+ */
+int watch_add(watch_table_t *table, char *key, struct in_addr addr,
+              in_port_t port) {
+  watch_t **link = find_watch(table, key);
+  if (*link != NULL) {
+    for (watcher_t *w = (*link)->watchers; w != NULL; w = w->next) {
+      if (w->addr.s_addr == addr.s_addr && w->port == port)
+        return 0;
+    }
+  }
+  if (table->num_watchers >= table->max_watchers)
+    return -1;
+
+  if (*link == NULL) {
+    *link = calloc(1, sizeof(watch_t));
+    (*link)->key = strdup(key);
+  }
+  watcher_t *watcher = malloc(sizeof(watcher_t));
+  *watcher = (watcher_t){.addr = addr, .port = port, .next = (*link)->watchers};
+  (*link)->watchers = watcher;
+  table->num_watchers++;
+  return 0;
+}
+
+/**
+ * @brief Removes the watch of a key after a write, so that its watchers can
+ * be notified.
+ *
+ * NOTE: Free the watchers with `destroy_watchers`, e.g. after notifying them
+ * outside of the lock.
+ *
+ * @param table - watch_table_t *
+ * @param key - char *
+ * @return list of the watchers, NULL means that the key is not watched.
+ */
+watcher_t *watch_take(watch_table_t *table, char *key) {
+  watch_t **link = find_watch(table, key);
+  watch_t *watch = *link;
+  if (watch == NULL)
+    return NULL;
+
+  *link = watch->next;
+  watcher_t *watchers = watch->watchers;
+  for (watcher_t *w = watchers; w != NULL; w = w->next)
+    table->num_watchers--;
+  free(watch->key);
+  free(watch);
+  return watchers;
+}
+
+/**
+ * @brief Frees a list of watchers.
+ *
+ * @param watchers - watcher_t *
+ */
+void destroy_watchers(watcher_t *watchers) {
+  while (watchers != NULL) {
+    watcher_t *next = watchers->next;
+    free(watchers);
+    watchers = next;
+  }
+}
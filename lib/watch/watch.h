@@ -0,0 +1,43 @@
+#ifndef __WATCH_H__
+#define __WATCH_H__
+
+#include "../hashing/hashing.h"
+#include <netinet/in.h>
+#include <stddef.h>
+
+// A client to notify when a key is written.
+typedef struct watcher_t {
+  struct in_addr addr;
+  in_port_t port; // of the datagram socket of the client.
+  struct watcher_t *next;
+} watcher_t;
+
+// The watchers of a key.
+typedef struct watch_t {
+  char *key;
+  watcher_t *watchers;
+  struct watch_t *next;
+} watch_t;
+
+// Hashtable of the keys that clients cache near them. Watches are one shot,
+// the next write of a key takes all of its watchers, and a client watches the
+// key again once it caches it again. The number of watchers is bounded, so
+// the table can not grow without bounds with the number of clients.
+//
+// NOTE: Is not thread safe, every call should use the same external lock,
+// e.g. the lock of the cache whose writes take the watchers.
+typedef struct {
+  watch_t **buckets;
+  size_t num_buckets;
+  size_t num_watchers;
+  size_t max_watchers;
+} watch_table_t;
+
+watch_table_t *create_watch_table(size_t, size_t);
+void destroy_watch_table(watch_table_t *);
+
+int watch_add(watch_table_t *, char *, struct in_addr, in_port_t);
+watcher_t *watch_take(watch_table_t *, char *);
+void destroy_watchers(watcher_t *);
+
+#endif // __WATCH_H__
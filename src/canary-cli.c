@@ -1,5 +1,6 @@
 #include "../lib/client/client.h"
 #include <bits/getopt_core.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,20 +8,25 @@
 
 #define DEFAULT_CNF_PORT 8080
 #define DEFAULT_CNF_ADDR "127.0.0.1"
+#define STUB_LOAD_LATENCY_US 200000
+#define NEAR_CACHE_CAPACITY 1024
+#define MAX_BATCH_KEYS 256
 
 CanaryCache cache;
 
 void run_shell();
 char *read_line();
 void execute_cmd(char *);
+int stub_load(char *, int *, void *);
 
 int main(int argc, char *argv[]) {
   int opt;
   char *cnf_addr = malloc(20);
   in_port_t cnf_port = DEFAULT_CNF_PORT;
+  unsigned int near_ttl_ms = 0;
   strcpy(cnf_addr, DEFAULT_CNF_ADDR);
 
-  while ((opt = getopt(argc, argv, "p:a:")) != -1) {
+  while ((opt = getopt(argc, argv, "p:a:n:")) != -1) {
     switch (opt) {
     case 'p':
       cnf_port = atoi(optarg);
@@ -29,13 +35,22 @@ int main(int argc, char *argv[]) {
       memset(cnf_addr, 0, strlen(cnf_addr) + 1);
       strcpy(cnf_addr, optarg);
       break;
+    case 'n':
+      near_ttl_ms = atoi(optarg);
+      break;
     default:
-      printf("Usage: %s [-a <cnf-address>] [-p <cnf-port>]\n", argv[0]);
+      printf("Usage: %s [-a <cnf-address>] [-p <cnf-port>] "
+             "[-n <near-cache-ttl-ms>]\n",
+             argv[0]);
       exit(EXIT_FAILURE);
     }
   }
   cache.cnf_addr = malloc(strlen(cnf_addr) + 1);
   cache = create_canary_cache(cnf_addr, cnf_port);
+  // Gets are served from a watched near cache, for at most the TTL.
+  if (near_ttl_ms > 0 &&
+      canary_near_cache(&cache, NEAR_CACHE_CAPACITY, near_ttl_ms, true) == -1)
+    printf("Could not create the near cache\n");
   printf("Welcome to the Canary-cli!\n\n This is an interface for the Canary "
          "distributed cache,\n make sure that you have started the "
          "configuration service and data shards!\n\n");
@@ -68,6 +83,25 @@ char *read_line() {
   return line;
 }
 
+/**
+ * @brief Stands in for a slow backing store, every key exists and its value is
+ * its length. Keys that start with "missing" do not exist.
+ *
+ * @param key - char *
+ * @param value - int *
+ * @param arg - int *, counts the loads.
+ * @return 0 if the key does not exist, 1 otherwise.
+ */
+int stub_load(char *key, int *value, void *arg) {
+  usleep(STUB_LOAD_LATENCY_US);
+  (*(int *)arg)++;
+  if (strncmp(key, "missing", strlen("missing")) == 0)
+    return 0;
+
+  *value = strlen(key);
+  return 1;
+}
+
 void execute_cmd(char *line) {
   char *cmd = strtok(line, " ");
   char *key = strtok(NULL, " ");
@@ -83,8 +117,104 @@ void execute_cmd(char *line) {
     int value = atoi(strtok(NULL, " "));
     canary_put(&cache, key, value);
     printf("Cached key value pair (%s, %d)!\n", key, value);
+  } else if (strcmp(cmd, "incr") == 0 || strcmp(cmd, "decr") == 0) {
+    char *arg = strtok(NULL, " ");
+    int value, delta = arg == NULL ? 1 : atoi(arg);
+    int rc = strcmp(cmd, "incr") == 0 ? canary_incr(&cache, key, delta, &value)
+                                      : canary_decr(&cache, key, delta, &value);
+    if (rc == -1) {
+      printf("Could not update counter!\n");
+    } else {
+      printf("Counter %s is now %d !\n", key, value);
+    }
+  } else if (strcmp(cmd, "add") == 0) {
+    int current, value = atoi(strtok(NULL, " "));
+    int rc = canary_add(&cache, key, value, &current);
+    if (rc == -1) {
+      printf("Could not add key value pair!\n");
+    } else if (rc == 0) {
+      printf("Key %s is already cached with value %d !\n", key, current);
+    } else {
+      printf("Cached key value pair (%s, %d)!\n", key, value);
+    }
+  } else if (strcmp(cmd, "gets") == 0) {
+    int value;
+    uint64_t version;
+    int rc = canary_gets(&cache, key, &value, &version);
+    if (rc == -1) {
+      printf("Could not get value!\n");
+    } else if (rc == 0) {
+      printf("No cached value found!\n");
+    } else {
+      printf("Got value %d at version %lu !\n", value, version);
+    }
+  } else if (strcmp(cmd, "cas") == 0) {
+    int value = atoi(strtok(NULL, " "));
+    uint64_t version, expected = strtoull(strtok(NULL, " "), NULL, 10);
+    int rc = canary_cas(&cache, key, value, expected, &version);
+    if (rc == -1) {
+      printf("Could not compare-and-set!\n");
+    } else if (rc == 0) {
+      printf("Version mismatch, %s is at version %lu !\n", key, version);
+    } else {
+      printf("Cached key value pair (%s, %d) at version %lu !\n", key, value,
+             version);
+    }
+  } else if (strcmp(cmd, "load") == 0) {
+    int value, loads = 0;
+    int rc = canary_get_or_load(&cache, key, &value, stub_load, &loads);
+    if (rc == -1) {
+      printf("Could not load value!\n");
+    } else if (rc == 0) {
+      printf("No value found in the backing store!\n");
+    } else {
+      printf("Got value %d (%s)!\n", value,
+             loads == 0 ? "cached" : "loaded from the backing store");
+    }
+  } else if (strcmp(cmd, "mget") == 0 || strcmp(cmd, "mput") == 0) {
+    // mget <key>... and mput <key> <value>...
+    bool put = strcmp(cmd, "mput") == 0;
+    char *keys[MAX_BATCH_KEYS];
+    int values[MAX_BATCH_KEYS];
+    canary_result_t results[MAX_BATCH_KEYS];
+    size_t num_keys = 0;
+    for (char *arg = key; arg != NULL && num_keys < MAX_BATCH_KEYS;
+         arg = strtok(NULL, " ")) {
+      char *value = put ? strtok(NULL, " ") : NULL;
+      if (put && value == NULL)
+        break;
+      keys[num_keys] = arg;
+      values[num_keys++] = put ? atoi(value) : 0;
+    }
+    if (put)
+      canary_mput(&cache, keys, values, num_keys, results);
+    else
+      canary_mget(&cache, keys, num_keys, results);
+    for (size_t i = 0; i < num_keys; i++) {
+      if (results[i].status == -1) {
+        printf("%s: could not %s!\n", keys[i], put ? "put" : "get");
+      } else if (results[i].status == 0) {
+        printf("%s: no cached value found!\n", keys[i]);
+      } else {
+        printf("%s: %s value %d !\n", keys[i], put ? "cached" : "got",
+               results[i].value);
+      }
+    }
+  } else if (strcmp(cmd, "stats") == 0) {
+    // `key` is the address of the shard.
+    char *port = strtok(NULL, " ");
+    char *stats = port == NULL ? NULL : canary_stats(key, atoi(port));
+    if (stats == NULL) {
+      printf("Could not get stats, try \"stats <shard-addr> <shard-port>\"!\n");
+    } else {
+      printf("%s", stats);
+      free(stats);
+    }
   } else {
-    printf("\"%s\" is not a valid command ! try \"put\" or \"get\"!\n", cmd);
+    printf("\"%s\" is not a valid command ! try \"put\", \"get\", \"gets\", "
+           "\"cas\", \"load\", \"incr\", \"decr\", \"add\", \"mget\", "
+           "\"mput\" or \"stats\"!\n",
+           cmd);
   }
   printf("\n");
 }
@@ -2,12 +2,18 @@
 #include "../lib/cproto/cproto.h"
 #include "../lib/hashing/hashing.h"
 #include "../lib/logger/logger.h"
+#include "../lib/metrics/metrics.h"
 #include "../lib/nethelpers/nethelpers.h"
+#include "../lib/ring/ring.h"
+#include "../lib/timerheap/timerheap.h"
+#include "../lib/trace/trace.h"
 #include <arpa/inet.h>
 #include <bits/getopt_core.h>
 #include <errno.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -19,12 +25,30 @@
 
 // ---------------- DEFAULT VALUES ----------------
 #define DEFAULT_CNF_PORT 8080
+#define DEFAULT_PRIMARY_ADDR "127.0.0.1"
 #define BACKLOG 100
 #define MAX_MASTER_SHARDS 100
 #define MAX_FLWR_PER_MASTER 2
 #define MAXTHREADS 10
-#define HEARTBEAT_INTERVAL_WITH_SLACK 15
-#define SHARD_MAITNENANCE_INTERVAL 30
+// Shards send a heartbeat every 2 seconds, and expire after missing three.
+#define HEARTBEAT_INTERVAL_WITH_SLACK 7
+#define EXPIRY_BATCH_SIZE 64
+#define DEFAULT_TRACE_SAMPLE_RATE 1000
+#define DEFAULT_VNODES 128
+#define REFERENCE_CAPACITY 1000
+#define MIGRATION_WINDOW 30
+#define MIGRATION_TIMER UINT64_MAX
+// How often loads are published in the ring map and compared for bounded
+// loads, the load below which a shard is never overloaded, and how long its
+// keys spill at least.
+#define LOAD_TIMER (UINT64_MAX - 1)
+#define LOAD_CHECK_INTERVAL 2
+#define MIN_OVERLOAD 100
+#define OVERLOAD_HOLD 30
+// Read-only replicas of the configuration service register every 2 seconds,
+// and expire after missing three.
+#define MAX_CNF_REPLICAS 16
+#define REPLICA_INTERVAL 2
 
 // ---------------- CUSTOM TYPES ------------------
 
@@ -38,18 +62,37 @@ typedef struct {
 typedef struct {
   shard_t shard;
   time_t expiration; // timestamp of when this shard expires.
+  uint64_t applied;  // last record of the replication log it has applied.
+  uint32_t load;     // gets per second, as of the last heartbeat.
 } follower_shard_t;
 
 // Represents Master shard.
 typedef struct {
   uint32_t id; // randomly generated id for consistent hashing.
   shard_t shard;
+  uint32_t capacity; // capacity of the cache of the shard.
   time_t expiration; // timestamp of when this shard expires.
   bool expired;      // flag that marks if this shard has expired.
+  uint32_t load;     // requests per second, as of the last heartbeat.
+  bool overloaded;   // its keys spill to the next shards.
+  time_t overloaded_until;
   int num_flwrs;
   follower_shard_t *flwrs[MAX_FLWR_PER_MASTER];
 } master_shard_t;
 
+// Read-only replica of the configuration service.
+typedef struct {
+  shard_t cnf;
+  time_t expiration;
+} cnf_replica_t;
+
+// Immutable copy of the ring map, with the map packed as sent to clients.
+typedef struct {
+  ring_map_t *map;
+  uint8_t *buf;
+  int buf_len;
+} ring_snapshot_t;
+
 // ---------------- FUNCTION PROTOTYPES ------------
 
 // Runner functions.
@@ -57,19 +100,45 @@ int run(in_port_t port);
 
 // Thread functions.
 void *worker_thread(void *arg);
-void *shard_maintenance_thread(void *arg);
+void *shard_expiry_thread(void *arg);
+void *heartbeat_thread(void *arg);
+void *replica_push_thread(void *arg);
+void *primary_thread(void *arg);
 
 // Handlers.
 void handle_connection(conn_ctx_t *ctx);
-void handle_master_shard_registration(int socket, uint8_t *payload, IA addr);
+void handle_master_shard_registration(int socket, uint8_t *payload,
+                                      uint32_t payload_len, IA addr);
+void handle_master_shard_deregistration(int socket, uint8_t *payload);
 void handle_flwr_shard_registration(int socket, uint8_t *payload, IA addr);
 void handle_shard_selection(int socket, uint8_t *payload);
-void handle_master_shard_heartbeat(uint8_t *payload);
-void handle_flwr_shard_heartbeat(uint8_t *payload);
+void handle_ring_request(int socket, CanaryMsgType type);
+void handle_replica_registration(int socket, uint8_t *payload, IA addr);
+void handle_ring_push(uint8_t *payload, uint32_t payload_len);
+void handle_master_shard_heartbeat(uint8_t *payload, uint32_t payload_len);
+void handle_flwr_shard_heartbeat(uint8_t *payload, uint32_t payload_len);
 
 // Utilities
+int pack_flwr_upstreams(master_shard_t *mstr, int flwr_idx, uint8_t **buf);
 int compare_shards(const void *a, const void *b);
 master_shard_t *find_master_shard_by_id(uint32_t id);
+int num_vnodes_of(uint32_t capacity);
+uint64_t expiry_timer_id(uint32_t mstr_id, int flwr_idx);
+void schedule_expiry(uint64_t id, time_t deadline);
+void expire_shards(timer_entry_t *timers, size_t num_timers);
+int promote_follower(master_shard_t *mstr, time_t now);
+void send_promotion(uint32_t mstr_id);
+void begin_migration();
+bool update_overloaded(time_t now);
+bool expire_replicas(time_t now);
+void build_ring_map(ring_map_t *map);
+void free_ring_map_shards(ring_map_t *map);
+void push_ring_map();
+void publish_ring_map();
+void swap_snapshot(ring_map_t *map, uint8_t *buf, int buf_len);
+int install_ring_map(uint8_t *payload, uint32_t payload_len);
+ring_snapshot_t *acquire_snapshot(int *slot);
+void release_snapshot(int slot);
 
 // ---------------- GLOBAL VARIABLES --------------
 
@@ -77,8 +146,51 @@ master_shard_t *find_master_shard_by_id(uint32_t id);
 master_shard_t mstr_shards[MAX_MASTER_SHARDS];
 pthread_rwlock_t shards_lock;
 
+// Virtual nodes of the master shards, protected by the shards lock.
+ring_t *ring;
+// Changes whenever the ring or the shards change, so that clients know when
+// their copy of the ring map is stale. Protected by the shards lock.
+uint64_t ring_epoch;
+
+// The ring and the master shards from before the last join or leave, kept
+// for `MIGRATION_WINDOW` seconds while the keys migrate to their new owners.
+// Protected by the shards lock.
+ring_t *prev_ring = NULL;
+ring_shard_t *prev_shards = NULL;
+size_t num_prev_shards = 0;
+time_t migration_ends_at;
+
+// Double buffered snapshot of the ring map, so that discovery and ring map
+// requests never take the shards lock. Readers count themselves on the slot
+// they read, and writers only rebuild the other slot once its readers have
+// left.
+ring_snapshot_t snapshots[2];
+// Loads are only published every `LOAD_CHECK_INTERVAL`, and without changing
+// the epoch. Protected by the shards lock.
+bool loads_changed = false;
+_Atomic int published_snapshot = 0;
+_Atomic int snapshot_readers[2];
+
+// Replicas that serve the ring map, ALWAYS listed in the ring map. Protected
+// by the shards lock.
+cnf_replica_t cnf_replicas[MAX_CNF_REPLICAS];
+int num_cnf_replicas = 0;
+// Every publish of the ring map is counted, so that the push thread knows
+// when to push it to the replicas.
+uint64_t num_published = 0;
+pthread_mutex_t push_lock;
+pthread_cond_t push_cond;
+
+// Expiration of every shard, and the end of the migration window. A shard
+// pushes a new timer on every heartbeat, the earlier ones are skipped once
+// they fire.
+timer_heap_t *expiry_timers;
+pthread_mutex_t timers_lock;
+pthread_cond_t timers_cond;
+
 // Threading related variables.
-pthread_t thread_pool[MAXTHREADS], shard_maintenance;
+pthread_t thread_pool[MAXTHREADS], shard_expiry, heartbeats, replica_push,
+    primary;
 conn_queue_t conn_q;
 pthread_cond_t conn_q_cond;
 pthread_mutex_t conn_q_lock;
@@ -87,6 +199,13 @@ pthread_mutex_t conn_q_lock;
 int num_mstr_shards = 0;
 int max_mstr_shards = MAX_MASTER_SHARDS;
 int flwr_per_master = 0;
+bool chain_replication = false;
+int vnodes_per_shard = DEFAULT_VNODES;
+bool weighted_vnodes = false;
+Placement placement = PlacementRing;
+double load_slack = -1; // ε of bounded loads, disabled when negative.
+char primary_addr[20] = DEFAULT_PRIMARY_ADDR;
+in_port_t primary_port = 0; // only set on replicas.
 
 // ---------------- IMPLEMENTATION -----------------
 
@@ -94,7 +213,25 @@ int flwr_per_master = 0;
  * @brief Runner code.
  *
  * - Parses commandline arguments int local/global values.
- * - Starts shard maintenance thread.
+ * - `-c` makes followers replicate in a chain (master -> follower1 ->
+ *   follower2) instead of all replicating from the master.
+ * - `-v` sets the number of virtual nodes of a master shard on the ring, and
+ *   `-w` scales it by the cache capacity of the shard.
+ * - `-a` picks how keys are placed on master shards: a consistent hashing
+ *   ring (default), jump consistent hash or rendezvous hashing. The number of
+ *   virtual nodes is the weight of a shard under rendezvous hashing, and is
+ *   ignored by jump consistent hash.
+ * - `-b` bounds the load of a master shard to (1 + ε) times the average load
+ *   of the masters. The keys of a shard above the bound spill to the next
+ *   shards, see `update_overloaded`.
+ * - `-r` runs a read-only replica of the configuration service at `-A`
+ *   (localhost by default). A replica only serves discovery and the ring
+ *   map, which the primary pushes to it, so that clients spread their
+ *   queries over the replicas. Shards keep talking to the primary.
+ * - Starts the shard expiry thread, the thread that receives heartbeat
+ *   datagrams on the same port number as the socket server, and the thread
+ *   that pushes the ring map to the replicas. A replica only starts the
+ *   thread that registers it with the primary.
  * - Runs multithreaded socket server.
  *
  * @param argc - int
@@ -106,9 +243,11 @@ int main(int argc, char *argv[]) {
   int opt;
   in_port_t port = DEFAULT_CNF_PORT;
   int num_threads = MAXTHREADS;
+  char *trace_path = NULL;
+  unsigned trace_sample_rate = DEFAULT_TRACE_SAMPLE_RATE;
 
   // Parse flags.
-  while ((opt = getopt(argc, argv, "p:t") != -1)) {
+  while ((opt = getopt(argc, argv, "p:t:cl:T:s:v:wa:b:r:A:")) != -1) {
     switch (opt) {
     case 'p':
       port = atoi(optarg);
@@ -117,20 +256,82 @@ int main(int argc, char *argv[]) {
       num_threads = atoi(optarg);
       num_threads = num_threads > MAXTHREADS ? MAXTHREADS : num_threads;
       break;
+    case 'c':
+      chain_replication = true;
+      break;
+    case 'T':
+      trace_path = optarg;
+      break;
+    case 's':
+      trace_sample_rate = atoi(optarg);
+      break;
+    case 'v':
+      vnodes_per_shard = atoi(optarg) > 0 ? atoi(optarg) : 1;
+      break;
+    case 'w':
+      weighted_vnodes = true;
+      break;
+    case 'a':
+      if (parse_placement(optarg, &placement) == -1)
+        goto usage;
+      break;
+    case 'b':
+      load_slack = atof(optarg) >= 0 ? atof(optarg) : 0;
+      break;
+    case 'r':
+      primary_port = atoi(optarg);
+      break;
+    case 'A':
+      memset(primary_addr, 0, sizeof(primary_addr));
+      strncpy(primary_addr, optarg, sizeof(primary_addr) - 1);
+      break;
+    case 'l':
+      if (parse_log_level(optarg, &log_level) == 0)
+        break;
     default:
-      printf("Usage: %s [-p <cnf-port>] [-t <num-threads>]\n", argv[0]);
+    usage:
+      printf("Usage: %s [-p <cnf-port>] [-t <num-threads>] [-c] [-l "
+             "<error|warn|info|debug>] [-T <trace-file>] [-s "
+             "<trace-sample-rate>] [-v <vnodes-per-shard>] [-w] [-a "
+             "<ring|jump|rendezvous>] [-b <load-epsilon>] [-r "
+             "<primary-port>] [-A <primary-addr>]\n",
+             argv[0]);
       exit(EXIT_FAILURE);
     }
   }
 
+  // Sample 1 in `trace_sample_rate` requests into a Chrome trace.
+  if (trace_path != NULL && trace_open(trace_path, trace_sample_rate) == -1) {
+    log_error("could not open trace file %s", trace_path);
+    exit(EXIT_FAILURE);
+  }
+
+  ring = create_ring(placement);
+  log_info("placing keys with %s hashing", placement_name(placement));
+  // Start from the clock, so that a restarted service never hands out an
+  // epoch that clients already have. A replica starts from 0, so that the
+  // first map of the primary replaces its empty map.
+  ring_epoch = primary_port == 0 ? (uint64_t)time(NULL) << 20 : 0;
+  publish_ring_map();
+
   // Create threads.
-  pthread_create(&shard_maintenance, NULL, shard_maintenance_thread, NULL);
+  if (primary_port == 0) {
+    expiry_timers = create_timer_heap(MAX_MASTER_SHARDS);
+    schedule_expiry(LOAD_TIMER, time(NULL) + LOAD_CHECK_INTERVAL);
+    pthread_create(&shard_expiry, NULL, shard_expiry_thread, NULL);
+    pthread_create(&heartbeats, NULL, heartbeat_thread, (void *)(long)port);
+    pthread_create(&replica_push, NULL, replica_push_thread, NULL);
+  } else {
+    log_info("replicating the configuration service at %s:%d", primary_addr,
+             primary_port);
+    pthread_create(&primary, NULL, primary_thread, (void *)(long)port);
+  }
   conn_q = create_queue();
   for (long i = 0; i < num_threads; i++) {
     pthread_create(&thread_pool[i], NULL, worker_thread, NULL);
   }
 
-  logfmt("Starting Configuration service on port %d", port);
+  log_info("Starting Configuration service on port %d", port);
   // Run server.
   if (run(port) == -1)
     exit(EXIT_FAILURE);
@@ -158,14 +359,15 @@ int run(in_port_t port) {
 
     if ((client_socket = accept(server_socket, (SA *)&client_addr,
                                 (socklen_t *)&addr_size)) == -1) {
-      logfmt("accept failed");
+      log_warn("accept failed");
       continue;
     }
 
     conn_ctx_t *ctx = malloc(sizeof(conn_ctx_t));
     *ctx = (conn_ctx_t){.socket = client_socket,
                         .client_addr = client_addr.sin_addr,
-                        .port = client_addr.sin_port};
+                        .port = client_addr.sin_port,
+                        .enqueued_at = metrics_now()};
 
     pthread_mutex_lock(&conn_q_lock);
     enqueue(&conn_q, ctx);
@@ -187,70 +389,168 @@ void *worker_thread(void *arg) {
 
     // CRITICAL SECTION BEGIN
     pthread_mutex_lock(&conn_q_lock);
-    if ((ctx = dequeue(&conn_q)) == NULL) {
+    while ((ctx = dequeue(&conn_q)) == NULL) {
+      // another worker may have grabbed the connection before us, retry.
       pthread_cond_wait(&conn_q_cond, &conn_q_lock);
-
-      // retry
-      ctx = dequeue(&conn_q);
     }
     pthread_mutex_unlock(&conn_q_lock);
     // CRITICAL SECTION END
 
+    trace_begin(ctx->enqueued_at);
+    trace_stage(Dequeue);
     handle_connection(ctx);
+    trace_end();
   }
 }
 
 /**
- * @brief Will periodically go through shards and remove stale shards.
+ * @brief Expires shards whose heartbeats have stopped, and ends the migration
+ * window. Sleeps until the earliest deadline instead of scanning the shards.
  *
- * TODO: must go through follower shards as well. Promote or remove.
  * @param arg - void *
  */
-void *shard_maintenance_thread(void *arg) {
+void *shard_expiry_thread(void *arg) {
+  timer_entry_t timers[EXPIRY_BATCH_SIZE];
+  timer_entry_t next;
+
   while (1) {
-    sleep(SHARD_MAITNENANCE_INTERVAL);
+    size_t num_timers = 0;
+
     // BEGIN CRITICAL SECTION
-    pthread_rwlock_wrlock(&shards_lock);
-    if (num_mstr_shards > 0) {
-      // Scan through the shards and mark expired shards.
-      int num_expired = 0;
-
-      for (int i = 0; i < num_mstr_shards; i++) {
-        for (int j = 0; j < MAX_FLWR_PER_MASTER; j++) {
-          follower_shard_t *flwr = mstr_shards[i].flwrs[j];
-          // Check follower shards expiration.
-          if (flwr != NULL && flwr->expiration < time(NULL)) {
-
-            logfmt("follower shard at %s:%d has expired",
-                   inet_ntoa(mstr_shards[i].flwrs[j]->shard.addr),
-                   mstr_shards[i].flwrs[j]->shard.port);
-            // free pointer and sett slot to NULL
-            free(mstr_shards[i].flwrs[j]);
-            mstr_shards[i].flwrs[j] = NULL;
-            // update local and global flwr count.
-            mstr_shards[i].num_flwrs--;
-            if (flwr_per_master > 0)
-              flwr_per_master--;
-          }
-        }
-        if (mstr_shards[i].expiration < time(NULL)) {
-          // TODO: Promote shard here
-          mstr_shards[i].expired = true;
-          num_expired++;
-
-          logfmt("master shard at %s:%d has expired",
-                 inet_ntoa(mstr_shards[i].shard.addr),
-                 mstr_shards[i].shard.port);
-        }
-
-        // Re-sort shards (expired will be put at the back).
-        qsort(mstr_shards, num_mstr_shards, sizeof(master_shard_t),
-              compare_shards);
-        num_mstr_shards -= num_expired;
+    pthread_mutex_lock(&timers_lock);
+    while (timer_peek(expiry_timers, &next) == -1 ||
+           next.deadline > (uint64_t)time(NULL)) {
+      if (expiry_timers->num_timers == 0) {
+        pthread_cond_wait(&timers_cond, &timers_lock);
+      } else {
+        struct timespec ts = {.tv_sec = next.deadline, .tv_nsec = 0};
+        pthread_cond_timedwait(&timers_cond, &timers_lock, &ts);
       }
     }
+    while (num_timers < EXPIRY_BATCH_SIZE &&
+           timer_pop_expired(expiry_timers, time(NULL), &timers[num_timers]) ==
+               0)
+      num_timers++;
+    pthread_mutex_unlock(&timers_lock);
+    // END CRITICAL SECTION
+
+    expire_shards(timers, num_timers);
+  }
+}
+
+/**
+ * @brief Receives heartbeat datagrams from the shards.
+ *
+ * @param arg - void *, the port.
+ */
+void *heartbeat_thread(void *arg) {
+  in_port_t port = (in_port_t)(long)arg;
+  CanaryMsg msg;
+
+  int socket = bind_udp_socket(port);
+  if (socket == -1) {
+    log_error("could not receive heartbeats on port %d", port);
+    exit(EXIT_FAILURE);
+  }
+
+  while (1) {
+    if (receive_datagram(socket, &msg) == -1)
+      continue;
+
+    if (msg.type == Mstr2CnfHeartbeat &&
+        (msg.payload_len == sizeof(uint32_t) ||
+         msg.payload_len == sizeof(uint32_t) * 2))
+      handle_master_shard_heartbeat(msg.payload, msg.payload_len);
+    else if (msg.type == Flwr2CnfHeartbeat &&
+             msg.payload_len >= sizeof(uint32_t) * 2 &&
+             msg.payload_len <= sizeof(uint32_t) * 3 + sizeof(uint64_t))
+      handle_flwr_shard_heartbeat(msg.payload, msg.payload_len);
+    else
+      free(msg.payload);
+  }
+}
+
+/**
+ * @brief Pushes the ring map to the replicas whenever it is published. Maps
+ * published while a push is under way are coalesced into the next push.
+ *
+ * @param arg - void *
+ */
+void *replica_push_thread(void *arg) {
+  uint64_t num_pushed = 0;
+  shard_t replicas[MAX_CNF_REPLICAS];
+
+  while (1) {
+    // BEGIN CRITICAL SECTION
+    pthread_mutex_lock(&push_lock);
+    while (num_pushed == num_published)
+      pthread_cond_wait(&push_cond, &push_lock);
+    num_pushed = num_published;
+    pthread_mutex_unlock(&push_lock);
+    // END CRITICAL SECTION
+
+    // BEGIN CRITICAL SECTION
+    pthread_rwlock_rdlock(&shards_lock);
+    int num_replicas = num_cnf_replicas;
+    for (int i = 0; i < num_replicas; i++)
+      replicas[i] = cnf_replicas[i].cnf;
     pthread_rwlock_unlock(&shards_lock);
     // END CRITICAL SECTION
+    if (num_replicas == 0)
+      continue;
+
+    int slot;
+    ring_snapshot_t *snapshot = acquire_snapshot(&slot);
+    int buf_len = snapshot->buf_len;
+    uint8_t *buf = malloc(buf_len);
+    memcpy(buf, snapshot->buf, buf_len);
+    release_snapshot(slot);
+
+    CanaryMsg msg = {
+        .type = Cnf2RplcRing, .payload_len = buf_len, .payload = buf};
+    for (int i = 0; i < num_replicas; i++) {
+      char *addr = inet_ntoa(replicas[i].addr);
+      int socket = connect_to_socket(addr, replicas[i].port);
+      // A replica that misses a push gets the map when it registers again.
+      if (socket == -1 || send_msg(socket, msg) == -1)
+        log_debug("could not push the ring map to replica at %s:%d", addr,
+                  replicas[i].port);
+      if (socket != -1)
+        close(socket);
+    }
+    free(buf);
+  }
+}
+
+/**
+ * @brief Registers a replica with the primary configuration service every
+ * `REPLICA_INTERVAL`, and installs the ring map it responds with. Keeps the
+ * replica registered, and catches up on pushes that it missed.
+ *
+ * @param arg - void *, the port of the replica.
+ */
+void *primary_thread(void *arg) {
+  uint8_t port[sizeof(in_port_t)];
+  pack_short((in_port_t)(long)arg, port);
+  CanaryMsg resp, req = {.type = Rplc2CnfRegister,
+                         .payload_len = sizeof(port),
+                         .payload = port};
+
+  while (1) {
+    int socket = connect_to_socket(primary_addr, primary_port);
+    if (socket == -1 || send_msg(socket, req) == -1 ||
+        receive_msg(socket, &resp) == -1) {
+      log_warn("could not reach the configuration service at %s:%d",
+               primary_addr, primary_port);
+    } else {
+      if (resp.type != Cnf2RplcRing ||
+          install_ring_map(resp.payload, resp.payload_len) == -1)
+        log_warn("could not register with the configuration service");
+      free(resp.payload);
+    }
+    if (socket != -1)
+      close(socket);
+    sleep(REPLICA_INTERVAL);
   }
 }
 
@@ -271,12 +571,30 @@ void handle_connection(conn_ctx_t *ctx) {
 
   if (receive_msg(socket, &msg) == -1) {
     send_error_msg(socket, "Could not receive message");
+    close(socket);
+    return;
+  }
+  trace_request_type = msg.type;
+  trace_stage(Receive);
+
+  // Replicas only serve the ring map, everything else goes to the primary.
+  bool read_only = msg.type == Client2CnfDiscover ||
+                   msg.type == Client2CnfRing || msg.type == Cnf2RplcRing;
+  if (primary_port != 0 ? !read_only : msg.type == Cnf2RplcRing) {
+    send_error_msg(socket, "Incorrect Canary message type for a primary or "
+                           "replica configuration service");
+    free(msg.payload);
+    close(socket);
     return;
   }
 
   switch (msg.type) {
   case Mstr2CnfRegister:
-    handle_master_shard_registration(socket, msg.payload, client_addr);
+    handle_master_shard_registration(socket, msg.payload, msg.payload_len,
+                                     client_addr);
+    break;
+  case Mstr2CnfDeregister:
+    handle_master_shard_deregistration(socket, msg.payload);
     break;
   case Flwr2CnfRegister:
     handle_flwr_shard_registration(socket, msg.payload, client_addr);
@@ -284,64 +602,157 @@ void handle_connection(conn_ctx_t *ctx) {
   case Client2CnfDiscover:
     handle_shard_selection(socket, msg.payload);
     break;
+  case Client2CnfRing:
+    handle_ring_request(socket, Cnf2ClientRing);
+    free(msg.payload);
+    break;
+  case Rplc2CnfRegister:
+    handle_replica_registration(socket, msg.payload, client_addr);
+    break;
+  case Cnf2RplcRing:
+    handle_ring_push(msg.payload, msg.payload_len);
+    break;
   case Mstr2CnfHeartbeat:
-    handle_master_shard_heartbeat(msg.payload);
+    handle_master_shard_heartbeat(msg.payload, msg.payload_len);
     break;
   case Flwr2CnfHeartbeat:
-    handle_flwr_shard_heartbeat(msg.payload);
+    handle_flwr_shard_heartbeat(msg.payload, msg.payload_len);
     break;
   default:
     send_error_msg(socket, "Incorrect Canary message type");
     break;
   }
+  close(socket);
 }
 
 /**
- * @brief Registers a new master shard
+ * @brief Registers a new master shard, and adds its virtual nodes to the
+ * ring.
  *
  * @param socket - int
- * @param payload - uint8_t *
+ * @param payload - uint8_t *, [ port | capacity ], shards that do not send
+ * their capacity get the reference capacity.
+ * @param payload_len - uint32_t
  * @param addr - IA
  */
-void handle_master_shard_registration(int socket, uint8_t *payload, IA addr) {
+void handle_master_shard_registration(int socket, uint8_t *payload,
+                                      uint32_t payload_len, IA addr) {
   in_port_t port;
+  uint32_t capacity = REFERENCE_CAPACITY;
   unpack_short(&port, payload);
+  if (payload_len >= sizeof(port) + sizeof(capacity))
+    capacity = ntohl(*(uint32_t *)(payload + sizeof(port)));
 
   free(payload);
   // create random id.
   uint32_t id = rand();
+  int num_vnodes = num_vnodes_of(capacity);
   master_shard_t mstr =
       (master_shard_t){.id = id,
                        .shard = {.addr = addr, .port = port},
+                       .capacity = capacity,
                        .expiration = time(NULL) + HEARTBEAT_INTERVAL_WITH_SLACK,
                        .expired = false,
                        .num_flwrs = 0,
                        .flwrs = {NULL, NULL}};
 
   // CRITICAL SECTION BEGIN
-  pthread_rwlock_rdlock(&shards_lock);
+  pthread_rwlock_wrlock(&shards_lock);
   if (num_mstr_shards >= max_mstr_shards) {
-    logfmt("could not register shard at %s:%d", inet_ntoa(addr), port);
+    pthread_rwlock_unlock(&shards_lock);
+    log_warn("could not register shard at %s:%d", inet_ntoa(addr), port);
     send_error_msg(socket, "Reached max shard capacity");
     return;
   }
 
   // Add to the end of array and sort the array.
+  begin_migration();
   mstr_shards[num_mstr_shards] = mstr;
   num_mstr_shards++;
   qsort(mstr_shards, num_mstr_shards, sizeof(master_shard_t), compare_shards);
+  ring_add(ring, id, num_vnodes);
+  ring_epoch++;
+  publish_ring_map();
   flwr_per_master = 0;
+  schedule_expiry(expiry_timer_id(id, -1), mstr.expiration);
   pthread_rwlock_unlock(&shards_lock);
   // CRITICAL SECTION END
 
-  logfmt("registered new master shard at %s:%d with id %d",
-         inet_ntoa(mstr.shard.addr), mstr.shard.port, mstr.id);
+  log_info("registered new master shard at %s:%d with id %d and %d virtual "
+           "nodes",
+           inet_ntoa(mstr.shard.addr), mstr.shard.port, mstr.id, num_vnodes);
 
   // respond to shard.
   uint32_t n_id = htonl(id);
   send_msg(socket, (CanaryMsg){.type = Cnf2MstrRegister,
                                .payload_len = sizeof(uint32_t),
                                .payload = (uint8_t *)&n_id});
+
+  // The owners of the keys that the new shard takes over hand them over.
+  push_ring_map();
+}
+
+/**
+ * @brief Removes a master shard that leaves the ring. The shard hands its
+ * keys to the new owners before it exits, and can be read from until then.
+ * Its followers are told to register again, so that they are attached to a
+ * remaining master.
+ *
+ * @param socket - int
+ * @param payload - uint8_t *, [ id ]
+ */
+void handle_master_shard_deregistration(int socket, uint8_t *payload) {
+  uint32_t id = ntohl(*(uint32_t *)payload);
+  shard_t flwrs[MAX_FLWR_PER_MASTER];
+  int num_flwrs = 0;
+  free(payload);
+
+  // BEGIN CRITICAL SECTION
+  pthread_rwlock_wrlock(&shards_lock);
+  master_shard_t *mstr = find_master_shard_by_id(id);
+  if (mstr == NULL) {
+    pthread_rwlock_unlock(&shards_lock);
+    send_error_msg(socket, "Master shard is not registered");
+    return;
+  }
+
+  begin_migration();
+  log_info("master shard at %s:%d with id %d leaves the ring",
+           inet_ntoa(mstr->shard.addr), mstr->shard.port, id);
+  for (int j = 0; j < MAX_FLWR_PER_MASTER; j++) {
+    if (mstr->flwrs[j] != NULL)
+      flwrs[num_flwrs++] = mstr->flwrs[j]->shard;
+    free(mstr->flwrs[j]);
+  }
+  mstr->expired = true;
+  ring_remove(ring, id);
+  qsort(mstr_shards, num_mstr_shards, sizeof(master_shard_t), compare_shards);
+  num_mstr_shards--;
+  ring_epoch++;
+  publish_ring_map();
+  // The followers that register again go to the masters with the fewest.
+  flwr_per_master = MAX_FLWR_PER_MASTER;
+  for (int i = 0; i < num_mstr_shards; i++)
+    if (mstr_shards[i].num_flwrs < flwr_per_master)
+      flwr_per_master = mstr_shards[i].num_flwrs;
+  pthread_rwlock_unlock(&shards_lock);
+  // END CRITICAL SECTION
+
+  send_msg(socket, (CanaryMsg){.type = Cnf2MstrDeregister, .payload_len = 0});
+  push_ring_map();
+
+  for (int i = 0; i < num_flwrs; i++) {
+    char addr[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &flwrs[i].addr, addr, sizeof(addr));
+    int flwr_socket = connect_to_socket(addr, flwrs[i].port);
+    if (flwr_socket == -1 ||
+        send_msg(flwr_socket, (CanaryMsg){.type = Cnf2FlwrReregister,
+                                          .payload_len = 0}) == -1)
+      log_warn("could not tell follower shard at %s:%d to register again",
+               addr, flwrs[i].port);
+    if (flwr_socket != -1)
+      close(flwr_socket);
+  }
 }
 
 /**
@@ -360,7 +771,7 @@ void handle_flwr_shard_registration(int socket, uint8_t *payload, IA addr) {
   in_port_t port;
   unpack_short(&port, payload);
 
-  follower_shard_t *flwr = malloc(sizeof(follower_shard_t));
+  follower_shard_t *flwr = calloc(1, sizeof(follower_shard_t));
 
   flwr->shard = (shard_t){.addr = addr, .port = port};
 
@@ -392,9 +803,13 @@ void handle_flwr_shard_registration(int socket, uint8_t *payload, IA addr) {
       mstr_idx = i;
       flwr_idx = j;
       mstr_shards[i].num_flwrs++;
+      ring_epoch++;
+      publish_ring_map();
+      schedule_expiry(expiry_timer_id(mstr_shards[i].id, j), flwr->expiration);
 
-      logfmt("register follower shard at %s:%d to master shard with id %d",
-             inet_ntoa(flwr->shard.addr), flwr->shard.port, mstr_shards[i].id);
+      log_info("register follower shard at %s:%d to master shard with id %d",
+               inet_ntoa(flwr->shard.addr), flwr->shard.port,
+               mstr_shards[i].id);
       break;
     }
     break;
@@ -407,55 +822,52 @@ void handle_flwr_shard_registration(int socket, uint8_t *payload, IA addr) {
     return;
   }
 
-  char *mstr_addr = inet_ntoa(mstr_shards[mstr_idx].shard.addr);
-  in_port_t mstr_port = mstr_shards[mstr_idx].shard.port;
-  uint32_t mstr_id = mstr_shards[mstr_idx].id;
-
-  int buf_len = sizeof(mstr_id) + sizeof(flwr_idx) + sizeof(uint32_t) +
-                strlen(mstr_addr) + 1 + sizeof(mstr_port);
-  uint8_t *buf = malloc(buf_len);
-
-  // pack indexes.
-  pack_int_int(mstr_id, flwr_idx, buf);
-  // pack mstr addr and port.
-  pack_string_short(mstr_addr, strlen(mstr_addr) + 1, mstr_port,
-                    (buf + sizeof(mstr_idx) + sizeof(flwr_idx)));
+  // BEGIN CRITICAL SECTION
+  pthread_rwlock_rdlock(&shards_lock);
+  uint8_t *buf;
+  int buf_len = pack_flwr_upstreams(&mstr_shards[mstr_idx], flwr_idx, &buf);
+  pthread_rwlock_unlock(&shards_lock);
+  // END CRITICAL SECTION
 
   send_msg(socket, (CanaryMsg){.type = Cnf2FlwrRegister,
                                .payload_len = buf_len,
                                .payload = buf});
+  free(buf);
 }
 
 /**
- * @brief Will tell a client which shard to turn to.
+ * @brief Will tell a client which shard to turn to, the owner of the virtual
+ * node that follows the key on the ring.
  *
- * TODO: should point to followers if it is a get request.
+ * Discovery does not know if the key is read or written, so it always points
+ * to the master. Clients with the ring map spread their gets over the
+ * followers, see `ring_shard_replica`.
  * @param socket - int
  * @param payload - uint8_t *
  */
 void handle_shard_selection(int socket, uint8_t *payload) {
-  // cast payload to string and hash it.
   char *key = (char *)payload;
-  size_t hash = hash_djb2(key) % RAND_MAX;
-
-  // Binary search to find the first shard.id > hash.
-  int start = 0, end = num_mstr_shards, middle;
-  while (start <= end) {
-    middle = start + (end - start) / 2;
-
-    if (mstr_shards[middle].id <= hash) {
-      start = middle + 1;
-    } else {
-      end = middle - 1;
-    }
+  char addr[INET_ADDRSTRLEN];
+  in_port_t port;
+  int slot;
+
+  ring_snapshot_t *snapshot = acquire_snapshot(&slot);
+  trace_stage(Lock);
+  ring_shard_t *mstr = ring_map_lookup(snapshot->map, key);
+  if (mstr != NULL) {
+    inet_ntop(AF_INET, &mstr->mstr.addr, addr, sizeof(addr));
+    port = mstr->mstr.port;
   }
+  trace_stage(Execute);
+  release_snapshot(slot);
+  trace_stage(Unlock);
 
-  // If we cant find an element s.t shard.id > hash, we wrap around to zero.
-  int idx = start > num_mstr_shards ? 0 : start;
+  if (mstr == NULL) {
+    send_error_msg(socket, "No master shard is registered");
+    free(payload);
+    return;
+  }
 
-  // Pack the payload and send the message to client.
-  char *addr = inet_ntoa(mstr_shards[idx].shard.addr);
-  in_port_t port = mstr_shards[idx].shard.port;
   uint32_t addr_len = strlen(addr) + 1;
   uint32_t buf_len = sizeof(addr_len) + addr_len + sizeof(port);
   uint8_t *buf = malloc(buf_len);
@@ -466,50 +878,212 @@ void handle_shard_selection(int socket, uint8_t *payload) {
       .type = Cnf2ClientDiscover, .payload_len = buf_len, .payload = buf};
 
   send_msg(socket, msg);
-  logfmt("notified client that shard at %s:%d has responsibility of key %s",
-         addr, port, key);
+  trace_stage(Send);
+  log_debug("notified client that shard at %s:%d has responsibility of key %s",
+            addr, port, key);
+  free(buf);
+  free(payload);
+}
+
+/**
+ * @brief Sends the ring map to a client, so that it can route keys without
+ * asking for every key, or to a replica that registers.
+ *
+ * @param socket - int
+ * @param type - CanaryMsgType, of the response.
+ */
+void handle_ring_request(int socket, CanaryMsgType type) {
+  int slot;
+
+  // The packed map is copied, so that a slow client does not hold up the
+  // next change of the ring.
+  ring_snapshot_t *snapshot = acquire_snapshot(&slot);
+  trace_stage(Lock);
+  uint64_t epoch = snapshot->map->epoch;
+  int buf_len = snapshot->buf_len;
+  uint8_t *buf = malloc(buf_len);
+  memcpy(buf, snapshot->buf, buf_len);
+  trace_stage(Execute);
+  release_snapshot(slot);
+  trace_stage(Unlock);
+
+  send_msg(socket,
+           (CanaryMsg){.type = type, .payload_len = buf_len, .payload = buf});
+  trace_stage(Send);
+  log_debug("sent ring map at epoch %lu", epoch);
+  free(buf);
 }
 
 /**
- * @brief Takes in a heartbeat and will update the expiration of the shard.
+ * @brief Registers a replica of the configuration service, or keeps it
+ * registered, and responds with the ring map. New replicas are listed in the
+ * ring map right away, but without changing the epoch.
+ *
+ * @param socket - int
+ * @param payload - uint8_t *, [ port ]
+ * @param addr - IA
+ */
+void handle_replica_registration(int socket, uint8_t *payload, IA addr) {
+  in_port_t port;
+  unpack_short(&port, payload);
+  free(payload);
+  time_t expiration = time(NULL) + HEARTBEAT_INTERVAL_WITH_SLACK;
+
+  // BEGIN CRITICAL SECTION
+  pthread_rwlock_wrlock(&shards_lock);
+  int i;
+  for (i = 0; i < num_cnf_replicas; i++) {
+    if (cnf_replicas[i].cnf.addr.s_addr == addr.s_addr &&
+        cnf_replicas[i].cnf.port == port)
+      break;
+  }
+  if (i == num_cnf_replicas) {
+    if (num_cnf_replicas == MAX_CNF_REPLICAS) {
+      pthread_rwlock_unlock(&shards_lock);
+      log_warn("could not register replica at %s:%d", inet_ntoa(addr), port);
+      send_error_msg(socket, "Reached max replica capacity");
+      return;
+    }
+    cnf_replicas[num_cnf_replicas++].cnf =
+        (shard_t){.addr = addr, .port = port};
+    publish_ring_map();
+    log_info("registered replica at %s:%d", inet_ntoa(addr), port);
+  }
+  cnf_replicas[i].expiration = expiration;
+  pthread_rwlock_unlock(&shards_lock);
+  // END CRITICAL SECTION
+
+  handle_ring_request(socket, Cnf2RplcRing);
+}
+
+/**
+ * @brief Installs the ring map pushed by the primary configuration service.
+ *
+ * @param payload - uint8_t *
+ * @param payload_len - uint32_t
+ */
+void handle_ring_push(uint8_t *payload, uint32_t payload_len) {
+  if (install_ring_map(payload, payload_len) == -1)
+    log_warn("received a malformed ring map");
+  free(payload);
+}
+
+/**
+ * @brief Takes in a heartbeat and will update the expiration and the load of
+ * the shard.
  *
  * @param payload - uint8_t;
+ * @param payload_len - uint32_t
  */
-void handle_master_shard_heartbeat(uint8_t *payload) {
-  uint32_t id = ntohl(*(uint32_t *)payload);
+void handle_master_shard_heartbeat(uint8_t *payload, uint32_t payload_len) {
+  uint32_t id, load = 0;
+  if (payload_len == sizeof(uint32_t) * 2)
+    unpack_int_int(&id, &load, payload);
+  else
+    id = ntohl(*(uint32_t *)payload);
   free(payload);
 
   // BEGIN CRITICAL SECTION
   pthread_rwlock_wrlock(&shards_lock);
   master_shard_t *mstr = find_master_shard_by_id(id);
 
-  if (mstr != NULL)
+  if (mstr != NULL) {
     mstr->expiration = time(NULL) + HEARTBEAT_INTERVAL_WITH_SLACK;
+    loads_changed |= mstr->load != load;
+    mstr->load = load;
+    schedule_expiry(expiry_timer_id(id, -1), mstr->expiration);
+  }
   pthread_rwlock_unlock(&shards_lock);
   // END CRITICAL SECTION
 }
 
 /**
- * @brief Takes in a heartbeat and will update the expiration of the shard.
+ * @brief Takes in a heartbeat and will update the expiration of the shard,
+ * and how far it has replicated.
  *
  * @param payload - uint8_t;
+ * @param payload_len - uint32_t
  */
-void handle_flwr_shard_heartbeat(uint8_t *payload) {
-  uint32_t mstr_id, flwr_idx;
+void handle_flwr_shard_heartbeat(uint8_t *payload, uint32_t payload_len) {
+  uint32_t mstr_id, flwr_idx, load = 0;
+  uint64_t applied = 0;
   unpack_int_int(&mstr_id, &flwr_idx, payload);
+  if (payload_len >= sizeof(uint32_t) * 2 + sizeof(uint64_t))
+    unpack_long(&applied, payload + sizeof(uint32_t) * 2);
+  if (payload_len == sizeof(uint32_t) * 3 + sizeof(uint64_t))
+    load = ntohl(*(uint32_t *)(payload + sizeof(uint32_t) * 2 +
+                               sizeof(uint64_t)));
   free(payload);
 
   // BEGIN CRITICAL SECTION
   pthread_rwlock_wrlock(&shards_lock);
   master_shard_t *mstr = find_master_shard_by_id(mstr_id);
 
-  if (mstr != NULL)
-    mstr->flwrs[flwr_idx]->expiration =
-        time(NULL) + HEARTBEAT_INTERVAL_WITH_SLACK;
+  follower_shard_t *flwr = mstr != NULL && flwr_idx < MAX_FLWR_PER_MASTER
+                               ? mstr->flwrs[flwr_idx]
+                               : NULL;
+  if (flwr != NULL) {
+    flwr->expiration = time(NULL) + HEARTBEAT_INTERVAL_WITH_SLACK;
+    flwr->applied = applied;
+    loads_changed |= flwr->load != load;
+    flwr->load = load;
+    schedule_expiry(expiry_timer_id(mstr_id, flwr_idx), flwr->expiration);
+  }
   pthread_rwlock_unlock(&shards_lock);
   // END CRITICAL SECTION
 }
 
+/**
+ * @brief Packs the master of a follower, and the shard it replicates from.
+ * In chain mode the follower replicates from the closest follower before it
+ * in the chain, otherwise (or if there is none) from the master.
+ *
+ * [ mstr_id | flwr_idx | mstr_addr | mstr_port | upstream_addr |
+ * upstream_port ]
+ *
+ * NOTE: Is not thread safe, should be executed in critical section. The
+ * buffer is allocated on the heap.
+ *
+ * @param mstr - master_shard_t *
+ * @param flwr_idx - int
+ * @param buf - uint8_t **
+ * @return the size of the buffer.
+ */
+int pack_flwr_upstreams(master_shard_t *mstr, int flwr_idx, uint8_t **buf) {
+  shard_t upstream = mstr->shard;
+  if (chain_replication) {
+    for (int j = flwr_idx - 1; j >= 0; j--) {
+      if (mstr->flwrs[j] != NULL) {
+        upstream = mstr->flwrs[j]->shard;
+        break;
+      }
+    }
+  }
+
+  char mstr_addr[INET_ADDRSTRLEN], upstream_addr[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &mstr->shard.addr, mstr_addr, sizeof(mstr_addr));
+  inet_ntop(AF_INET, &upstream.addr, upstream_addr, sizeof(upstream_addr));
+  in_port_t mstr_port = mstr->shard.port;
+
+  uint32_t mstr_addr_len = strlen(mstr_addr) + 1;
+  uint32_t upstream_addr_len = strlen(upstream_addr) + 1;
+  int mstr_len = sizeof(mstr_addr_len) + mstr_addr_len + sizeof(mstr_port);
+  int buf_len = sizeof(mstr->id) + sizeof(flwr_idx) + mstr_len +
+                sizeof(upstream_addr_len) + upstream_addr_len +
+                sizeof(upstream.port);
+  *buf = malloc(buf_len);
+
+  // pack indexes.
+  pack_int_int(mstr->id, flwr_idx, *buf);
+  // pack mstr addr and port.
+  pack_string_short(mstr_addr, mstr_addr_len, mstr_port,
+                    (*buf + sizeof(mstr->id) + sizeof(flwr_idx)));
+  // pack upstream addr and port.
+  pack_string_short(upstream_addr, upstream_addr_len, upstream.port,
+                    (*buf + sizeof(mstr->id) + sizeof(flwr_idx) + mstr_len));
+  return buf_len;
+}
+
 /**
  * @brief Comparator for `master_shard_t` meant to be used in `qsort`.
  *
@@ -541,7 +1115,7 @@ int compare_shards(const void *a, const void *b) {
  * @return pointer to the master shard, NULL if shard could not bee found.
  */
 master_shard_t *find_master_shard_by_id(uint32_t id) {
-  int start = 0, end = num_mstr_shards;
+  int start = 0, end = num_mstr_shards - 1;
   while (start <= end) {
     int middle = start + (end - start) / 2;
     if (mstr_shards[middle].id == id) {
@@ -555,3 +1129,566 @@ master_shard_t *find_master_shard_by_id(uint32_t id) {
   }
   return NULL;
 }
+
+/**
+ * @brief Number of virtual nodes of a master shard. With weighted virtual
+ * nodes a shard gets a share of the keys in proportion to its capacity.
+ *
+ * @param capacity - uint32_t
+ * @return int
+ */
+int num_vnodes_of(uint32_t capacity) {
+  if (!weighted_vnodes)
+    return vnodes_per_shard;
+
+  uint64_t num_vnodes =
+      (uint64_t)vnodes_per_shard * capacity / REFERENCE_CAPACITY;
+  return num_vnodes > 0 ? num_vnodes : 1;
+}
+
+/**
+ * @brief Identifies the expiry timer of a master shard, or of one of its
+ * followers.
+ *
+ * @param mstr_id - uint32_t
+ * @param flwr_idx - int, -1 for the master shard itself.
+ * @return uint64_t
+ */
+uint64_t expiry_timer_id(uint32_t mstr_id, int flwr_idx) {
+  return (uint64_t)mstr_id << 32 | (uint32_t)(flwr_idx + 1);
+}
+
+/**
+ * @brief Schedules an expiry timer, and wakes up the expiry thread in case
+ * it is earlier than the timers it waits for.
+ *
+ * @param id - uint64_t
+ * @param deadline - time_t
+ */
+void schedule_expiry(uint64_t id, time_t deadline) {
+  // BEGIN CRITICAL SECTION
+  pthread_mutex_lock(&timers_lock);
+  if (timer_push(expiry_timers, deadline, id) == -1)
+    log_error("could not schedule expiry timer");
+  pthread_cond_signal(&timers_cond);
+  pthread_mutex_unlock(&timers_lock);
+  // END CRITICAL SECTION
+}
+
+/**
+ * @brief Expires the shards of timers that have fired, unless a heartbeat
+ * has moved their expiration since. Ends the migration window if its timer
+ * has fired, and compares the loads of the shards if theirs has.
+ *
+ * @param timers - timer_entry_t *
+ * @param num_timers - size_t
+ */
+void expire_shards(timer_entry_t *timers, size_t num_timers) {
+  uint32_t promoted[EXPIRY_BATCH_SIZE];
+  int num_expired = 0, num_promoted = 0;
+  bool migration_ended = false, replicas_expired = false;
+  time_t now = time(NULL);
+
+  // BEGIN CRITICAL SECTION
+  pthread_rwlock_wrlock(&shards_lock);
+  uint64_t epoch = ring_epoch;
+  for (size_t i = 0; i < num_timers; i++) {
+    if (timers[i].id == MIGRATION_TIMER) {
+      // The previous owners have had time to hand over their keys.
+      if (prev_ring != NULL && migration_ends_at <= now) {
+        destroy_ring(prev_ring);
+        free(prev_shards);
+        prev_ring = NULL;
+        prev_shards = NULL;
+        num_prev_shards = 0;
+        ring_epoch++;
+        migration_ended = true;
+      }
+      continue;
+    }
+    if (timers[i].id == LOAD_TIMER) {
+      if (load_slack >= 0)
+        update_overloaded(now);
+      replicas_expired |= expire_replicas(now);
+      schedule_expiry(LOAD_TIMER, now + LOAD_CHECK_INTERVAL);
+      continue;
+    }
+
+    // Expired shards are only moved to the back by the sort below, so the
+    // binary search still works.
+    master_shard_t *mstr = find_master_shard_by_id(timers[i].id >> 32);
+    if (mstr == NULL || mstr->expired)
+      continue;
+
+    int flwr_idx = (int)(timers[i].id & UINT32_MAX) - 1;
+    if (flwr_idx >= 0) {
+      follower_shard_t *flwr = mstr->flwrs[flwr_idx];
+      if (flwr == NULL || flwr->expiration > now)
+        continue;
+
+      log_warn("follower shard at %s:%d has expired",
+               inet_ntoa(flwr->shard.addr), flwr->shard.port);
+      free(flwr);
+      mstr->flwrs[flwr_idx] = NULL;
+      // update local and global flwr count.
+      mstr->num_flwrs--;
+      if (flwr_per_master > 0)
+        flwr_per_master--;
+      ring_epoch++;
+    } else if (mstr->expiration <= now) {
+      if (promote_follower(mstr, now) == 0) {
+        promoted[num_promoted++] = mstr->id;
+        ring_epoch++;
+        continue;
+      }
+
+      mstr->expired = true;
+      ring_remove(ring, mstr->id);
+      ring_epoch++;
+      num_expired++;
+
+      log_warn("master shard at %s:%d has expired",
+               inet_ntoa(mstr->shard.addr), mstr->shard.port);
+    }
+  }
+
+  if (num_expired > 0) {
+    // Re-sort shards (expired will be put at the back).
+    qsort(mstr_shards, num_mstr_shards, sizeof(master_shard_t),
+          compare_shards);
+    num_mstr_shards -= num_expired;
+  }
+  bool changed = ring_epoch != epoch;
+  if (changed || loads_changed || replicas_expired)
+    publish_ring_map();
+  pthread_rwlock_unlock(&shards_lock);
+  // END CRITICAL SECTION
+
+  if (migration_ended)
+    log_info("key migration window has ended");
+  for (int i = 0; i < num_promoted; i++)
+    send_promotion(promoted[i]);
+  if (changed)
+    push_ring_map();
+}
+
+/**
+ * @brief Promotes the follower of an expired master that has applied the
+ * most of the replication log. The follower takes over the id of the master,
+ * and with it the position on the ring, so no keys move and they are served
+ * from a warm cache. The other followers keep replicating from the log of
+ * the promoted follower, which mirrors the log of the master.
+ *
+ * NOTE: Is not thread safe, should be executed in critical section.
+ *
+ * @param mstr - master_shard_t *
+ * @param now - time_t
+ * @return -1 if the master has no live followers, 0 otherwise.
+ */
+int promote_follower(master_shard_t *mstr, time_t now) {
+  int best = -1;
+  for (int j = 0; j < MAX_FLWR_PER_MASTER; j++) {
+    follower_shard_t *flwr = mstr->flwrs[j];
+    if (flwr == NULL || flwr->expiration <= now)
+      continue;
+    if (best == -1 || flwr->applied > mstr->flwrs[best]->applied)
+      best = j;
+  }
+  if (best == -1)
+    return -1;
+
+  follower_shard_t *flwr = mstr->flwrs[best];
+  char addr[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &mstr->shard.addr, addr, sizeof(addr));
+  log_warn("master shard at %s:%d has expired, promoting follower at %s:%d "
+           "at sequence number %lu",
+           addr, mstr->shard.port, inet_ntoa(flwr->shard.addr),
+           flwr->shard.port, flwr->applied);
+
+  mstr->shard = flwr->shard;
+  mstr->expiration = now + HEARTBEAT_INTERVAL_WITH_SLACK;
+  mstr->load = 0;
+  mstr->flwrs[best] = NULL;
+  mstr->num_flwrs--;
+  if (flwr_per_master > 0)
+    flwr_per_master--;
+  free(flwr);
+  schedule_expiry(expiry_timer_id(mstr->id, -1), mstr->expiration);
+  return 0;
+}
+
+/**
+ * @brief Tells a promoted follower to take over its master, and the other
+ * followers of the master where to replicate from. A promoted follower that
+ * can not be reached expires like any other master.
+ *
+ * @param mstr_id - uint32_t
+ */
+void send_promotion(uint32_t mstr_id) {
+  shard_t mstr, flwrs[MAX_FLWR_PER_MASTER];
+  uint8_t *bufs[MAX_FLWR_PER_MASTER];
+  int buf_lens[MAX_FLWR_PER_MASTER], num_flwrs = 0;
+
+  // BEGIN CRITICAL SECTION
+  pthread_rwlock_rdlock(&shards_lock);
+  master_shard_t *shard = find_master_shard_by_id(mstr_id);
+  if (shard == NULL || shard->expired) {
+    pthread_rwlock_unlock(&shards_lock);
+    return;
+  }
+  mstr = shard->shard;
+  for (int j = 0; j < MAX_FLWR_PER_MASTER; j++) {
+    if (shard->flwrs[j] == NULL)
+      continue;
+    flwrs[num_flwrs] = shard->flwrs[j]->shard;
+    buf_lens[num_flwrs] = pack_flwr_upstreams(shard, j, &bufs[num_flwrs]);
+    num_flwrs++;
+  }
+  pthread_rwlock_unlock(&shards_lock);
+  // END CRITICAL SECTION
+
+  uint32_t n_id = htonl(mstr_id);
+  CanaryMsg msg = {.type = Cnf2FlwrPromote,
+                   .payload_len = sizeof(n_id),
+                   .payload = (uint8_t *)&n_id};
+  for (int i = -1; i < num_flwrs; i++) {
+    shard_t *to = i == -1 ? &mstr : &flwrs[i];
+    if (i >= 0)
+      msg = (CanaryMsg){.type = Cnf2FlwrUpstream,
+                        .payload_len = buf_lens[i],
+                        .payload = bufs[i]};
+
+    char addr[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &to->addr, addr, sizeof(addr));
+    int socket = connect_to_socket(addr, to->port);
+    if (socket == -1 || send_msg(socket, msg) == -1)
+      log_warn("could not tell shard at %s:%d about the promotion", addr,
+               to->port);
+    if (socket != -1)
+      close(socket);
+    if (i >= 0)
+      free(bufs[i]);
+  }
+}
+
+/**
+ * @brief Remembers the ring and the master shards before they change, so
+ * that the keys that move can still be read from their previous owners.
+ * Masters that join or leave during a migration start a new one.
+ *
+ * NOTE: Is not thread safe, should be executed in critical section.
+ */
+void begin_migration() {
+  if (prev_ring != NULL)
+    destroy_ring(prev_ring);
+  free(prev_shards);
+
+  prev_ring = copy_ring(ring);
+  prev_shards = malloc(sizeof(ring_shard_t) * (num_mstr_shards + 1));
+  num_prev_shards = num_mstr_shards;
+  for (int i = 0; i < num_mstr_shards; i++) {
+    prev_shards[i] = (ring_shard_t){
+        .id = mstr_shards[i].id,
+        .mstr = {.addr = mstr_shards[i].shard.addr,
+                 .port = mstr_shards[i].shard.port},
+        .num_flwrs = 0,
+        .flwrs = NULL};
+  }
+  migration_ends_at = time(NULL) + MIGRATION_WINDOW;
+  schedule_expiry(MIGRATION_TIMER, migration_ends_at);
+}
+
+/**
+ * @brief Bounded loads, marks the master shards whose load exceeds (1 + ε)
+ * times the average load as overloaded, which caps the load of a shard that
+ * owns a hot range of keys. Keys of an overloaded shard spill to the next
+ * shards, and migrate like after a join or leave.
+ *
+ * The load of a shard drops as soon as its keys spill, so it stays marked for
+ * at least `OVERLOAD_HOLD` seconds to keep its keys from moving back and forth.
+ *
+ * NOTE: Is not thread safe, should be executed in critical section.
+ *
+ * @param now - time_t
+ * @return whether any shard was marked or unmarked.
+ */
+bool update_overloaded(time_t now) {
+  bool overloaded[MAX_MASTER_SHARDS];
+  bool changed = false;
+  uint64_t total = 0;
+  for (int i = 0; i < num_mstr_shards; i++)
+    total += mstr_shards[i].load;
+  if (num_mstr_shards == 0)
+    return false;
+
+  double bound = (1 + load_slack) * total / num_mstr_shards;
+  for (int i = 0; i < num_mstr_shards; i++) {
+    master_shard_t *mstr = &mstr_shards[i];
+    if (mstr->load >= MIN_OVERLOAD && mstr->load > bound)
+      mstr->overloaded_until = now + OVERLOAD_HOLD;
+    overloaded[i] = mstr->overloaded_until > now;
+    changed |= overloaded[i] != mstr->overloaded;
+  }
+  if (!changed)
+    return false;
+
+  begin_migration();
+  for (int i = 0; i < num_mstr_shards; i++) {
+    master_shard_t *mstr = &mstr_shards[i];
+    if (overloaded[i] == mstr->overloaded)
+      continue;
+
+    mstr->overloaded = overloaded[i];
+    ring_set_overloaded(ring, mstr->id, overloaded[i]);
+    if (overloaded[i])
+      log_warn("master shard at %s:%d is overloaded with %u requests per "
+               "second, above the bound of %.0f, spilling its keys",
+               inet_ntoa(mstr->shard.addr), mstr->shard.port, mstr->load,
+               bound);
+    else
+      log_info("master shard at %s:%d is no longer overloaded",
+               inet_ntoa(mstr->shard.addr), mstr->shard.port);
+  }
+  ring_epoch++;
+  return true;
+}
+
+/**
+ * @brief Removes the replicas of the configuration service that have stopped
+ * registering.
+ *
+ * NOTE: Is not thread safe, should be executed in critical section.
+ *
+ * @param now - time_t
+ * @return whether any replica was removed.
+ */
+bool expire_replicas(time_t now) {
+  int num_replicas = 0;
+  for (int i = 0; i < num_cnf_replicas; i++) {
+    if (cnf_replicas[i].expiration > now) {
+      cnf_replicas[num_replicas++] = cnf_replicas[i];
+      continue;
+    }
+    log_warn("replica at %s:%d has expired",
+             inet_ntoa(cnf_replicas[i].cnf.addr), cnf_replicas[i].cnf.port);
+  }
+  bool expired = num_replicas != num_cnf_replicas;
+  num_cnf_replicas = num_replicas;
+  return expired;
+}
+
+/**
+ * @brief Builds the ring map from the master shards. While keys migrate, the
+ * map also holds the previous ring and its masters.
+ *
+ * NOTE: Is not thread safe, should be executed in critical section. The ring
+ * map shares the rings, free it with `free_ring_map_shards`.
+ *
+ * @param map - ring_map_t *
+ */
+void build_ring_map(ring_map_t *map) {
+  *map = (ring_map_t){
+      .epoch = ring_epoch,
+      .ring = ring,
+      .prev_ring = prev_ring,
+      .shards = malloc(sizeof(ring_shard_t) *
+                       (num_mstr_shards + num_prev_shards + 1)),
+      .num_shards = 0,
+      .cnfs = malloc(sizeof(ring_addr_t) * (num_cnf_replicas + 1)),
+      .num_cnfs = num_cnf_replicas};
+  for (int i = 0; i < num_cnf_replicas; i++)
+    map->cnfs[i] = (ring_addr_t){.addr = cnf_replicas[i].cnf.addr,
+                                 .port = cnf_replicas[i].cnf.port};
+
+  // Merge the masters of both rings, which are already in order of ids.
+  size_t i = 0, j = 0;
+  while (i < (size_t)num_mstr_shards || j < num_prev_shards) {
+    if (j < num_prev_shards && (i == (size_t)num_mstr_shards ||
+                                prev_shards[j].id < mstr_shards[i].id)) {
+      map->shards[map->num_shards++] = prev_shards[j++];
+      continue;
+    }
+    if (j < num_prev_shards && prev_shards[j].id == mstr_shards[i].id)
+      j++;
+
+    master_shard_t *mstr = &mstr_shards[i++];
+    ring_shard_t *shard = &map->shards[map->num_shards++];
+    *shard = (ring_shard_t){
+        .id = mstr->id,
+        .mstr = {.addr = mstr->shard.addr,
+                 .port = mstr->shard.port,
+                 .load = mstr->load},
+        .num_flwrs = 0,
+        .flwrs = malloc(sizeof(ring_addr_t) * MAX_FLWR_PER_MASTER)};
+    for (int k = 0; k < MAX_FLWR_PER_MASTER; k++) {
+      if (mstr->flwrs[k] != NULL) {
+        shard->flwrs[shard->num_flwrs++] =
+            (ring_addr_t){.addr = mstr->flwrs[k]->shard.addr,
+                          .port = mstr->flwrs[k]->shard.port,
+                          .load = mstr->flwrs[k]->load};
+      }
+    }
+  }
+}
+
+/**
+ * @brief Frees the shards of a ring map built by `build_ring_map`.
+ *
+ * @param map - ring_map_t *
+ */
+void free_ring_map_shards(ring_map_t *map) {
+  for (size_t i = 0; i < map->num_shards; i++)
+    free(map->shards[i].flwrs);
+  free(map->shards);
+  free(map->cnfs);
+}
+
+/**
+ * @brief Pushes the ring map to the masters of both rings, so that they turn
+ * away keys they no longer own and hand them to the new owners without
+ * waiting for their next heartbeat.
+ */
+void push_ring_map() {
+  int slot;
+
+  // Pushing may take a while, so the snapshot is copied.
+  ring_snapshot_t *snapshot = acquire_snapshot(&slot);
+  ring_map_t *map = unpack_ring_map(snapshot->buf, snapshot->buf_len);
+  int buf_len = snapshot->buf_len;
+  uint8_t *buf = malloc(buf_len);
+  memcpy(buf, snapshot->buf, buf_len);
+  release_snapshot(slot);
+
+  CanaryMsg msg = {
+      .type = Cnf2MstrRing, .payload_len = buf_len, .payload = buf};
+  for (size_t i = 0; i < map->num_shards; i++) {
+    char addr[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &map->shards[i].mstr.addr, addr, sizeof(addr));
+    int socket = connect_to_socket(addr, map->shards[i].mstr.port);
+    // A shard that just registered may not be listening yet, the masters
+    // also fetch the ring map after every heartbeat.
+    if (socket == -1 || send_msg(socket, msg) == -1)
+      log_debug("could not push the ring map to master shard at %s:%d", addr,
+                map->shards[i].mstr.port);
+    if (socket != -1)
+      close(socket);
+  }
+  log_debug("pushed ring map at epoch %lu to %zu master shards", map->epoch,
+            map->num_shards);
+
+  destroy_ring_map(map);
+  free(buf);
+}
+
+/**
+ * @brief Publishes a snapshot of the ring map, called whenever the epoch
+ * changes, and wakes up the thread that pushes it to the replicas.
+ *
+ * NOTE: Must be executed in the critical section of the shards write lock,
+ * which also keeps writers from publishing at the same time.
+ */
+void publish_ring_map() {
+  ring_map_t map;
+  uint8_t *buf;
+  build_ring_map(&map);
+  loads_changed = false;
+  int buf_len = pack_ring_map(&map, &buf);
+  free_ring_map_shards(&map);
+  // Unpacking makes a copy that shares nothing with the live ring.
+  swap_snapshot(unpack_ring_map(buf, buf_len), buf, buf_len);
+
+  // BEGIN CRITICAL SECTION
+  pthread_mutex_lock(&push_lock);
+  num_published++;
+  pthread_cond_signal(&push_cond);
+  pthread_mutex_unlock(&push_lock);
+  // END CRITICAL SECTION
+}
+
+/**
+ * @brief Publishes a ring map and its packed buffer as the snapshot. The
+ * snapshot is rebuilt in the slot that is not published, after waiting for
+ * the readers that still hold it from the previous change.
+ *
+ * NOTE: Must be executed in the critical section of the shards write lock.
+ * The snapshot takes over the map and the buffer.
+ *
+ * @param map - ring_map_t *
+ * @param buf - uint8_t *
+ * @param buf_len - int
+ */
+void swap_snapshot(ring_map_t *map, uint8_t *buf, int buf_len) {
+  int next = 1 - atomic_load(&published_snapshot);
+  while (atomic_load(&snapshot_readers[next]) > 0)
+    sched_yield();
+
+  ring_snapshot_t *snapshot = &snapshots[next];
+  if (snapshot->map != NULL) {
+    destroy_ring_map(snapshot->map);
+    free(snapshot->buf);
+  }
+  *snapshot = (ring_snapshot_t){.map = map, .buf = buf, .buf_len = buf_len};
+
+  atomic_store(&published_snapshot, next);
+}
+
+/**
+ * @brief Installs a ring map received from the primary configuration service
+ * on a replica. Maps of an older epoch than the installed one are ignored,
+ * since pushes and registrations may arrive out of order.
+ *
+ * @param payload - uint8_t *
+ * @param payload_len - uint32_t
+ * @return -1 if the map is malformed, 0 otherwise.
+ */
+int install_ring_map(uint8_t *payload, uint32_t payload_len) {
+  ring_map_t *map = unpack_ring_map(payload, payload_len);
+  if (map == NULL)
+    return -1;
+  uint8_t *buf = malloc(payload_len);
+  memcpy(buf, payload, payload_len);
+
+  // BEGIN CRITICAL SECTION
+  pthread_rwlock_wrlock(&shards_lock);
+  // Only writers publish, so the published snapshot can be read directly.
+  if (map->epoch < snapshots[atomic_load(&published_snapshot)].map->epoch) {
+    pthread_rwlock_unlock(&shards_lock);
+    destroy_ring_map(map);
+    free(buf);
+    return 0;
+  }
+  swap_snapshot(map, buf, payload_len);
+  pthread_rwlock_unlock(&shards_lock);
+  // END CRITICAL SECTION
+  return 0;
+}
+
+/**
+ * @brief Acquires the published snapshot of the ring map without locking. A
+ * reader that races with a publish retries on the new snapshot.
+ *
+ * @param slot - int *, to be passed to `release_snapshot`.
+ * @return pointer to the snapshot, valid until it is released.
+ */
+ring_snapshot_t *acquire_snapshot(int *slot) {
+  while (1) {
+    int i = atomic_load(&published_snapshot);
+    atomic_fetch_add(&snapshot_readers[i], 1);
+    // The writer may have started to rebuild the slot before we counted
+    // ourselves, but only if it is no longer published.
+    if (atomic_load(&published_snapshot) == i) {
+      *slot = i;
+      return &snapshots[i];
+    }
+    atomic_fetch_sub(&snapshot_readers[i], 1);
+  }
+}
+
+/**
+ * @brief Releases a snapshot acquired with `acquire_snapshot`.
+ *
+ * @param slot - int
+ */
+void release_snapshot(int slot) {
+  atomic_fetch_sub(&snapshot_readers[slot], 1);
+}
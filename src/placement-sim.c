@@ -0,0 +1,150 @@
+#include "../lib/metrics/metrics.h"
+#include "../lib/ring/ring.h"
+#include <bits/getopt_core.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_NUM_SHARDS 16
+#define DEFAULT_NUM_KEYS 1000000
+#define DEFAULT_WEIGHT 128
+#define KEY_SIZE 16
+
+int num_shards = DEFAULT_NUM_SHARDS;
+int num_keys = DEFAULT_NUM_KEYS;
+char (*keys)[KEY_SIZE];
+
+void simulate(Placement);
+ring_t *build_ring(Placement);
+void lookup_all(ring_t *, uint32_t *);
+double moved_share(uint32_t *, uint32_t *);
+
+/**
+ * @brief Compares how the placements of the configuration service spread keys
+ * over master shards, without starting any shards.
+ *
+ * For every placement it prints the cost of a lookup, how evenly the keys are
+ * spread, and the share of the keys that move when a shard joins or leaves
+ * compared to the least possible.
+ *
+ * @param argc - int
+ * @param argv - char *[]
+ * @return
+ */
+int main(int argc, char *argv[]) {
+  int opt;
+  while ((opt = getopt(argc, argv, "n:k:")) != -1) {
+    switch (opt) {
+    case 'n':
+      num_shards = atoi(optarg) > 1 ? atoi(optarg) : 2;
+      break;
+    case 'k':
+      num_keys = atoi(optarg) > 0 ? atoi(optarg) : 1;
+      break;
+    default:
+      printf("Usage: %s [-n <num-shards>] [-k <num-keys>]\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  keys = malloc(sizeof(*keys) * num_keys);
+  for (int i = 0; i < num_keys; i++)
+    snprintf(keys[i], KEY_SIZE, "key%d", i);
+
+  printf("%d shards, %d keys\n\n", num_shards, num_keys);
+  printf("%-11s %10s %10s %10s %10s %10s\n", "placement", "ns/lookup",
+         "stddev", "max", "join", "leave");
+  for (int i = 0; i < NUM_PLACEMENTS; i++)
+    simulate(i);
+  printf("%-11s %10s %10s %10.3f %10.3f %10.3f\n", "ideal", "-", "0.000",
+         1.0, 1.0 / (num_shards + 1), 1.0 / num_shards);
+  printf("\nstddev and max are relative to the mean load, join and leave are "
+         "the shares of keys that moved.\n");
+
+  free(keys);
+  return 0;
+}
+
+/**
+ * @brief Simulates a placement and prints a row of results.
+ *
+ * @param placement - Placement
+ */
+void simulate(Placement placement) {
+  ring_t *ring = build_ring(placement);
+  uint32_t *owners = malloc(sizeof(uint32_t) * num_keys);
+  uint32_t *moved = malloc(sizeof(uint32_t) * num_keys);
+
+  uint64_t start = metrics_now();
+  lookup_all(ring, owners);
+  double ns_per_lookup = (double)(metrics_now() - start) / num_keys;
+
+  // Shard ids are 1 to `num_shards`.
+  int *load = calloc(num_shards + 2, sizeof(int));
+  for (int i = 0; i < num_keys; i++)
+    load[owners[i]]++;
+  double mean = (double)num_keys / num_shards, variance = 0;
+  int max = 0;
+  for (int id = 1; id <= num_shards; id++) {
+    variance += (load[id] - mean) * (load[id] - mean) / num_shards;
+    max = load[id] > max ? load[id] : max;
+  }
+
+  ring_add(ring, num_shards + 1, DEFAULT_WEIGHT);
+  lookup_all(ring, moved);
+  double joined = moved_share(owners, moved);
+  ring_remove(ring, num_shards + 1);
+
+  // A shard in the middle leaves, rather than the last one to join.
+  ring_remove(ring, num_shards / 2);
+  lookup_all(ring, moved);
+  double left = moved_share(owners, moved);
+
+  printf("%-11s %10.1f %10.3f %10.3f %10.3f %10.3f\n",
+         placement_name(placement), ns_per_lookup, sqrt(variance) / mean,
+         max / mean, joined, left);
+
+  free(load);
+  free(moved);
+  free(owners);
+  destroy_ring(ring);
+}
+
+/**
+ * @brief Creates a ring of `num_shards` shards of the same weight.
+ *
+ * @param placement - Placement
+ * @return pointer to the ring.
+ */
+ring_t *build_ring(Placement placement) {
+  ring_t *ring = create_ring(placement);
+  for (int id = 1; id <= num_shards; id++)
+    ring_add(ring, id, DEFAULT_WEIGHT);
+  return ring;
+}
+
+/**
+ * @brief Looks up the owners of all keys.
+ *
+ * @param ring - ring_t *
+ * @param owners - uint32_t *
+ */
+void lookup_all(ring_t *ring, uint32_t *owners) {
+  for (int i = 0; i < num_keys; i++)
+    ring_lookup(ring, keys[i], &owners[i]);
+}
+
+/**
+ * @brief Share of the keys whose owner changed.
+ *
+ * @param before - uint32_t *
+ * @param after - uint32_t *
+ * @return double
+ */
+double moved_share(uint32_t *before, uint32_t *after) {
+  int moved = 0;
+  for (int i = 0; i < num_keys; i++)
+    moved += before[i] != after[i];
+  return (double)moved / num_keys;
+}
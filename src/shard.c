@@ -1,18 +1,30 @@
 #include "../lib/connq/connq.h"
+#include "../lib/hashing/hashing.h"
+#include "../lib/lease/lease.h"
 #include "../lib/cproto/cproto.h"
 #include "../lib/logger/logger.h"
 #include "../lib/lru//lru.h"
+#include "../lib/metrics/metrics.h"
 #include "../lib/nethelpers/nethelpers.h"
+#include "../lib/replog/replog.h"
+#include "../lib/ring/ring.h"
+#include "../lib/trace/trace.h"
+#include "../lib/watch/watch.h"
 #include <arpa/inet.h>
 #include <bits/getopt_core.h>
 #include <errno.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
 // ---------------- DEFAULT VALUES ----------------
@@ -22,8 +34,26 @@
 #define BACKLOG 100
 #define MAX_THREADS 10
 #define MAX_CACHE_CAPACITY 1000
-#define HEARTBEAT_INTERVAL 10
+#define HEARTBEAT_INTERVAL 2
+#define RING_MAP_REFRESH_INTERVAL 10
 #define MAX_FLWR_PER_MASTER 2
+#define REPL_LOG_CAPACITY 4096
+#define REPL_BATCH_SIZE 128
+#define SNAPSHOT_BATCH_SIZE 512
+#define REPL_RECONNECT_INTERVAL 1
+#define REPL_IDLE_TIMEOUT_MS 1000
+#define MAX_UPSTREAM_FAILURES 3
+#define METRICS_BACKLOG 10
+#define DEFAULT_TRACE_SAMPLE_RATE 1000
+#define LEASE_TABLE_SIZE 1024
+#define LEASE_TIMEOUT_MS 1000
+#define LEASE_WAIT_MS 100
+#define EVICT_INTERVAL_MS 100
+#define EVICT_BATCH_SIZE 64
+#define MIGRATE_RETRY_INTERVAL 1
+#define POLL_BATCH_SIZE 64
+#define WATCH_TABLE_SIZE 1024
+#define MAX_WATCHERS 65536
 // ---------------- CUSTOM TYPES ------------------
 
 typedef enum {
@@ -34,16 +64,15 @@ typedef enum {
 typedef struct {
   IA addr;
   in_port_t port;
+  int socket;      // persistent replication stream.
+  uint64_t cursor; // sequence number of the last record sent.
+  uint64_t acked;  // sequence number acknowledged by the follower.
+  bool snapshot;   // follower can not catch up from the log.
+  bool closed;     // stream is shutting down.
+  int refs;        // held by the sender and the ack thread.
+  int idx;         // slot in the follower array.
 } follower_t;
 
-typedef struct {
-  uint8_t *payload;
-  uint32_t payload_len;
-  pthread_mutex_t lock;
-  pthread_cond_t cond;
-  bool consume;
-} follower_chan_t;
-
 // ---------------- FUNCTION PROTOTYPES ------------
 
 // Runner functions.
@@ -52,19 +81,65 @@ int run(in_port_t shard_port);
 
 // Thread functions.
 void *worker_thread(void *arg);
+void *poller_thread(void *arg);
 void *master_heartbeat_thread(void *arg);
 void *follower_heartbeat_thread(void *arg);
+void *replication_sender_thread(void *arg);
+void *replication_receiver_thread(void *arg);
+void *replication_ack_thread(void *arg);
+void *metrics_thread(void *arg);
+void *eviction_thread(void *arg);
+void *migration_thread(void *arg);
+void *shutdown_thread(void *arg);
+uint64_t measure_load(metrics_snapshot_t *snapshot, uint64_t requests,
+                      uint32_t *load);
+
+// Replication.
+int connect_to_upstream(bool fallback);
+void set_upstreams(uint8_t *payload);
+void receive_replication_stream(int socket);
+int send_snapshot(follower_t *flwr);
+void send_ack();
+void release_follower(follower_t *flwr);
+void apply_records(uint8_t *record, uint32_t num_records, bool append);
+void wake_evictor();
+int refresh_ring_map();
+void install_ring_map(ring_map_t *map);
+char *key_of(CanaryMsg *msg);
+bool owns_key(char *key, bool read, uint64_t *epoch);
+int migrate_keys();
+void notify_watchers(char *key, watcher_t *watchers);
+
+// Connections.
+void enqueue_connection(conn_ctx_t *ctx);
+void watch_connection(conn_ctx_t *ctx);
 
 // Handlers.
 void handle_connection(conn_ctx_t *ctx);
-void handle_put(uint8_t *payload, uint32_t payload_len);
+void handle_put(int socket, uint8_t *payload);
+void handle_counter(int socket, CanaryMsgType type, uint8_t *payload);
+void handle_cas(int socket, uint8_t *payload);
+bool is_cas_payload(uint8_t *payload, uint32_t len);
 void handle_get(int socket, uint8_t *payload);
-void handle_flwr_connection(int socket, IA addr, uint8_t *payload);
-void handle_replication(int socket, uint8_t *payload, uint32_t payload_len);
+void handle_lease(int socket, uint8_t *payload);
+void handle_watch(int socket, IA addr, uint8_t *payload);
+void handle_mget(int socket, uint8_t *payload, uint32_t payload_len);
+void handle_mput(int socket, uint8_t *payload, uint32_t payload_len);
+void handle_stats(int socket);
+int handle_flwr_connection(int socket, IA addr, uint8_t *payload);
+int handle_replication(uint8_t *payload);
+int handle_snapshot(uint8_t *payload, bool first);
+void handle_migration(int socket, uint8_t *payload);
+void handle_reregistration();
+void handle_promotion(uint8_t *payload);
+void handle_upstreams(uint8_t *payload);
 
 // ---------------- GLOBAL VARIABLES --------------
 
-ShardRole role = Master;
+// The role and the id change when a follower is promoted, while other threads
+// read them, so they are atomic. The id is written before the role, so that a
+// thread that sees the shard as a master also sees its id.
+_Atomic ShardRole role = Master;
 
 // Address and port of configuration service.
 char cnf_addr[20] = DEFAULT_CNF_ADDR;
@@ -74,16 +149,67 @@ int num_flwrs = 0;
 follower_t *flwrs[MAX_FLWR_PER_MASTER] = {NULL};
 pthread_mutex_t flwr_lock;
 
+// Replication log that feeds the follower streams. Followers mirror the log
+// of their master, so that they can feed followers after them in a chain.
+replog_t *repl_log;
+
+// Master shard, and upstream shard (the master or the previous follower in a
+// chain) that a follower replicates from. Protected by the upstream lock once
+// the follower is registered, they change when a follower is promoted or
+// registers again.
+char mstr_addr[20], upstream_addr[20];
+in_port_t mstr_port, upstream_port, flwr_port;
+
+// Replication stream to the upstream shard, acks are written to it from
+// several threads.
+int upstream_socket = -1;
+pthread_mutex_t upstream_lock;
+
+// [ mstr_id | flwr_idx ] of a follower, sent with its heartbeats. Changes when
+// the follower registers again, protected by the upstream lock.
+uint8_t flwr_ids[sizeof(uint32_t) * 2];
+
+// Id of the shard on the ring, if it is a master.
+_Atomic uint32_t shard_id;
+
+// Ring map of the configuration service, used to turn away keys that the
+// shard does not own. NULL until it has been fetched.
+ring_map_t *ring_map = NULL;
+pthread_rwlock_t ring_map_lock;
+
+// Wakes up the migration thread when the ring map changes.
+pthread_cond_t ring_changed_cond;
+pthread_mutex_t ring_changed_lock;
+bool ring_changed = false;
+
+// Only one thread at a time hands keys to their new owners.
+pthread_mutex_t migrate_lock;
+
 // Thread pool variables.
 conn_queue_t conn_q;
 pthread_t thread_pool[MAX_THREADS], heartbeat;
 pthread_cond_t conn_q_cond;
 pthread_mutex_t conn_q_lock;
 
+// Clients keep their connections open between requests, the poller puts a
+// connection back on the queue once its next request arrives.
+int poll_fd;
+
 // local LRU cache protected by mutex.
 lru_cache_t *cache;
 pthread_mutex_t cache_lock;
 
+// Wakes up the eviction thread when the cache grows past its high watermark.
+pthread_cond_t evict_cond;
+
+// In-flight read-through loads, protected by the cache lock.
+lease_table_t *leases;
+
+// Clients to notify when a key they cache near them is written, protected by
+// the cache lock. Invalidations are sent from an unconnected datagram socket.
+watch_table_t *watches;
+int notify_socket;
+
 // ---------------- IMPLEMENTATION -----------------
 
 /**
@@ -92,15 +218,20 @@ pthread_mutex_t cache_lock;
  * - Parses command line arguments into local/global values.
  * - Registers shard with configuration service
  * - Runs the shard socket server.
+ * - On SIGTERM or SIGINT a master leaves the ring and hands its keys to the
+ *   new owners before it exits.
  *
  */
 int main(int argc, char *argv[]) {
   int opt;
   int num_threads = MAX_THREADS, cache_capacity = MAX_CACHE_CAPACITY;
-  in_port_t shard_port = DEFAULT_SHARD_PORT;
+  unsigned ttl = 0;
+  in_port_t shard_port = DEFAULT_SHARD_PORT, metrics_port = 0;
+  char *trace_path = NULL;
+  unsigned trace_sample_rate = DEFAULT_TRACE_SAMPLE_RATE;
 
   // Parse flags
-  while ((opt = getopt(argc, argv, "p:P:a:c:t:f")) != -1) {
+  while ((opt = getopt(argc, argv, "p:P:a:c:t:fl:m:T:s:e:")) != -1) {
     switch (opt) {
     case 'p':
       shard_port = atoi(optarg);
@@ -124,20 +255,66 @@ int main(int argc, char *argv[]) {
     case 'f':
       role = Follower;
       break;
+    case 'm':
+      metrics_port = atoi(optarg);
+      break;
+    case 'T':
+      trace_path = optarg;
+      break;
+    case 's':
+      trace_sample_rate = atoi(optarg);
+      break;
+    case 'e':
+      ttl = atoi(optarg);
+      break;
+    case 'l':
+      if (parse_log_level(optarg, &log_level) == 0)
+        break;
     default:
       printf("Usage: %s [-p <shard-port] [-P <cnf-port>] [-a <cnf-addr>] [-c "
-             "<cache-capacity>] [-t <num-threads], [-f]\n",
+             "<cache-capacity>] [-t <num-threads], [-f] [-l "
+             "<error|warn|info|debug>] [-m <metrics-port>] [-T <trace-file>] "
+             "[-s <trace-sample-rate>] [-e <ttl-seconds>]\n",
              argv[0]);
       exit(EXIT_FAILURE);
     }
   }
 
+  // Replication streams are long-lived, a dead peer must not kill the shard.
+  signal(SIGPIPE, SIG_IGN);
+
+  // Termination is handled by the shutdown thread, every thread inherits the
+  // blocked signals.
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+  // Sample 1 in `trace_sample_rate` requests into a Chrome trace.
+  if (trace_path != NULL && trace_open(trace_path, trace_sample_rate) == -1) {
+    log_error("could not open trace file %s", trace_path);
+    exit(EXIT_FAILURE);
+  }
+
   // Initialize local LRU cache.
+  srand(time(NULL) ^ getpid());
   cache = create_lru_cache(cache_capacity);
+  // Start the versions from the clock, so that a restarted master does not
+  // hand out versions that clients may still hold from before the restart.
+  cache->version_clock = (uint64_t)time(NULL) << 20;
+  cache->ttl = (uint64_t)ttl * 1000000000;
+  leases = create_lease_table(LEASE_TABLE_SIZE);
+  watches = create_watch_table(WATCH_TABLE_SIZE, MAX_WATCHERS);
+  if ((notify_socket = bind_udp_socket(0)) == -1) {
+    log_error("could not create the invalidation socket");
+    exit(EXIT_FAILURE);
+  }
+  repl_log = create_replog(REPL_LOG_CAPACITY, rand64());
 
   // Register shard with configuration service.
   if (register_with_cnf(cnf_addr, cnf_port, shard_port) == -1) {
-    logfmt("Could not register with configuration service");
+    log_error("Could not register with configuration service");
     exit(EXIT_FAILURE);
   }
 
@@ -146,11 +323,41 @@ int main(int argc, char *argv[]) {
   for (long i = 0; i < num_threads; i++) {
     pthread_create(&thread_pool[i], NULL, worker_thread, (void *)i);
   }
+  if ((poll_fd = epoll_create1(0)) == -1) {
+    log_error("could not watch client connections");
+    exit(EXIT_FAILURE);
+  }
+  pthread_t poller;
+  pthread_create(&poller, NULL, poller_thread, NULL);
+  pthread_detach(poller);
+
+  // The eviction thread waits with a monotonic deadline.
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&evict_cond, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_t evictor;
+  pthread_create(&evictor, NULL, eviction_thread, NULL);
+  pthread_detach(evictor);
+
+  pthread_t migrator, terminator;
+  pthread_create(&migrator, NULL, migration_thread, NULL);
+  pthread_detach(migrator);
+  pthread_create(&terminator, NULL, shutdown_thread, NULL);
+  pthread_detach(terminator);
+
+  // Optionally serve the metrics over HTTP, for Prometheus to scrape.
+  if (metrics_port != 0) {
+    pthread_t metrics;
+    pthread_create(&metrics, NULL, metrics_thread, (void *)(long)metrics_port);
+    pthread_detach(metrics);
+  }
 
-  logfmt("starting data shard server at port %d", shard_port);
+  log_info("starting data shard server at port %d", shard_port);
   // Run socket server.
   if (run(shard_port) == -1) {
-    logfmt("could not run shard server");
+    log_error("could not run shard server");
     exit(EXIT_FAILURE);
   }
 }
@@ -171,10 +378,13 @@ int register_with_cnf(char *cnf_addr, in_port_t cnf_port,
   CanaryMsg req, resp;
   int cnf_socket = connect_to_socket(cnf_addr, cnf_port);
 
-  uint8_t payload[2];
+  // [ port | capacity ], the capacity weighs the share of keys of a master.
+  uint8_t payload[sizeof(in_port_t) + sizeof(uint32_t)];
   pack_short(shard_port, payload);
+  uint32_t n_capacity = htonl(cache->capacity);
+  memcpy(payload + sizeof(in_port_t), &n_capacity, sizeof(n_capacity));
 
-  req = (CanaryMsg){.payload_len = 2, .payload = payload};
+  req = (CanaryMsg){.payload_len = sizeof(payload), .payload = payload};
 
   if (role == Master) {
     req.type = Mstr2CnfRegister;
@@ -187,29 +397,30 @@ int register_with_cnf(char *cnf_addr, in_port_t cnf_port,
 
   switch (resp.type) {
   case Cnf2MstrRegister:
+    shard_id = ntohl(*(uint32_t *)resp.payload);
     pthread_create(&heartbeat, NULL, master_heartbeat_thread,
                    (void *)resp.payload);
-    logfmt("Successfully registered shard as a master shard");
+    log_info("Successfully registered shard as a master shard");
     return 0;
   case Cnf2FlwrRegister: {
-    char *mstr_addr;
-    in_port_t mstr_port;
-    unpack_string_short(&mstr_addr, &mstr_port,
-                        (resp.payload + sizeof(uint32_t) * 2));
-    pthread_create(&heartbeat, NULL, follower_heartbeat_thread,
-                   (void *)resp.payload);
-    int mstr_socket = connect_to_socket(mstr_addr, mstr_port);
-    send_msg(mstr_socket, (CanaryMsg){.type = Flwr2MstrConnect,
-                                      .payload_len = sizeof(in_port_t),
-                                      .payload = payload});
-    logfmt("Successfully registered shard as a follower shard");
+    set_upstreams(resp.payload);
+    free(resp.payload);
+    flwr_port = shard_port;
+
+    pthread_create(&heartbeat, NULL, follower_heartbeat_thread, NULL);
+
+    // The receiver keeps a replication stream open to the master.
+    pthread_t receiver;
+    pthread_create(&receiver, NULL, replication_receiver_thread, NULL);
+    pthread_detach(receiver);
+    log_info("Successfully registered shard as a follower shard");
     return 0;
   }
   case Error:
-    logfmt("Failed to register shardd due to: %s", resp.payload);
+    log_warn("Failed to register shardd due to: %s", resp.payload);
     break;
   default:
-    logfmt("Received wrong message type %d", resp.type);
+    log_warn("Received wrong message type %d", resp.type);
     break;
   }
 
@@ -235,22 +446,23 @@ int run(in_port_t shard_port) {
     addr_size = sizeof(SA_IN);
     if ((client_socket = accept(shard_socket, (SA *)&client_addr,
                                 (socklen_t *)&addr_size)) == -1) {
-      logfmt("Accept failed");
+      log_warn("Accept failed");
       continue;
     }
+    // Responses to pipelined requests must not wait for the previous ones
+    // to be acknowledged.
+    int nodelay = 1;
+    setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &nodelay,
+               sizeof(nodelay));
 
     // Allocate on heap, freed by worker.
     conn_ctx_t *ctx = malloc(sizeof(conn_ctx_t));
     *ctx = (conn_ctx_t){.socket = client_socket,
                         .client_addr = client_addr.sin_addr,
-                        .port = client_addr.sin_port};
-
-    // CRITICAL SECTION BEGIN
-    pthread_mutex_lock(&conn_q_lock);
-    enqueue(&conn_q, ctx);
-    pthread_cond_signal(&conn_q_cond);
-    pthread_mutex_unlock(&conn_q_lock);
-    // CRITICAL SECTION END
+                        .port = client_addr.sin_port,
+                        .enqueued_at = metrics_now(),
+                        .kept_alive = false};
+    enqueue_connection(ctx);
   }
 }
 
@@ -267,246 +479,1935 @@ void *worker_thread(void *arg) {
 
     // CRITICAL SECTION BEGIN
     pthread_mutex_lock(&conn_q_lock);
-    if ((ctx = dequeue(&conn_q)) == NULL) {
-      // Suspend if there is no work.
+    while ((ctx = dequeue(&conn_q)) == NULL) {
+      // Suspend if there is no work, another worker may have grabbed the
+      // connection before us so always retry.
       pthread_cond_wait(&conn_q_cond, &conn_q_lock);
-
-      // retry
-      ctx = dequeue(&conn_q);
     }
     pthread_mutex_unlock(&conn_q_lock);
     // CRITICAL SECTION END
 
+    trace_begin(ctx->enqueued_at);
+    trace_stage(Dequeue);
+    metrics_gauge_add(GaugeQueueDepth, -1);
+    metrics_record(HistQueueWait, metrics_now() - ctx->enqueued_at);
     handle_connection(ctx);
+    trace_end();
+  }
+}
+
+/**
+ * @brief Waits for the next request on the connections that clients keep
+ * open, and puts them on the connection queue once it arrives. Connections
+ * are watched one shot at a time, so that a connection is only ever handled
+ * by one worker.
+ *
+ * @param arg - void *
+ */
+void *poller_thread(void *arg) {
+  struct epoll_event events[POLL_BATCH_SIZE];
+
+  while (1) {
+    int num_events = epoll_wait(poll_fd, events, POLL_BATCH_SIZE, -1);
+    for (int i = 0; i < num_events; i++) {
+      conn_ctx_t *ctx = events[i].data.ptr;
+      ctx->enqueued_at = metrics_now();
+      enqueue_connection(ctx);
+    }
   }
 }
 
 /**
- * @brief Will periodically send a heartbeat to the configuration service.
+ * @brief Will periodically send a heartbeat datagram to the configuration
+ * service, and fetch its ring map in case a push of it was missed. A single
+ * datagram socket is used for the lifetime of the shard, so a heartbeat costs
+ * no connection setup on either side.
+ *
+ * Heartbeats carry the load of the shard, the gets and puts per second since
+ * the last heartbeat, for the bounded loads of the configuration service.
  *
  * @param arg - void *
  * @return
  */
 void *master_heartbeat_thread(void *arg) {
-  int socket;
-
-  // As the message payload is always identical we can create it in advance.
-  uint32_t id = *(uint32_t *)arg;
-  int payload_len = sizeof(id);
-  uint8_t *payload = (uint8_t *)&id;
+  // [ id | load ], the id is already in network byte order.
+  uint32_t payload[2] = {*(uint32_t *)arg, 0};
   CanaryMsg msg = {.type = Mstr2CnfHeartbeat,
-                   .payload_len = payload_len,
-                   .payload = payload};
+                   .payload_len = sizeof(payload),
+                   .payload = (uint8_t *)payload};
+  metrics_snapshot_t *snapshot = malloc(sizeof(metrics_snapshot_t));
+  uint64_t requests = measure_load(snapshot, 0, NULL);
 
   free(arg);
+  int socket = connect_udp_socket(cnf_addr, cnf_port);
+  if (socket == -1)
+    log_warn("Heartbeat thread could not create socket to configuration "
+             "service");
+
+  refresh_ring_map();
+  time_t refresh_at = time(NULL) + RING_MAP_REFRESH_INTERVAL;
   // sleep -> send message -> sleep ...
   while (1) {
     sleep(HEARTBEAT_INTERVAL);
-    if ((socket = connect_to_socket(cnf_addr, cnf_port)) == -1) {
-      logfmt("Heartbeat thread could not connect to configuration service");
-      continue;
+    uint32_t load;
+    requests = measure_load(snapshot, requests, &load);
+    payload[1] = htonl(load);
+
+    if (socket != -1 && send_datagram(socket, msg) == -1)
+      log_warn("Heartbeat thread could not reach configuration service");
+    if (time(NULL) >= refresh_at) {
+      refresh_ring_map();
+      refresh_at = time(NULL) + RING_MAP_REFRESH_INTERVAL;
     }
-    send_msg(socket, msg);
-    close(socket);
   }
 }
 
 /**
- * @brief Will periodically send a heartbeat to the configuration service.
+ * @brief Will periodically send a heartbeat datagram to the configuration
+ * service, with the last applied record of the replication log so that the
+ * most up-to-date follower can be promoted, and its load so that clients
+ * spread their gets over the replicas. Stops once the follower has been
+ * promoted.
  *
  * @param arg
  * @return
  */
 void *follower_heartbeat_thread(void *arg) {
-  int socket, payload_len = sizeof(uint32_t) * 2;
-
-  // copy the data to stack as pointer will be freed by other function call.
-  uint8_t *cnf_payload = (uint8_t *)arg;
-  uint8_t payload[payload_len];
-  memcpy(payload, cnf_payload, payload_len);
-  free(arg);
+  // [ mstr_id | flwr_idx | seq | load ]
+  uint8_t payload[sizeof(flwr_ids) + sizeof(uint64_t) + sizeof(uint32_t)];
+  metrics_snapshot_t *snapshot = malloc(sizeof(metrics_snapshot_t));
+  uint64_t requests = measure_load(snapshot, 0, NULL);
 
   CanaryMsg msg = {.type = Flwr2CnfHeartbeat,
-                   .payload_len = payload_len,
+                   .payload_len = sizeof(payload),
                    .payload = payload};
 
+  int socket = connect_udp_socket(cnf_addr, cnf_port);
+  if (socket == -1)
+    log_warn("Heartbeat thread could not create socket to configuration "
+             "service");
+
   // sleep -> send message -> sleep ...
-  while (1) {
+  while (role == Follower) {
     sleep(HEARTBEAT_INTERVAL);
-    if ((socket = connect_to_socket(cnf_addr, cnf_port)) == -1) {
-      logfmt("Heartbeat thread could not connect to configuration service");
-      continue;
-    }
-    send_msg(socket, msg);
+
+    // BEGIN CRITICAL SECTION
+    pthread_mutex_lock(&upstream_lock);
+    memcpy(payload, flwr_ids, sizeof(flwr_ids));
+    pthread_mutex_unlock(&upstream_lock);
+    // END CRITICAL SECTION
+
+    // BEGIN CRITICAL SECTION
+    pthread_mutex_lock(&cache_lock);
+    pack_long(replog_head(repl_log), payload + sizeof(flwr_ids));
+    pthread_mutex_unlock(&cache_lock);
+    // END CRITICAL SECTION
+
+    uint32_t load;
+    requests = measure_load(snapshot, requests, &load);
+    load = htonl(load);
+    memcpy(payload + sizeof(flwr_ids) + sizeof(uint64_t), &load, sizeof(load));
+
+    if (role == Follower && socket != -1 && send_datagram(socket, msg) == -1)
+      log_warn("Heartbeat thread could not reach configuration service");
+  }
+  if (socket != -1)
     close(socket);
+  free(snapshot);
+  return NULL;
+}
+
+/**
+ * @brief Measures the load of the shard, the gets and puts per second since
+ * the last heartbeat.
+ *
+ * @param snapshot - metrics_snapshot_t *
+ * @param requests - uint64_t, the gets and puts as of the last heartbeat.
+ * @param load - uint32_t *, NULL to only count the gets and puts.
+ * @return the gets and puts so far, to be passed to the next call.
+ */
+uint64_t measure_load(metrics_snapshot_t *snapshot, uint64_t requests,
+                      uint32_t *load) {
+  metrics_collect(snapshot);
+  uint64_t total =
+      snapshot->counters[CounterGets] + snapshot->counters[CounterPuts];
+  if (load != NULL)
+    *load = (total - requests) / HEARTBEAT_INTERVAL;
+  return total;
+}
+
+/**
+ * @brief Streams the replication log to a single follower. Followers that can
+ * not catch up from the log first receive a snapshot of the cache. Pending
+ * records are coalesced into batched frames, so a slow follower only delays
+ * itself. An empty frame is sent when the log is idle, to keep acks flowing.
+ *
+ * @param arg - follower_t *
+ */
+void *replication_sender_thread(void *arg) {
+  follower_t *flwr = (follower_t *)arg;
+  replog_batch_t batch = create_batch();
+  bool closed = false;
+
+  if (flwr->snapshot && send_snapshot(flwr) == -1) {
+    log_warn("could not send snapshot to follower at %s:%d",
+             inet_ntoa(flwr->addr), flwr->port);
+    closed = true;
+  }
+
+  while (!closed) {
+    if (replog_read(repl_log, &flwr->cursor, &batch, REPL_BATCH_SIZE,
+                    REPL_IDLE_TIMEOUT_MS) == -1) {
+      log_warn("follower at %s:%d fell behind the replication log",
+               inet_ntoa(flwr->addr), flwr->port);
+      break;
+    }
+
+    CanaryMsg msg = {.type = Mstr2FlwrReplicate,
+                     .payload_len = batch.buf_len,
+                     .payload = batch.buf};
+    if (send_msg(flwr->socket, msg) == -1) {
+      log_warn("lost replication stream to follower at %s:%d",
+               inet_ntoa(flwr->addr), flwr->port);
+      break;
+    }
+
+    pthread_mutex_lock(&flwr_lock);
+    closed = flwr->closed;
+    pthread_mutex_unlock(&flwr_lock);
   }
+
+  // Closing the stream makes the follower reconnect and catch up.
+  destroy_batch(&batch);
+  release_follower(flwr);
+  return NULL;
 }
 
-// HANDLERS
+/**
+ * @brief Keeps a replication stream open to the upstream shard, reconnecting
+ * and catching up whenever the stream is lost. If the upstream follower in a
+ * chain can not be reached, the follower falls back to the master. Stops once
+ * the follower has been promoted.
+ *
+ * @param arg - void *
+ */
+void *replication_receiver_thread(void *arg) {
+  int failures = 0;
+  while (role == Follower) {
+    int socket = connect_to_upstream(failures >= MAX_UPSTREAM_FAILURES);
+    if (socket == -1) {
+      failures++;
+      log_warn("could not connect to upstream shard");
+    } else {
+      failures = 0;
+      receive_replication_stream(socket);
+
+      pthread_mutex_lock(&upstream_lock);
+      upstream_socket = -1;
+      pthread_mutex_unlock(&upstream_lock);
+
+      close(socket);
+      if (role != Follower)
+        break;
+      log_warn("lost replication stream from upstream shard");
+    }
+    sleep(REPL_RECONNECT_INTERVAL);
+  }
+  return NULL;
+}
 
 /**
- * @brief Will handle a socket connection. Will in turn multiplex out to other
- * handlers depending on what type of message is received.
+ * @brief Reads acks sent back by a follower on its replication stream. Acks
+ * from followers after this one in a chain are forwarded upstream.
  *
- * @param ctx - conn_ctx_t
+ * @param arg - follower_t *
  */
-void handle_connection(conn_ctx_t *ctx) {
-  int socket = ctx->socket;
-  IA client_addr = ctx->client_addr;
+void *replication_ack_thread(void *arg) {
+  follower_t *flwr = (follower_t *)arg;
   CanaryMsg msg;
 
-  free(ctx); // we have copied the necessary data.
+  while (receive_msg(flwr->socket, &msg) != -1) {
+    if (msg.type != Flwr2MstrAck) {
+      free(msg.payload);
+      break;
+    }
 
-  if (receive_msg(socket, &msg) == -1) {
-    send_error_msg(socket, "Could not receive message");
-    return;
+    uint64_t seq;
+    unpack_long(&seq, msg.payload);
+    free(msg.payload);
+
+    pthread_mutex_lock(&flwr_lock);
+    flwr->acked = seq;
+    pthread_mutex_unlock(&flwr_lock);
+
+    if (role == Follower)
+      send_ack();
   }
 
-  // Multiplex out to other handlers.
-  switch (msg.type) {
-  case Client2MstrPut:
-    if (role != Master) {
-      logfmt("follower received put message");
-    } else {
-      handle_put(msg.payload, msg.payload_len);
+  release_follower(flwr);
+  return NULL;
+}
+
+/**
+ * @brief Serves the metrics of the shard over HTTP, in the Prometheus text
+ * format. Scrapes are rare, so they are served one at a time.
+ *
+ * @param arg - in_port_t, the metrics port.
+ */
+void *metrics_thread(void *arg) {
+  in_port_t port = (in_port_t)(long)arg;
+  int server_socket, socket;
+  char request[1024], header[128];
+
+  if ((server_socket = bind_n_listen_socket(port, METRICS_BACKLOG)) == -1) {
+    log_error("could not serve metrics at port %d", port);
+    return NULL;
+  }
+  log_info("serving metrics at port %d", port);
+
+  while (1) {
+    if ((socket = accept(server_socket, NULL, NULL)) == -1)
+      continue;
+
+    // Every request gets the metrics, the request itself is ignored.
+    if (recv(socket, request, sizeof(request), 0) <= 0) {
+      close(socket);
+      continue;
     }
-    break;
-  case Mstr2FlwrReplicate:
-    if (role != Follower) {
-      logfmt("master received replication message");
-    } else {
-      handle_put(msg.payload, msg.payload_len);
+
+    metrics_snapshot_t *snapshot = malloc(sizeof(metrics_snapshot_t));
+    char *text;
+    int len;
+    metrics_collect(snapshot);
+    if ((len = metrics_format(snapshot, &text)) != -1) {
+      int header_len =
+          snprintf(header, sizeof(header),
+                   "HTTP/1.0 200 OK\r\nContent-Type: text/plain; "
+                   "version=0.0.4\r\nContent-Length: %d\r\n\r\n",
+                   len);
+      send(socket, header, header_len, 0);
+      send(socket, text, len, 0);
+      free(text);
     }
-    break;
-  case Client2ShardGet:
-    handle_get(socket, msg.payload);
-    break;
-  case Flwr2MstrConnect:
-    if (role != Master) {
-      send_error_msg(socket, "Not master shard");
+    free(snapshot);
+    close(socket);
+  }
+}
+
+/**
+ * @brief Keeps the cache below its high watermark, so that puts rarely pay
+ * for an eviction. Once the cache grows past the high watermark, entries are
+ * evicted in batches until it is down to the low watermark, and expired
+ * entries are reclaimed on every round. The removed entries go back to the
+ * free list of the cache for puts to reuse, and those that do not fit are
+ * freed outside of the cache lock, which is released between batches.
+ *
+ * @param arg - void *
+ */
+void *eviction_thread(void *arg) {
+  bool evicting = false;
+
+  // BEGIN CRITICAL SECTION
+  pthread_mutex_lock(&cache_lock);
+  while (1) {
+    if (!evicting) {
+      uint64_t deadline = metrics_now() + (uint64_t)EVICT_INTERVAL_MS * 1000000;
+      struct timespec ts = {.tv_sec = deadline / 1000000000,
+                            .tv_nsec = deadline % 1000000000};
+      pthread_cond_timedwait(&evict_cond, &cache_lock, &ts);
+    }
+
+    size_t num_elements = cache->num_elements;
+    lru_entry_t *expired = lru_expire(cache, lru_now(), EVICT_BATCH_SIZE);
+    size_t num_expired = num_elements - cache->num_elements;
+
+    lru_entry_t *evicted = NULL;
+    if (evicting || cache->num_elements > cache->high_watermark)
+      evicted = lru_evict(cache, cache->low_watermark, EVICT_BATCH_SIZE);
+    size_t num_evicted = num_elements - num_expired - cache->num_elements;
+    evicting = evicted != NULL && cache->num_elements > cache->low_watermark;
+
+    expired = lru_recycle(cache, expired);
+    evicted = lru_recycle(cache, evicted);
+    pthread_mutex_unlock(&cache_lock);
+
+    destroy_entries(expired);
+    destroy_entries(evicted);
+    metrics_inc(CounterExpirations, num_expired);
+    metrics_inc(CounterEvictions, num_evicted);
+
+    pthread_mutex_lock(&cache_lock);
+  }
+  // END CRITICAL SECTION
+}
+
+/**
+ * @brief Hands the keys that the master no longer owns to their new owners
+ * whenever the ring map changes.
+ *
+ * @param arg - void *
+ */
+void *migration_thread(void *arg) {
+  bool retry = false;
+  while (1) {
+    // BEGIN CRITICAL SECTION
+    pthread_mutex_lock(&ring_changed_lock);
+    while (!ring_changed && !retry)
+      pthread_cond_wait(&ring_changed_cond, &ring_changed_lock);
+    ring_changed = false;
+    pthread_mutex_unlock(&ring_changed_lock);
+    // END CRITICAL SECTION
+
+    // A new owner may not be listening yet, keys it did not take are retried.
+    retry = migrate_keys() > 0;
+    if (retry)
+      sleep(MIGRATE_RETRY_INTERVAL);
+  }
+}
+
+/**
+ * @brief Waits for SIGTERM or SIGINT. A master leaves the ring first, and
+ * hands all its keys to their new owners before the shard exits.
+ *
+ * @param arg - void *
+ */
+void *shutdown_thread(void *arg) {
+  int sig;
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGINT);
+  sigwait(&signals, &sig);
+
+  log_info("received signal %d, shutting down", sig);
+  if (role == Master && shard_id != 0) {
+    uint32_t n_id = htonl(shard_id);
+    CanaryMsg msg = {.type = Mstr2CnfDeregister,
+                     .payload_len = sizeof(n_id),
+                     .payload = (uint8_t *)&n_id};
+    int socket = connect_to_socket(cnf_addr, cnf_port);
+    if (socket != -1 && send_msg(socket, msg) != -1 &&
+        receive_msg(socket, &msg) != -1 && msg.type == Cnf2MstrDeregister) {
+      free(msg.payload);
+      // The configuration service also pushes the map, but we can not rely
+      // on it arriving before the shard exits.
+      if (refresh_ring_map() == 0)
+        migrate_keys();
     } else {
-      handle_flwr_connection(socket, client_addr, msg.payload);
+      log_warn("could not leave the ring, the keys of the shard are lost");
     }
-    break;
-  default:
-    send_error_msg(socket, "Incorrect Canary message type");
-    break;
+    if (socket != -1)
+      close(socket);
   }
-  close(socket);
+  flush_log();
+  exit(EXIT_SUCCESS);
 }
 
+// REPLICATION
+
 /**
- * @brief Handles a `put` operation by a client. If the role of the shard is
- * `Master` it will send the payload to all listening follower channels.
+ * @brief Connects to the upstream shard and reports the last applied sequence
+ * number, so that the upstream can decide how to catch the follower up.
  *
- * @param payload - uint8_t *
+ * @param fallback - bool, connect to the master instead of the upstream.
+ * @return the socket of the replication stream, -1 in case of error.
  */
-void handle_put(uint8_t *payload, uint32_t payload_len) {
-  char *key;
-  int value;
+int connect_to_upstream(bool fallback) {
+  char addr[sizeof(mstr_addr)];
+  in_port_t port;
 
-  unpack_string_int(&key, &value, payload);
+  // BEGIN CRITICAL SECTION
+  pthread_mutex_lock(&upstream_lock);
+  strcpy(addr, fallback ? mstr_addr : upstream_addr);
+  port = fallback ? mstr_port : upstream_port;
+  pthread_mutex_unlock(&upstream_lock);
+  // END CRITICAL SECTION
+
+  int socket = connect_to_socket(addr, port);
+  if (socket == -1)
+    return -1;
+
+  // [ port | log_id | seq ]
+  uint8_t payload[sizeof(in_port_t) + sizeof(uint64_t) * 2];
+  pack_short(flwr_port, payload);
 
   // BEGIN CRITICAL SECTION
   pthread_mutex_lock(&cache_lock);
-  lru_entry_t *removed = put(cache, key, value);
+  pack_long(repl_log->id, payload + sizeof(in_port_t));
+  pack_long(replog_head(repl_log),
+            payload + sizeof(in_port_t) + sizeof(uint64_t));
   pthread_mutex_unlock(&cache_lock);
   // END CRITICAL SECTION
 
-  logfmt("Put key value pair (%s, %d)", key, value);
-  if (removed != NULL) {
-    logfmt("expelled key value pair (%s, %d) from cache", removed->key,
-           removed->value);
-    free(removed);
+  if (send_msg(socket, (CanaryMsg){.type = Flwr2MstrConnect,
+                                   .payload_len = sizeof(payload),
+                                   .payload = payload}) == -1) {
+    close(socket);
+    return -1;
   }
 
-  // If master replicate tho followers
-  if (role == Master) {
-    // BEGIN CRITICAL SECTION
-    pthread_mutex_lock(&flwr_lock);
-    for (int i = 0; i < MAX_FLWR_PER_MASTER; i++) {
-      if (flwrs[i] == NULL)
-        continue;
+  pthread_mutex_lock(&upstream_lock);
+  upstream_socket = socket;
+  pthread_mutex_unlock(&upstream_lock);
+  return socket;
+}
+
+/**
+ * @brief Sets the master of the follower and the shard it replicates from.
+ *
+ * [ mstr_id | flwr_idx | mstr_addr | mstr_port | upstream_addr |
+ * upstream_port ]
+ *
+ * NOTE: Is not thread safe, should be executed in critical section once the
+ * replication receiver is running.
+ *
+ * @param payload - uint8_t *
+ */
+void set_upstreams(uint8_t *payload) {
+  char *addr;
+  uint8_t *buf = payload + sizeof(flwr_ids);
+  memcpy(flwr_ids, payload, sizeof(flwr_ids));
+
+  unpack_string_short(&addr, &mstr_port, buf);
+  memset(mstr_addr, 0, sizeof(mstr_addr));
+  strncpy(mstr_addr, addr, sizeof(mstr_addr) - 1);
+  buf += sizeof(uint32_t) + strlen(addr) + 1 + sizeof(mstr_port);
+  free(addr);
+
+  unpack_string_short(&addr, &upstream_port, buf);
+  memset(upstream_addr, 0, sizeof(upstream_addr));
+  strncpy(upstream_addr, addr, sizeof(upstream_addr) - 1);
+  free(addr);
+}
 
-      int socket = connect_to_socket(inet_ntoa(flwrs[i]->addr), flwrs[i]->port);
-      if (socket == -1) {
-        free(flwrs[i]);
-        flwrs[i] = NULL;
+/**
+ * @brief Applies messages from a replication stream until it is lost or a gap
+ * in the sequence numbers is detected.
+ *
+ * @param socket - int
+ */
+void receive_replication_stream(int socket) {
+  CanaryMsg msg;
+  bool in_snapshot = false;
+
+  while (receive_msg(socket, &msg) != -1) {
+    switch (msg.type) {
+    case Mstr2FlwrSnapshot:
+      // A snapshot is terminated by a frame without records.
+      in_snapshot = handle_snapshot(msg.payload, !in_snapshot) > 0;
+      if (!in_snapshot)
+        send_ack();
+      break;
+    case Mstr2FlwrReplicate:
+      if (handle_replication(msg.payload) == -1) {
+        log_warn("gap in replication stream, catching up");
+        return;
       }
-      send_msg(socket, (CanaryMsg){.type = Mstr2FlwrReplicate,
-                                   .payload_len = payload_len,
-                                   .payload = payload});
-      close(socket);
+      send_ack();
+      break;
+    case Error:
+      log_warn("master shard refused replication stream: %s", msg.payload);
+      free(msg.payload);
+      return;
+    default:
+      log_warn("Received wrong message type %d on replication stream",
+               msg.type);
+      free(msg.payload);
+      return;
     }
-    pthread_mutex_unlock(&flwr_lock);
-    // END CRITICAL SECTION
   }
-  free(payload);
 }
 
 /**
- * @brief Handles a `get` operation by a client.
+ * @brief Sends a snapshot of the whole cache to a follower. The snapshot is
+ * taken together with the head of the replication log, after which the
+ * follower continues from the log.
  *
- * @param socket - int
- * @param payload - uint8_t *
+ * @param flwr - follower_t *
+ * @return -1 in case of error, 0 otherwise.
  */
-void handle_get(int socket, uint8_t *payload) {
-  CanaryMsg msg = {.type = Shard2ClientGet};
-
-  char *key = (char *)payload;
+int send_snapshot(follower_t *flwr) {
+  int rc = 0;
 
   // BEGIN CRITICAL SECTION
   pthread_mutex_lock(&cache_lock);
-  int *value = get(cache, key);
+  // Puts are appended to the log while holding the cache lock.
+  uint64_t seq = replog_head(repl_log);
+
+  int num_batches;
+  replog_batch_t *batches =
+      replog_snapshot(cache, repl_log->id, seq, SNAPSHOT_BATCH_SIZE, lru_now(),
+                      &num_batches);
   pthread_mutex_unlock(&cache_lock);
   // END CRITICAL SECTION
 
-  if (value == NULL) {
-    logfmt("no value cached for key \"%s\"", key);
-    msg.payload_len = 0;
-  } else {
-    logfmt("value %d cached for key \"%s\"", *value, key);
-    msg.payload_len = sizeof(int);
-    msg.payload = (uint8_t *)value;
+  for (int i = 0; i < num_batches; i++) {
+    CanaryMsg msg = {.type = Mstr2FlwrSnapshot,
+                     .payload_len = batches[i].buf_len,
+                     .payload = batches[i].buf};
+    if (rc == 0 && send_msg(flwr->socket, msg) == -1)
+      rc = -1;
+    destroy_batch(&batches[i]);
   }
-  send_msg(socket, msg);
+  free(batches);
+
+  log_info("sent snapshot at sequence number %lu to follower at %s:%d", seq,
+           inet_ntoa(flwr->addr), flwr->port);
+  flwr->cursor = seq;
+  return rc;
 }
 
 /**
- * @brief Will register a new follower
- *
- *
- * @param socket - int
+ * @brief Acknowledges the highest sequence number that has been applied by
+ * this follower and by all followers after it in the chain.
  */
-void handle_flwr_connection(int socket, IA addr, uint8_t *payload) {
-  in_port_t port;
-  unpack_short(&port, payload);
-  int idx = -1;
-  follower_t *flwr;
+void send_ack() {
+  uint64_t seq = replog_head(repl_log);
 
   // BEGIN CRITICAL SECTION
   pthread_mutex_lock(&flwr_lock);
-
-  if (num_flwrs >= MAX_FLWR_PER_MASTER) {
-    send_error_msg(socket, "Follower capacity reached");
-  } else {
-    // Create channel.
-    flwr = malloc(sizeof(follower_t));
-    *flwr = (follower_t){.addr = addr, .port = port};
-
-    for (idx = 0; idx < MAX_FLWR_PER_MASTER; idx++) {
-      if (flwrs[idx] == NULL) {
-        flwrs[idx] = flwr;
-        num_flwrs++;
-        break;
-      }
-    }
+  for (int i = 0; i < MAX_FLWR_PER_MASTER; i++) {
+    if (flwrs[i] != NULL && !flwrs[i]->closed && flwrs[i]->acked < seq)
+      seq = flwrs[i]->acked;
   }
   pthread_mutex_unlock(&flwr_lock);
   // END CRITICAL SECTION
+
+  uint8_t payload[sizeof(seq)];
+  pack_long(seq, payload);
+
+  // BEGIN CRITICAL SECTION
+  pthread_mutex_lock(&upstream_lock);
+  if (upstream_socket != -1)
+    send_msg(upstream_socket, (CanaryMsg){.type = Flwr2MstrAck,
+                                          .payload_len = sizeof(payload),
+                                          .payload = payload});
+  pthread_mutex_unlock(&upstream_lock);
+  // END CRITICAL SECTION
 }
 
-void handle_replication(int socket, uint8_t *payload, uint32_t payload_len) {
-  logfmt("replicating data from master shard");
-  handle_put(payload, payload_len);
+/**
+ * @brief Releases a reference to a follower stream. The first release removes
+ * the follower and shuts the stream down, the last one frees it.
+ *
+ * @param flwr - follower_t *
+ */
+void release_follower(follower_t *flwr) {
+  // BEGIN CRITICAL SECTION
+  pthread_mutex_lock(&flwr_lock);
+  if (!flwr->closed) {
+    flwr->closed = true;
+    flwrs[flwr->idx] = NULL;
+    num_flwrs--;
+    metrics_gauge_add(GaugeFollowers, -1);
+    shutdown(flwr->socket, SHUT_RDWR);
+  }
+  bool last = --flwr->refs == 0;
+  pthread_mutex_unlock(&flwr_lock);
+  // END CRITICAL SECTION
+
+  if (last) {
+    close(flwr->socket);
+    free(flwr);
+  }
+}
+
+/**
+ * @brief Puts a number of packed records into the cache, and optionally
+ * appends them to the local replication log.
+ *
+ * NOTE: Is not thread safe, should be executed in critical section.
+ *
+ * @param record - uint8_t *
+ * @param num_records - uint32_t
+ * @param append - bool
+ */
+void apply_records(uint8_t *record, uint32_t num_records, bool append) {
+  for (uint32_t i = 0; i < num_records; i++) {
+    char *key;
+    int value;
+    uint64_t version;
+    record += unpack_record(record, &key, &value, &version);
+
+    // Keep the versions of the master, so clients can compare-and-set with
+    // versions read from any shard.
+    lru_entry_t *removed = put_version(cache, key, value, version);
+    lease_complete(leases, key);
+    wake_evictor();
+    if (removed != NULL) {
+      metrics_inc(CounterEvictions, 1);
+      destroy_entry(removed);
+    }
+    if (append)
+      replog_append(repl_log, key, value, version);
+    free(key);
+  }
+}
+
+/**
+ * @brief Wakes up the eviction thread if the cache has grown past its high
+ * watermark.
+ *
+ * NOTE: Is not thread safe, should be executed in critical section.
+ */
+void wake_evictor() {
+  if (cache->num_elements > cache->high_watermark)
+    pthread_cond_signal(&evict_cond);
+}
+
+/**
+ * @brief Fetches the ring map from the configuration service, and replaces
+ * the current one if it is newer.
+ *
+ * @return -1 in case of error, 0 otherwise.
+ */
+int refresh_ring_map() {
+  CanaryMsg resp, req = {.type = Client2CnfRing, .payload_len = 0};
+  int socket = connect_to_socket(cnf_addr, cnf_port);
+  if (socket == -1)
+    return -1;
+
+  int rc = send_msg(socket, req) == -1 ? -1 : receive_msg(socket, &resp);
+  close(socket);
+  if (rc == -1)
+    return -1;
+
+  ring_map_t *map = resp.type == Cnf2ClientRing
+                        ? unpack_ring_map(resp.payload, resp.payload_len)
+                        : NULL;
+  free(resp.payload);
+  if (map == NULL) {
+    log_warn("could not fetch the ring map from the configuration service");
+    return -1;
+  }
+  install_ring_map(map);
+  return 0;
+}
+
+/**
+ * @brief Replaces the ring map if the new one is newer, and wakes up the
+ * migration thread so that keys the master no longer owns are handed over.
+ *
+ * @param map - ring_map_t *, freed if it is not installed.
+ */
+void install_ring_map(ring_map_t *map) {
+  bool installed = false;
+
+  // BEGIN CRITICAL SECTION
+  pthread_rwlock_wrlock(&ring_map_lock);
+  if (ring_map == NULL || ring_map->epoch < map->epoch) {
+    if (ring_map != NULL)
+      log_info("ring map moved from epoch %lu to %lu", ring_map->epoch,
+               map->epoch);
+    ring_map_t *old = ring_map;
+    ring_map = map;
+    map = old;
+    installed = true;
+  }
+  pthread_rwlock_unlock(&ring_map_lock);
+  // END CRITICAL SECTION
+
+  if (map != NULL)
+    destroy_ring_map(map);
+
+  if (installed && role == Master) {
+    pthread_mutex_lock(&ring_changed_lock);
+    ring_changed = true;
+    pthread_cond_signal(&ring_changed_cond);
+    pthread_mutex_unlock(&ring_changed_lock);
+  }
+}
+
+/**
+ * @brief Sends an invalidation of a written key to the clients that watched
+ * it, and frees the watchers. Invalidations are datagrams, a lost one leaves
+ * the client with a stale value until its near cache expires the key.
+ *
+ * @param key - char *
+ * @param watchers - watcher_t *, as taken from the watch table.
+ */
+void notify_watchers(char *key, watcher_t *watchers) {
+  if (watchers == NULL)
+    return;
+
+  CanaryMsg msg = {.type = Mstr2ClientInvalidate,
+                   .payload_len = strlen(key) + 1,
+                   .payload = (uint8_t *)key};
+  for (watcher_t *watcher = watchers; watcher != NULL;
+       watcher = watcher->next) {
+    SA_IN addr = {.sin_family = AF_INET,
+                  .sin_addr = watcher->addr,
+                  .sin_port = htons(watcher->port)};
+    if (send_datagram_to(notify_socket, msg, &addr) == -1)
+      log_debug("could not invalidate key \"%s\" for a client", key);
+  }
+  destroy_watchers(watchers);
+}
+
+/**
+ * @brief Finds the key of a client request. Keys that are not terminated
+ * within the payload are not returned, so that they are never read past it.
+ *
+ * @param msg - CanaryMsg *
+ * @return pointer to the key in the payload, NULL if the request has no key.
+ */
+char *key_of(CanaryMsg *msg) {
+  uint32_t offset;
+  switch (msg->type) {
+  case Client2MstrPut:
+  case Client2MstrIncr:
+  case Client2MstrDecr:
+  case Client2MstrAdd:
+  case Client2MstrCas:
+    // [ key_len | key | ... ]
+    offset = sizeof(uint32_t);
+    break;
+  case Client2MstrWatch:
+    // [ port | key ]
+    offset = sizeof(uint16_t);
+    break;
+  case Client2ShardGet:
+  case Client2ShardLease:
+    offset = 0;
+    break;
+  default:
+    return NULL;
+  }
+
+  if (msg->payload_len <= offset ||
+      memchr(msg->payload + offset, '\0', msg->payload_len - offset) == NULL)
+    return NULL;
+  return (char *)msg->payload + offset;
+}
+
+/**
+ * @brief Checks whether the key belongs to this shard in the current ring
+ * map. While keys migrate, the previous owner of a key still serves reads of
+ * it. A shard that has not fetched a map yet owns every key.
+ *
+ * @param key - char *
+ * @param read - bool
+ * @param epoch - uint64_t *, the epoch of the ring map.
+ * @return true if the shard owns the key.
+ */
+bool owns_key(char *key, bool read, uint64_t *epoch) {
+  bool owns = true;
+  *epoch = 0;
+
+  // BEGIN CRITICAL SECTION
+  pthread_rwlock_rdlock(&ring_map_lock);
+  if (ring_map != NULL) {
+    ring_shard_t *owner = ring_map_lookup(ring_map, key);
+    ring_shard_t *prev_owner = ring_map_lookup_prev(ring_map, key);
+    owns = owner == NULL || owner->id == shard_id ||
+           (read && prev_owner != NULL && prev_owner->id == shard_id);
+    *epoch = ring_map->epoch;
+  }
+  pthread_rwlock_unlock(&ring_map_lock);
+  // END CRITICAL SECTION
+
+  return owns;
+}
+
+/**
+ * @brief Hands the keys that the master does not own in the current ring map
+ * to their owners, one batch per owner. A key is only removed from the cache
+ * once its owner has acknowledged the batch, and only if it has not been
+ * written since.
+ *
+ * @return the number of keys that could not be migrated.
+ */
+int migrate_keys() {
+  int num_failed = 0;
+  pthread_mutex_lock(&migrate_lock);
+
+  // BEGIN CRITICAL SECTION
+  pthread_rwlock_rdlock(&ring_map_lock);
+  if (ring_map == NULL) {
+    pthread_rwlock_unlock(&ring_map_lock);
+    pthread_mutex_unlock(&migrate_lock);
+    return 0;
+  }
+  size_t num_shards = ring_map->num_shards;
+  ring_addr_t *owners = malloc(sizeof(ring_addr_t) * num_shards);
+  replog_batch_t *batches = calloc(num_shards, sizeof(replog_batch_t));
+
+  pthread_mutex_lock(&cache_lock);
+  uint64_t now = lru_now();
+  for (lru_entry_t *entry = cache->tail; entry != NULL;
+       entry = entry->lru_prev) {
+    ring_shard_t *owner = ring_map_lookup(ring_map, entry->key);
+    if (owner == NULL || owner->id == shard_id ||
+        (entry->expires_at != 0 && entry->expires_at <= now))
+      continue;
+
+    size_t idx = owner - ring_map->shards;
+    if (batches[idx].buf == NULL) {
+      batches[idx] = create_batch();
+      batch_reset(&batches[idx], 0, 0);
+      owners[idx] = owner->mstr;
+    }
+    batch_add(&batches[idx], entry->key, entry->value, entry->version);
+  }
+  pthread_mutex_unlock(&cache_lock);
+  pthread_rwlock_unlock(&ring_map_lock);
+  // END CRITICAL SECTION
+
+  for (size_t i = 0; i < num_shards; i++) {
+    if (batches[i].buf == NULL)
+      continue;
+
+    char addr[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &owners[i].addr, addr, sizeof(addr));
+    batch_seal(&batches[i]);
+    CanaryMsg resp, msg = {.type = Mstr2MstrMigrate,
+                           .payload_len = batches[i].buf_len,
+                           .payload = batches[i].buf};
+
+    int socket = connect_to_socket(addr, owners[i].port), rc = -1;
+    if (socket != -1) {
+      rc = send_msg(socket, msg) == -1 ? -1 : receive_msg(socket, &resp);
+      close(socket);
+    }
+    if (rc == -1 || resp.type != Mstr2MstrMigrated) {
+      if (rc != -1)
+        free(resp.payload);
+      log_warn("could not migrate %u keys to shard at %s:%d",
+               batches[i].num_records, addr, owners[i].port);
+      num_failed += batches[i].num_records;
+      destroy_batch(&batches[i]);
+      continue;
+    }
+    free(resp.payload);
+
+    // BEGIN CRITICAL SECTION
+    pthread_mutex_lock(&cache_lock);
+    uint64_t log_id, seq;
+    uint32_t num_records;
+    uint8_t *record =
+        batches[i].buf +
+        unpack_batch_header(batches[i].buf, &log_id, &seq, &num_records);
+    for (uint32_t j = 0; j < num_records; j++) {
+      char *key;
+      int value;
+      uint64_t version;
+      record += unpack_record(record, &key, &value, &version);
+
+      lru_entry_t *entry = get_entry(cache, key);
+      if (entry != NULL && entry->version == version)
+        destroy_entry(lru_delete(cache, key));
+      free(key);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    // END CRITICAL SECTION
+
+    log_info("migrated %u keys to shard at %s:%d", batches[i].num_records,
+             addr, owners[i].port);
+    metrics_inc(CounterMigrated, batches[i].num_records);
+    destroy_batch(&batches[i]);
+  }
+  free(batches);
+  free(owners);
+  pthread_mutex_unlock(&migrate_lock);
+  return num_failed;
+}
+
+// CONNECTIONS
+
+/**
+ * @brief Puts a connection with a pending request on the connection queue.
+ *
+ * @param ctx - conn_ctx_t *
+ */
+void enqueue_connection(conn_ctx_t *ctx) {
+  metrics_gauge_add(GaugeQueueDepth, 1);
+
+  // CRITICAL SECTION BEGIN
+  pthread_mutex_lock(&conn_q_lock);
+  enqueue(&conn_q, ctx);
+  pthread_cond_signal(&conn_q_cond);
+  pthread_mutex_unlock(&conn_q_lock);
+  // CRITICAL SECTION END
+}
+
+/**
+ * @brief Keeps a client connection open once its request has been handled,
+ * and has the poller watch it for the next request.
+ *
+ * NOTE: The connection may be handled by another worker as soon as it is
+ * watched, so the context must not be touched after this call.
+ *
+ * @param ctx - conn_ctx_t *
+ */
+void watch_connection(conn_ctx_t *ctx) {
+  int op = ctx->kept_alive ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  struct epoll_event event = {.events = EPOLLIN | EPOLLONESHOT,
+                              .data.ptr = ctx};
+  ctx->kept_alive = true;
+  if (epoll_ctl(poll_fd, op, ctx->socket, &event) == -1) {
+    log_warn("could not keep client connection open");
+    close(ctx->socket);
+    free(ctx);
+  }
+}
+
+// HANDLERS
+
+/**
+ * @brief Will handle a socket connection. Will in turn multiplex out to other
+ * handlers depending on what type of message is received.
+ *
+ * Connections of client requests are kept open for the next request, all
+ * other connections are closed once handled.
+ *
+ * @param ctx - conn_ctx_t
+ */
+void handle_connection(conn_ctx_t *ctx) {
+  int socket = ctx->socket;
+  IA client_addr = ctx->client_addr;
+  CanaryMsg msg;
+  bool keep_open = false;
+
+  if (receive_msg(socket, &msg) == -1) {
+    // Clients close the connections they kept open once they are done.
+    if (!ctx->kept_alive)
+      send_error_msg(socket, "Could not receive message");
+    close(socket);
+    free(ctx);
+    return;
+  }
+  metrics_inc(CounterRequests, 1);
+  trace_request_type = msg.type;
+  trace_stage(Receive);
+
+  // Clients route with their own copy of the ring map, turn away keys that
+  // the master does not own so that they refresh their copy.
+  char *key = key_of(&msg);
+  uint64_t epoch;
+  bool read = msg.type == Client2ShardGet;
+  if (role == Master && key != NULL && !owns_key(key, read, &epoch)) {
+    log_debug("turned away key \"%s\" owned by another shard", key);
+    uint8_t payload[sizeof(epoch)];
+    pack_long(epoch, payload);
+    send_msg(socket, (CanaryMsg){.type = Shard2ClientNotOwner,
+                                 .payload_len = sizeof(payload),
+                                 .payload = payload});
+    free(msg.payload);
+    watch_connection(ctx);
+    return;
+  }
+
+  switch (msg.type) {
+  case Client2MstrPut:
+  case Client2MstrIncr:
+  case Client2MstrDecr:
+  case Client2MstrAdd:
+  case Client2MstrCas:
+  case Client2MstrWatch:
+  case Client2ShardGet:
+  case Client2ShardLease:
+  case Client2ShardStats:
+  case Client2ShardMget:
+  case Client2MstrMput:
+    keep_open = true;
+    break;
+  default:
+    break;
+  }
+
+  // Multiplex out to other handlers.
+  switch (msg.type) {
+  case Client2MstrPut:
+    if (role != Master) {
+      send_error_msg(socket, "Puts must go to the master shard");
+      free(msg.payload);
+    } else {
+      handle_put(socket, msg.payload);
+    }
+    break;
+  case Client2MstrIncr:
+  case Client2MstrDecr:
+  case Client2MstrAdd:
+    if (role != Master) {
+      send_error_msg(socket, "Counter operations must go to the master shard");
+      free(msg.payload);
+    } else {
+      handle_counter(socket, msg.type, msg.payload);
+    }
+    break;
+  case Client2MstrCas:
+    if (role != Master) {
+      send_error_msg(socket, "Compare-and-set must go to the master shard");
+      free(msg.payload);
+    } else if (!is_cas_payload(msg.payload, msg.payload_len)) {
+      send_error_msg(socket, "Malformed compare-and-set request");
+      free(msg.payload);
+    } else {
+      handle_cas(socket, msg.payload);
+    }
+    break;
+  case Client2MstrWatch:
+    if (role != Master) {
+      send_error_msg(socket, "Watches must go to the master shard");
+      free(msg.payload);
+    } else {
+      handle_watch(socket, client_addr, msg.payload);
+    }
+    break;
+  case Client2ShardGet:
+    handle_get(socket, msg.payload);
+    break;
+  case Client2ShardLease:
+    handle_lease(socket, msg.payload);
+    break;
+  case Client2ShardStats:
+    handle_stats(socket);
+    break;
+  case Client2ShardMget:
+    handle_mget(socket, msg.payload, msg.payload_len);
+    break;
+  case Client2MstrMput:
+    if (role != Master) {
+      send_error_msg(socket, "Puts must go to the master shard");
+      free(msg.payload);
+    } else {
+      handle_mput(socket, msg.payload, msg.payload_len);
+    }
+    break;
+  case Cnf2MstrRing: {
+    ring_map_t *map = unpack_ring_map(msg.payload, msg.payload_len);
+    if (map != NULL)
+      install_ring_map(map);
+    free(msg.payload);
+    break;
+  }
+  case Mstr2MstrMigrate:
+    handle_migration(socket, msg.payload);
+    break;
+  case Cnf2FlwrReregister:
+    free(msg.payload);
+    handle_reregistration();
+    break;
+  case Cnf2FlwrPromote:
+    handle_promotion(msg.payload);
+    break;
+  case Cnf2FlwrUpstream:
+    handle_upstreams(msg.payload);
+    break;
+  case Flwr2MstrConnect:
+    // Followers also accept connections from the next follower in a chain.
+    if (handle_flwr_connection(socket, client_addr, msg.payload) == 0) {
+      free(ctx);
+      return; // socket is now owned by the replication threads.
+    }
+    break;
+  default:
+    send_error_msg(socket, "Incorrect Canary message type");
+    break;
+  }
+
+  if (keep_open) {
+    watch_connection(ctx);
+  } else {
+    close(socket);
+    free(ctx);
+  }
+}
+
+/**
+ * @brief Handles a `put` operation by a client. The put is appended to the
+ * replication log, from which it is streamed to the followers. The client
+ * gets an acknowledgement once the put has been applied.
+ *
+ * @param socket - int
+ * @param payload - uint8_t *
+ */
+void handle_put(int socket, uint8_t *payload) {
+  uint64_t start = metrics_now();
+  char *key;
+  int value;
+
+  unpack_string_int(&key, &value, payload);
+
+  // BEGIN CRITICAL SECTION
+  pthread_mutex_lock(&cache_lock);
+  trace_stage(Lock);
+  lru_entry_t *removed = put(cache, key, value);
+  lease_complete(leases, key);
+  watcher_t *watchers = watch_take(watches, key);
+  wake_evictor();
+
+  // Enqueue for the follower streams, the client does not wait on them.
+  // Appending under the cache lock keeps snapshots consistent with the log.
+  replog_append(repl_log, key, value, cache->version_clock);
+  trace_stage(Execute);
+  pthread_mutex_unlock(&cache_lock);
+  // END CRITICAL SECTION
+  trace_stage(Unlock);
+
+  send_msg(socket, (CanaryMsg){.type = Mstr2ClientPut, .payload_len = 0});
+  trace_stage(Send);
+  notify_watchers(key, watchers);
+
+  log_debug("Put key value pair (%s, %d)", key, value);
+  if (removed != NULL) {
+    log_debug("expelled key value pair (%s, %d) from cache", removed->key,
+              removed->value);
+    metrics_inc(CounterEvictions, 1);
+    destroy_entry(removed);
+  }
+
+  free(key);
+  free(payload);
+  metrics_inc(CounterPuts, 1);
+  metrics_record(HistPut, metrics_now() - start);
+}
+
+/**
+ * @brief Handles an atomic counter operation by a client. The read and the
+ * write happen in the same critical section, so concurrent operations on a
+ * key are never lost. The resulting value is replicated like a put.
+ *
+ * @param socket - int
+ * @param type - CanaryMsgType, incr, decr or add.
+ * @param payload - uint8_t *
+ */
+void handle_counter(int socket, CanaryMsgType type, uint8_t *payload) {
+  uint64_t start = metrics_now();
+  lru_entry_t *removed = NULL;
+  watcher_t *watchers = NULL;
+  bool applied = true;
+  char *key;
+  int operand, result;
+  uint8_t resp[2 * sizeof(uint32_t)];
+
+  unpack_string_int(&key, &operand, payload);
+
+  // BEGIN CRITICAL SECTION
+  pthread_mutex_lock(&cache_lock);
+  trace_stage(Lock);
+  lru_entry_t *entry = get_entry(cache, key);
+  if (entry != NULL && type == Client2MstrAdd) {
+    applied = false;
+    result = entry->value;
+  } else {
+    // Wrap around on overflow instead of invoking undefined behaviour.
+    uint32_t delta = type == Client2MstrDecr ? -(uint32_t)operand : operand;
+    result = type == Client2MstrAdd || entry == NULL
+                 ? (int)delta
+                 : (int)((uint32_t)entry->value + delta);
+    removed = put(cache, key, result);
+    lease_complete(leases, key);
+    watchers = watch_take(watches, key);
+    wake_evictor();
+    replog_append(repl_log, key, result, cache->version_clock);
+  }
+  trace_stage(Execute);
+  pthread_mutex_unlock(&cache_lock);
+  // END CRITICAL SECTION
+  trace_stage(Unlock);
+
+  pack_int_int(applied, result, resp);
+  send_msg(socket, (CanaryMsg){.type = Mstr2ClientCounter,
+                               .payload_len = sizeof(resp),
+                               .payload = resp});
+  trace_stage(Send);
+  notify_watchers(key, watchers);
+
+  log_debug("counter operation %d on key \"%s\" resulted in %d", type, key,
+            result);
+  if (removed != NULL) {
+    metrics_inc(CounterEvictions, 1);
+    destroy_entry(removed);
+  }
+  free(key);
+  free(payload);
+  metrics_inc(CounterPuts, 1);
+  metrics_record(HistPut, metrics_now() - start);
+}
+
+/**
+ * @brief Checks that a compare-and-set payload [ key_len | key | value |
+ * expected ] has exactly the size that its key length implies, and that the
+ * key is terminated by its last byte, before anything reads it.
+ *
+ * @param payload - uint8_t *
+ * @param len - uint32_t
+ * @return true if the payload is well formed.
+ */
+bool is_cas_payload(uint8_t *payload, uint32_t len) {
+  uint32_t key_len;
+  if (len < sizeof(key_len))
+    return false;
+  memcpy(&key_len, payload, sizeof(key_len));
+  key_len = ntohl(key_len);
+  uint64_t cas_len =
+      sizeof(key_len) + (uint64_t)key_len + sizeof(uint32_t) + sizeof(uint64_t);
+  if (key_len == 0 || cas_len != len)
+    return false;
+  char *key = (char *)payload + sizeof(key_len);
+  return memchr(key, '\0', key_len) == key + key_len - 1;
+}
+
+/**
+ * @brief Handles a compare-and-set by a client. The value is only put if the
+ * version of the entry still matches the expected version, where version 0
+ * means that the key must be absent. The put is replicated like any other.
+ *
+ * @param socket - int
+ * @param payload - uint8_t *
+ */
+void handle_cas(int socket, uint8_t *payload) {
+  uint64_t start = metrics_now();
+  lru_entry_t *removed = NULL;
+  watcher_t *watchers = NULL;
+  bool applied = false;
+  char *key;
+  int value;
+  uint64_t expected, version;
+  uint8_t resp[sizeof(uint32_t) + sizeof(uint64_t)];
+
+  unpack_string_int(&key, &value, payload);
+  unpack_long(&expected,
+              payload + sizeof(uint32_t) + strlen(key) + 1 + sizeof(value));
+
+  // BEGIN CRITICAL SECTION
+  pthread_mutex_lock(&cache_lock);
+  trace_stage(Lock);
+  lru_entry_t *entry = get_entry(cache, key);
+  version = entry == NULL ? 0 : entry->version;
+  if (version == expected) {
+    applied = true;
+    removed = put(cache, key, value);
+    lease_complete(leases, key);
+    watchers = watch_take(watches, key);
+    wake_evictor();
+    version = cache->version_clock;
+    replog_append(repl_log, key, value, version);
+  }
+  trace_stage(Execute);
+  pthread_mutex_unlock(&cache_lock);
+  // END CRITICAL SECTION
+  trace_stage(Unlock);
+
+  // Respond with the current version, so a failed client can retry with it.
+  uint32_t n_applied = htonl(applied);
+  memcpy(resp, &n_applied, sizeof(n_applied));
+  pack_long(version, resp + sizeof(n_applied));
+  send_msg(socket, (CanaryMsg){.type = Mstr2ClientCas,
+                               .payload_len = sizeof(resp),
+                               .payload = resp});
+  trace_stage(Send);
+  notify_watchers(key, watchers);
+
+  log_debug("compare-and-set of key \"%s\" at version %lu %s", key, expected,
+            applied ? "succeeded" : "failed");
+  if (removed != NULL) {
+    metrics_inc(CounterEvictions, 1);
+    destroy_entry(removed);
+  }
+  free(key);
+  free(payload);
+  metrics_inc(CounterPuts, 1);
+  metrics_record(HistPut, metrics_now() - start);
+}
+
+/**
+ * @brief Handles a `get` operation by a client. The response is empty on a
+ * miss, and [ value | version ] otherwise.
+ *
+ * @param socket - int
+ * @param payload - uint8_t *
+ */
+void handle_get(int socket, uint8_t *payload) {
+  uint64_t start = metrics_now();
+  CanaryMsg msg = {.type = Shard2ClientGet};
+  uint8_t resp[sizeof(int) + sizeof(uint64_t)];
+  int value;
+  uint64_t version;
+
+  char *key = (char *)payload;
+
+  // BEGIN CRITICAL SECTION
+  pthread_mutex_lock(&cache_lock);
+  trace_stage(Lock);
+  lru_entry_t *entry = get_entry(cache, key);
+  // Copy while locked, the entry may be evicted as soon as we unlock.
+  if (entry != NULL) {
+    value = entry->value;
+    version = entry->version;
+  }
+  trace_stage(Execute);
+  pthread_mutex_unlock(&cache_lock);
+  // END CRITICAL SECTION
+  trace_stage(Unlock);
+
+  if (entry == NULL) {
+    log_debug("no value cached for key \"%s\"", key);
+    metrics_inc(CounterMisses, 1);
+    msg.payload_len = 0;
+  } else {
+    log_debug("value %d cached for key \"%s\"", value, key);
+    metrics_inc(CounterHits, 1);
+    memcpy(resp, &value, sizeof(value));
+    pack_long(version, resp + sizeof(value));
+    msg.payload_len = sizeof(resp);
+    msg.payload = resp;
+  }
+  send_msg(socket, msg);
+  trace_stage(Send);
+  metrics_inc(CounterGets, 1);
+  metrics_record(HistGet, metrics_now() - start);
+}
+
+/**
+ * @brief Handles a get by a client that caches the key near it. The key is
+ * watched before it is read, so a write that the response misses always
+ * sends an invalidation. When the watch table is full the key is read without
+ * a watch, and the client relies on the TTL of its near cache alone.
+ *
+ * @param socket - int
+ * @param addr - IA, of the client.
+ * @param payload - uint8_t *
+ */
+void handle_watch(int socket, IA addr, uint8_t *payload) {
+  uint16_t port;
+  unpack_short(&port, payload);
+  char *key = (char *)payload + sizeof(port);
+
+  // BEGIN CRITICAL SECTION
+  pthread_mutex_lock(&cache_lock);
+  int rc = watch_add(watches, key, addr, port);
+  pthread_mutex_unlock(&cache_lock);
+  // END CRITICAL SECTION
+
+  if (rc == -1)
+    log_warn("too many watchers, key \"%s\" is not watched", key);
+  handle_get(socket, (uint8_t *)key);
+  free(payload);
+}
+
+/**
+ * @brief Handles a read-through get by a client. A hit is answered right away.
+ * On a miss the first requester is granted a lease to load the key, and
+ * requesters after it wait for the lease to be completed by a put of the key.
+ * Waiters that time out are told to retry, so that a slow load never turns
+ * into a load per requester. A lease that is not completed in time is handed
+ * to the next requester.
+ *
+ * @param socket - int
+ * @param payload - uint8_t *
+ */
+void handle_lease(int socket, uint8_t *payload) {
+  uint64_t start = metrics_now();
+  uint64_t deadline = start + (uint64_t)LEASE_WAIT_MS * 1000000;
+  LeaseStatus status;
+  int value = 0;
+  uint64_t version = 0;
+  uint8_t resp[sizeof(uint32_t) + sizeof(value) + sizeof(version)];
+
+  char *key = (char *)payload;
+
+  // BEGIN CRITICAL SECTION
+  pthread_mutex_lock(&cache_lock);
+  trace_stage(Lock);
+  while (1) {
+    lru_entry_t *entry = get_entry(cache, key);
+    if (entry != NULL) {
+      status = LeaseHit;
+      value = entry->value;
+      version = entry->version;
+      break;
+    }
+
+    uint64_t now = metrics_now();
+    lease_t *lease = lease_find(leases, key, now);
+    if (lease == NULL) {
+      lease_acquire(leases, key, now + (uint64_t)LEASE_TIMEOUT_MS * 1000000);
+      status = LeaseGranted;
+      break;
+    }
+
+    // Releases the cache lock while waiting.
+    if (lease_wait(lease, &cache_lock, deadline) == -1) {
+      status = LeaseRetry;
+      break;
+    }
+  }
+  trace_stage(Execute);
+  pthread_mutex_unlock(&cache_lock);
+  // END CRITICAL SECTION
+  trace_stage(Unlock);
+
+  uint32_t n_status = htonl(status);
+  memcpy(resp, &n_status, sizeof(n_status));
+  memcpy(resp + sizeof(n_status), &value, sizeof(value));
+  pack_long(version, resp + sizeof(n_status) + sizeof(value));
+  send_msg(socket, (CanaryMsg){.type = Shard2ClientLease,
+                               .payload_len = sizeof(resp),
+                               .payload = resp});
+  trace_stage(Send);
+
+  log_debug("read-through get of key \"%s\" resulted in status %d", key,
+            status);
+  metrics_inc(status == LeaseHit       ? CounterHits
+              : status == LeaseGranted ? CounterLeasesGranted
+                                       : CounterLeaseRetries,
+              1);
+  if (status != LeaseHit)
+    metrics_inc(CounterMisses, 1);
+  metrics_inc(CounterGets, 1);
+  metrics_record(HistGet, metrics_now() - start);
+  free(payload);
+}
+
+/**
+ * @brief Handles the gets of a batch of keys by a client, in one critical
+ * section. A master answers the keys that it does not own with
+ * `KeyNotOwner`, while the others are answered like `handle_get`.
+ *
+ * @param socket - int
+ * @param payload - uint8_t *
+ * @param payload_len - uint32_t
+ */
+void handle_mget(int socket, uint8_t *payload, uint32_t payload_len) {
+  uint64_t start = metrics_now();
+  uint32_t num_keys, num_hits = 0, num_owned = 0;
+  uint64_t epoch;
+
+  char **keys = unpack_batch(payload, payload_len, NULL, &num_keys);
+  if (keys == NULL) {
+    send_error_msg(socket, "Malformed batch of gets");
+    free(payload);
+    return;
+  }
+
+  uint32_t resp_len = sizeof(num_keys) + num_keys * BATCH_RECORD_SIZE;
+  uint8_t *resp = calloc(1, resp_len);
+  uint32_t n_num_keys = htonl(num_keys);
+  memcpy(resp, &n_num_keys, sizeof(n_num_keys));
+  bool *owned = malloc(sizeof(bool) * num_keys);
+  for (uint32_t i = 0; i < num_keys; i++) {
+    owned[i] = role != Master || owns_key(keys[i], true, &epoch);
+    num_owned += owned[i];
+  }
+
+  // BEGIN CRITICAL SECTION
+  pthread_mutex_lock(&cache_lock);
+  trace_stage(Lock);
+  for (uint32_t i = 0; i < num_keys; i++) {
+    uint8_t *record = resp + sizeof(num_keys) + i * BATCH_RECORD_SIZE;
+    lru_entry_t *entry = owned[i] ? get_entry(cache, keys[i]) : NULL;
+    if (entry == NULL) {
+      pack_int_int(owned[i] ? KeyMiss : KeyNotOwner, 0, record);
+      continue;
+    }
+    // Copy while locked, the entry may be evicted as soon as we unlock.
+    pack_int_int(KeyDone, entry->value, record);
+    pack_long(entry->version, record + 2 * sizeof(uint32_t));
+    num_hits++;
+  }
+  trace_stage(Execute);
+  pthread_mutex_unlock(&cache_lock);
+  // END CRITICAL SECTION
+  trace_stage(Unlock);
+
+  send_msg(socket, (CanaryMsg){.type = Shard2ClientMget,
+                               .payload_len = resp_len,
+                               .payload = resp});
+  trace_stage(Send);
+
+  log_debug("batch of %u gets resulted in %u hits", num_keys, num_hits);
+  metrics_inc(CounterHits, num_hits);
+  metrics_inc(CounterMisses, num_owned - num_hits);
+  metrics_inc(CounterGets, num_owned);
+  metrics_record(HistGet, metrics_now() - start);
+  free(owned);
+  free(resp);
+  free(keys);
+  free(payload);
+}
+
+/**
+ * @brief Handles the puts of a batch of keys by a client, which are applied
+ * and replicated in one critical section. Keys that the master does not own
+ * are answered with `KeyNotOwner`, the others like `handle_put`.
+ *
+ * @param socket - int
+ * @param payload - uint8_t *
+ * @param payload_len - uint32_t
+ */
+void handle_mput(int socket, uint8_t *payload, uint32_t payload_len) {
+  uint64_t start = metrics_now();
+  lru_entry_t *removed = NULL;
+  uint32_t num_keys, num_applied = 0;
+  uint64_t epoch;
+  int *values;
+
+  char **keys = unpack_batch(payload, payload_len, &values, &num_keys);
+  if (keys == NULL) {
+    send_error_msg(socket, "Malformed batch of puts");
+    free(payload);
+    return;
+  }
+
+  uint32_t resp_len = sizeof(num_keys) + num_keys * BATCH_RECORD_SIZE;
+  uint8_t *resp = calloc(1, resp_len);
+  uint32_t n_num_keys = htonl(num_keys);
+  memcpy(resp, &n_num_keys, sizeof(n_num_keys));
+  watcher_t **watchers = calloc(num_keys, sizeof(watcher_t *));
+  bool *owned = malloc(sizeof(bool) * num_keys);
+  for (uint32_t i = 0; i < num_keys; i++)
+    owned[i] = owns_key(keys[i], false, &epoch);
+
+  // BEGIN CRITICAL SECTION
+  pthread_mutex_lock(&cache_lock);
+  trace_stage(Lock);
+  for (uint32_t i = 0; i < num_keys; i++) {
+    uint8_t *record = resp + sizeof(num_keys) + i * BATCH_RECORD_SIZE;
+    if (!owned[i]) {
+      pack_int_int(KeyNotOwner, 0, record);
+      continue;
+    }
+    lru_entry_t *entry = put(cache, keys[i], values[i]);
+    if (entry != NULL) {
+      entry->lru_next = removed;
+      removed = entry;
+    }
+    lease_complete(leases, keys[i]);
+    watchers[i] = watch_take(watches, keys[i]);
+    replog_append(repl_log, keys[i], values[i], cache->version_clock);
+    pack_int_int(KeyDone, values[i], record);
+    pack_long(cache->version_clock, record + 2 * sizeof(uint32_t));
+    num_applied++;
+  }
+  wake_evictor();
+  trace_stage(Execute);
+  pthread_mutex_unlock(&cache_lock);
+  // END CRITICAL SECTION
+  trace_stage(Unlock);
+
+  send_msg(socket, (CanaryMsg){.type = Mstr2ClientMput,
+                               .payload_len = resp_len,
+                               .payload = resp});
+  trace_stage(Send);
+  for (uint32_t i = 0; i < num_keys; i++)
+    notify_watchers(keys[i], watchers[i]);
+
+  log_debug("batch of %u puts applied %u", num_keys, num_applied);
+  metrics_inc(CounterEvictions, destroy_entries(removed));
+  metrics_inc(CounterPuts, num_applied);
+  metrics_record(HistPut, metrics_now() - start);
+  free(watchers);
+  free(owned);
+  free(resp);
+  free(values);
+  free(keys);
+  free(payload);
+}
+
+/**
+ * @brief Handles a request for the metrics of the shard, which are sent back
+ * in the Prometheus text format.
+ *
+ * @param socket - int
+ */
+void handle_stats(int socket) {
+  metrics_snapshot_t *snapshot = malloc(sizeof(metrics_snapshot_t));
+  char *text;
+  int len;
+
+  metrics_collect(snapshot);
+  if ((len = metrics_format(snapshot, &text)) == -1) {
+    send_error_msg(socket, "Could not format metrics");
+  } else {
+    send_msg(socket, (CanaryMsg){.type = Shard2ClientStats,
+                                 .payload_len = len + 1,
+                                 .payload = (uint8_t *)text});
+    free(text);
+  }
+  free(snapshot);
+}
+
+/**
+ * @brief Will register a new follower and start streaming the replication log
+ * to it over the provided socket. A follower whose last applied sequence
+ * number is still in the log receives the delta, otherwise a snapshot.
+ *
+ * @param socket - int
+ * @param addr - IA
+ * @param payload - uint8_t *
+ * @return 0 if the socket was handed over to a sender thread, -1 otherwise.
+ */
+int handle_flwr_connection(int socket, IA addr, uint8_t *payload) {
+  in_port_t port;
+  uint64_t log_id, seq;
+  unpack_short(&port, payload);
+  unpack_long(&log_id, payload + sizeof(port));
+  unpack_long(&seq, payload + sizeof(port) + sizeof(log_id));
+  free(payload);
+
+  bool catch_up = replog_contains(repl_log, log_id, seq);
+  follower_t *flwr = NULL;
+
+  // BEGIN CRITICAL SECTION
+  pthread_mutex_lock(&flwr_lock);
+  if (num_flwrs < MAX_FLWR_PER_MASTER) {
+    for (int idx = 0; idx < MAX_FLWR_PER_MASTER; idx++) {
+      if (flwrs[idx] != NULL)
+        continue;
+
+      flwr = malloc(sizeof(follower_t));
+      *flwr = (follower_t){.addr = addr,
+                           .port = port,
+                           .socket = socket,
+                           .cursor = seq,
+                           .acked = 0,
+                           .snapshot = !catch_up,
+                           .closed = false,
+                           .refs = 2,
+                           .idx = idx};
+      flwrs[idx] = flwr;
+      num_flwrs++;
+      metrics_gauge_add(GaugeFollowers, 1);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&flwr_lock);
+  // END CRITICAL SECTION
+
+  if (flwr == NULL) {
+    send_error_msg(socket, "Follower capacity reached");
+    return -1;
+  }
+
+  pthread_t sender, acks;
+  pthread_create(&sender, NULL, replication_sender_thread, (void *)flwr);
+  pthread_create(&acks, NULL, replication_ack_thread, (void *)flwr);
+  pthread_detach(sender);
+  pthread_detach(acks);
+  log_info("streaming replication log to follower at %s:%d from %s",
+           inet_ntoa(addr), port, catch_up ? "log" : "snapshot");
+  return 0;
+}
+
+/**
+ * @brief Applies a batch of replicated puts to the local cache.
+ *
+ * @param payload - uint8_t *
+ * @return -1 if the batch does not follow the last applied sequence number,
+ * 0 otherwise.
+ */
+int handle_replication(uint8_t *payload) {
+  uint64_t start = metrics_now();
+  uint64_t log_id, first_seq;
+  uint32_t num_records;
+  uint8_t *records =
+      payload + unpack_batch_header(payload, &log_id, &first_seq, &num_records);
+  int rc = 0;
+
+  // BEGIN CRITICAL SECTION
+  pthread_mutex_lock(&cache_lock);
+  if (log_id != repl_log->id || first_seq != replog_head(repl_log) + 1) {
+    rc = -1;
+  } else {
+    // Mirror the records in the local log, keeping the sequence numbers.
+    apply_records(records, num_records, true);
+  }
+  pthread_mutex_unlock(&cache_lock);
+  // END CRITICAL SECTION
+
+  if (rc == 0 && num_records > 0) {
+    log_debug("replicated %d puts from upstream shard", num_records);
+    metrics_inc(CounterReplicated, num_records);
+    metrics_record(HistReplication, metrics_now() - start);
+  }
+  free(payload);
+  return rc;
+}
+
+/**
+ * @brief Applies a batch of keys handed over by their previous owner. Keys
+ * that have been written here since the ring changed are newer, so records
+ * are only applied to absent keys. Applied records are replicated like puts.
+ *
+ * @param socket - int
+ * @param payload - uint8_t *
+ */
+void handle_migration(int socket, uint8_t *payload) {
+  uint64_t log_id, seq;
+  uint32_t num_records, applied = 0;
+  uint8_t *record =
+      payload + unpack_batch_header(payload, &log_id, &seq, &num_records);
+
+  // BEGIN CRITICAL SECTION
+  pthread_mutex_lock(&cache_lock);
+  for (uint32_t i = 0; i < num_records; i++) {
+    char *key;
+    int value;
+    uint64_t version;
+    record += unpack_record(record, &key, &value, &version);
+
+    if (get_entry(cache, key) == NULL) {
+      lru_entry_t *removed = put_version(cache, key, value, version);
+      lease_complete(leases, key);
+      wake_evictor();
+      replog_append(repl_log, key, value, version);
+      if (removed != NULL) {
+        metrics_inc(CounterEvictions, 1);
+        destroy_entry(removed);
+      }
+      applied++;
+    }
+    free(key);
+  }
+  pthread_mutex_unlock(&cache_lock);
+  // END CRITICAL SECTION
+
+  send_msg(socket, (CanaryMsg){.type = Mstr2MstrMigrated, .payload_len = 0});
+  log_info("received %u migrated keys, applied %u", num_records, applied);
+  free(payload);
+}
+
+/**
+ * @brief Registers the follower again after its master has left the ring, so
+ * that the configuration service attaches it to a remaining master. The
+ * replication stream is closed so that the receiver reconnects to the new
+ * upstream, which sends it a snapshot.
+ */
+void handle_reregistration() {
+  CanaryMsg resp;
+  if (role != Follower)
+    return;
+
+  uint8_t payload[sizeof(in_port_t)];
+  pack_short(flwr_port, payload);
+  int socket = connect_to_socket(cnf_addr, cnf_port);
+  if (socket == -1 ||
+      send_msg(socket, (CanaryMsg){.type = Flwr2CnfRegister,
+                                   .payload_len = sizeof(payload),
+                                   .payload = payload}) == -1 ||
+      receive_msg(socket, &resp) == -1) {
+    log_warn("could not register again with configuration service");
+    if (socket != -1)
+      close(socket);
+    return;
+  }
+  close(socket);
+
+  if (resp.type != Cnf2FlwrRegister) {
+    log_warn("could not register again with configuration service: %s",
+             resp.type == Error ? (char *)resp.payload : "wrong message type");
+    free(resp.payload);
+    return;
+  }
+
+  // BEGIN CRITICAL SECTION
+  pthread_mutex_lock(&upstream_lock);
+  set_upstreams(resp.payload);
+  if (upstream_socket != -1)
+    shutdown(upstream_socket, SHUT_RDWR);
+  pthread_mutex_unlock(&upstream_lock);
+  // END CRITICAL SECTION
+
+  log_info("master left the ring, replicating from %s:%d, master is at %s:%d",
+           upstream_addr, upstream_port, mstr_addr, mstr_port);
+  free(resp.payload);
+}
+
+/**
+ * @brief Applies a snapshot frame to the local cache. The cache is cleared
+ * on the first frame, and the follower only adopts the sequence number of
+ * the snapshot once the terminating frame has been received.
+ *
+ * @param payload - uint8_t *
+ * @param first - bool
+ * @return the number of records in the frame.
+ */
+int handle_snapshot(uint8_t *payload, bool first) {
+  uint64_t log_id, seq;
+  uint32_t num_records;
+  uint8_t *records =
+      payload + unpack_batch_header(payload, &log_id, &seq, &num_records);
+
+  // BEGIN CRITICAL SECTION
+  pthread_mutex_lock(&cache_lock);
+  if (first) {
+    size_t capacity = cache->capacity;
+    uint64_t ttl = cache->ttl;
+    destroy_lru_cache(cache);
+    cache = create_lru_cache(capacity);
+    cache->ttl = ttl;
+
+    // Until the snapshot is complete a reconnect must start over.
+    replog_reset(repl_log, 0, 0);
+  }
+
+  apply_records(records, num_records, false);
+  if (num_records == 0)
+    replog_reset(repl_log, log_id, seq);
+  pthread_mutex_unlock(&cache_lock);
+  // END CRITICAL SECTION
+
+  if (num_records == 0)
+    log_info("loaded snapshot at sequence number %lu from upstream shard", seq);
+  free(payload);
+  return num_records;
+}
+
+/**
+ * @brief Takes over the master of this follower, which has expired. The cache
+ * and the replication log are kept, so that the shard serves the keys of the
+ * master from a warm cache and the other followers of the master can catch
+ * up from the log. Versions continue from the highest replicated version.
+ *
+ * @param payload - uint8_t *, [ mstr_id ].
+ */
+void handle_promotion(uint8_t *payload) {
+  if (role != Follower) {
+    free(payload);
+    return;
+  }
+
+  // The heartbeat thread expects the id in network byte order.
+  shard_id = ntohl(*(uint32_t *)payload);
+  role = Master;
+
+  // The receiver and the follower heartbeat thread stop on the new role.
+  // BEGIN CRITICAL SECTION
+  pthread_mutex_lock(&upstream_lock);
+  if (upstream_socket != -1)
+    shutdown(upstream_socket, SHUT_RDWR);
+  pthread_mutex_unlock(&upstream_lock);
+  // END CRITICAL SECTION
+
+  pthread_create(&heartbeat, NULL, master_heartbeat_thread, (void *)payload);
+  log_info("promoted to master shard with id %u at sequence number %lu",
+           shard_id, replog_head(repl_log));
+}
+
+/**
+ * @brief Switches the follower to a new master or upstream shard, after a
+ * follower of its master has been promoted. The replication stream is closed
+ * so that the receiver reconnects to the new upstream and catches up.
+ *
+ * @param payload - uint8_t *
+ */
+void handle_upstreams(uint8_t *payload) {
+  if (role != Follower) {
+    free(payload);
+    return;
+  }
+
+  // BEGIN CRITICAL SECTION
+  pthread_mutex_lock(&upstream_lock);
+  set_upstreams(payload);
+  if (upstream_socket != -1)
+    shutdown(upstream_socket, SHUT_RDWR);
+  pthread_mutex_unlock(&upstream_lock);
+  // END CRITICAL SECTION
+
+  log_info("replicating from %s:%d, master is at %s:%d", upstream_addr,
+           upstream_port, mstr_addr, mstr_port);
+  free(payload);
 }
@@ -0,0 +1,169 @@
+#include "../lib/asyncclient/asyncclient.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define NUM_OPS 1000
+
+void test_pipelining();
+void test_failure();
+void *shard_thread(void *);
+void count_completion(canary_op_t *, void *);
+
+int listener;
+int num_accepted = 0;
+CanaryCache cache;
+
+int main(int argc, char *argv[]) {
+  // A stand-in for a master shard on any free port, that keeps its keys in an
+  // LRU cache like a shard, and closes the connection on a get of "crash".
+  SA_IN shard_addr;
+  socklen_t addr_len = sizeof(shard_addr);
+  listener = bind_n_listen_socket(0, 16);
+  getsockname(listener, (SA *)&shard_addr, &addr_len);
+  pthread_t thread;
+  pthread_create(&thread, NULL, shard_thread, NULL);
+
+  // Route every key to the stand-in, without a configuration service.
+  ring_map_t *map = calloc(1, sizeof(ring_map_t));
+  map->epoch = 1;
+  map->ring = create_ring(PlacementRing);
+  ring_add(map->ring, 1, 16);
+  map->shards = calloc(1, sizeof(ring_shard_t));
+  map->num_shards = 1;
+  inet_pton(AF_INET, "127.0.0.1", &map->shards[0].mstr.addr);
+  map->shards[0].id = 1;
+  map->shards[0].mstr.port = ntohs(shard_addr.sin_port);
+  cache = create_canary_cache("127.0.0.1", 0);
+  cache.map = map;
+  cache.map_expires_at = time(NULL) + 3600;
+
+  printf("\nTESTS FOR ASYNC CLIENT:\n\n");
+  printf("\tTesting pipelining:\n");
+  test_pipelining();
+  printf("\n");
+  printf("\tTesting failure:\n");
+  test_failure();
+  destroy_canary_cache(&cache);
+  return 0;
+}
+
+void test_pipelining() {
+  CanaryAsync *async = create_canary_async(&cache);
+  canary_op_t *ops[NUM_OPS];
+  char key[32];
+  int num_completed = 0;
+
+  printf("\t\ttest submitting does not wait for responses...");
+  for (int i = 0; i < NUM_OPS; i++) {
+    snprintf(key, sizeof(key), "key%d", i);
+    ops[i] = canary_put_async(async, key, i, count_completion, &num_completed);
+    assert(ops[i] != NULL);
+  }
+  assert(async->num_pending == NUM_OPS);
+  printf("✅\n");
+
+  printf("\t\ttest all operations complete over one connection...");
+  assert(canary_wait(async, ops[NUM_OPS - 1]) == 1);
+  while (async->num_pending > 0)
+    assert(canary_poll(async, -1) >= 0);
+  assert(num_completed == NUM_OPS);
+  for (int i = 0; i < NUM_OPS; i++) {
+    assert(ops[i]->done && ops[i]->status == 1);
+    destroy_canary_op(ops[i]);
+  }
+  assert(num_accepted == 1);
+  printf("✅\n");
+
+  printf("\t\ttest responses are matched to their requests...");
+  for (int i = 0; i < NUM_OPS; i++) {
+    snprintf(key, sizeof(key), i % 2 == 0 ? "key%d" : "missing%d", i);
+    ops[i] = canary_get_async(async, key, NULL, NULL);
+  }
+  for (int i = 0; i < NUM_OPS; i++) {
+    if (i % 2 == 0) {
+      assert(canary_wait(async, ops[i]) == 1);
+      assert(ops[i]->value == i && ops[i]->version != 0);
+    } else {
+      assert(canary_wait(async, ops[i]) == 0);
+    }
+    destroy_canary_op(ops[i]);
+  }
+  assert(num_completed == NUM_OPS);
+  printf("✅\n");
+
+  printf("\t\ttest the connection goes back to the pool...");
+  destroy_canary_async(async);
+  assert(cache.pool->num_conns == 1);
+  printf("✅\n");
+}
+
+void test_failure() {
+  CanaryAsync *async = create_canary_async(&cache);
+  int num_completed = 0;
+
+  printf("\t\ttest operations in flight on a failed connection fail...");
+  canary_op_t *crash = canary_get_async(async, "crash", NULL, NULL);
+  canary_op_t *behind =
+      canary_get_async(async, "key1", count_completion, &num_completed);
+  assert(canary_wait(async, crash) == -1);
+  assert(canary_wait(async, behind) == -1);
+  assert(num_completed == 1 && async->num_pending == 0);
+  assert(async->conns == NULL);
+  destroy_canary_op(crash);
+  destroy_canary_op(behind);
+  printf("✅\n");
+
+  printf("\t\ttest new operations reconnect...");
+  canary_op_t *op = canary_get_async(async, "key1", NULL, NULL);
+  assert(canary_wait(async, op) == 1 && op->value == 1);
+  assert(num_accepted == 2);
+  destroy_canary_op(op);
+  printf("✅\n");
+
+  destroy_canary_async(async);
+}
+
+void count_completion(canary_op_t *op, void *arg) { (*(int *)arg)++; }
+
+void *shard_thread(void *arg) {
+  lru_cache_t *store = create_lru_cache(2 * NUM_OPS);
+  CanaryMsg msg;
+  char *key;
+  int value;
+  uint8_t resp[sizeof(int) + sizeof(uint64_t)];
+
+  while (1) {
+    int socket = accept(listener, NULL, NULL);
+    num_accepted++;
+    while (receive_msg(socket, &msg) == 0) {
+      if (msg.type == Client2MstrPut) {
+        unpack_string_int(&key, &value, msg.payload);
+        lru_entry_t *removed = put(store, key, value);
+        if (removed != NULL)
+          destroy_entry(removed);
+        free(key);
+        send_msg(socket, (CanaryMsg){.type = Mstr2ClientPut});
+      } else if (strcmp((char *)msg.payload, "crash") == 0) {
+        free(msg.payload);
+        break;
+      } else {
+        lru_entry_t *entry = get_entry(store, (char *)msg.payload);
+        CanaryMsg get = {.type = Shard2ClientGet};
+        if (entry != NULL) {
+          memcpy(resp, &entry->value, sizeof(entry->value));
+          pack_long(entry->version, resp + sizeof(entry->value));
+          get.payload_len = sizeof(resp);
+          get.payload = resp;
+        }
+        send_msg(socket, get);
+      }
+      free(msg.payload);
+    }
+    close(socket);
+  }
+  return NULL;
+}
@@ -0,0 +1,114 @@
+#include "../lib/connpool/connpool.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+void test_reuse();
+void test_health();
+
+IA localhost;
+in_port_t port;
+int listener;
+
+int main(int argc, char *argv[]) {
+  // Listen on any free port, connections are accepted by the backlog.
+  SA_IN server_addr;
+  socklen_t addr_len = sizeof(server_addr);
+  listener = bind_n_listen_socket(0, 16);
+  getsockname(listener, (SA *)&server_addr, &addr_len);
+  port = ntohs(server_addr.sin_port);
+  inet_pton(AF_INET, "127.0.0.1", &localhost);
+
+  printf("\nTESTS FOR CONNECTION POOL:\n\n");
+  printf("\tTesting reuse:\n");
+  test_reuse();
+  printf("\n");
+  printf("\tTesting health:\n");
+  test_health();
+  close(listener);
+  return 0;
+}
+
+void test_reuse() {
+  conn_pool_t *pool = create_conn_pool(1, 60);
+
+  printf("\t\ttest released connections are reused...");
+  int socket = pool_acquire(pool, localhost, port);
+  assert(socket != -1);
+  pool_release(pool, localhost, port, socket);
+  assert(pool->num_conns == 1);
+  assert(pool_acquire(pool, localhost, port) == socket);
+  assert(pool->num_conns == 0);
+  printf("✅\n");
+
+  printf("\t\ttest connections are not shared between shards...");
+  // Pretend that the connection goes to another shard on the same host.
+  pool_release(pool, localhost, port + 1, socket);
+  int other = pool_acquire(pool, localhost, port);
+  assert(other != -1 && other != socket);
+  assert(pool->num_conns == 1);
+  close(other);
+  printf("✅\n");
+
+  printf("\t\ttest idle connections per shard are capped...");
+  assert(pool_acquire(pool, localhost, port + 1) == socket);
+  close(socket);
+  int first = pool_acquire(pool, localhost, port);
+  int second = pool_acquire(pool, localhost, port);
+  assert(first != -1 && second != -1 && first != second);
+  pool_release(pool, localhost, port, first);
+  pool_release(pool, localhost, port, second);
+  assert(pool->num_conns == 1);
+  assert(pool_acquire(pool, localhost, port) == first);
+  close(first);
+  printf("✅\n");
+
+  destroy_conn_pool(pool);
+}
+
+void test_health() {
+  conn_pool_t *pool = create_conn_pool(4, 60);
+
+  printf("\t\ttest connections closed by the shard are replaced...");
+  int socket = pool_acquire(pool, localhost, port);
+  int peer = accept(listener, NULL, NULL);
+  pool_release(pool, localhost, port, socket);
+  close(peer);
+  usleep(10000);
+  int replaced = pool_acquire(pool, localhost, port);
+  assert(replaced != -1);
+  assert(pool->num_conns == 0);
+  // The stale socket was closed, so its number may be handed out again, but
+  // the new connection is still waiting to be accepted.
+  peer = accept(listener, NULL, NULL);
+  assert(peer != -1);
+  close(peer);
+  close(replaced);
+  printf("✅\n");
+
+  printf("\t\ttest connections with unread data are replaced...");
+  socket = pool_acquire(pool, localhost, port);
+  peer = accept(listener, NULL, NULL);
+  assert(write(peer, "x", 1) == 1);
+  usleep(10000);
+  pool_release(pool, localhost, port, socket);
+  replaced = pool_acquire(pool, localhost, port);
+  assert(replaced != -1 && pool->num_conns == 0);
+  close(peer);
+  close(replaced);
+  printf("✅\n");
+
+  printf("\t\ttest idle connections time out...");
+  socket = pool_acquire(pool, localhost, port);
+  replaced = pool_acquire(pool, localhost, port);
+  pool_release(pool, localhost, port, socket);
+  pool->conns[0].idle_since -= pool->idle_timeout;
+  // Any use of the pool closes the connections that have timed out.
+  pool_release(pool, localhost, port + 1, replaced);
+  assert(pool->num_conns == 1 && pool->conns[0].port == port + 1);
+  printf("✅\n");
+
+  destroy_conn_pool(pool);
+}
@@ -1,13 +1,17 @@
 #include "../lib/cproto/cproto.h"
 #include <assert.h>
+#include <pthread.h>
 #include <netinet/in.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 void test_msg_serialization();
 void test_payload_packing();
+void test_socket_transfer();
 
 int main(int argc, char *argv[]) {
   printf("\nTESTS FOR CANARY PROTOCOL HELPERS\n\n");
@@ -20,6 +24,10 @@ int main(int argc, char *argv[]) {
   test_payload_packing();
   printf("\n");
 
+  printf("\tTesting sending/receiving Canary Messages\n");
+  test_socket_transfer();
+  printf("\n");
+
   return 0;
 }
 
@@ -87,4 +95,101 @@ void test_payload_packing() {
   assert(num1 == num3);
   assert(num2 == num4);
   printf("✅\n");
+
+  uint8_t long_buf[8];
+  uint64_t long1 = 0x0102030405060708, long2;
+  printf("\t\tTest long packing/unpacking...");
+  pack_long(long1, long_buf);
+  assert(long_buf[0] == 0x01 && long_buf[7] == 0x08);
+  unpack_long(&long2, long_buf);
+  assert(long1 == long2);
+  printf("✅\n");
+
+  // [ num_keys | key_len | key | value | key_len | key | value ]
+  uint8_t batch_buf[4 + 2 * (4 + 7 + 4)];
+  uint32_t num_keys = htonl(2);
+  memcpy(batch_buf, &num_keys, sizeof(num_keys));
+  pack_string_int(key1, key_len, 1, batch_buf + 4);
+  pack_string_int("lumpan", key_len, -2, batch_buf + 4 + 4 + key_len + 4);
+  char **keys;
+  int *values;
+  printf("\t\tTest batch unpacking...");
+  keys = unpack_batch(batch_buf, sizeof(batch_buf), &values, &num_keys);
+  assert(keys != NULL && num_keys == 2);
+  assert(strcmp(keys[0], "limpan") == 0 && strcmp(keys[1], "lumpan") == 0);
+  assert(values[0] == 1 && values[1] == -2);
+  free(keys);
+  free(values);
+  printf("✅\n");
+
+  printf("\t\tTest malformed batches are rejected...");
+  for (uint32_t len = 0; len < sizeof(batch_buf); len++)
+    assert(unpack_batch(batch_buf, len, &values, &num_keys) == NULL);
+  // A batch of gets has no values, so the keys no longer line up.
+  assert(unpack_batch(batch_buf, sizeof(batch_buf), NULL, &num_keys) == NULL);
+  num_keys = htonl(1 << 30);
+  memcpy(batch_buf, &num_keys, sizeof(num_keys));
+  assert(unpack_batch(batch_buf, sizeof(batch_buf), &values, &num_keys) ==
+         NULL);
+  printf("✅\n");
+}
+
+void *send_thread(void *arg) {
+  int socket = *(int *)arg;
+  size_t len = 16 << 20; // larger than a thread stack.
+  uint8_t *payload = malloc(len);
+  for (size_t i = 0; i < len; i++)
+    payload[i] = i % 251;
+
+  send_msg(socket, (CanaryMsg){.type = Mstr2FlwrReplicate,
+                               .payload_len = len,
+                               .payload = payload});
+  free(payload);
+  return NULL;
+}
+
+void test_socket_transfer() {
+  int fds[2];
+  CanaryMsg msg;
+  pthread_t thread;
+  socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+
+  printf("\t\tTest sent and received messages match...");
+  char *payload = "this is a payload";
+  send_msg(fds[0], (CanaryMsg){.type = Cnf2MstrRegister,
+                               .payload_len = strlen(payload) + 1,
+                               .payload = (uint8_t *)payload});
+  assert(receive_msg(fds[1], &msg) == 0);
+  assert(msg.type == Cnf2MstrRegister);
+  assert(msg.payload_len == strlen(payload) + 1);
+  assert(strcmp((char *)msg.payload, payload) == 0);
+  free(msg.payload);
+  printf("✅\n");
+
+  printf("\t\tTest empty payloads...");
+  send_msg(fds[0], (CanaryMsg){.type = Error, .payload_len = 0});
+  assert(receive_msg(fds[1], &msg) == 0);
+  assert(msg.type == Error && msg.payload_len == 0);
+  free(msg.payload);
+  printf("✅\n");
+
+  printf("\t\tTest large payloads...");
+  pthread_create(&thread, NULL, send_thread, &fds[0]);
+  assert(receive_msg(fds[1], &msg) == 0);
+  pthread_join(thread, NULL);
+  assert(msg.type == Mstr2FlwrReplicate && msg.payload_len == 16 << 20);
+  for (size_t i = 0; i < msg.payload_len; i++)
+    assert(msg.payload[i] == i % 251);
+  free(msg.payload);
+  printf("✅\n");
+
+  printf("\t\tTest oversized frames are rejected...");
+  uint32_t header[3] = {htonl(8 + MAX_PAYLOAD_SIZE + 1), htonl(Error),
+                        htonl(MAX_PAYLOAD_SIZE + 1)};
+  write(fds[0], header, sizeof(header));
+  assert(receive_msg(fds[1], &msg) == -1);
+  printf("✅\n");
+
+  close(fds[0]);
+  close(fds[1]);
 }
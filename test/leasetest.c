@@ -0,0 +1,90 @@
+#include "../lib/lease/lease.h"
+#include "../lib/metrics/metrics.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define MS 1000000
+
+void test_acquire();
+void test_wait();
+
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+lease_table_t *table;
+
+int main(int argc, char *argv[]) {
+  printf("\nTESTS FOR LEASES:\n\n");
+  printf("\tTesting acquire:\n");
+  test_acquire();
+  printf("\n");
+  printf("\tTesting wait:\n");
+  test_wait();
+  return 0;
+}
+
+void test_acquire() {
+  table = create_lease_table(1); // every key collides.
+
+  printf("\t\ttest no lease before acquire...");
+  assert(lease_find(table, "limp", 0) == NULL);
+  printf("✅\n");
+
+  printf("\t\ttest finding acquired leases...");
+  lease_t *limp = lease_acquire(table, "limp", 100);
+  lease_t *limpz = lease_acquire(table, "limpz", 200);
+  assert(lease_find(table, "limp", 50) == limp);
+  assert(lease_find(table, "limpz", 50) == limpz);
+  assert(table->num_leases == 2);
+  printf("✅\n");
+
+  printf("\t\ttest expired lease is dropped...");
+  assert(lease_find(table, "limp", 100) == NULL);
+  assert(lease_find(table, "limpz", 100) == limpz);
+  assert(table->num_leases == 1);
+  printf("✅\n");
+
+  printf("\t\ttest completing a lease...");
+  lease_complete(table, "limpan"); // no lease.
+  lease_complete(table, "limpz");
+  assert(lease_find(table, "limpz", 0) == NULL);
+  assert(table->num_leases == 0);
+  printf("✅\n");
+
+  destroy_lease_table(table);
+}
+
+void *complete_thread(void *arg) {
+  usleep(10000);
+  pthread_mutex_lock(&lock);
+  lease_complete(table, "limp");
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+void test_wait() {
+  pthread_t thread;
+  table = create_lease_table(8);
+
+  printf("\t\ttest waiting until the lease is completed...");
+  pthread_mutex_lock(&lock);
+  lease_t *lease = lease_acquire(table, "limp", UINT64_MAX);
+  pthread_create(&thread, NULL, complete_thread, NULL);
+  assert(lease_wait(lease, &lock, metrics_now() + 1000 * MS) == 0);
+  assert(lease_find(table, "limp", 0) == NULL);
+  pthread_mutex_unlock(&lock);
+  pthread_join(thread, NULL);
+  printf("✅\n");
+
+  printf("\t\ttest waiting times out...");
+  pthread_mutex_lock(&lock);
+  lease = lease_acquire(table, "limp", UINT64_MAX);
+  uint64_t start = metrics_now();
+  assert(lease_wait(lease, &lock, start + 10 * MS) == -1);
+  assert(metrics_now() - start >= 10 * MS);
+  assert(lease_find(table, "limp", 0) == lease);
+  pthread_mutex_unlock(&lock);
+  printf("✅\n");
+
+  destroy_lease_table(table);
+}
@@ -0,0 +1,161 @@
+#include "../lib/logger/logger.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define LOG_FILE "/tmp/canary-loggertest.log"
+
+void test_levels();
+void test_json();
+void test_threads();
+
+int main(int argc, char *argv[]) {
+  printf("\nTESTS FOR LOGGER:\n\n");
+  printf("\tTesting levels:\n");
+  test_levels();
+  printf("\n");
+  printf("\tTesting JSON output:\n");
+  test_json();
+  printf("\n");
+  printf("\tTesting threads:\n");
+  test_threads();
+  remove(LOG_FILE);
+  return 0;
+}
+
+/**
+ * @brief Redirects stderr to the log file, truncating it.
+ */
+void capture_stderr() {
+  flush_log();
+  assert(freopen(LOG_FILE, "w", stderr) != NULL);
+}
+
+/**
+ * @brief Flushes the log and reads back everything written to stderr.
+ *
+ * @return the contents of the log file, allocated on the heap.
+ */
+char *read_captured() {
+  flush_log();
+  FILE *f = fopen(LOG_FILE, "r");
+  char *buf = calloc(1, 1 << 16);
+  fread(buf, 1, (1 << 16) - 1, f);
+  fclose(f);
+  return buf;
+}
+
+/**
+ * @brief Counts the number of occurrences of `needle` in `haystack`.
+ */
+int count(char *haystack, char *needle) {
+  int n = 0;
+  for (char *p = strstr(haystack, needle); p != NULL;
+       p = strstr(p + 1, needle)) {
+    n++;
+  }
+  return n;
+}
+
+void test_levels() {
+  LogLevel level;
+
+  printf("\t\ttest parsing level names...");
+  assert(parse_log_level("debug", &level) == 0 && level == LogDebug);
+  assert(parse_log_level("error", &level) == 0 && level == LogError);
+  assert(parse_log_level("verbose", &level) == -1);
+  printf("✅\n");
+
+  printf("\t\ttest records above the runtime level are skipped...");
+  capture_stderr();
+  log_level = LogInfo;
+  log_info("limp %d", 1);
+  log_debug("limpz %d", 2);
+  log_error("limpan %d", 3);
+  char *out = read_captured();
+  assert(count(out, "\n") == 2);
+  assert(strstr(out, "limp 1") != NULL);
+  assert(strstr(out, "limpz 2") == NULL);
+  assert(strstr(out, "limpan 3") != NULL);
+  free(out);
+  printf("✅\n");
+}
+
+void test_json() {
+  printf("\t\ttest fields are written...");
+  capture_stderr();
+  log_warn("limp");
+  char *out = read_captured();
+  assert(strncmp(out, "{\"time\":\"", 9) == 0);
+  assert(strstr(out, "\"level\":\"warn\"") != NULL);
+  assert(strstr(out, "\"tid\":") != NULL);
+  assert(strstr(out, "\"message\":\"limp\"}\n") != NULL);
+  free(out);
+  printf("✅\n");
+
+  printf("\t\ttest message is escaped...");
+  capture_stderr();
+  log_info("key \"limp\\z\"\n");
+  out = read_captured();
+  assert(strstr(out, "\"message\":\"key \\\"limp\\\\z\\\"\\u000a\"") != NULL);
+  free(out);
+  printf("✅\n");
+}
+
+void *log_thread(void *arg) {
+  for (int i = 0; i < 100; i++) {
+    log_info("thread %ld record %d", (long)arg, i);
+  }
+  return NULL;
+}
+
+pthread_key_t late_key;
+
+// Runs after the ring of the exiting thread has been released, and waits for
+// the drain thread to free it.
+void log_late(void *arg) {
+  usleep(50000);
+  log_info("late record %ld", (long)arg);
+}
+
+void *late_log_thread(void *arg) {
+  pthread_setspecific(late_key, arg);
+  log_info("early record %ld", (long)arg);
+  return NULL;
+}
+
+void test_threads() {
+  pthread_t threads[4];
+
+  printf("\t\ttest records of exited threads are written...");
+  capture_stderr();
+  for (long i = 0; i < 4; i++) {
+    pthread_create(&threads[i], NULL, log_thread, (void *)i);
+  }
+  for (int i = 0; i < 4; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  char *out = read_captured();
+  assert(count(out, "\n") == 400);
+  assert(strstr(out, "thread 3 record 99") != NULL);
+  free(out);
+  printf("✅\n");
+
+  // Keys created after the ring key are destroyed after it.
+  printf("\t\ttest records logged while a thread exits are written...");
+  pthread_key_create(&late_key, log_late);
+  capture_stderr();
+  for (long i = 0; i < 4; i++) {
+    pthread_create(&threads[i], NULL, late_log_thread, (void *)(i + 1));
+  }
+  for (int i = 0; i < 4; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  out = read_captured();
+  assert(count(out, "early record") == 4 && count(out, "late record") == 4);
+  assert(strstr(out, "late record 4") != NULL);
+  free(out);
+  printf("✅\n");
+}
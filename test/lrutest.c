@@ -1,5 +1,6 @@
 #include "../lib/lru/lru.h"
 #include <assert.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -104,6 +105,222 @@ void test_get() {
   destroy_lru_cache(cache);
 }
 
+void test_versions() {
+  lru_cache_t *cache = create_lru_cache(3);
+  lru_entry_t *entry;
+
+  printf("\t\ttest puts get increasing versions...");
+  put(cache, "limp", 1);
+  put(cache, "limpz", 2);
+  assert(get_entry(cache, "limp")->version == 1);
+  assert(get_entry(cache, "limpz")->version == 2);
+  assert(cache->version_clock == 2);
+  printf("✅\n");
+
+  printf("\t\ttest updating an entry changes its version...");
+  put(cache, "limp", 3);
+  entry = get_entry(cache, "limp");
+  assert(entry->value == 3 && entry->version == 3);
+  printf("✅\n");
+
+  printf("\t\ttest put with explicit version advances the clock...");
+  put_version(cache, "limpan", 4, 10);
+  assert(get_entry(cache, "limpan")->version == 10);
+  put(cache, "limpz", 5);
+  assert(get_entry(cache, "limpz")->version == 11);
+  printf("✅\n");
+
+  printf("\t\ttest older explicit version does not move the clock back...");
+  put_version(cache, "limp", 6, 5);
+  assert(get_entry(cache, "limp")->version == 5);
+  assert(cache->version_clock == 11);
+  assert(get_entry(cache, "limper") == NULL);
+  printf("✅\n");
+
+  destroy_lru_cache(cache);
+}
+
+void test_collisions() {
+  // A single slot, every key collides.
+  lru_cache_t *cache = create_lru_cache(1);
+  lru_entry_t *removed;
+
+  printf("\t\ttest replacing the only entry...");
+  put(cache, "limp", 1);
+  removed = put(cache, "limpz", 2);
+  assert(removed != NULL && strcmp(removed->key, "limp") == 0);
+  destroy_entry(removed);
+  assert(cache->head == cache->tail);
+  assert(*get(cache, "limpz") == 2);
+  assert(get(cache, "limp") == NULL);
+  printf("✅\n");
+
+  destroy_lru_cache(cache);
+
+  cache = create_lru_cache(2);
+  printf("\t\ttest evicting the first entry of a bucket...");
+  for (int i = 0; i < 20; i++) {
+    char key[8];
+    sprintf(key, "k%d", i);
+    removed = put(cache, key, i);
+    if (removed != NULL)
+      destroy_entry(removed);
+  }
+  assert(cache->num_elements == 2);
+  assert(*get(cache, "k19") == 19);
+  assert(*get(cache, "k18") == 18);
+  assert(get(cache, "k17") == NULL);
+  printf("✅\n");
+
+  destroy_lru_cache(cache);
+}
+
+void test_evict() {
+  lru_cache_t *cache = create_lru_cache(10);
+  lru_entry_t *removed;
+
+  printf("\t\ttest default watermarks...");
+  assert(cache->high_watermark == 9 && cache->low_watermark == 8);
+  printf("✅\n");
+
+  printf("\t\ttest small caches keep headroom...");
+  for (size_t capacity = 2; capacity < 10; capacity++) {
+    lru_cache_t *small = create_lru_cache(capacity);
+    assert(small->high_watermark == capacity - 1);
+    assert(small->low_watermark < small->high_watermark);
+    destroy_lru_cache(small);
+  }
+  lru_cache_t *tiny = create_lru_cache(5);
+  assert(tiny->high_watermark == 4 && tiny->low_watermark == 3);
+  destroy_lru_cache(tiny);
+  printf("✅\n");
+
+  for (int i = 0; i < 10; i++) {
+    char key[8];
+    sprintf(key, "k%d", i);
+    put(cache, key, i);
+  }
+  get(cache, "k0");
+
+  printf("\t\ttest evicting a bounded batch...");
+  removed = lru_evict(cache, 5, 2);
+  assert(cache->num_elements == 8);
+  // Most recently evicted first.
+  assert(strcmp(removed->key, "k2") == 0);
+  assert(strcmp(removed->lru_next->key, "k1") == 0);
+  assert(removed->lru_next->lru_next == NULL);
+  destroy_entries(removed);
+  assert(strcmp(cache->tail->key, "k3") == 0);
+  assert(get(cache, "k1") == NULL && *get(cache, "k0") == 0);
+  printf("✅\n");
+
+  printf("\t\ttest evicting down to the target...");
+  removed = lru_evict(cache, 5, 100);
+  assert(cache->num_elements == 5);
+  destroy_entries(removed);
+  assert(lru_evict(cache, 5, 100) == NULL);
+  printf("✅\n");
+
+  printf("\t\ttest deleting entries...");
+  assert(lru_delete(cache, "k1") == NULL);
+  removed = lru_delete(cache, "k0");
+  assert(removed != NULL && strcmp(removed->key, "k0") == 0);
+  destroy_entry(removed);
+  assert(cache->num_elements == 4 && get(cache, "k0") == NULL);
+  removed = lru_delete(cache, cache->tail->key);
+  destroy_entry(removed);
+  assert(cache->num_elements == 3 && cache->tail->lru_next == NULL);
+  printf("✅\n");
+
+  printf("\t\ttest evicting every entry...");
+  destroy_entries(lru_evict(cache, 0, 100));
+  assert(cache->num_elements == 0);
+  assert(cache->head == NULL && cache->tail == NULL);
+  put(cache, "limp", 1);
+  assert(cache->head == cache->tail && *get(cache, "limp") == 1);
+  printf("✅\n");
+
+  printf("\t\ttest puts reuse recycled entries...");
+  for (int i = 0; i < 9; i++) {
+    char key[8];
+    sprintf(key, "k%d", i);
+    put(cache, key, i);
+  }
+  removed = lru_evict(cache, 6, 100);
+  assert(lru_recycle(cache, removed) == NULL && cache->num_free == 4);
+  lru_entry_t *reused = cache->free_list;
+  put(cache, "a much longer key", 7);
+  assert(cache->num_free == 3 && cache->head == reused);
+  assert(strcmp(reused->key, "a much longer key") == 0);
+  assert(*get(cache, "a much longer key") == 7);
+  printf("✅\n");
+
+  printf("\t\ttest the free list is bounded by the capacity...");
+  for (int i = 0; i < 3; i++) {
+    char key[8];
+    sprintf(key, "n%d", i);
+    put(cache, key, i);
+  }
+  assert(cache->num_free == 0 && cache->num_elements == 10);
+  removed = lru_evict(cache, 7, 100);
+  lru_entry_t *last = removed->lru_next->lru_next;
+  assert(last != NULL && last->lru_next == NULL);
+  // Only two of the three entries fit next to the eight that are left.
+  put(cache, "limpz", 1);
+  assert(lru_recycle(cache, removed) == last && cache->num_free == 2);
+  destroy_entries(last);
+  printf("✅\n");
+
+  destroy_lru_cache(cache);
+}
+
+void test_expire() {
+  lru_cache_t *cache = create_lru_cache(10);
+  lru_entry_t *removed;
+
+  printf("\t\ttest entries without ttl never expire...");
+  put(cache, "limp", 1);
+  assert(cache->head->expires_at == 0);
+  assert(lru_expire(cache, UINT64_MAX, 10) == NULL);
+  printf("✅\n");
+
+  printf("\t\ttest expired entries are not returned...");
+  cache->ttl = 1000000000;
+  put(cache, "limpz", 2);
+  put(cache, "limpan", 3);
+  lru_entry_t *limpz = get_entry(cache, "limpz");
+  assert(limpz->expires_at > lru_now());
+  limpz->expires_at = lru_now();
+  assert(get(cache, "limpz") == NULL);
+  assert(*get(cache, "limpan") == 3);
+  printf("✅\n");
+
+  printf("\t\ttest putting an expired key...");
+  put(cache, "limpz", 4);
+  assert(*get(cache, "limpz") == 4);
+  printf("✅\n");
+
+  printf("\t\ttest reclaiming expired entries...");
+  uint64_t now = get_entry(cache, "limpan")->expires_at;
+  removed = lru_expire(cache, now, 10);
+  assert(strcmp(removed->key, "limpan") == 0 && removed->lru_next == NULL);
+  destroy_entries(removed);
+  assert(cache->num_elements == 2);
+  assert(*get(cache, "limp") == 1 && *get(cache, "limpz") == 4);
+  printf("✅\n");
+
+  printf("\t\ttest scanning a bounded number of entries...");
+  // "limpz" is the tail, and expires before "limp".
+  get(cache, "limp");
+  removed = lru_expire(cache, UINT64_MAX, 1);
+  assert(strcmp(removed->key, "limpz") == 0 && removed->lru_next == NULL);
+  destroy_entries(removed);
+  assert(cache->head == cache->tail && cache->num_elements == 1);
+  printf("✅\n");
+
+  destroy_lru_cache(cache);
+}
+
 int main(int argc, char *argv[]) {
   printf("\nTEST FOR LRU CACHE:\n\n");
   printf("\tTesting put:\n");
@@ -111,5 +328,17 @@ int main(int argc, char *argv[]) {
   printf("\n");
   printf("\tTesting get:\n");
   test_get();
+  printf("\n");
+  printf("\tTesting versions:\n");
+  test_versions();
+  printf("\n");
+  printf("\tTesting collisions:\n");
+  test_collisions();
+  printf("\n");
+  printf("\tTesting eviction:\n");
+  test_evict();
+  printf("\n");
+  printf("\tTesting expiry:\n");
+  test_expire();
   return 0;
 }
@@ -0,0 +1,175 @@
+#include "../lib/metrics/metrics.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void test_counters();
+void test_histograms();
+void test_format();
+
+int main(int argc, char *argv[]) {
+  printf("\nTESTS FOR METRICS:\n\n");
+  printf("\tTesting counters:\n");
+  test_counters();
+  printf("\n");
+  printf("\tTesting histograms:\n");
+  test_histograms();
+  printf("\n");
+  printf("\tTesting format:\n");
+  test_format();
+  return 0;
+}
+
+void *count_thread(void *arg) {
+  for (int i = 0; i < 1000; i++) {
+    metrics_inc(CounterGets, 1);
+    metrics_gauge_add(GaugeQueueDepth, 1);
+  }
+  return NULL;
+}
+
+void *drain_thread(void *arg) {
+  for (int i = 0; i < 1000; i++) {
+    metrics_gauge_add(GaugeQueueDepth, -1);
+  }
+  return NULL;
+}
+
+pthread_key_t late_key;
+
+// Runs after the slot of the exiting thread has been released, while other
+// threads may claim it.
+void count_late(void *arg) {
+  for (int i = 0; i < 100000; i++)
+    metrics_inc(CounterPuts, 1);
+}
+
+void *late_count_thread(void *arg) {
+  pthread_setspecific(late_key, arg);
+  metrics_inc(CounterPuts, 1);
+  return NULL;
+}
+
+void *put_thread(void *arg) {
+  for (int i = 0; i < 100000; i++)
+    metrics_inc(CounterPuts, 1);
+  return NULL;
+}
+
+void test_counters() {
+  metrics_snapshot_t *snapshot = malloc(sizeof(metrics_snapshot_t));
+  pthread_t threads[4];
+
+  printf("\t\ttest counters of all threads are summed...");
+  for (int i = 0; i < 4; i++) {
+    pthread_create(&threads[i], NULL, count_thread, NULL);
+  }
+  for (int i = 0; i < 4; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  metrics_collect(snapshot);
+  assert(snapshot->counters[CounterGets] == 4000);
+  assert(snapshot->counters[CounterPuts] == 0);
+  printf("✅\n");
+
+  printf("\t\ttest gauges are summed across threads...");
+  assert(snapshot->gauges[GaugeQueueDepth] == 4000);
+  pthread_create(&threads[0], NULL, drain_thread, NULL);
+  pthread_join(threads[0], NULL);
+  metrics_collect(snapshot);
+  assert(snapshot->gauges[GaugeQueueDepth] == 3000);
+  printf("✅\n");
+
+  printf("\t\ttest slots of exited threads are reused...");
+  pthread_create(&threads[0], NULL, count_thread, NULL);
+  pthread_join(threads[0], NULL);
+  metrics_collect(snapshot);
+  assert(snapshot->counters[CounterGets] == 5000);
+  printf("✅\n");
+
+  // Keys created after the slot key are destroyed after it.
+  printf("\t\ttest counts recorded while a thread exits are kept...");
+  pthread_key_create(&late_key, count_late);
+  for (int round = 0; round < 20; round++) {
+    pthread_t late[4], puts[4];
+    for (int i = 0; i < 4; i++) {
+      pthread_create(&late[i], NULL, late_count_thread, (void *)1);
+      pthread_create(&puts[i], NULL, put_thread, NULL);
+    }
+    for (int i = 0; i < 4; i++) {
+      pthread_join(late[i], NULL);
+      pthread_join(puts[i], NULL);
+    }
+  }
+  metrics_collect(snapshot);
+  assert(snapshot->counters[CounterPuts] == 20 * 4 * (1 + 100000 + 100000));
+  printf("✅\n");
+
+  free(snapshot);
+}
+
+void test_histograms() {
+  metrics_snapshot_t *snapshot = malloc(sizeof(metrics_snapshot_t));
+
+  printf("\t\ttest empty histogram...");
+  metrics_collect(snapshot);
+  assert(snapshot->hists[HistGet].count == 0);
+  assert(hist_percentile(&snapshot->hists[HistGet], 0.5) == 0);
+  printf("✅\n");
+
+  printf("\t\ttest small values are exact...");
+  for (uint64_t i = 1; i <= 4; i++) {
+    metrics_record(HistPut, i);
+  }
+  metrics_collect(snapshot);
+  hist_t *hist = &snapshot->hists[HistPut];
+  assert(hist->count == 4 && hist->sum == 10);
+  assert(hist_percentile(hist, 0.5) == 2);
+  assert(hist_percentile(hist, 1) == 4);
+  printf("✅\n");
+
+  printf("\t\ttest percentiles are within the relative error...");
+  for (uint64_t i = 1; i <= 100000; i++) {
+    metrics_record(HistGet, i * 1000);
+  }
+  metrics_collect(snapshot);
+  hist = &snapshot->hists[HistGet];
+  double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+  for (int i = 0; i < 4; i++) {
+    double expected = quantiles[i] * 100000 * 1000;
+    uint64_t value = hist_percentile(hist, quantiles[i]);
+    assert(value >= expected && value <= expected * 1.125);
+  }
+  printf("✅\n");
+
+  printf("\t\ttest huge values...");
+  metrics_record(HistReplication, UINT64_MAX);
+  metrics_collect(snapshot);
+  assert(hist_percentile(&snapshot->hists[HistReplication], 1) == UINT64_MAX);
+  printf("✅\n");
+
+  free(snapshot);
+}
+
+void test_format() {
+  metrics_snapshot_t *snapshot = malloc(sizeof(metrics_snapshot_t));
+  char *text;
+
+  printf("\t\ttest prometheus text format...");
+  metrics_collect(snapshot);
+  int len = metrics_format(snapshot, &text);
+  assert(len == strlen(text));
+  assert(strstr(text, "# TYPE canary_gets_total counter\n") != NULL);
+  assert(strstr(text, "\ncanary_gets_total 5000\n") != NULL);
+  assert(strstr(text, "\ncanary_queue_depth 4000\n") != NULL);
+  assert(strstr(text, "# TYPE canary_put_latency_seconds summary\n") != NULL);
+  assert(strstr(text, "\ncanary_put_latency_seconds_count 4\n") != NULL);
+  assert(strstr(text, "canary_get_latency_seconds{quantile=\"0.99\"}") !=
+         NULL);
+  free(text);
+  printf("✅\n");
+
+  free(snapshot);
+}
@@ -0,0 +1,230 @@
+#include "../lib/replog/replog.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void test_append_and_read();
+void test_overrun();
+void test_batches();
+void test_snapshots();
+
+int main(int argc, char *argv[]) {
+  printf("\nTESTS FOR REPLICATION LOG:\n\n");
+  printf("\tTesting append/read:\n");
+  test_append_and_read();
+  printf("\n");
+  printf("\tTesting overrun:\n");
+  test_overrun();
+  printf("\n");
+  printf("\tTesting batches:\n");
+  test_batches();
+  printf("\n");
+  printf("\tTesting snapshots:\n");
+  test_snapshots();
+  return 0;
+}
+
+void test_append_and_read() {
+  replog_t *log = create_replog(4, 42);
+  replog_batch_t batch = create_batch();
+  uint64_t cursor = 0, log_id, first_seq;
+  uint32_t num_records;
+  char *key;
+  int value;
+  uint64_t version;
+
+  printf("\t\ttest append returns sequence numbers...");
+  assert(replog_head(log) == 0);
+  assert(replog_append(log, "limp", 1, 1) == 1);
+  assert(replog_append(log, "limpz", 2, 2) == 2);
+  assert(replog_append(log, "limpan", 3, 3) == 3);
+  assert(replog_head(log) == 3);
+  printf("✅\n");
+
+  printf("\t\ttest read is capped by max records...");
+  assert(replog_read(log, &cursor, &batch, 2, 0) == 0);
+  assert(batch.num_records == 2);
+  assert(cursor == 2);
+  printf("✅\n");
+
+  printf("\t\ttest batch header...");
+  uint8_t *record = batch.buf;
+  record += unpack_batch_header(record, &log_id, &first_seq, &num_records);
+  assert(log_id == 42);
+  assert(first_seq == 1);
+  assert(num_records == 2);
+  printf("✅\n");
+
+  printf("\t\ttest records are unpacked in order...");
+  record += unpack_record(record, &key, &value, &version);
+  assert(strcmp(key, "limp") == 0 && value == 1 && version == 1);
+  free(key);
+  record += unpack_record(record, &key, &value, &version);
+  assert(strcmp(key, "limpz") == 0 && value == 2 && version == 2);
+  free(key);
+  assert(record == batch.buf + batch.buf_len);
+  printf("✅\n");
+
+  printf("\t\ttest read continues from cursor...");
+  assert(replog_read(log, &cursor, &batch, 10, 0) == 0);
+  record = batch.buf;
+  record += unpack_batch_header(record, &log_id, &first_seq, &num_records);
+  assert(first_seq == 3 && num_records == 1);
+  unpack_record(record, &key, &value, &version);
+  assert(strcmp(key, "limpan") == 0 && value == 3 && version == 3);
+  assert(cursor == 3);
+  free(key);
+  printf("✅\n");
+
+  destroy_batch(&batch);
+  destroy_replog(log);
+}
+
+void test_overrun() {
+  replog_t *log = create_replog(2, 42);
+  replog_batch_t batch = create_batch();
+  uint64_t cursor = 0;
+
+  replog_append(log, "limp", 1, 1);
+  replog_append(log, "limpz", 2, 2);
+  replog_append(log, "limpan", 3, 3);
+
+  printf("\t\ttest contains delta still in the ring...");
+  assert(replog_contains(log, 42, 1));
+  assert(replog_contains(log, 42, 3));
+  printf("✅\n");
+
+  printf("\t\ttest does not contain overwritten or unknown delta...");
+  assert(!replog_contains(log, 42, 0));
+  assert(!replog_contains(log, 42, 4));
+  assert(!replog_contains(log, 7, 2));
+  printf("✅\n");
+
+  printf("\t\ttest reading overwritten records fails...");
+  assert(replog_read(log, &cursor, &batch, 10, 0) == -1);
+  printf("✅\n");
+
+  printf("\t\ttest reading records still in the ring...");
+  cursor = 1;
+  assert(replog_read(log, &cursor, &batch, 10, 0) == 0);
+  assert(batch.num_records == 2);
+  assert(cursor == 3);
+  printf("✅\n");
+
+  printf("\t\ttest read times out with an empty batch...");
+  assert(replog_read(log, &cursor, &batch, 10, 10) == 0);
+  assert(batch.num_records == 0);
+  assert(cursor == 3);
+  printf("✅\n");
+
+  printf("\t\ttest reset switches history...");
+  replog_reset(log, 7, 10);
+  assert(replog_head(log) == 10);
+  assert(replog_contains(log, 7, 10));
+  assert(!replog_contains(log, 42, 3));
+  assert(replog_read(log, &cursor, &batch, 10, 0) == -1);
+  assert(replog_append(log, "limp", 4, 4) == 11);
+  printf("✅\n");
+
+  destroy_batch(&batch);
+  destroy_replog(log);
+}
+
+void test_batches() {
+  replog_batch_t batch = create_batch();
+  uint64_t log_id, first_seq;
+  uint32_t num_records;
+  char *key;
+  int value;
+  uint64_t version;
+
+  printf("\t\ttest packing records into a batch...");
+  batch_reset(&batch, 7, 10);
+  batch_add(&batch, "limp", 1, 100);
+  batch_add(&batch, "limpz", 2, 2);
+  batch_seal(&batch);
+
+  uint8_t *record = batch.buf;
+  record += unpack_batch_header(record, &log_id, &first_seq, &num_records);
+  assert(log_id == 7 && first_seq == 10 && num_records == 2);
+  record += unpack_record(record, &key, &value, &version);
+  assert(strcmp(key, "limp") == 0 && value == 1 && version == 100);
+  free(key);
+  printf("✅\n");
+
+  printf("\t\ttest reset empties the batch...");
+  batch_reset(&batch, 7, 11);
+  batch_seal(&batch);
+  unpack_batch_header(batch.buf, &log_id, &first_seq, &num_records);
+  assert(first_seq == 11 && num_records == 0);
+  assert(batch.buf_len == BATCH_HEADER_SIZE);
+  printf("✅\n");
+
+  destroy_batch(&batch);
+}
+
+void test_snapshots() {
+  lru_cache_t *cache = create_lru_cache(16);
+  replog_batch_t *batches;
+  int num_batches;
+  uint64_t log_id, first_seq;
+  uint32_t num_records;
+  char *key;
+  int value;
+  uint64_t version;
+
+  for (int i = 0; i < 8; i++) {
+    char key[8];
+    sprintf(key, "k%d", i);
+    put(cache, key, i);
+  }
+
+  printf("\t\ttest entries are packed into full batches...");
+  batches = replog_snapshot(cache, 7, 20, 4, lru_now(), &num_batches);
+  assert(num_batches == 3);
+  unpack_batch_header(batches[0].buf, &log_id, &first_seq, &num_records);
+  assert(log_id == 7 && first_seq == 20 && num_records == 4);
+  unpack_record(batches[0].buf + BATCH_HEADER_SIZE, &key, &value, &version);
+  // Oldest entry first.
+  assert(strcmp(key, "k0") == 0 && value == 0 && version == 1);
+  free(key);
+  unpack_batch_header(batches[2].buf, &log_id, &first_seq, &num_records);
+  assert(num_records == 0);
+  for (int i = 0; i < num_batches; i++)
+    destroy_batch(&batches[i]);
+  free(batches);
+  printf("✅\n");
+
+  printf("\t\ttest expired entries are left out...");
+  // Expire all but three entries, fewer than a full batch.
+  for (lru_entry_t *entry = cache->tail; entry != NULL; entry = entry->lru_prev)
+    entry->expires_at = entry->value < 5 ? 1 : 0;
+  batches = replog_snapshot(cache, 7, 20, 4, lru_now(), &num_batches);
+  // One batch of live entries, then the terminator.
+  assert(num_batches == 2);
+  unpack_batch_header(batches[0].buf, &log_id, &first_seq, &num_records);
+  assert(num_records == 3);
+  unpack_record(batches[0].buf + BATCH_HEADER_SIZE, &key, &value, &version);
+  assert(strcmp(key, "k5") == 0 && value == 5);
+  free(key);
+  unpack_batch_header(batches[1].buf, &log_id, &first_seq, &num_records);
+  assert(num_records == 0 && first_seq == 20);
+  for (int i = 0; i < num_batches; i++)
+    destroy_batch(&batches[i]);
+  free(batches);
+  printf("✅\n");
+
+  printf("\t\ttest a snapshot of expired entries is only a terminator...");
+  for (lru_entry_t *entry = cache->tail; entry != NULL; entry = entry->lru_prev)
+    entry->expires_at = 1;
+  batches = replog_snapshot(cache, 7, 20, 4, lru_now(), &num_batches);
+  assert(num_batches == 1);
+  unpack_batch_header(batches[0].buf, &log_id, &first_seq, &num_records);
+  assert(num_records == 0);
+  destroy_batch(&batches[0]);
+  free(batches);
+  printf("✅\n");
+
+  destroy_lru_cache(cache);
+}
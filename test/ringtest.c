@@ -0,0 +1,483 @@
+#include "../lib/ring/ring.h"
+#include <arpa/inet.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NUM_KEYS 100000
+
+void test_lookup();
+void test_balance();
+void test_map();
+void test_jump();
+void test_rendezvous();
+void test_placement_maps();
+void test_bounded_loads();
+void test_replicas();
+
+int main(int argc, char *argv[]) {
+  printf("\nTESTS FOR CONSISTENT HASHING RING:\n\n");
+  printf("\tTesting lookup:\n");
+  test_lookup();
+  printf("\n");
+  printf("\tTesting balance:\n");
+  test_balance();
+  printf("\n");
+  printf("\tTesting ring maps:\n");
+  test_map();
+  printf("\n");
+  printf("\tTesting jump consistent hash:\n");
+  test_jump();
+  printf("\n");
+  printf("\tTesting rendezvous hashing:\n");
+  test_rendezvous();
+  printf("\n");
+  printf("\tTesting maps of other placements:\n");
+  test_placement_maps();
+  printf("\n");
+  printf("\tTesting bounded loads:\n");
+  test_bounded_loads();
+  printf("\n");
+  printf("\tTesting replicas:\n");
+  test_replicas();
+  return 0;
+}
+
+void test_lookup() {
+  ring_t *ring = create_ring(PlacementRing);
+  uint32_t owner;
+
+  printf("\t\ttest lookup in empty ring...");
+  assert(ring_lookup(ring, "limp", &owner) == -1);
+  printf("✅\n");
+
+  printf("\t\ttest virtual nodes are sorted...");
+  ring_add(ring, 1, 64);
+  ring_add(ring, 2, 64);
+  assert(ring->num_vnodes == 128);
+  for (size_t i = 1; i < ring->num_vnodes; i++)
+    assert(ring->vnodes[i - 1].hash <= ring->vnodes[i].hash);
+  printf("✅\n");
+
+  printf("\t\ttest key is owned by the next virtual node...");
+  for (int i = 0; i < 1000; i++) {
+    char key[16];
+    sprintf(key, "key%d", i);
+    uint32_t hash = ring_hash(key);
+    size_t next = 0;
+    while (next < ring->num_vnodes && ring->vnodes[next].hash < hash)
+      next++;
+    assert(ring_lookup(ring, key, &owner) == 0);
+    assert(owner == ring->vnodes[next % ring->num_vnodes].owner);
+  }
+  printf("✅\n");
+
+  printf("\t\ttest removing a shard moves only its keys...");
+  ring_add(ring, 3, 64);
+  uint32_t owners[1000];
+  for (int i = 0; i < 1000; i++) {
+    char key[16];
+    sprintf(key, "key%d", i);
+    ring_lookup(ring, key, &owners[i]);
+  }
+  ring_remove(ring, 3);
+  assert(ring->num_vnodes == 128);
+  for (int i = 0; i < 1000; i++) {
+    char key[16];
+    sprintf(key, "key%d", i);
+    ring_lookup(ring, key, &owner);
+    assert(owner != 3);
+    assert(owners[i] == 3 || owners[i] == owner);
+  }
+  printf("✅\n");
+
+  destroy_ring(ring);
+}
+
+void test_balance() {
+  ring_t *ring = create_ring(PlacementRing);
+  int counts[5] = {0};
+  uint32_t owner;
+
+  printf("\t\ttest keys are spread evenly...");
+  for (uint32_t id = 1; id <= 4; id++)
+    ring_add(ring, id * 7919, 128);
+  for (int i = 0; i < NUM_KEYS; i++) {
+    char key[16];
+    sprintf(key, "key%d", i);
+    ring_lookup(ring, key, &owner);
+    counts[owner / 7919]++;
+  }
+  // Every shard should own close to a quarter of the keys.
+  for (int id = 1; id <= 4; id++)
+    assert(abs(counts[id] - NUM_KEYS / 4) < NUM_KEYS / 16);
+  printf("✅\n");
+
+  printf("\t\ttest keys are spread by weight...");
+  // As many vnodes as the other shards together.
+  ring_add(ring, 5 * 7919, 512);
+  int heavy = 0;
+  for (int i = 0; i < NUM_KEYS; i++) {
+    char key[16];
+    sprintf(key, "key%d", i);
+    ring_lookup(ring, key, &owner);
+    if (owner == 5 * 7919)
+      heavy++;
+  }
+  assert(abs(heavy - NUM_KEYS / 2) < NUM_KEYS / 16);
+  printf("✅\n");
+
+  destroy_ring(ring);
+}
+
+void test_map() {
+  ring_addr_t flwrs[2] = {{.port = 7001, .load = 10}, {.port = 7002}};
+  ring_addr_t cnfs[1] = {{.port = 8081}};
+  ring_shard_t shards[2] = {{.id = 1, .mstr = {.port = 6001}, .num_flwrs = 0},
+                            {.id = 2,
+                             .mstr = {.port = 6002},
+                             .num_flwrs = 2,
+                             .flwrs = flwrs}};
+  inet_pton(AF_INET, "10.0.0.1", &shards[0].mstr.addr);
+  inet_pton(AF_INET, "10.0.0.2", &shards[1].mstr.addr);
+  ring_map_t map = {.epoch = 42,
+                    .ring = create_ring(PlacementRing),
+                    .shards = shards,
+                    .num_shards = 2,
+                    .cnfs = cnfs,
+                    .num_cnfs = 1};
+  ring_add(map.ring, 1, 16);
+  ring_add(map.ring, 2, 16);
+  uint8_t *buf;
+
+  printf("\t\ttest packed and unpacked maps match...");
+  int len = pack_ring_map(&map, &buf);
+  ring_map_t *copy = unpack_ring_map(buf, len);
+  assert(copy != NULL);
+  assert(copy->epoch == 42 && copy->num_shards == 2);
+  assert(copy->ring->num_vnodes == 32);
+  assert(memcmp(copy->ring->vnodes, map.ring->vnodes, sizeof(vnode_t) * 32) ==
+         0);
+  assert(copy->shards[0].mstr.addr.s_addr == shards[0].mstr.addr.s_addr);
+  assert(copy->shards[1].mstr.port == 6002);
+  assert(copy->shards[1].num_flwrs == 2);
+  assert(copy->shards[1].flwrs[1].port == 7002);
+  assert(copy->shards[1].flwrs[0].load == 10);
+  assert(copy->num_cnfs == 1 && copy->cnfs[0].port == 8081);
+  printf("✅\n");
+
+  printf("\t\ttest looking up the shard of a key...");
+  uint32_t owner;
+  ring_lookup(map.ring, "limp", &owner);
+  assert(ring_map_lookup(copy, "limp")->id == owner);
+  printf("✅\n");
+
+  printf("\t\ttest truncated maps are rejected...");
+  for (int i = 0; i < len; i++)
+    assert(unpack_ring_map(buf, i) == NULL);
+  printf("✅\n");
+
+  printf("\t\ttest no previous owners without a migration...");
+  assert(copy->prev_ring == NULL);
+  assert(ring_map_lookup_prev(copy, "limp") == NULL);
+  printf("✅\n");
+  free(buf);
+  destroy_ring_map(copy);
+
+  printf("\t\ttest previous owners of migrating keys...");
+  // Shard 2 joined the ring.
+  map.prev_ring = copy_ring(map.ring);
+  ring_remove(map.prev_ring, 2);
+  len = pack_ring_map(&map, &buf);
+  copy = unpack_ring_map(buf, len);
+  assert(copy != NULL && copy->prev_ring->num_vnodes == 16);
+  for (int i = 0; i < 100; i++) {
+    char key[16];
+    sprintf(key, "key%d", i);
+    ring_shard_t *prev = ring_map_lookup_prev(copy, key);
+    if (ring_map_lookup(copy, key)->id == 1) {
+      assert(prev == NULL);
+    } else {
+      assert(prev != NULL && prev->id == 1);
+    }
+  }
+  printf("✅\n");
+
+  free(buf);
+  destroy_ring_map(copy);
+  destroy_ring(map.prev_ring);
+  destroy_ring(map.ring);
+}
+
+void test_jump() {
+  ring_t *ring = create_ring(PlacementJump);
+  int counts[5] = {0};
+  uint32_t owner, owners[1000];
+
+  printf("\t\ttest lookup without shards...");
+  assert(ring_lookup(ring, "limp", &owner) == -1);
+  printf("✅\n");
+
+  printf("\t\ttest keys are spread evenly...");
+  for (uint32_t id = 1; id <= 4; id++)
+    ring_add(ring, id * 7919, 1);
+  assert(ring->num_members == 4 && ring->num_vnodes == 0);
+  for (int i = 0; i < NUM_KEYS; i++) {
+    char key[16];
+    sprintf(key, "key%d", i);
+    ring_lookup(ring, key, &owner);
+    counts[owner / 7919]++;
+  }
+  for (int id = 1; id <= 4; id++)
+    assert(abs(counts[id] - NUM_KEYS / 4) < NUM_KEYS / 50);
+  printf("✅\n");
+
+  printf("\t\ttest a joining shard only takes keys...");
+  for (int i = 0; i < 1000; i++) {
+    char key[16];
+    sprintf(key, "key%d", i);
+    ring_lookup(ring, key, &owners[i]);
+  }
+  ring_add(ring, 5 * 7919, 1);
+  for (int i = 0; i < 1000; i++) {
+    char key[16];
+    sprintf(key, "key%d", i);
+    ring_lookup(ring, key, &owner);
+    assert(owner == 5 * 7919 || owner == owners[i]);
+  }
+  printf("✅\n");
+
+  printf("\t\ttest removing the last shard restores the owners...");
+  ring_remove(ring, 5 * 7919);
+  for (int i = 0; i < 1000; i++) {
+    char key[16];
+    sprintf(key, "key%d", i);
+    ring_lookup(ring, key, &owner);
+    assert(owner == owners[i]);
+  }
+  printf("✅\n");
+
+  printf("\t\ttest removing a shard moves the last one in its place...");
+  ring_remove(ring, 2 * 7919);
+  assert(ring->num_members == 3 && ring->members[1].owner == 4 * 7919);
+  for (int i = 0; i < 1000; i++) {
+    char key[16];
+    sprintf(key, "key%d", i);
+    ring_lookup(ring, key, &owner);
+    assert(owner != 2 * 7919);
+    if (owners[i] != 2 * 7919 && owners[i] != 4 * 7919)
+      assert(owner == owners[i]);
+  }
+  printf("✅\n");
+
+  destroy_ring(ring);
+}
+
+void test_rendezvous() {
+  ring_t *ring = create_ring(PlacementRendezvous);
+  int counts[6] = {0};
+  uint32_t owner, owners[1000];
+
+  printf("\t\ttest keys are spread evenly...");
+  for (uint32_t id = 1; id <= 4; id++)
+    ring_add(ring, id * 7919, 100);
+  for (int i = 0; i < NUM_KEYS; i++) {
+    char key[16];
+    sprintf(key, "key%d", i);
+    ring_lookup(ring, key, &owner);
+    counts[owner / 7919]++;
+  }
+  for (int id = 1; id <= 4; id++)
+    assert(abs(counts[id] - NUM_KEYS / 4) < NUM_KEYS / 50);
+  printf("✅\n");
+
+  printf("\t\ttest removing a shard moves only its keys...");
+  for (int i = 0; i < 1000; i++) {
+    char key[16];
+    sprintf(key, "key%d", i);
+    ring_lookup(ring, key, &owners[i]);
+  }
+  ring_remove(ring, 2 * 7919);
+  for (int i = 0; i < 1000; i++) {
+    char key[16];
+    sprintf(key, "key%d", i);
+    ring_lookup(ring, key, &owner);
+    assert(owner != 2 * 7919);
+    assert(owners[i] == 2 * 7919 || owners[i] == owner);
+  }
+  printf("✅\n");
+
+  printf("\t\ttest keys are spread by weight...");
+  // As much weight as the other shards together.
+  ring_add(ring, 5 * 7919, 300);
+  int heavy = 0;
+  for (int i = 0; i < NUM_KEYS; i++) {
+    char key[16];
+    sprintf(key, "key%d", i);
+    ring_lookup(ring, key, &owner);
+    if (owner == 5 * 7919)
+      heavy++;
+  }
+  assert(abs(heavy - NUM_KEYS / 2) < NUM_KEYS / 50);
+  printf("✅\n");
+
+  destroy_ring(ring);
+}
+
+void test_placement_maps() {
+  ring_shard_t shards[3] = {{.id = 1}, {.id = 2}, {.id = 3}};
+  Placement placements[2] = {PlacementJump, PlacementRendezvous};
+
+  printf("\t\ttest placement names are parsed...");
+  Placement placement;
+  assert(parse_placement("jump", &placement) == 0);
+  assert(placement == PlacementJump);
+  assert(parse_placement("rendezvous", &placement) == 0);
+  assert(placement == PlacementRendezvous);
+  assert(parse_placement("ring", &placement) == 0);
+  assert(placement == PlacementRing);
+  assert(parse_placement("maglev", &placement) == -1);
+  printf("✅\n");
+
+  for (int p = 0; p < 2; p++) {
+    printf("\t\ttest packed %s maps look up the same shards...",
+           placement_name(placements[p]));
+    ring_map_t map = {.epoch = 7,
+                      .ring = create_ring(placements[p]),
+                      .shards = shards,
+                      .num_shards = 3};
+    for (uint32_t id = 1; id <= 3; id++)
+      ring_add(map.ring, id, id * 10);
+    map.prev_ring = copy_ring(map.ring);
+    ring_remove(map.prev_ring, 3);
+
+    uint8_t *buf;
+    int len = pack_ring_map(&map, &buf);
+    ring_map_t *copy = unpack_ring_map(buf, len);
+    assert(copy != NULL && copy->ring->placement == placements[p]);
+    assert(copy->ring->num_members == 3 && copy->prev_ring->num_members == 2);
+    assert(copy->ring->num_vnodes == 0);
+    for (int i = 0; i < 1000; i++) {
+      char key[16];
+      uint32_t owner, prev_owner;
+      sprintf(key, "key%d", i);
+      ring_lookup(map.ring, key, &owner);
+      ring_lookup(map.prev_ring, key, &prev_owner);
+      assert(ring_map_lookup(copy, key)->id == owner);
+      ring_shard_t *prev = ring_map_lookup_prev(copy, key);
+      assert(prev == NULL ? owner == prev_owner : prev->id == prev_owner);
+    }
+    for (int i = 0; i < len; i++)
+      assert(unpack_ring_map(buf, i) == NULL);
+    printf("✅\n");
+
+    free(buf);
+    destroy_ring_map(copy);
+    destroy_ring(map.prev_ring);
+    destroy_ring(map.ring);
+  }
+}
+
+void test_bounded_loads() {
+  for (int p = 0; p < NUM_PLACEMENTS; p++) {
+    ring_t *ring = create_ring(p);
+    uint32_t owner, owners[1000];
+    int spilled_to[5] = {0};
+    for (uint32_t id = 1; id <= 4; id++)
+      ring_add(ring, id, 64);
+    for (int i = 0; i < 1000; i++) {
+      char key[16];
+      sprintf(key, "key%d", i);
+      ring_lookup(ring, key, &owners[i]);
+    }
+
+    printf("\t\ttest %s spills only the keys of an overloaded shard...",
+           placement_name(p));
+    assert(ring_set_overloaded(ring, 2, true) == 1);
+    assert(ring_set_overloaded(ring, 2, true) == 0);
+    assert(ring_set_overloaded(ring, 9, true) == -1);
+    assert(ring->num_overloaded == 1);
+    for (int i = 0; i < 1000; i++) {
+      char key[16];
+      sprintf(key, "key%d", i);
+      ring_lookup(ring, key, &owner);
+      assert(owner != 2);
+      if (owners[i] == 2)
+        spilled_to[owner]++;
+      else
+        assert(owner == owners[i]);
+    }
+    // Only the ring spills to a neighbour, every other shard takes some.
+    for (int id = 1; p != PlacementRing && id <= 4; id++)
+      assert(id == 2 || spilled_to[id] > 0);
+    printf("✅\n");
+
+    printf("\t\ttest %s maps keep the overloaded shards...",
+           placement_name(p));
+    ring_shard_t shards[4] = {{.id = 1}, {.id = 2}, {.id = 3}, {.id = 4}};
+    ring_map_t map = {.ring = ring, .shards = shards, .num_shards = 4};
+    uint8_t *buf;
+    int len = pack_ring_map(&map, &buf);
+    ring_map_t *copy = unpack_ring_map(buf, len);
+    assert(copy != NULL && copy->ring->num_overloaded == 1);
+    for (int i = 0; i < 1000; i++) {
+      char key[16];
+      sprintf(key, "key%d", i);
+      ring_lookup(ring, key, &owner);
+      assert(ring_map_lookup(copy, key)->id == owner);
+    }
+    free(buf);
+    destroy_ring_map(copy);
+    printf("✅\n");
+
+    printf("\t\ttest %s ignores the bound when every shard is over it...",
+           placement_name(p));
+    for (uint32_t id = 1; id <= 4; id++)
+      ring_set_overloaded(ring, id, true);
+    for (int i = 0; i < 1000; i++) {
+      char key[16];
+      sprintf(key, "key%d", i);
+      ring_lookup(ring, key, &owner);
+      assert(owner == owners[i]);
+    }
+    ring_remove(ring, 4);
+    assert(ring->num_overloaded == 3);
+    printf("✅\n");
+
+    destroy_ring(ring);
+  }
+}
+
+void test_replicas() {
+  ring_addr_t flwrs[2] = {{.port = 7001}, {.port = 7002}};
+  ring_shard_t shard = {.id = 1, .mstr = {.port = 7000}, .flwrs = flwrs};
+  int picked[3] = {0};
+
+  printf("\t\ttest a shard without followers is read from its master...");
+  for (uint32_t r = 0; r < 100; r++)
+    assert(ring_shard_replica(&shard, r) == &shard.mstr);
+  printf("✅\n");
+
+  printf("\t\ttest reads are spread over equally loaded replicas...");
+  shard.num_flwrs = 2;
+  srand(1);
+  for (int i = 0; i < 30000; i++)
+    picked[ring_shard_replica(&shard, rand())->port % 1000]++;
+  for (int i = 0; i < 3; i++)
+    assert(abs(picked[i] - 10000) < 1000);
+  printf("✅\n");
+
+  printf("\t\ttest the less loaded of two replicas is picked...");
+  shard.mstr.load = 300;
+  flwrs[0].load = 200;
+  flwrs[1].load = 100;
+  memset(picked, 0, sizeof(picked));
+  for (uint32_t r = 0; r < 30000; r++)
+    picked[ring_shard_replica(&shard, r)->port % 1000]++;
+  // The most loaded replica loses every draw, the least loaded wins both of
+  // its draws.
+  assert(picked[0] == 0);
+  assert(picked[1] == 10000 && picked[2] == 20000);
+  printf("✅\n");
+}
@@ -0,0 +1,81 @@
+#include "../lib/timerheap/timerheap.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NUM_TIMERS 10000
+
+void test_order();
+void test_expired();
+
+int main(int argc, char *argv[]) {
+  printf("\nTESTS FOR TIMER HEAP:\n\n");
+  printf("\tTesting order:\n");
+  test_order();
+  printf("\n");
+  printf("\tTesting expiry:\n");
+  test_expired();
+  return 0;
+}
+
+void test_order() {
+  timer_heap_t *heap = create_timer_heap(1); // grows on every other push.
+  timer_entry_t timer;
+
+  printf("\t\ttest empty heap...");
+  assert(timer_peek(heap, &timer) == -1);
+  assert(timer_pop_expired(heap, UINT64_MAX, &timer) == -1);
+  printf("✅\n");
+
+  printf("\t\ttest earliest deadline is at the root...");
+  timer_push(heap, 30, 3);
+  timer_push(heap, 10, 1);
+  timer_push(heap, 20, 2);
+  assert(timer_peek(heap, &timer) == 0);
+  assert(timer.deadline == 10 && timer.id == 1);
+  assert(heap->num_timers == 3);
+  printf("✅\n");
+
+  printf("\t\ttest timers pop in order of deadlines...");
+  srand(1);
+  for (int i = 0; i < NUM_TIMERS; i++)
+    timer_push(heap, rand() % 1000, i);
+  uint64_t last = 0;
+  int num_popped = 0;
+  while (timer_pop_expired(heap, UINT64_MAX, &timer) == 0) {
+    assert(timer.deadline >= last);
+    last = timer.deadline;
+    num_popped++;
+  }
+  assert(num_popped == NUM_TIMERS + 3);
+  assert(heap->num_timers == 0);
+  printf("✅\n");
+
+  destroy_timer_heap(heap);
+}
+
+void test_expired() {
+  timer_heap_t *heap = create_timer_heap(8);
+  timer_entry_t timer;
+
+  printf("\t\ttest only expired timers pop...");
+  timer_push(heap, 100, 1);
+  timer_push(heap, 200, 2);
+  timer_push(heap, 100, 3);
+  assert(timer_pop_expired(heap, 99, &timer) == -1);
+  assert(timer_pop_expired(heap, 100, &timer) == 0 && timer.deadline == 100);
+  assert(timer_pop_expired(heap, 100, &timer) == 0 && timer.deadline == 100);
+  assert(timer_pop_expired(heap, 100, &timer) == -1);
+  assert(timer_peek(heap, &timer) == 0 && timer.id == 2);
+  printf("✅\n");
+
+  printf("\t\ttest a later deadline leaves the earlier timer behind...");
+  timer_push(heap, 300, 2);
+  assert(timer_pop_expired(heap, 300, &timer) == 0 && timer.deadline == 200);
+  assert(timer_pop_expired(heap, 300, &timer) == 0 && timer.deadline == 300);
+  assert(timer.id == 2);
+  assert(heap->num_timers == 0);
+  printf("✅\n");
+
+  destroy_timer_heap(heap);
+}
@@ -0,0 +1,78 @@
+#include "../lib/metrics/metrics.h"
+#include "../lib/trace/trace.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TRACE_FILE "/tmp/canary-tracetest.json"
+
+void test_sampling();
+
+int main(int argc, char *argv[]) {
+  printf("\nTESTS FOR TRACE:\n\n");
+  printf("\tTesting sampling:\n");
+  test_sampling();
+  remove(TRACE_FILE);
+  return 0;
+}
+
+/**
+ * @brief Counts the number of occurrences of `needle` in `haystack`.
+ */
+int count(char *haystack, char *needle) {
+  int n = 0;
+  for (char *p = strstr(haystack, needle); p != NULL;
+       p = strstr(p + 1, needle)) {
+    n++;
+  }
+  return n;
+}
+
+void test_sampling() {
+  char *buf = calloc(1, 1 << 16);
+
+  printf("\t\ttest nothing is sampled before the trace is opened...");
+  trace_begin(metrics_now());
+  assert(!trace_sampled);
+  printf("✅\n");
+
+  printf("\t\ttest every request is sampled at rate 1...");
+  assert(trace_open(TRACE_FILE, 1) == 0);
+  for (int i = 0; i < 2; i++) {
+    trace_begin(metrics_now());
+    assert(trace_sampled);
+    trace_request_type = 9;
+    trace_stage(Dequeue);
+    trace_stage(Lock);
+    trace_end();
+    assert(!trace_sampled);
+  }
+  printf("✅\n");
+
+  printf("\t\ttest stages are written as chrome trace events...");
+  FILE *f = fopen(TRACE_FILE, "r");
+  fread(buf, 1, (1 << 16) - 1, f);
+  fclose(f);
+  assert(strncmp(buf, "[\n{", 3) == 0);
+  assert(count(buf, "\"name\":\"request\"") == 2);
+  assert(count(buf, "\"name\":\"queue\"") == 2);
+  assert(count(buf, "\"name\":\"lock\"") == 2);
+  assert(count(buf, "\"name\":\"send\"") == 0);
+  assert(count(buf, "\"ph\":\"X\"") == 6);
+  assert(count(buf, "\"args\":{\"type\":9}") == 6);
+  printf("✅\n");
+
+  printf("\t\ttest 1 in N requests is sampled...");
+  assert(trace_open(TRACE_FILE, 10) == 0);
+  int sampled = 0;
+  for (int i = 0; i < 10000; i++) {
+    trace_begin(metrics_now());
+    sampled += trace_sampled;
+    trace_end();
+  }
+  assert(sampled > 800 && sampled < 1200);
+  printf("✅\n");
+
+  free(buf);
+}
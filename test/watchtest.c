@@ -0,0 +1,76 @@
+#include "../lib/watch/watch.h"
+#include <assert.h>
+#include <stdio.h>
+
+void test_add();
+void test_take();
+
+struct in_addr client = {.s_addr = 1}, other = {.s_addr = 2};
+
+int main(int argc, char *argv[]) {
+  printf("\nTESTS FOR WATCHES:\n\n");
+  printf("\tTesting add:\n");
+  test_add();
+  printf("\n");
+  printf("\tTesting take:\n");
+  test_take();
+  return 0;
+}
+
+void test_add() {
+  watch_table_t *table = create_watch_table(1, 3); // every key collides.
+
+  printf("\t\ttest watching keys...");
+  assert(watch_add(table, "limp", client, 9000) == 0);
+  assert(watch_add(table, "limpz", client, 9000) == 0);
+  assert(table->num_watchers == 2);
+  printf("✅\n");
+
+  printf("\t\ttest a client is counted once per key...");
+  assert(watch_add(table, "limp", client, 9000) == 0);
+  assert(table->num_watchers == 2);
+  printf("✅\n");
+
+  printf("\t\ttest the number of watchers is bounded...");
+  assert(watch_add(table, "limp", other, 9000) == 0);
+  assert(watch_add(table, "limp", client, 9001) == -1);
+  assert(watch_add(table, "limp", other, 9000) == 0);
+  assert(table->num_watchers == 3);
+  printf("✅\n");
+
+  destroy_watch_table(table);
+}
+
+void test_take() {
+  watch_table_t *table = create_watch_table(1, 8);
+
+  printf("\t\ttest unwatched keys have no watchers...");
+  assert(watch_take(table, "limp") == NULL);
+  printf("✅\n");
+
+  printf("\t\ttest taking the watchers of a key...");
+  watch_add(table, "limp", client, 9000);
+  watch_add(table, "limp", other, 9000);
+  watch_add(table, "limpz", client, 9000);
+  watcher_t *watchers = watch_take(table, "limp");
+  int num_watchers = 0;
+  for (watcher_t *w = watchers; w != NULL; w = w->next) {
+    assert(w->port == 9000);
+    num_watchers++;
+  }
+  assert(num_watchers == 2);
+  assert(table->num_watchers == 1);
+  destroy_watchers(watchers);
+  printf("✅\n");
+
+  printf("\t\ttest watches are one shot...");
+  assert(watch_take(table, "limp") == NULL);
+  watchers = watch_take(table, "limpz");
+  assert(watchers != NULL && watchers->next == NULL);
+  assert(watchers->addr.s_addr == client.s_addr);
+  destroy_watchers(watchers);
+  assert(table->num_watchers == 0);
+  printf("✅\n");
+
+  destroy_watch_table(table);
+}